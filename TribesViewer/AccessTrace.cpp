@@ -0,0 +1,360 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include "AccessTrace.h"
+#include "Log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+std::atomic<bool> AccessTrace::smEnabled(false);
+
+static std::mutex sAccessMutex;
+static std::vector<AccessTrace::Record> sAccessRecords;
+static std::vector<std::string> sAccessStrings;
+static std::unordered_map<std::string, uint32_t> sAccessStringMap;
+static std::string sAccessPath;
+static std::chrono::steady_clock::time_point sAccessStart;
+static std::atomic<uint32_t> sNextAccessThreadID(1);
+
+static thread_local std::string tCurrentAsset;
+static thread_local bool tHasAsset = false;
+
+static uint16_t getAccessThreadID()
+{
+   thread_local uint16_t threadID = (uint16_t)sNextAccessThreadID.fetch_add(1);
+   return threadID;
+}
+
+// Called with sAccessMutex held
+static uint32_t internAccessString(const std::string& str)
+{
+   auto itr = sAccessStringMap.find(str);
+   if (itr != sAccessStringMap.end())
+      return itr->second;
+   
+   uint32_t idx = (uint32_t)sAccessStrings.size();
+   sAccessStrings.push_back(str);
+   sAccessStringMap[str] = idx;
+   return idx;
+}
+
+bool AccessTrace::open(const char* path)
+{
+   FILE* fp = fopen(path, "wb");
+   if (fp == NULL)
+   {
+      LOG_ERROR("Couldn't open access trace file %s", path);
+      return false;
+   }
+   fclose(fp);
+   
+   {
+      // Loader threads may still be recording into the previous trace
+      std::lock_guard<std::mutex> lock(sAccessMutex);
+      sAccessPath = path;
+      sAccessStart = std::chrono::steady_clock::now();
+      sAccessRecords.clear();
+      sAccessRecords.reserve(4096);
+      sAccessStrings.clear();
+      sAccessStringMap.clear();
+   }
+   smEnabled.store(true, std::memory_order_release);
+   return true;
+}
+
+void AccessTrace::close()
+{
+   if (!smEnabled.exchange(false))
+      return;
+   
+   std::lock_guard<std::mutex> lock(sAccessMutex);
+   
+   FILE* fp = fopen(sAccessPath.c_str(), "wb");
+   if (fp == NULL)
+   {
+      LOG_ERROR("Couldn't write access trace to %s", sAccessPath.c_str());
+      return;
+   }
+   
+   Header header = {};
+   header.ident = IDENT;
+   header.version = VERSION;
+   header.numStrings = (uint32_t)sAccessStrings.size();
+   header.numRecords = (uint32_t)sAccessRecords.size();
+   for (std::string& str : sAccessStrings)
+   {
+      header.stringBytes += (uint32_t)str.size() + 1;
+   }
+   
+   bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+   for (std::string& str : sAccessStrings)
+   {
+      ok = ok && fwrite(str.c_str(), str.size() + 1, 1, fp) == 1;
+   }
+   ok = ok && (sAccessRecords.empty() || fwrite(&sAccessRecords[0], sizeof(Record), sAccessRecords.size(), fp) == sAccessRecords.size());
+   fclose(fp);
+   
+   if (ok)
+      LOG_INFO("Wrote %u file accesses to %s", header.numRecords, sAccessPath.c_str());
+   else
+      LOG_ERROR("Couldn't write access trace to %s", sAccessPath.c_str());
+   
+   sAccessRecords.clear();
+   sAccessStrings.clear();
+   sAccessStringMap.clear();
+}
+
+bool AccessTrace::beginAsset(const char* name)
+{
+   if (tHasAsset)
+      return false;
+   
+   tCurrentAsset = name;
+   tHasAsset = true;
+   return true;
+}
+
+void AccessTrace::endAsset()
+{
+   tHasAsset = false;
+}
+
+void AccessTrace::addRecord(const char* filename, const char* mountName, int32_t entryIdx, uint32_t bytes)
+{
+   if (!smEnabled.load(std::memory_order_acquire))
+      return;
+   
+   Record record = {};
+   auto now = std::chrono::steady_clock::now();
+   record.entryIdx = entryIdx;
+   record.bytes = bytes;
+   record.threadID = getAccessThreadID();
+   
+   std::lock_guard<std::mutex> lock(sAccessMutex);
+   record.timeUS = std::chrono::duration_cast<std::chrono::microseconds>(now - sAccessStart).count();
+   record.nameIdx = internAccessString(filename);
+   record.mountIdx = internAccessString(mountName);
+   record.assetIdx = tHasAsset ? internAccessString(tCurrentAsset) : (uint32_t)NoAsset;
+   sAccessRecords.push_back(record);
+}
+
+int AccessTrace::summarize(const char* path, const char* orderPath)
+{
+   struct FileStats
+   {
+      uint32_t nameIdx;
+      uint32_t mountIdx;
+      int32_t entryIdx;
+      uint32_t numReads;
+      uint64_t bytes;
+      std::vector<uint32_t> assets;  // sorted, unique
+   };
+   
+   struct Group
+   {
+      std::vector<uint32_t> files;   // indices into fileStats
+      uint32_t numAssets;
+      uint64_t bytes;
+   };
+   
+   FILE* fp = fopen(path, "rb");
+   if (fp == NULL)
+   {
+      printf("Couldn't open %s\n", path);
+      return 1;
+   }
+   
+   Header header;
+   std::vector<char> stringData;
+   std::vector<Record> records;
+   bool ok = fread(&header, sizeof(header), 1, fp) == 1 && header.ident == IDENT && header.version == VERSION;
+   if (ok)
+   {
+      stringData.resize(header.stringBytes + 1, '\0');
+      records.resize(header.numRecords);
+      ok = (header.stringBytes == 0 || fread(&stringData[0], header.stringBytes, 1, fp) == 1) &&
+           (header.numRecords == 0 || fread(&records[0], sizeof(Record), header.numRecords, fp) == header.numRecords);
+   }
+   fclose(fp);
+   
+   std::vector<const char*> strings;
+   for (uint32_t pos=0; ok && pos<header.stringBytes; pos += (uint32_t)strlen(&stringData[pos]) + 1)
+   {
+      strings.push_back(&stringData[pos]);
+   }
+   
+   for (Record& record : records)
+   {
+      ok = ok && record.nameIdx < strings.size() && record.mountIdx < strings.size() &&
+           (record.assetIdx == NoAsset || record.assetIdx < strings.size());
+   }
+   
+   if (!ok || strings.size() != header.numStrings)
+   {
+      printf("%s isn't a valid access trace\n", path);
+      return 1;
+   }
+   
+   // Files are told apart by name and mount, since the same name can resolve differently between runs
+   std::vector<FileStats> fileStats;
+   std::unordered_map<uint64_t, uint32_t> fileLookup;
+   std::vector<uint32_t> firstOrder;
+   std::vector<bool> assetSeen(strings.size(), false);
+   uint32_t numAssets = 0;
+   uint32_t numThreads = 0;
+   uint64_t totalBytes = 0;
+   uint64_t durationUS = 0;
+   std::vector<bool> threadSeen(65536, false);
+   
+   for (Record& record : records)
+   {
+      uint64_t key = ((uint64_t)record.mountIdx << 32) | record.nameIdx;
+      auto itr = fileLookup.find(key);
+      if (itr == fileLookup.end())
+      {
+         FileStats stats = {record.nameIdx, record.mountIdx, record.entryIdx, 0, 0, {}};
+         itr = fileLookup.emplace(key, (uint32_t)fileStats.size()).first;
+         fileStats.push_back(stats);
+         firstOrder.push_back(itr->second);
+      }
+      
+      FileStats& stats = fileStats[itr->second];
+      stats.numReads++;
+      stats.bytes += record.bytes;
+      
+      std::vector<uint32_t>::iterator pos = std::lower_bound(stats.assets.begin(), stats.assets.end(), record.assetIdx);
+      if (pos == stats.assets.end() || *pos != record.assetIdx)
+         stats.assets.insert(pos, record.assetIdx);
+      
+      if (record.assetIdx != NoAsset && !assetSeen[record.assetIdx])
+      {
+         assetSeen[record.assetIdx] = true;
+         numAssets++;
+      }
+      
+      if (!threadSeen[record.threadID])
+      {
+         threadSeen[record.threadID] = true;
+         numThreads++;
+      }
+      
+      totalBytes += record.bytes;
+      durationUS = std::max(durationUS, record.timeUS);
+   }
+   
+   printf("Access trace %s: %u reads of %u files, %.1f KB over %.2fs, %u threads, %u assets\n", path, (uint32_t)records.size(),
+          (uint32_t)fileStats.size(), totalBytes / 1024.0, durationUS / 1000000.0, numThreads, numAssets);
+   
+   std::vector<uint32_t> hot(fileStats.size());
+   for (uint32_t i=0; i<hot.size(); i++)
+      hot[i] = i;
+   
+   std::sort(hot.begin(), hot.end(), [&](uint32_t a, uint32_t b){
+      if (fileStats[a].numReads != fileStats[b].numReads)
+         return fileStats[a].numReads > fileStats[b].numReads;
+      return fileStats[a].bytes > fileStats[b].bytes;
+   });
+   
+   printf("\n  Most read files\n  %8s %12s %8s  %-32s %s\n", "reads", "KB", "entry", "file", "mount");
+   for (uint32_t i=0; i<hot.size() && i<20; i++)
+   {
+      FileStats& stats = fileStats[hot[i]];
+      printf("  %8u %12.1f %8d  %-32s %s\n", stats.numReads, stats.bytes / 1024.0, stats.entryIdx,
+             strings[stats.nameIdx], strings[stats.mountIdx]);
+   }
+   
+   // Files read by exactly the same assets are always loaded together
+   std::vector<Group> groups;
+   std::unordered_map<std::string, uint32_t> groupLookup;
+   for (uint32_t i=0; i<fileStats.size(); i++)
+   {
+      FileStats& stats = fileStats[i];
+      std::string key((const char*)&stats.assets[0], stats.assets.size() * sizeof(uint32_t));
+      
+      auto itr = groupLookup.find(key);
+      if (itr == groupLookup.end())
+      {
+         Group group = {{}, (uint32_t)stats.assets.size(), 0};
+         itr = groupLookup.emplace(key, (uint32_t)groups.size()).first;
+         groups.push_back(group);
+      }
+      
+      Group& group = groups[itr->second];
+      group.files.push_back(i);
+      group.bytes += stats.bytes / stats.numReads;
+   }
+   
+   std::sort(groups.begin(), groups.end(), [](const Group& a, const Group& b){
+      if (a.files.size() != b.files.size())
+         return a.files.size() > b.files.size();
+      return a.bytes > b.bytes;
+   });
+   
+   printf("\n  Files always loaded together\n");
+   uint32_t numShown = 0;
+   for (Group& group : groups)
+   {
+      if (group.files.size() < 2 || numShown++ >= 20)
+         continue;
+      
+      uint32_t firstAsset = fileStats[group.files[0]].assets[0];
+      printf("  %u files, %.1f KB, loaded by %u asset%s (%s%s):", (uint32_t)group.files.size(), group.bytes / 1024.0,
+             group.numAssets, group.numAssets == 1 ? "" : "s", firstAsset == NoAsset ? "none" : strings[firstAsset],
+             group.numAssets > 1 ? ", ..." : "");
+      
+      for (uint32_t i=0; i<group.files.size() && i<8; i++)
+         printf(" %s", strings[fileStats[group.files[i]].nameIdx]);
+      printf("%s\n", group.files.size() > 8 ? " ..." : "");
+   }
+   
+   if (orderPath)
+   {
+      FILE* out = fopen(orderPath, "w");
+      if (out == NULL)
+      {
+         printf("Couldn't write %s\n", orderPath);
+         return 1;
+      }
+      
+      fprintf(out, "# First read order from %s\n", path);
+      std::vector<bool> written(strings.size(), false);
+      for (uint32_t idx : firstOrder)
+      {
+         uint32_t nameIdx = fileStats[idx].nameIdx;
+         if (!written[nameIdx])
+            fprintf(out, "%s\n", strings[nameIdx]);
+         written[nameIdx] = true;
+      }
+      fclose(out);
+      printf("\nWrote first read order to %s\n", orderPath);
+   }
+   
+   return 0;
+}
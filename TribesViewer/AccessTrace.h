@@ -0,0 +1,120 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _ACCESSTRACE_H_
+#define _ACCESSTRACE_H_
+
+#include <stdint.h>
+#include <atomic>
+
+// Binary log of every file ResManager opens, to find out what to prefetch and how to lay out volumes.
+//
+// Each record holds the file, the mount it resolved to, its volume entry, its size, when and on which
+// thread it was read, and the asset being loaded at the time (set with ACCESS_TRACE_ASSET around a
+// load). Nothing is recorded until open() is called; when off, recording and asset scopes cost a single
+// relaxed atomic load. Records are buffered in memory and written out by close().
+//
+// summarize() reads a trace back and prints the most used entries and the groups of files that are always
+// loaded together, and can write the order files were first read in for -repackorder.
+//
+class AccessTrace
+{
+public:
+   
+   enum
+   {
+      IDENT = 0x54415654, // TVAT
+      VERSION = 1,
+      NoAsset = 0xFFFFFFFF
+   };
+   
+   // File layout: Header, numStrings NUL terminated strings (stringBytes in total), then numRecords Records
+#pragma pack(1)
+   struct Header
+   {
+      uint32_t ident;
+      uint32_t version;
+      uint32_t numStrings;
+      uint32_t stringBytes;
+      uint32_t numRecords;
+   };
+   
+   struct Record
+   {
+      uint64_t timeUS;    // since open()
+      uint32_t nameIdx;   // strings are shared, so each name is only stored once
+      uint32_t mountIdx;  // name of the path or volume the file came from
+      uint32_t assetIdx;  // or NoAsset
+      int32_t entryIdx;   // volume entry, or -1 for loose files
+      uint32_t bytes;
+      uint16_t threadID;
+   };
+#pragma pack()
+   
+   // Marks the files read on this thread while in scope as loaded for an asset. Nested scopes keep the
+   // outermost asset, so the files a shape pulls in are put down to the shape.
+   class AssetScope
+   {
+   public:
+      bool mActive;
+      
+      AssetScope(const char* name) : mActive(smEnabled.load(std::memory_order_relaxed) && beginAsset(name)) {;}
+      
+      ~AssetScope()
+      {
+         if (mActive)
+            endAsset();
+      }
+   };
+   
+   // Starts recording; records are written to path on close()
+   static bool open(const char* path);
+   static void close();
+   
+   static inline bool isEnabled() { return smEnabled.load(std::memory_order_relaxed); }
+   
+   static inline void record(const char* filename, const char* mountName, int32_t entryIdx, uint32_t bytes)
+   {
+      if (smEnabled.load(std::memory_order_relaxed))
+         addRecord(filename, mountName, entryIdx, bytes);
+   }
+   
+   // Prints a summary of a trace. When orderPath is given the files are also written there, one per line,
+   // in the order they were first read. Returns 0 on success.
+   static int summarize(const char* path, const char* orderPath);
+   
+protected:
+   
+   // Set by open/close while loads may be running on other threads. The record test only needs a relaxed
+   // load; addRecord re-checks with acquire before touching the state open() set up.
+   static std::atomic<bool> smEnabled;
+   
+   static bool beginAsset(const char* name);
+   static void endAsset();
+   static void addRecord(const char* filename, const char* mountName, int32_t entryIdx, uint32_t bytes);
+};
+
+#define ACCESS_TRACE_CONCAT_(a, b) a##b
+#define ACCESS_TRACE_CONCAT(a, b) ACCESS_TRACE_CONCAT_(a, b)
+#define ACCESS_TRACE_ASSET(name) AccessTrace::AssetScope ACCESS_TRACE_CONCAT(accessScope, __LINE__)(name)
+
+#endif
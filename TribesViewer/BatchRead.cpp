@@ -0,0 +1,504 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include "BatchRead.h"
+#include "Trace.h"
+#include "Log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <algorithm>
+
+#if defined(TV_ENABLE_IO_URING) && defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define TV_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+BatchReader::Backend BatchReader::smBackend = BatchReader::Backend_Auto;
+
+#ifdef TV_HAVE_IO_URING
+
+// Minimal io_uring setup using the raw syscalls, so liburing isn't needed
+struct IOUring
+{
+   int fd;
+   uint32_t numEntries;
+   
+   void* sqPtr;
+   size_t sqSize;
+   void* cqPtr;
+   size_t cqSize;
+   io_uring_sqe* sqes;
+   size_t sqesSize;
+   
+   uint32_t* sqTail;
+   uint32_t sqMask;
+   uint32_t* sqArray;
+   
+   uint32_t* cqHead;
+   uint32_t* cqTail;
+   uint32_t cqMask;
+   io_uring_cqe* cqes;
+   
+   IOUring() : fd(-1), numEntries(0), sqPtr(MAP_FAILED), sqSize(0), cqPtr(MAP_FAILED), cqSize(0), sqes((io_uring_sqe*)MAP_FAILED), sqesSize(0) {;}
+   
+   ~IOUring()
+   {
+      if (sqes != MAP_FAILED)
+         munmap(sqes, sqesSize);
+      if (cqPtr != MAP_FAILED && cqPtr != sqPtr)
+         munmap(cqPtr, cqSize);
+      if (sqPtr != MAP_FAILED)
+         munmap(sqPtr, sqSize);
+      if (fd >= 0)
+         close(fd);
+   }
+   
+   bool init(uint32_t entries)
+   {
+      io_uring_params params = {};
+      fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+      if (fd < 0)
+         return false;
+      
+      numEntries = params.sq_entries;
+      sqSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+      cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      
+      bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+      if (singleMap)
+         sqSize = cqSize = std::max(sqSize, cqSize);
+      
+      sqPtr = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+      if (sqPtr == MAP_FAILED)
+         return false;
+      
+      cqPtr = singleMap ? sqPtr : mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+      if (cqPtr == MAP_FAILED)
+         return false;
+      
+      sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+      sqes = (io_uring_sqe*)mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+      if (sqes == MAP_FAILED)
+         return false;
+      
+      uint8_t* sq = (uint8_t*)sqPtr;
+      sqTail = (uint32_t*)(sq + params.sq_off.tail);
+      sqMask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+      sqArray = (uint32_t*)(sq + params.sq_off.array);
+      
+      uint8_t* cq = (uint8_t*)cqPtr;
+      cqHead = (uint32_t*)(cq + params.cq_off.head);
+      cqTail = (uint32_t*)(cq + params.cq_off.tail);
+      cqMask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+      cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+      return true;
+   }
+   
+   // Only this thread submits, so the tail can be read without ordering
+   void queueReadv(int fileFd, const struct iovec* iov, uint32_t iovCount, uint64_t offset, uint64_t userData)
+   {
+      uint32_t tail = *sqTail;
+      uint32_t index = tail & sqMask;
+      
+      io_uring_sqe* sqe = &sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_READV;
+      sqe->fd = fileFd;
+      sqe->addr = (uint64_t)(uintptr_t)iov;
+      sqe->len = iovCount;
+      sqe->off = offset;
+      sqe->user_data = userData;
+      
+      sqArray[index] = index;
+      __atomic_store_n(sqTail, tail+1, __ATOMIC_RELEASE);
+   }
+   
+   int enter(uint32_t toSubmit, uint32_t minComplete)
+   {
+      return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, IORING_ENTER_GETEVENTS, NULL, 0);
+   }
+   
+   bool popCompletion(uint64_t* outUserData, int32_t* outRes)
+   {
+      uint32_t head = *cqHead;
+      if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+         return false;
+      
+      io_uring_cqe* cqe = &cqes[head & cqMask];
+      *outUserData = cqe->user_data;
+      *outRes = cqe->res;
+      __atomic_store_n(cqHead, head+1, __ATOMIC_RELEASE);
+      return true;
+   }
+};
+
+static bool sIOUringChecked = false;
+static bool sIOUringAvailable = false;
+
+#endif
+
+BatchReader::BatchReader() : mRing(NULL)
+{
+   mStats = {};
+}
+
+BatchReader::~BatchReader()
+{
+   clear();
+#ifdef TV_HAVE_IO_URING
+   delete (IOUring*)mRing;
+#endif
+}
+
+uint32_t BatchReader::add(uint64_t offset, uint32_t size)
+{
+   Range range = {offset, size, (uint32_t)mRanges.size(), NULL};
+   mRanges.push_back(range);
+   return range.idx;
+}
+
+void BatchReader::clear()
+{
+   // Anything not handed back by read()
+   for (Range& range : mRanges)
+   {
+      free(range.data);
+   }
+   
+   mRanges.clear();
+   mSpans.clear();
+   mIov.clear();
+}
+
+bool BatchReader::isBackendAvailable(Backend backend)
+{
+   switch (backend)
+   {
+      case Backend_Auto:
+      case Backend_Preadv:
+         return true;
+      case Backend_IOUring:
+#ifdef TV_HAVE_IO_URING
+         if (!sIOUringChecked)
+         {
+            // Can be compiled out of the kernel or blocked by seccomp
+            IOUring ring;
+            sIOUringAvailable = ring.init(QueueDepth);
+            sIOUringChecked = true;
+         }
+         return sIOUringAvailable;
+#else
+         return false;
+#endif
+      default:
+         return false;
+   }
+}
+
+const char* BatchReader::getBackendName(Backend backend)
+{
+   static const char* sNames[Backend_Count] = {
+      "auto",
+      "io_uring",
+      "preadv"
+   };
+   return backend < Backend_Count ? sNames[backend] : "unknown";
+}
+
+void BatchReader::buildSpans()
+{
+   std::sort(mRanges.begin(), mRanges.end(), [](const Range& a, const Range& b){
+      return a.offset < b.offset;
+   });
+   
+   mSpans.clear();
+   mIov.clear();
+   
+   for (uint32_t i=0; i<mRanges.size(); i++)
+   {
+      const Range& range = mRanges[i];
+      
+      if (!mSpans.empty())
+      {
+         Span& span = mSpans.back();
+         uint64_t spanEnd = span.offset + span.size;
+         
+         // Overlapping ranges can't share a vectored read, so only merge forwards
+         if (range.offset >= spanEnd &&
+             range.offset - spanEnd <= MaxGap &&
+             (range.offset + range.size) - span.offset <= MaxSpanBytes &&
+             span.count < MaxSpanRanges)
+         {
+            span.size = (range.offset + range.size) - span.offset;
+            span.count++;
+            continue;
+         }
+      }
+      
+      Span span = {range.offset, range.size, i, 1, 0, 0};
+      mSpans.push_back(span);
+   }
+   
+   mStats.numSpans = (uint32_t)mSpans.size();
+   for (Span& span : mSpans)
+   {
+      mStats.bytesRead += span.size;
+   }
+}
+
+void BatchReader::prepareSpan(uint32_t spanIdx)
+{
+   Span& span = mSpans[spanIdx];
+   span.iovFirst = (uint32_t)mIov.size();
+   
+   uint64_t pos = span.offset;
+   for (uint32_t i=span.first; i<span.first+span.count; i++)
+   {
+      Range& range = mRanges[i];
+      
+      if (range.offset > pos)
+      {
+         struct iovec gap = {&mScratch[0], (size_t)(range.offset - pos)};
+         mIov.push_back(gap);
+      }
+      
+      range.data = (uint8_t*)malloc(std::max<uint32_t>(range.size, 1));
+      struct iovec iov = {range.data, range.size};
+      mIov.push_back(iov);
+      pos = range.offset + range.size;
+   }
+   
+   span.iovCount = (uint32_t)mIov.size() - span.iovFirst;
+}
+
+void BatchReader::finishSpan(uint32_t spanIdx, bool ok, const CompleteFunc& func)
+{
+   Span& span = mSpans[spanIdx];
+   
+   for (uint32_t i=span.first; i<span.first+span.count; i++)
+   {
+      Range& range = mRanges[i];
+      uint8_t* data = range.data;
+      range.data = NULL;
+      
+      if (!ok)
+      {
+         free(data);
+         data = NULL;
+         mStats.numFailed++;
+      }
+      
+      func(range.idx, data, range.size);
+   }
+}
+
+// Reads a span with preadv, carrying on after short reads
+bool BatchReader::readSpanSync(int fd, uint32_t spanIdx)
+{
+   const Span& span = mSpans[spanIdx];
+   if (span.size == 0)
+      return true;
+   
+   std::vector<struct iovec> iov(mIov.begin() + span.iovFirst, mIov.begin() + span.iovFirst + span.iovCount);
+   uint64_t offset = span.offset;
+   uint32_t iovIdx = 0;
+   
+   while (iovIdx < iov.size())
+   {
+      ssize_t ret = preadv(fd, &iov[iovIdx], (int)(iov.size() - iovIdx), (off_t)offset);
+      mStats.numSubmits++;
+      
+      if (ret < 0 && errno == EINTR)
+         continue;
+      if (ret <= 0)
+         return false;
+      
+      offset += ret;
+      
+      // Skip what was filled
+      size_t remaining = (size_t)ret;
+      while (iovIdx < iov.size() && remaining >= iov[iovIdx].iov_len)
+      {
+         remaining -= iov[iovIdx].iov_len;
+         iovIdx++;
+      }
+      
+      if (remaining > 0)
+      {
+         iov[iovIdx].iov_base = (uint8_t*)iov[iovIdx].iov_base + remaining;
+         iov[iovIdx].iov_len -= remaining;
+      }
+   }
+   
+   return true;
+}
+
+bool BatchReader::read(int fd, const CompleteFunc& func)
+{
+   TRACE_ZONE("BatchReader::read");
+   
+   mStats = {};
+   mStats.numRanges = (uint32_t)mRanges.size();
+   for (Range& range : mRanges)
+   {
+      mStats.bytesRequested += range.size;
+   }
+   
+   if (mRanges.empty())
+      return true;
+   
+   if (mScratch.empty())
+      mScratch.resize(MaxGap);
+   
+   buildSpans();
+   
+   // Spans keep pointers into mIov, so size it up front
+   uint32_t maxIov = 0;
+   for (Span& span : mSpans)
+   {
+      maxIov += span.count * 2;
+   }
+   mIov.reserve(maxIov);
+   
+   bool ok = false;
+   Backend backend = smBackend;
+   if (backend == Backend_Auto)
+      backend = isBackendAvailable(Backend_IOUring) ? Backend_IOUring : Backend_Preadv;
+   else if (!isBackendAvailable(backend))
+      backend = Backend_Preadv;
+   
+   mStats.backend = backend;
+   
+   if (backend == Backend_IOUring)
+      ok = readIOUring(fd, func);
+   else
+      ok = readPreadv(fd, func);
+   
+   mRanges.clear();
+   mSpans.clear();
+   mIov.clear();
+   return ok;
+}
+
+bool BatchReader::readPreadv(int fd, const CompleteFunc& func)
+{
+   bool allOk = true;
+   
+   for (uint32_t i=0; i<mSpans.size(); i++)
+   {
+      prepareSpan(i);
+      bool ok = readSpanSync(fd, i);
+      finishSpan(i, ok, func);
+      allOk = allOk && ok;
+   }
+   
+   return allOk;
+}
+
+bool BatchReader::readIOUring(int fd, const CompleteFunc& func)
+{
+#ifdef TV_HAVE_IO_URING
+   IOUring* ring = (IOUring*)mRing;
+   if (ring == NULL)
+   {
+      ring = new IOUring();
+      if (!ring->init(QueueDepth))
+      {
+         delete ring;
+         mStats.backend = Backend_Preadv;
+         return readPreadv(fd, func);
+      }
+      mRing = ring;
+   }
+   
+   bool allOk = true;
+   uint32_t nextSpan = 0;
+   uint32_t numInFlight = 0;
+   uint32_t numDone = 0;
+   uint32_t toSubmit = 0;
+   
+   while (numDone < mSpans.size())
+   {
+      while (nextSpan < mSpans.size() && numInFlight < ring->numEntries)
+      {
+         prepareSpan(nextSpan);
+         const Span& span = mSpans[nextSpan];
+         ring->queueReadv(fd, &mIov[span.iovFirst], span.iovCount, span.offset, nextSpan);
+         nextSpan++;
+         numInFlight++;
+         toSubmit++;
+      }
+      
+      int ret = ring->enter(toSubmit, 1);
+      mStats.numSubmits++;
+      if (ret >= 0)
+         toSubmit -= std::min<uint32_t>(toSubmit, (uint32_t)ret);
+      else if (errno != EINTR)
+      {
+         // Queued entries are lost with the ring, so finish everything still outstanding with preadv
+         LOG_WARN("io_uring_enter failed (%s), falling back to preadv", strerror(errno));
+         delete ring;
+         mRing = NULL;
+         
+         for (uint32_t i=0; i<mSpans.size(); i++)
+         {
+            if (i >= nextSpan)
+               prepareSpan(i);
+            if (mRanges[mSpans[i].first].data == NULL)
+               continue; // already handed back
+            
+            bool ok = readSpanSync(fd, i);
+            finishSpan(i, ok, func);
+            allOk = allOk && ok;
+         }
+         
+         return allOk;
+      }
+      
+      uint64_t spanIdx = 0;
+      int32_t res = 0;
+      while (ring->popCompletion(&spanIdx, &res))
+      {
+         numInFlight--;
+         numDone++;
+         
+         // Short reads are rare (end of file, signals); finish them synchronously
+         bool ok = res >= 0 && (uint64_t)res == mSpans[spanIdx].size;
+         if (!ok && res >= 0)
+            ok = readSpanSync(fd, (uint32_t)spanIdx);
+         
+         finishSpan((uint32_t)spanIdx, ok, func);
+         allOk = allOk && ok;
+      }
+   }
+   
+   return allOk;
+#else
+   return readPreadv(fd, func);
+#endif
+}
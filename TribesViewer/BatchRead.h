@@ -0,0 +1,133 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _BATCHREAD_H_
+#define _BATCHREAD_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <functional>
+#include <vector>
+
+// Reads many ranges of one file with as few requests as possible.
+//
+// Ranges are sorted by offset, and neighbours less than MaxGap apart are merged into spans. Entries packed
+// together in a volume then come back from one request instead of a seek and read each. Each span is read
+// with one vectored read straight into the buffers of the ranges it covers, with the gaps going to a
+// scratch buffer, so nothing needs copying afterwards.
+//
+// When built with ENABLE_IO_URING on Linux, spans are queued together through io_uring, provided the kernel
+// allows it. Otherwise they are read one after another with preadv. Completed ranges are handed back on
+// the calling thread as their spans finish.
+//
+class BatchReader
+{
+public:
+   
+   enum Backend
+   {
+      Backend_Auto,     // io_uring if available, otherwise preadv
+      Backend_IOUring,
+      Backend_Preadv,
+      Backend_Count
+   };
+   
+   enum
+   {
+      MaxGap = 16 * 1024,
+      MaxSpanBytes = 1024 * 1024,
+      MaxSpanRanges = 256,
+      QueueDepth = 32
+   };
+   
+   // data is allocated with malloc and belongs to the callee, or is NULL if the range couldn't be read
+   typedef std::function<void(uint32_t rangeIdx, uint8_t* data, uint32_t size)> CompleteFunc;
+   
+   struct Stats
+   {
+      uint32_t numRanges;
+      uint32_t numSpans;
+      uint32_t numSubmits;    // io_uring_enter or preadv calls
+      uint32_t numFailed;
+      uint64_t bytesRequested;
+      uint64_t bytesRead;     // including gaps
+      Backend backend;
+   };
+   
+   // Backend used by read()
+   static Backend smBackend;
+   
+   BatchReader();
+   ~BatchReader();
+   
+   // Returns the index passed back to the CompleteFunc
+   uint32_t add(uint64_t offset, uint32_t size);
+   void clear();
+   inline uint32_t getNumRanges() const { return (uint32_t)mRanges.size(); }
+   
+   // Reads every range added since the last clear(). Returns false if any of them failed.
+   bool read(int fd, const CompleteFunc& func);
+   
+   inline const Stats& getStats() const { return mStats; }
+   
+   static bool isBackendAvailable(Backend backend);
+   static const char* getBackendName(Backend backend);
+   
+protected:
+   
+   struct Range
+   {
+      uint64_t offset;
+      uint32_t size;
+      uint32_t idx;
+      uint8_t* data;
+   };
+   
+   // Covers mRanges[first, first+count) once sorted, read through mIov[iovFirst, iovFirst+iovCount)
+   struct Span
+   {
+      uint64_t offset;
+      uint64_t size;
+      uint32_t first;
+      uint32_t count;
+      uint32_t iovFirst;
+      uint32_t iovCount;
+   };
+   
+   std::vector<Range> mRanges;
+   std::vector<Span> mSpans;
+   std::vector<struct iovec> mIov;
+   std::vector<uint8_t> mScratch;
+   Stats mStats;
+   void* mRing;                // io_uring state, set up on first use
+   
+   void buildSpans();
+   void prepareSpan(uint32_t spanIdx);
+   void finishSpan(uint32_t spanIdx, bool ok, const CompleteFunc& func);
+   bool readSpanSync(int fd, uint32_t spanIdx);
+   
+   bool readPreadv(int fd, const CompleteFunc& func);
+   bool readIOUring(int fd, const CompleteFunc& func);
+};
+
+#endif
@@ -0,0 +1,214 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <string.h>
+#include <chrono>
+#include "BatchTransform.h"
+
+BatchTransform::Stats BatchTransform::smLastStats;
+BatchTransform::Stats BatchTransform::smLoadStats;
+
+namespace
+{
+
+// Accumulates timing into an optional Stats block
+class StatsScope
+{
+public:
+   BatchTransform::Stats* mStats;
+   size_t mCount;
+   std::chrono::steady_clock::time_point mStart;
+   
+   StatsScope(BatchTransform::Stats* stats, size_t count) : mStats(stats), mCount(count)
+   {
+      if (mStats)
+         mStart = std::chrono::steady_clock::now();
+   }
+   
+   ~StatsScope()
+   {
+      if (!mStats)
+         return;
+      auto end = std::chrono::steady_clock::now();
+      mStats->numPoints += mCount;
+      mStats->timeUS += std::chrono::duration_cast<std::chrono::nanoseconds>(end - mStart).count() / 1000.0f;
+   }
+};
+
+#ifdef SLMATH_SIMD
+static inline slm::m128_t transformPoint(const slm::m128_t* c, const float* p)
+{
+   return SLMATH_ADD_PS( SLMATH_ADD_PS( SLMATH_MUL_PS(c[0], SLMATH_LOAD_PS1(p)), SLMATH_MUL_PS(c[1], SLMATH_LOAD_PS1(p+1)) ),
+                         SLMATH_ADD_PS( SLMATH_MUL_PS(c[2], SLMATH_LOAD_PS1(p+2)), c[3] ) );
+}
+
+// Stores xyz only, so interleaved data following the point is left alone
+static inline void storePoint3(float* dst, slm::m128_t v)
+{
+#ifdef SLMATH_SSE2
+   _mm_storel_pi((__m64*)dst, v);
+   _mm_store_ss(dst+2, _mm_movehl_ps(v, v));
+#else
+   float tmp[4];
+   SLMATH_STOREU_PS(tmp, v);
+   dst[0] = tmp[0];
+   dst[1] = tmp[1];
+   dst[2] = tmp[2];
+#endif
+}
+#endif
+
+}
+
+void BatchTransform::transformPoints(const slm::mat4& m, const slm::vec3* in, size_t inStride, slm::vec3* out, size_t outStride, size_t count, Stats* stats)
+{
+   StatsScope scope(stats, count);
+   const uint8_t* src = (const uint8_t*)in;
+   uint8_t* dst = (uint8_t*)out;
+   
+#ifdef SLMATH_SIMD
+   const slm::m128_t* c = m.m128();
+   for (size_t i=0; i<count; i++)
+   {
+      storePoint3((float*)(dst + (i*outStride)), transformPoint(c, (const float*)(src + (i*inStride))));
+   }
+#else
+   for (size_t i=0; i<count; i++)
+   {
+      const slm::vec3& p = *((const slm::vec3*)(src + (i*inStride)));
+      *((slm::vec3*)(dst + (i*outStride))) = (m[0]*p.x + m[1]*p.y + m[2]*p.z + m[3]).xyz();
+   }
+#endif
+}
+
+void BatchTransform::transformPointsSoA(const slm::mat4& m, const float* inX, const float* inY, const float* inZ, float* outX, float* outY, float* outZ, size_t count, Stats* stats)
+{
+   StatsScope scope(stats, count);
+   size_t i = 0;
+   
+#ifdef SLMATH_SIMD
+   const slm::m128_t m00 = SLMATH_LOAD_PS1(&m[0].x), m01 = SLMATH_LOAD_PS1(&m[0].y), m02 = SLMATH_LOAD_PS1(&m[0].z);
+   const slm::m128_t m10 = SLMATH_LOAD_PS1(&m[1].x), m11 = SLMATH_LOAD_PS1(&m[1].y), m12 = SLMATH_LOAD_PS1(&m[1].z);
+   const slm::m128_t m20 = SLMATH_LOAD_PS1(&m[2].x), m21 = SLMATH_LOAD_PS1(&m[2].y), m22 = SLMATH_LOAD_PS1(&m[2].z);
+   const slm::m128_t m30 = SLMATH_LOAD_PS1(&m[3].x), m31 = SLMATH_LOAD_PS1(&m[3].y), m32 = SLMATH_LOAD_PS1(&m[3].z);
+   
+   for (; i+4<=count; i+=4)
+   {
+      const slm::m128_t x = SLMATH_LOADU_PS(inX+i);
+      const slm::m128_t y = SLMATH_LOADU_PS(inY+i);
+      const slm::m128_t z = SLMATH_LOADU_PS(inZ+i);
+      
+      const slm::m128_t rx = SLMATH_ADD_PS( SLMATH_ADD_PS(SLMATH_MUL_PS(m00, x), SLMATH_MUL_PS(m10, y)), SLMATH_ADD_PS(SLMATH_MUL_PS(m20, z), m30) );
+      const slm::m128_t ry = SLMATH_ADD_PS( SLMATH_ADD_PS(SLMATH_MUL_PS(m01, x), SLMATH_MUL_PS(m11, y)), SLMATH_ADD_PS(SLMATH_MUL_PS(m21, z), m31) );
+      const slm::m128_t rz = SLMATH_ADD_PS( SLMATH_ADD_PS(SLMATH_MUL_PS(m02, x), SLMATH_MUL_PS(m12, y)), SLMATH_ADD_PS(SLMATH_MUL_PS(m22, z), m32) );
+      
+      SLMATH_STOREU_PS(outX+i, rx);
+      SLMATH_STOREU_PS(outY+i, ry);
+      SLMATH_STOREU_PS(outZ+i, rz);
+   }
+#endif
+   
+   for (; i<count; i++)
+   {
+      const float x = inX[i];
+      const float y = inY[i];
+      const float z = inZ[i];
+      outX[i] = m[0].x*x + m[1].x*y + m[2].x*z + m[3].x;
+      outY[i] = m[0].y*x + m[1].y*y + m[2].y*z + m[3].y;
+      outZ[i] = m[0].z*x + m[1].z*y + m[2].z*z + m[3].z;
+   }
+}
+
+void BatchTransform::projectPointsSoA(const slm::mat4& m, const float* inX, const float* inY, const float* inZ, float* out, size_t outStride, size_t count, Stats* stats)
+{
+   StatsScope scope(stats, count);
+   uint8_t* dst = (uint8_t*)out;
+   size_t i = 0;
+   
+#ifdef SLMATH_SIMD
+   const slm::m128_t m00 = SLMATH_LOAD_PS1(&m[0].x), m01 = SLMATH_LOAD_PS1(&m[0].y), m02 = SLMATH_LOAD_PS1(&m[0].z), m03 = SLMATH_LOAD_PS1(&m[0].w);
+   const slm::m128_t m10 = SLMATH_LOAD_PS1(&m[1].x), m11 = SLMATH_LOAD_PS1(&m[1].y), m12 = SLMATH_LOAD_PS1(&m[1].z), m13 = SLMATH_LOAD_PS1(&m[1].w);
+   const slm::m128_t m20 = SLMATH_LOAD_PS1(&m[2].x), m21 = SLMATH_LOAD_PS1(&m[2].y), m22 = SLMATH_LOAD_PS1(&m[2].z), m23 = SLMATH_LOAD_PS1(&m[2].w);
+   const slm::m128_t m30 = SLMATH_LOAD_PS1(&m[3].x), m31 = SLMATH_LOAD_PS1(&m[3].y), m32 = SLMATH_LOAD_PS1(&m[3].z), m33 = SLMATH_LOAD_PS1(&m[3].w);
+   
+   for (; i+4<=count; i+=4)
+   {
+      const slm::m128_t x = SLMATH_LOADU_PS(inX+i);
+      const slm::m128_t y = SLMATH_LOADU_PS(inY+i);
+      const slm::m128_t z = SLMATH_LOADU_PS(inZ+i);
+      
+      slm::m128_t rx = SLMATH_ADD_PS( SLMATH_ADD_PS(SLMATH_MUL_PS(m00, x), SLMATH_MUL_PS(m10, y)), SLMATH_ADD_PS(SLMATH_MUL_PS(m20, z), m30) );
+      slm::m128_t ry = SLMATH_ADD_PS( SLMATH_ADD_PS(SLMATH_MUL_PS(m01, x), SLMATH_MUL_PS(m11, y)), SLMATH_ADD_PS(SLMATH_MUL_PS(m21, z), m31) );
+      slm::m128_t rz = SLMATH_ADD_PS( SLMATH_ADD_PS(SLMATH_MUL_PS(m02, x), SLMATH_MUL_PS(m12, y)), SLMATH_ADD_PS(SLMATH_MUL_PS(m22, z), m32) );
+      slm::m128_t rw = SLMATH_ADD_PS( SLMATH_ADD_PS(SLMATH_MUL_PS(m03, x), SLMATH_MUL_PS(m13, y)), SLMATH_ADD_PS(SLMATH_MUL_PS(m23, z), m33) );
+      
+      // Back to one xyzw per point
+      SLMATH_TRANSPOSE4_PS(rx, ry, rz, rw);
+      SLMATH_STOREU_PS((float*)(dst + (i*outStride)), rx);
+      SLMATH_STOREU_PS((float*)(dst + ((i+1)*outStride)), ry);
+      SLMATH_STOREU_PS((float*)(dst + ((i+2)*outStride)), rz);
+      SLMATH_STOREU_PS((float*)(dst + ((i+3)*outStride)), rw);
+   }
+#endif
+   
+   for (; i<count; i++)
+   {
+      slm::vec4 r = m[0]*inX[i] + m[1]*inY[i] + m[2]*inZ[i] + m[3];
+      memcpy(dst + (i*outStride), &r.x, sizeof(float)*4);
+   }
+}
+
+void BatchTransform::unpackPoints(const uint8_t* packed, size_t packedStride, const uint32_t* remap, size_t count, const slm::vec3& scale, const slm::vec3& origin, slm::vec3* out, size_t outStride, Stats* stats)
+{
+   StatsScope scope(stats, count);
+   uint8_t* dst = (uint8_t*)out;
+   size_t i = 0;
+   
+#ifdef SLMATH_SSE2
+   // Each point is read as a full 32bit word, so this needs at least 4 bytes per point
+   if (packedStride >= 4)
+   {
+      const __m128 vScale = _mm_setr_ps(scale.x, scale.y, scale.z, 0.0f);
+      const __m128 vOrigin = _mm_setr_ps(origin.x, origin.y, origin.z, 0.0f);
+      const __m128i zero = _mm_setzero_si128();
+      
+      for (; i<count; i++)
+      {
+         int32_t word;
+         size_t idx = remap ? remap[i] : i;
+         memcpy(&word, packed + (idx*packedStride), sizeof(int32_t));
+         
+         const __m128i bytes = _mm_cvtsi32_si128(word);
+         const __m128 p = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero));
+         storePoint3((float*)(dst + (i*outStride)), _mm_add_ps(_mm_mul_ps(p, vScale), vOrigin));
+      }
+   }
+#endif
+   
+   for (; i<count; i++)
+   {
+      size_t idx = remap ? remap[i] : i;
+      const uint8_t* p = packed + (idx*packedStride);
+      *((slm::vec3*)(dst + (i*outStride))) = slm::vec3(p[0] * scale.x + origin.x, p[1] * scale.y + origin.y, p[2] * scale.z + origin.z);
+   }
+}
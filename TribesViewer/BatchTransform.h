@@ -0,0 +1,69 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _BATCHTRANSFORM_H_
+#define _BATCHTRANSFORM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <slm/slmath.h>
+
+// Kernels which transform whole arrays of points at once.
+//
+// AoS variants take byte strides so they can read from or write into interleaved data (e.g. the
+// translation column of a mat4 array, or the position half of a position+normal vertex buffer).
+// SoA variants take separate x/y/z arrays and process 4 points per iteration; use these for points
+// which are transformed every frame (e.g. occluder vertices).
+//
+// Each kernel optionally accumulates the number of points processed and the time taken into a
+// Stats block; pass NULL when calling from a worker thread.
+//
+class BatchTransform
+{
+public:
+   
+   struct Stats
+   {
+      uint64_t numPoints;
+      float timeUS;
+      
+      inline double getPointsPerSec() const { return timeUS > 0.0f ? (numPoints / (timeUS * 1e-6)) : 0.0; }
+   };
+   
+   static Stats smLastStats; // reset each frame
+   static Stats smLoadStats; // accumulated while loading
+   
+   // out[i] = (m * vec4(in[i], 1)).xyz
+   static void transformPoints(const slm::mat4& m, const slm::vec3* in, size_t inStride, slm::vec3* out, size_t outStride, size_t count, Stats* stats=NULL);
+   
+   // SoA form of transformPoints. in and out may be the same arrays.
+   static void transformPointsSoA(const slm::mat4& m, const float* inX, const float* inY, const float* inZ, float* outX, float* outY, float* outZ, size_t count, Stats* stats=NULL);
+   
+   // out[i] = m * vec4(inX[i], inY[i], inZ[i], 1), written as 4 floats every outStride bytes
+   static void projectPointsSoA(const slm::mat4& m, const float* inX, const float* inY, const float* inZ, float* out, size_t outStride, size_t count, Stats* stats=NULL);
+   
+   // out[i] = packed[remap[i]].xyz * scale + origin, where each packed point is 3 uint8_t components.
+   // remap may be NULL to read points sequentially.
+   static void unpackPoints(const uint8_t* packed, size_t packedStride, const uint32_t* remap, size_t count, const slm::vec3& scale, const slm::vec3& origin, slm::vec3* out, size_t outStride, Stats* stats=NULL);
+};
+
+#endif
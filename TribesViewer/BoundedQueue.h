@@ -0,0 +1,134 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _BOUNDEDQUEUE_H_
+#define _BOUNDEDQUEUE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+// Fixed size multi-producer, multi-consumer queue. Each slot carries a sequence number which says whether
+// it is free for the producer at that position or holds a value for the consumer, so neither side needs
+// a lock. push() fails rather than blocking when the queue is full, leaving backpressure to the caller.
+//
+// pushWith/popWith hand the slot's value to a function instead of copying it, for large values such as
+// log messages.
+//
+template<class T, uint32_t Size> class BoundedQueue
+{
+   static_assert((Size & (Size-1)) == 0, "Size must be a power of two");
+   
+public:
+   
+   BoundedQueue() : mTail(0), mHead(0)
+   {
+      for (uint32_t i=0; i<Size; i++)
+      {
+         mSlots[i].sequence.store(i, std::memory_order_relaxed);
+      }
+   }
+   
+   bool push(const T& value)
+   {
+      return pushWith([&value](T& slotValue){ slotValue = value; });
+   }
+   
+   bool pop(T& outValue)
+   {
+      return popWith([&outValue](const T& slotValue){ outValue = slotValue; });
+   }
+   
+   template<class F> bool pushWith(F&& fill)
+   {
+      uint64_t pos = mTail.load(std::memory_order_relaxed);
+      Slot* slot = NULL;
+      
+      while (true)
+      {
+         slot = &mSlots[pos & (Size-1)];
+         int64_t diff = (int64_t)slot->sequence.load(std::memory_order_acquire) - (int64_t)pos;
+         
+         if (diff == 0)
+         {
+            if (mTail.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+               break;
+         }
+         else if (diff < 0)
+         {
+            return false; // full
+         }
+         else
+         {
+            pos = mTail.load(std::memory_order_relaxed);
+         }
+      }
+      
+      fill(slot->value);
+      slot->sequence.store(pos+1, std::memory_order_release);
+      return true;
+   }
+   
+   template<class F> bool popWith(F&& read)
+   {
+      uint64_t pos = mHead.load(std::memory_order_relaxed);
+      Slot* slot = NULL;
+      
+      while (true)
+      {
+         slot = &mSlots[pos & (Size-1)];
+         int64_t diff = (int64_t)slot->sequence.load(std::memory_order_acquire) - (int64_t)(pos+1);
+         
+         if (diff == 0)
+         {
+            if (mHead.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+               break;
+         }
+         else if (diff < 0)
+         {
+            return false; // empty
+         }
+         else
+         {
+            pos = mHead.load(std::memory_order_relaxed);
+         }
+      }
+      
+      read(slot->value);
+      slot->sequence.store(pos + Size, std::memory_order_release);
+      return true;
+   }
+   
+protected:
+   
+   struct Slot
+   {
+      std::atomic<uint64_t> sequence;
+      T value;
+   };
+   
+   Slot mSlots[Size];
+   std::atomic<uint64_t> mTail;
+   std::atomic<uint64_t> mHead;
+};
+
+#endif
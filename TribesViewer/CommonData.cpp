@@ -31,12 +31,14 @@
 #include <unordered_map>
 #include <slm/slmath.h>
 #include "CommonData.h"
+#include "Trace.h"
 
 DarkstarPersistObject::NamedFuncMap DarkstarPersistObject::smNamedCreateFuncs;
 DarkstarPersistObject::IDFuncMap DarkstarPersistObject::smIDCreateFuncs;
 
 DarkstarPersistObject* DarkstarPersistObject::createFromStream(MemRStream& mem)
 {
+   TRACE_ZONE("DarkstarPersistObject::createFromStream");
    IFFBlock block;
    uint32_t version = 0;
    mem.read(block);
@@ -71,7 +73,7 @@ DarkstarPersistObject* DarkstarPersistObject::createFromStream(MemRStream& mem)
    return obj;
 }
 
-Palette::Palette() : mRemapData(NULL)
+Palette::Palette() : mRemapData(NULL), mRemapTrack(MemTrack::Category_Assets)
 {
 }
    
@@ -213,6 +215,7 @@ bool Palette::read(MemRStream& mem)
      }
      
      mRemapData = (uint8_t*)malloc(lookupSize);
+     mRemapTrack.set(lookupSize);
      mem.read(lookupSize, mRemapData);
      
      // Assign lookup ptrs
@@ -293,7 +296,7 @@ Palette::Data* Palette::getPaletteByIndex(uint32_t idx)
   return &mPalettes[0]; // fallback
 }
 
-Bitmap::Bitmap() : mData(NULL), mUserData(NULL), mPal(NULL), mBGR(false)
+Bitmap::Bitmap() : mData(NULL), mDataTrack(MemTrack::Category_Assets), mUserData(NULL), mPal(NULL), mBGR(false)
 {;}
 
 Bitmap::~Bitmap()
@@ -341,6 +344,7 @@ bool Bitmap::readMSBMP(MemRStream& mem)
   }
   
   mData = (uint8_t*)malloc(mHeight * mStride);
+  mDataTrack.set(mHeight * mStride);
   memset(mData, '\0', mHeight * mStride);
   mMips[0] = mData;
   
@@ -355,6 +359,7 @@ bool Bitmap::readMSBMP(MemRStream& mem)
 
 bool Bitmap::read(MemRStream& mem)
 {
+  TRACE_ZONE("Bitmap::read");
   IFFBlock block;
   mem.read(block);
   uint32_t expectedChunks=UINT_MAX-1;
@@ -404,6 +409,7 @@ bool Bitmap::read(MemRStream& mem)
         case IDENT_data:
            if (mData) free(mData);
            mData = (uint8_t*)malloc(block.getSize());
+           mDataTrack.set(block.getSize());
            mem.read(block.getSize(), mData);
            block.seekToEnd(startPos, mem);
            break;
@@ -447,6 +453,7 @@ bool Bitmap::read(MemRStream& mem)
 
 void LZH::lzh_unpack(int text_size, MemRStream& in_stream, MemRStream& out_stream)
 {
+   TRACE_ZONE("LZH::lzh_unpack");
    init_huff_and_tree();
    int r = BUF_SIZE - LOOK_AHEAD;
    text_buf.assign(BUF_SIZE + LOOK_AHEAD - 1, 0);
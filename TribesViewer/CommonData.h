@@ -25,6 +25,7 @@
 
 #include <algorithm>
 #include <functional>
+#include "MemTrack.h"
 
 struct _LineVert
 {
@@ -109,36 +110,51 @@ public:
    
    bool mOwnPtr;
    
-   MemRStream(uint32_t sz, void* ptr, bool ownPtr=false) : mPos(0), mSize(sz), mPtr((uint8_t*)ptr), mOwnPtr(ownPtr) {;}
+   // NOTE: owned data is counted as IO memory until the owning stream is destroyed
+   MemRStream(uint32_t sz, void* ptr, bool ownPtr=false) : mPos(0), mSize(sz), mPtr((uint8_t*)ptr), mOwnPtr(ownPtr)
+   {
+      if (mOwnPtr)
+         MemTrack::add(MemTrack::Category_IO, mSize);
+   }
    MemRStream(MemRStream &&other)
    {
       mPtr = other.mPtr;
       mPos = other.mPos;
       mSize = other.mSize;
+      mOwnPtr = other.mOwnPtr;
       other.mOwnPtr = false;
-      mOwnPtr = true;
    }
    MemRStream(MemRStream &other)
    {
       mPtr = other.mPtr;
       mPos = other.mPos;
       mSize = other.mSize;
+      mOwnPtr = other.mOwnPtr;
       other.mOwnPtr = false;
-      mOwnPtr = true;
    }
    MemRStream& operator=(MemRStream other)
    {
+      releasePtr();
       mPtr = other.mPtr;
       mPos = other.mPos;
       mSize = other.mSize;
+      mOwnPtr = other.mOwnPtr;
       other.mOwnPtr = false;
-      mOwnPtr = true;
       return *this;
    }
    ~MemRStream()
    {
-      if(mOwnPtr)
+      releasePtr();
+   }
+   
+   inline void releasePtr()
+   {
+      if (mOwnPtr)
+      {
          free(mPtr);
+         MemTrack::remove(MemTrack::Category_IO, mSize);
+      }
+      mOwnPtr = false;
    }
    
    // For array types
@@ -396,6 +412,7 @@ public:
    uint32_t mWeightStart;
    uint32_t mWeightEnd;
    uint8_t* mRemapData;
+   MemTrack::Allocation mRemapTrack;
    
    std::vector<Data> mPalettes;
    
@@ -489,6 +506,7 @@ public:
    int32_t mPaletteIndex;
    
    uint8_t* mData;
+   MemTrack::Allocation mDataTrack;
    char* mUserData;
    uint8_t* mMips[MAX_MIPS];
    
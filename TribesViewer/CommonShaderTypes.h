@@ -44,6 +44,7 @@ enum ModelPipelineState
    ModelPipeline_AdditiveBlend,
    ModelPipeline_SubtractiveBlend,
    ModelPipeline_TranslucentBlend,
+   ModelPipeline_DepthOnly,
    ModelPipeline_Count
 };
 
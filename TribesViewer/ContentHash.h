@@ -0,0 +1,63 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _CONTENTHASH_H_
+#define _CONTENTHASH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// 64-bit FNV-1a, used to key cached data by the contents of the file it was built from.
+//
+// Not cryptographic; collisions are possible but unlikely enough for caches of a few thousand entries.
+// Hashes can be built up incrementally by passing the previous result back in as hash.
+//
+class ContentHash
+{
+public:
+   
+   static const uint64_t OffsetBasis = 0xcbf29ce484222325ULL;
+   static const uint64_t Prime = 0x100000001b3ULL;
+   
+   static inline uint64_t hash(const void* data, size_t size, uint64_t hash=OffsetBasis)
+   {
+      const uint8_t* bytes = (const uint8_t*)data;
+      for (size_t i=0; i<size; i++)
+      {
+         hash ^= bytes[i];
+         hash *= Prime;
+      }
+      return hash;
+   }
+   
+   static inline uint64_t hashString(const char* str, uint64_t hash=OffsetBasis)
+   {
+      for (; *str; str++)
+      {
+         hash ^= (uint8_t)*str;
+         hash *= Prime;
+      }
+      return hash;
+   }
+};
+
+#endif
@@ -0,0 +1,180 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include "DirIndex.h"
+#include "Log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <algorithm>
+#include <filesystem>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#define TV_HAVE_INOTIFY 1
+#endif
+
+bool DirIndex::smEnabled = true;
+
+static std::string foldName(const char* name)
+{
+   std::string folded = name;
+   std::transform(folded.begin(), folded.end(), folded.begin(), ::tolower);
+   return folded;
+}
+
+DirIndex::DirIndex() : mNotifyFD(-1)
+{
+   mStats = {};
+}
+
+DirIndex::~DirIndex()
+{
+   clear();
+}
+
+void DirIndex::clear()
+{
+#ifdef TV_HAVE_INOTIFY
+   if (mNotifyFD >= 0)
+      close(mNotifyFD);
+#endif
+   mNotifyFD = -1;
+   mDirs.clear();
+}
+
+uint32_t DirIndex::addDirectory(const char* path)
+{
+   Directory dir;
+   dir.path = path;
+   dir.watch = -1;
+   dir.dirty = true;
+   
+#ifdef TV_HAVE_INOTIFY
+   if (mNotifyFD < 0)
+   {
+      mNotifyFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if (mNotifyFD < 0)
+         LOG_WARN("DirIndex: inotify unavailable (%s), loose files will be probed", strerror(errno));
+   }
+   
+   if (mNotifyFD >= 0)
+   {
+      dir.watch = inotify_add_watch(mNotifyFD, path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+      if (dir.watch < 0)
+         LOG_DEBUG("DirIndex: can't watch %s (%s)", path, strerror(errno));
+   }
+#endif
+   
+   mDirs.push_back(dir);
+   return (uint32_t)mDirs.size() - 1;
+}
+
+void DirIndex::scan(Directory& dir)
+{
+   dir.names.clear();
+   dir.foldedNames.clear();
+   dir.dirty = false;
+   mStats.numScans++;
+   mStats.numFSCalls++;
+   
+   std::error_code err;
+   for (std::filesystem::directory_iterator itr(dir.path, err), end; !err && itr != end; itr.increment(err))
+   {
+      // Symlinks and unknown types are kept; only directories are left out
+      if (itr->is_directory(err))
+         continue;
+      
+      std::string name = itr->path().filename().string();
+      dir.foldedNames.emplace(foldName(name.c_str()), name);
+      dir.names.insert(name);
+   }
+   
+   LOG_DEBUG("DirIndex: %s has %u files", dir.path.c_str(), (uint32_t)dir.names.size());
+}
+
+DirIndex::Lookup DirIndex::find(uint32_t dirIdx, const char* filename, std::string& outPath)
+{
+   Directory& dir = mDirs[dirIdx];
+   mStats.numLookups++;
+   
+   if (!smEnabled || dir.watch < 0 || strchr(filename, '/') || strchr(filename, '\\'))
+   {
+      outPath = dir.path + "/" + filename;
+      return Lookup_Unknown;
+   }
+   
+   if (dir.dirty)
+      scan(dir);
+   
+   if (dir.names.find(filename) != dir.names.end())
+   {
+      outPath = dir.path + "/" + filename;
+      return Lookup_Found;
+   }
+   
+   auto itr = dir.foldedNames.find(foldName(filename));
+   if (itr != dir.foldedNames.end())
+   {
+      outPath = dir.path + "/" + itr->second;
+      return Lookup_Found;
+   }
+   
+   mStats.numMissing++;
+   return Lookup_Missing;
+}
+
+void DirIndex::poll()
+{
+#ifdef TV_HAVE_INOTIFY
+   if (mNotifyFD < 0)
+      return;
+   
+   alignas(inotify_event) char buffer[4096];
+   for (;;)
+   {
+      ssize_t len = read(mNotifyFD, buffer, sizeof(buffer));
+      mStats.numFSCalls++;
+      if (len <= 0)
+         break;
+      
+      for (ssize_t pos = 0; pos < len; )
+      {
+         const inotify_event* evt = (const inotify_event*)(buffer + pos);
+         pos += sizeof(inotify_event) + evt->len;
+         
+         for (Directory& dir : mDirs)
+         {
+            // A lost event could be anything, so list everything again
+            if (dir.watch == evt->wd || (evt->mask & IN_Q_OVERFLOW))
+               dir.dirty = true;
+            
+            // The watch is gone with the directory, so stop trusting the index
+            if (dir.watch == evt->wd && (evt->mask & IN_IGNORED))
+               dir.watch = -1;
+         }
+      }
+   }
+#endif
+}
@@ -0,0 +1,99 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _DIRINDEX_H_
+#define _DIRINDEX_H_
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Remembers which files each loose directory mount holds, so looking up a file that isn't there costs no
+// filesystem calls.
+//
+// Each directory is listed once and its files kept by case-folded name. Lookups prefer an exact match, and
+// otherwise find the file whatever its case, as volume lookups do. On Linux an inotify watch marks a
+// directory as changed, and it is listed again on the next lookup after poll() picks up the change. Without
+// a watch a directory isn't indexed and lookups report it as unknown, so the caller probes the path as
+// before. Names with a path separator are also left to the caller.
+//
+// Not thread safe; used from the main thread like ResManager::openFile.
+//
+class DirIndex
+{
+public:
+   
+   enum Lookup
+   {
+      Lookup_Missing,
+      Lookup_Found,
+      Lookup_Unknown    // not indexed; probe the path instead
+   };
+   
+   struct Stats
+   {
+      uint64_t numLookups;
+      uint64_t numMissing;
+      uint64_t numScans;
+      uint64_t numFSCalls;      // directory listings and change reads
+   };
+   
+   // Cleared with -nodirindex, to compare against probing every path
+   static bool smEnabled;
+   
+   DirIndex();
+   ~DirIndex();
+   
+   // Returns the index passed to find()
+   uint32_t addDirectory(const char* path);
+   void clear();
+   inline uint32_t getNumDirectories() const { return (uint32_t)mDirs.size(); }
+   
+   // Sets outPath to the path to open when found, or to probe when unknown
+   Lookup find(uint32_t dirIdx, const char* filename, std::string& outPath);
+   
+   // Reads pending change notifications; a single non-blocking read when nothing changed
+   void poll();
+   
+   inline const Stats& getStats() const { return mStats; }
+   
+protected:
+   
+   struct Directory
+   {
+      std::string path;
+      std::unordered_set<std::string> names;
+      std::unordered_map<std::string, std::string> foldedNames;
+      int32_t watch;
+      bool dirty;
+   };
+   
+   std::vector<Directory> mDirs;
+   int mNotifyFD;
+   Stats mStats;
+   
+   void scan(Directory& dir);
+};
+
+#endif
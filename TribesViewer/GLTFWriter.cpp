@@ -0,0 +1,805 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include "GLTFWriter.h"
+#include "Log.h"
+
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+
+static const uint32_t GLBMagic = 0x46546C67;     // "glTF"
+static const uint32_t GLBChunkJSON = 0x4E4F534A; // "JSON"
+static const uint32_t GLBChunkBIN = 0x004E4942;  // "BIN\0"
+static const uint32_t CopyBlockSize = 64 * 1024;
+static const uint32_t MaxStoredBlock = 65535;
+
+static const char* getAlphaModeName(GLTFWriter::AlphaMode mode)
+{
+   switch (mode)
+   {
+      case GLTFWriter::Alpha_Mask: return "MASK";
+      case GLTFWriter::Alpha_Blend: return "BLEND";
+      default: return "OPAQUE";
+   }
+}
+
+static void appendFloat(std::string& out, float value)
+{
+   char buffer[32];
+   snprintf(buffer, sizeof(buffer), "%.9g", isfinite(value) ? value : 0.0f);
+   out += buffer;
+}
+
+static void appendInt(std::string& out, int64_t value)
+{
+   char buffer[32];
+   snprintf(buffer, sizeof(buffer), "%lld", (long long)value);
+   out += buffer;
+}
+
+// Names come from game data, so anything outside ascii is treated as latin-1
+static void appendString(std::string& out, const std::string& str)
+{
+   out += '"';
+   for (unsigned char c : str)
+   {
+      if (c == '"' || c == '\\')
+      {
+         out += '\\';
+         out += (char)c;
+      }
+      else if (c < 0x20 || c >= 0x80)
+      {
+         char buffer[8];
+         snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+         out += buffer;
+      }
+      else
+      {
+         out += (char)c;
+      }
+   }
+   out += '"';
+}
+
+static void appendIntArray(std::string& out, const std::vector<int32_t>& values)
+{
+   out += '[';
+   for (size_t i=0; i<values.size(); i++)
+   {
+      if (i > 0) out += ',';
+      appendInt(out, values[i]);
+   }
+   out += ']';
+}
+
+static void appendFloatArray(std::string& out, const float* values, uint32_t count)
+{
+   out += '[';
+   for (uint32_t i=0; i<count; i++)
+   {
+      if (i > 0) out += ',';
+      appendFloat(out, values[i]);
+   }
+   out += ']';
+}
+
+static void writeBE32(std::vector<uint8_t>& out, uint32_t value)
+{
+   out.push_back((value >> 24) & 0xFF);
+   out.push_back((value >> 16) & 0xFF);
+   out.push_back((value >> 8) & 0xFF);
+   out.push_back(value & 0xFF);
+}
+
+static uint32_t updateCRC32(uint32_t crc, const uint8_t* data, size_t size)
+{
+   static uint32_t table[256];
+   static bool tableInit = []() {
+      for (uint32_t i=0; i<256; i++)
+      {
+         uint32_t c = i;
+         for (int k=0; k<8; k++)
+            c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+         table[i] = c;
+      }
+      return true;
+   }();
+   (void)tableInit;
+   
+   for (size_t i=0; i<size; i++)
+   {
+      crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+   }
+   return crc;
+}
+
+// Appends a png chunk; data is everything after the type
+static void writePNGChunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t size)
+{
+   writeBE32(out, (uint32_t)size);
+   size_t start = out.size();
+   out.insert(out.end(), type, type+4);
+   if (size > 0)
+      out.insert(out.end(), data, data+size);
+   uint32_t crc = updateCRC32(0xFFFFFFFF, &out[start], size+4) ^ 0xFFFFFFFF;
+   writeBE32(out, crc);
+}
+
+void GLTFWriter::encodePNG(uint32_t width, uint32_t height, const uint8_t* pixels, std::vector<uint8_t>& outData)
+{
+   static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+   outData.assign(signature, signature+8);
+   
+   std::vector<uint8_t> header;
+   writeBE32(header, width);
+   writeBE32(header, height);
+   header.push_back(8); // bit depth
+   header.push_back(6); // rgba
+   header.push_back(0); // deflate
+   header.push_back(0); // adaptive filtering
+   header.push_back(0); // no interlace
+   writePNGChunk(outData, "IHDR", &header[0], header.size());
+   
+   // Scanlines each start with a filter type (none)
+   const size_t rowBytes = (size_t)width * 4;
+   std::vector<uint8_t> raw;
+   raw.reserve((rowBytes+1) * height);
+   for (uint32_t y=0; y<height; y++)
+   {
+      raw.push_back(0);
+      raw.insert(raw.end(), pixels + (y*rowBytes), pixels + ((y+1)*rowBytes));
+   }
+   
+   // zlib stream of stored blocks
+   std::vector<uint8_t> zdata;
+   zdata.reserve(raw.size() + ((raw.size() / MaxStoredBlock) + 1) * 5 + 6);
+   zdata.push_back(0x78);
+   zdata.push_back(0x01);
+   
+   size_t pos = 0;
+   do
+   {
+      uint32_t blockSize = (uint32_t)std::min<size_t>(raw.size() - pos, MaxStoredBlock);
+      bool last = pos + blockSize >= raw.size();
+      zdata.push_back(last ? 1 : 0);
+      zdata.push_back(blockSize & 0xFF);
+      zdata.push_back((blockSize >> 8) & 0xFF);
+      zdata.push_back(~blockSize & 0xFF);
+      zdata.push_back((~blockSize >> 8) & 0xFF);
+      zdata.insert(zdata.end(), raw.begin() + pos, raw.begin() + pos + blockSize);
+      pos += blockSize;
+   } while (pos < raw.size());
+   
+   uint32_t a = 1, b = 0;
+   for (uint8_t c : raw)
+   {
+      a = (a + c) % 65521;
+      b = (b + a) % 65521;
+   }
+   writeBE32(zdata, (b << 16) | a);
+   
+   writePNGChunk(outData, "IDAT", &zdata[0], zdata.size());
+   writePNGChunk(outData, "IEND", NULL, 0);
+}
+
+GLTFWriter::GLTFWriter() : mBinary(false), mFailed(false), mBinFile(NULL), mBinSize(0), mBytesWritten(0)
+{
+}
+
+GLTFWriter::~GLTFWriter()
+{
+   if (mBinFile)
+      abort();
+}
+
+bool GLTFWriter::open(const char* path, bool binary)
+{
+   mPath = path;
+   mBinary = binary;
+   mFailed = false;
+   mBinSize = 0;
+   mBytesWritten = 0;
+   
+   if (binary)
+   {
+      mBinPath = mPath + ".bin.tmp";
+   }
+   else
+   {
+      size_t extPos = mPath.find_last_of('.');
+      size_t dirPos = mPath.find_last_of("/\\");
+      mBinPath = (extPos != std::string::npos && (dirPos == std::string::npos || extPos > dirPos)) ? mPath.substr(0, extPos) : mPath;
+      mBinPath += ".bin";
+   }
+   
+   mBinFile = fopen(mBinPath.c_str(), "wb");
+   if (mBinFile == NULL)
+   {
+      LOG_ERROR("GLTFWriter: couldn't create %s", mBinPath.c_str());
+      return false;
+   }
+   
+   return true;
+}
+
+void GLTFWriter::abort()
+{
+   if (mBinFile)
+   {
+      fclose(mBinFile);
+      mBinFile = NULL;
+   }
+   remove(mBinPath.c_str());
+   remove(mPath.c_str());
+}
+
+void GLTFWriter::writeData(const void* data, uint32_t size)
+{
+   static const uint8_t padding[4] = {0,0,0,0};
+   
+   if (size > 0 && fwrite(data, size, 1, mBinFile) != 1)
+      mFailed = true;
+   mBinSize += size;
+   
+   // Keep every view 4-byte aligned
+   uint32_t padSize = (4 - (mBinSize & 3)) & 3;
+   if (padSize > 0 && fwrite(padding, padSize, 1, mBinFile) != 1)
+      mFailed = true;
+   mBinSize += padSize;
+}
+
+int32_t GLTFWriter::addBufferView(const void* data, uint32_t size, Target target)
+{
+   BufferView view;
+   view.offset = mBinSize;
+   view.size = size;
+   view.target = target;
+   writeData(data, size);
+   mBufferViews.push_back(view);
+   return (int32_t)mBufferViews.size()-1;
+}
+
+int32_t GLTFWriter::addAccessor(int32_t bufferView, ComponentType componentType, uint32_t count, const char* type, const float* minValues, const float* maxValues, uint32_t numComponents)
+{
+   Accessor accessor;
+   accessor.bufferView = bufferView;
+   accessor.componentType = componentType;
+   accessor.count = count;
+   accessor.type = type;
+   accessor.numComponents = (minValues && maxValues) ? std::min<uint32_t>(numComponents, 4) : 0;
+   for (uint32_t i=0; i<accessor.numComponents; i++)
+   {
+      accessor.minValues[i] = minValues[i];
+      accessor.maxValues[i] = maxValues[i];
+   }
+   mAccessors.push_back(accessor);
+   return (int32_t)mAccessors.size()-1;
+}
+
+int32_t GLTFWriter::addPositions(const slm::vec3* points, uint32_t count)
+{
+   float minP[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+   float maxP[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+   for (uint32_t i=0; i<count; i++)
+   {
+      for (int j=0; j<3; j++)
+      {
+         minP[j] = std::min(minP[j], points[i][j]);
+         maxP[j] = std::max(maxP[j], points[i][j]);
+      }
+   }
+   
+   int32_t view = addBufferView(points, count * sizeof(slm::vec3), Target_ArrayBuffer);
+   return addAccessor(view, Component_Float, count, "VEC3", minP, maxP, count > 0 ? 3 : 0);
+}
+
+int32_t GLTFWriter::addNormals(const slm::vec3* normals, uint32_t count)
+{
+   int32_t view = addBufferView(normals, count * sizeof(slm::vec3), Target_ArrayBuffer);
+   return addAccessor(view, Component_Float, count, "VEC3");
+}
+
+int32_t GLTFWriter::addTexCoords(const slm::vec2* coords, uint32_t count)
+{
+   int32_t view = addBufferView(coords, count * sizeof(slm::vec2), Target_ArrayBuffer);
+   return addAccessor(view, Component_Float, count, "VEC2");
+}
+
+int32_t GLTFWriter::addIndices(const uint32_t* indices, uint32_t count)
+{
+   uint32_t maxIndex = 0;
+   for (uint32_t i=0; i<count; i++)
+   {
+      maxIndex = std::max(maxIndex, indices[i]);
+   }
+   
+   if (maxIndex >= 0xFFFF)
+   {
+      int32_t view = addBufferView(indices, count * sizeof(uint32_t), Target_ElementArrayBuffer);
+      return addAccessor(view, Component_UnsignedInt, count, "SCALAR");
+   }
+   
+   std::vector<uint16_t> shortIndices(indices, indices + count);
+   int32_t view = addBufferView(shortIndices.empty() ? NULL : &shortIndices[0], count * sizeof(uint16_t), Target_ElementArrayBuffer);
+   return addAccessor(view, Component_UnsignedShort, count, "SCALAR");
+}
+
+int32_t GLTFWriter::addTimes(const float* times, uint32_t count)
+{
+   float minT = count > 0 ? times[0] : 0.0f;
+   float maxT = count > 0 ? times[count-1] : 0.0f;
+   int32_t view = addBufferView(times, count * sizeof(float), Target_None);
+   return addAccessor(view, Component_Float, count, "SCALAR", &minT, &maxT, 1);
+}
+
+int32_t GLTFWriter::addFloats(const float* values, uint32_t count)
+{
+   int32_t view = addBufferView(values, count * sizeof(float), Target_None);
+   return addAccessor(view, Component_Float, count, "SCALAR");
+}
+
+int32_t GLTFWriter::addVec3s(const slm::vec3* values, uint32_t count)
+{
+   int32_t view = addBufferView(values, count * sizeof(slm::vec3), Target_None);
+   return addAccessor(view, Component_Float, count, "VEC3");
+}
+
+int32_t GLTFWriter::addQuats(const slm::quat* values, uint32_t count)
+{
+   std::vector<float> data(count * 4);
+   for (uint32_t i=0; i<count; i++)
+   {
+      data[(i*4)+0] = values[i].x;
+      data[(i*4)+1] = values[i].y;
+      data[(i*4)+2] = values[i].z;
+      data[(i*4)+3] = values[i].w;
+   }
+   
+   int32_t view = addBufferView(data.empty() ? NULL : &data[0], count * sizeof(float) * 4, Target_None);
+   return addAccessor(view, Component_Float, count, "VEC4");
+}
+
+int32_t GLTFWriter::addImage(const char* name, uint32_t width, uint32_t height, const uint8_t* pixels)
+{
+   std::vector<uint8_t> png;
+   encodePNG(width, height, pixels, png);
+   
+   Image image;
+   image.name = name;
+   image.bufferView = addBufferView(&png[0], (uint32_t)png.size(), Target_None);
+   mImages.push_back(image);
+   return (int32_t)mImages.size()-1;
+}
+
+int32_t GLTFWriter::addMaterial(const char* name, int32_t image, const slm::vec4& baseColor, AlphaMode alphaMode)
+{
+   Material material;
+   material.name = name;
+   material.image = image;
+   material.baseColor = baseColor;
+   material.alphaMode = alphaMode;
+   mMaterials.push_back(material);
+   return (int32_t)mMaterials.size()-1;
+}
+
+int32_t GLTFWriter::addMesh(const char* name, const std::vector<Primitive>& primitives, uint32_t numTargets)
+{
+   Mesh mesh;
+   mesh.name = name;
+   mesh.primitives = primitives;
+   mesh.numTargets = numTargets;
+   mMeshes.push_back(mesh);
+   return (int32_t)mMeshes.size()-1;
+}
+
+int32_t GLTFWriter::addNode(const Node& node)
+{
+   mNodes.push_back(node);
+   return (int32_t)mNodes.size()-1;
+}
+
+int32_t GLTFWriter::addScene(const char* name, const std::vector<int32_t>& nodes)
+{
+   Scene scene;
+   scene.name = name;
+   scene.nodes = nodes;
+   mScenes.push_back(scene);
+   return (int32_t)mScenes.size()-1;
+}
+
+int32_t GLTFWriter::addAnimation(const char* name)
+{
+   Animation animation;
+   animation.name = name;
+   mAnimations.push_back(animation);
+   return (int32_t)mAnimations.size()-1;
+}
+
+void GLTFWriter::addChannel(int32_t animation, int32_t node, const char* path, int32_t input, int32_t output, Interpolation interpolation)
+{
+   Channel channel;
+   channel.node = node;
+   channel.path = path;
+   channel.input = input;
+   channel.output = output;
+   channel.interpolation = interpolation;
+   mAnimations[animation].channels.push_back(channel);
+}
+
+void GLTFWriter::buildJSON(std::string& out)
+{
+   out += "{\"asset\":{\"version\":\"2.0\",\"generator\":\"TribesViewer\"}";
+   
+   if (mBinSize > 0)
+   {
+      out += ",\"buffers\":[{\"byteLength\":";
+      appendInt(out, mBinSize);
+      if (!mBinary)
+      {
+         size_t dirPos = mBinPath.find_last_of("/\\");
+         out += ",\"uri\":";
+         appendString(out, dirPos == std::string::npos ? mBinPath : mBinPath.substr(dirPos+1));
+      }
+      out += "}]";
+   }
+   
+   if (!mBufferViews.empty())
+   {
+      out += ",\"bufferViews\":[";
+      for (size_t i=0; i<mBufferViews.size(); i++)
+      {
+         const BufferView& view = mBufferViews[i];
+         if (i > 0) out += ',';
+         out += "{\"buffer\":0,\"byteOffset\":";
+         appendInt(out, view.offset);
+         out += ",\"byteLength\":";
+         appendInt(out, view.size);
+         if (view.target != Target_None)
+         {
+            out += ",\"target\":";
+            appendInt(out, view.target);
+         }
+         out += '}';
+      }
+      out += ']';
+   }
+   
+   if (!mAccessors.empty())
+   {
+      out += ",\"accessors\":[";
+      for (size_t i=0; i<mAccessors.size(); i++)
+      {
+         const Accessor& accessor = mAccessors[i];
+         if (i > 0) out += ',';
+         out += "{\"bufferView\":";
+         appendInt(out, accessor.bufferView);
+         out += ",\"componentType\":";
+         appendInt(out, accessor.componentType);
+         out += ",\"count\":";
+         appendInt(out, accessor.count);
+         out += ",\"type\":\"";
+         out += accessor.type;
+         out += '"';
+         if (accessor.numComponents > 0)
+         {
+            out += ",\"min\":";
+            appendFloatArray(out, accessor.minValues, accessor.numComponents);
+            out += ",\"max\":";
+            appendFloatArray(out, accessor.maxValues, accessor.numComponents);
+         }
+         out += '}';
+      }
+      out += ']';
+   }
+   
+   if (!mImages.empty())
+   {
+      out += ",\"images\":[";
+      for (size_t i=0; i<mImages.size(); i++)
+      {
+         if (i > 0) out += ',';
+         out += "{\"name\":";
+         appendString(out, mImages[i].name);
+         out += ",\"bufferView\":";
+         appendInt(out, mImages[i].bufferView);
+         out += ",\"mimeType\":\"image/png\"}";
+      }
+      out += "],\"samplers\":[{\"magFilter\":9729,\"minFilter\":9729}],\"textures\":[";
+      for (size_t i=0; i<mImages.size(); i++)
+      {
+         if (i > 0) out += ',';
+         out += "{\"sampler\":0,\"source\":";
+         appendInt(out, i);
+         out += '}';
+      }
+      out += ']';
+   }
+   
+   if (!mMaterials.empty())
+   {
+      out += ",\"materials\":[";
+      for (size_t i=0; i<mMaterials.size(); i++)
+      {
+         const Material& material = mMaterials[i];
+         if (i > 0) out += ',';
+         out += "{\"name\":";
+         appendString(out, material.name);
+         out += ",\"pbrMetallicRoughness\":{\"baseColorFactor\":";
+         float color[4] = {material.baseColor.x, material.baseColor.y, material.baseColor.z, material.baseColor.w};
+         appendFloatArray(out, color, 4);
+         if (material.image >= 0)
+         {
+            out += ",\"baseColorTexture\":{\"index\":";
+            appendInt(out, material.image);
+            out += '}';
+         }
+         out += ",\"metallicFactor\":0,\"roughnessFactor\":1}";
+         if (material.alphaMode != Alpha_Opaque)
+         {
+            out += ",\"alphaMode\":\"";
+            out += getAlphaModeName(material.alphaMode);
+            out += '"';
+         }
+         out += '}';
+      }
+      out += ']';
+   }
+   
+   if (!mMeshes.empty())
+   {
+      out += ",\"meshes\":[";
+      for (size_t i=0; i<mMeshes.size(); i++)
+      {
+         const Mesh& mesh = mMeshes[i];
+         if (i > 0) out += ',';
+         out += "{\"name\":";
+         appendString(out, mesh.name);
+         out += ",\"primitives\":[";
+         for (size_t j=0; j<mesh.primitives.size(); j++)
+         {
+            const Primitive& prim = mesh.primitives[j];
+            if (j > 0) out += ',';
+            out += "{\"attributes\":{\"POSITION\":";
+            appendInt(out, prim.position);
+            if (prim.normal >= 0)
+            {
+               out += ",\"NORMAL\":";
+               appendInt(out, prim.normal);
+            }
+            if (prim.texCoord >= 0)
+            {
+               out += ",\"TEXCOORD_0\":";
+               appendInt(out, prim.texCoord);
+            }
+            out += '}';
+            if (prim.indices >= 0)
+            {
+               out += ",\"indices\":";
+               appendInt(out, prim.indices);
+            }
+            if (prim.material >= 0)
+            {
+               out += ",\"material\":";
+               appendInt(out, prim.material);
+            }
+            if (!prim.targets.empty())
+            {
+               out += ",\"targets\":[";
+               for (size_t k=0; k<prim.targets.size(); k++)
+               {
+                  if (k > 0) out += ',';
+                  out += "{\"POSITION\":";
+                  appendInt(out, prim.targets[k]);
+                  out += '}';
+               }
+               out += ']';
+            }
+            out += '}';
+         }
+         out += ']';
+         if (mesh.numTargets > 0)
+         {
+            std::vector<float> weights(mesh.numTargets, 0.0f);
+            out += ",\"weights\":";
+            appendFloatArray(out, &weights[0], mesh.numTargets);
+         }
+         out += '}';
+      }
+      out += ']';
+   }
+   
+   if (!mNodes.empty())
+   {
+      out += ",\"nodes\":[";
+      for (size_t i=0; i<mNodes.size(); i++)
+      {
+         const Node& node = mNodes[i];
+         if (i > 0) out += ',';
+         out += "{\"name\":";
+         appendString(out, node.name);
+         if (node.mesh >= 0)
+         {
+            out += ",\"mesh\":";
+            appendInt(out, node.mesh);
+         }
+         if (node.hasTransform)
+         {
+            float translation[3] = {node.translation.x, node.translation.y, node.translation.z};
+            float rotation[4] = {node.rotation.x, node.rotation.y, node.rotation.z, node.rotation.w};
+            out += ",\"translation\":";
+            appendFloatArray(out, translation, 3);
+            out += ",\"rotation\":";
+            appendFloatArray(out, rotation, 4);
+         }
+         if (!node.children.empty())
+         {
+            out += ",\"children\":";
+            appendIntArray(out, node.children);
+         }
+         out += '}';
+      }
+      out += ']';
+   }
+   
+   if (!mScenes.empty())
+   {
+      out += ",\"scene\":0,\"scenes\":[";
+      for (size_t i=0; i<mScenes.size(); i++)
+      {
+         if (i > 0) out += ',';
+         out += "{\"name\":";
+         appendString(out, mScenes[i].name);
+         out += ",\"nodes\":";
+         appendIntArray(out, mScenes[i].nodes);
+         out += '}';
+      }
+      out += ']';
+   }
+   
+   if (!mAnimations.empty())
+   {
+      out += ",\"animations\":[";
+      for (size_t i=0; i<mAnimations.size(); i++)
+      {
+         const Animation& animation = mAnimations[i];
+         if (i > 0) out += ',';
+         out += "{\"name\":";
+         appendString(out, animation.name);
+         out += ",\"samplers\":[";
+         for (size_t j=0; j<animation.channels.size(); j++)
+         {
+            const Channel& channel = animation.channels[j];
+            if (j > 0) out += ',';
+            out += "{\"input\":";
+            appendInt(out, channel.input);
+            out += ",\"output\":";
+            appendInt(out, channel.output);
+            out += channel.interpolation == Interpolation_Step ? ",\"interpolation\":\"STEP\"}" : ",\"interpolation\":\"LINEAR\"}";
+         }
+         out += "],\"channels\":[";
+         for (size_t j=0; j<animation.channels.size(); j++)
+         {
+            const Channel& channel = animation.channels[j];
+            if (j > 0) out += ',';
+            out += "{\"sampler\":";
+            appendInt(out, j);
+            out += ",\"target\":{\"node\":";
+            appendInt(out, channel.node);
+            out += ",\"path\":\"";
+            out += channel.path;
+            out += "\"}}";
+         }
+         out += "]}";
+      }
+      out += ']';
+   }
+   
+   out += '}';
+}
+
+bool GLTFWriter::writeGLB()
+{
+   std::string json;
+   buildJSON(json);
+   while (json.size() & 3)
+   {
+      json += ' ';
+   }
+   
+   FILE* fp = fopen(mPath.c_str(), "wb");
+   if (fp == NULL)
+      return false;
+   
+   uint32_t totalSize = 12 + 8 + (uint32_t)json.size() + (mBinSize > 0 ? 8 + mBinSize : 0);
+   uint32_t header[3] = {GLBMagic, 2, totalSize};
+   uint32_t jsonChunk[2] = {(uint32_t)json.size(), GLBChunkJSON};
+   bool ok = fwrite(header, sizeof(header), 1, fp) == 1 &&
+             fwrite(jsonChunk, sizeof(jsonChunk), 1, fp) == 1 &&
+             fwrite(json.c_str(), json.size(), 1, fp) == 1;
+   
+   if (ok && mBinSize > 0)
+   {
+      uint32_t binChunk[2] = {mBinSize, GLBChunkBIN};
+      ok = fwrite(binChunk, sizeof(binChunk), 1, fp) == 1;
+      
+      // Copy the buffer over a block at a time
+      FILE* binFP = fopen(mBinPath.c_str(), "rb");
+      ok = ok && binFP != NULL;
+      if (binFP)
+      {
+         std::vector<uint8_t> block(CopyBlockSize);
+         uint32_t remaining = mBinSize;
+         while (ok && remaining > 0)
+         {
+            uint32_t toCopy = std::min(remaining, CopyBlockSize);
+            ok = fread(&block[0], toCopy, 1, binFP) == 1 && fwrite(&block[0], toCopy, 1, fp) == 1;
+            remaining -= toCopy;
+         }
+         fclose(binFP);
+      }
+   }
+   
+   ok = (fclose(fp) == 0) && ok;
+   remove(mBinPath.c_str());
+   mBytesWritten = totalSize;
+   return ok;
+}
+
+bool GLTFWriter::close()
+{
+   if (mBinFile == NULL)
+      return false;
+   
+   mFailed = (fclose(mBinFile) != 0) || mFailed;
+   mBinFile = NULL;
+   
+   bool ok = !mFailed;
+   if (ok && mBinary)
+   {
+      ok = writeGLB();
+   }
+   else if (ok)
+   {
+      if (mBinSize == 0)
+         remove(mBinPath.c_str());
+      
+      std::string json;
+      buildJSON(json);
+      FILE* fp = fopen(mPath.c_str(), "wb");
+      ok = fp != NULL && fwrite(json.c_str(), json.size(), 1, fp) == 1;
+      if (fp)
+         ok = (fclose(fp) == 0) && ok;
+      mBytesWritten = json.size() + mBinSize;
+   }
+   
+   if (!ok)
+   {
+      LOG_ERROR("GLTFWriter: failed writing %s", mPath.c_str());
+      remove(mBinPath.c_str());
+      remove(mPath.c_str());
+   }
+   
+   return ok;
+}
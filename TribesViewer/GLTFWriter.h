@@ -0,0 +1,236 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _GLTFWRITER_H_
+#define _GLTFWRITER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <slm/slmath.h>
+
+// Minimal glTF 2.0 writer used by the batch exporter.
+//
+// Binary data (vertex streams, indices, animation keys and PNG images) is appended to the output buffer as
+// it is added, so a file never has to be held in memory as a whole; only the json document is built up. For
+// .gltf output the buffer is the .bin file next to it. For .glb output it goes to a temporary file which is
+// copied into the BIN chunk by close().
+//
+// Everything lives in one buffer, including images, so the output is self contained apart from the .bin.
+//
+class GLTFWriter
+{
+public:
+   
+   enum ComponentType
+   {
+      Component_UnsignedShort = 5123,
+      Component_UnsignedInt = 5125,
+      Component_Float = 5126
+   };
+   
+   enum Target
+   {
+      Target_None = 0,
+      Target_ArrayBuffer = 34962,
+      Target_ElementArrayBuffer = 34963
+   };
+   
+   enum AlphaMode
+   {
+      Alpha_Opaque,
+      Alpha_Mask,
+      Alpha_Blend
+   };
+   
+   enum Interpolation
+   {
+      Interpolation_Linear,
+      Interpolation_Step
+   };
+   
+   struct Primitive
+   {
+      int32_t position;
+      int32_t normal;
+      int32_t texCoord;
+      int32_t indices;
+      int32_t material;
+      std::vector<int32_t> targets; // POSITION displacement accessors
+      
+      Primitive() : position(-1), normal(-1), texCoord(-1), indices(-1), material(-1) {;}
+   };
+   
+   struct Node
+   {
+      std::string name;
+      int32_t mesh;
+      bool hasTransform;
+      slm::vec3 translation;
+      slm::quat rotation; // x,y,z,w as in glTF
+      std::vector<int32_t> children;
+      
+      Node() : mesh(-1), hasTransform(false), translation(0), rotation(0,0,0,1) {;}
+   };
+   
+   GLTFWriter();
+   ~GLTFWriter();
+   
+   // Starts a new file; binary selects .glb output. Existing files are replaced.
+   bool open(const char* path, bool binary);
+   
+   // Writes the document. Returns false (and removes the output) if anything failed to write.
+   bool close();
+   
+   // Removes anything written so far
+   void abort();
+   
+   // Appends raw data as a buffer view
+   int32_t addBufferView(const void* data, uint32_t size, Target target);
+   
+   int32_t addAccessor(int32_t bufferView, ComponentType componentType, uint32_t count, const char* type, const float* minValues=NULL, const float* maxValues=NULL, uint32_t numComponents=0);
+   
+   // Vertex streams. Positions include the bounds required by the spec (also for morph targets).
+   int32_t addPositions(const slm::vec3* points, uint32_t count);
+   int32_t addNormals(const slm::vec3* normals, uint32_t count);
+   int32_t addTexCoords(const slm::vec2* coords, uint32_t count);
+   
+   // Stored as 16-bit indices when they fit
+   int32_t addIndices(const uint32_t* indices, uint32_t count);
+   
+   // Animation inputs (with bounds) and outputs
+   int32_t addTimes(const float* times, uint32_t count);
+   int32_t addFloats(const float* values, uint32_t count);
+   int32_t addVec3s(const slm::vec3* values, uint32_t count);
+   int32_t addQuats(const slm::quat* values, uint32_t count);
+   
+   // Encodes RGBA8 pixels as a png image in the buffer
+   int32_t addImage(const char* name, uint32_t width, uint32_t height, const uint8_t* pixels);
+   
+   // Texture is an image index or -1
+   int32_t addMaterial(const char* name, int32_t image, const slm::vec4& baseColor, AlphaMode alphaMode);
+   
+   int32_t addMesh(const char* name, const std::vector<Primitive>& primitives, uint32_t numTargets=0);
+   
+   int32_t addNode(const Node& node);
+   Node& getNode(int32_t idx) { return mNodes[idx]; }
+   
+   // Scenes list their root nodes. The first scene is the default.
+   int32_t addScene(const char* name, const std::vector<int32_t>& nodes);
+   
+   int32_t addAnimation(const char* name);
+   
+   // path is "translation", "rotation" or "weights"
+   void addChannel(int32_t animation, int32_t node, const char* path, int32_t input, int32_t output, Interpolation interpolation);
+   
+   inline uint64_t getBytesWritten() const { return mBytesWritten; }
+   inline bool hasFailed() const { return mFailed; }
+   
+   // PNG with stored (uncompressed) deflate blocks, since there's no zlib here
+   static void encodePNG(uint32_t width, uint32_t height, const uint8_t* pixels, std::vector<uint8_t>& outData);
+   
+protected:
+   
+   struct BufferView
+   {
+      uint32_t offset;
+      uint32_t size;
+      Target target;
+   };
+   
+   struct Accessor
+   {
+      int32_t bufferView;
+      ComponentType componentType;
+      uint32_t count;
+      const char* type;
+      uint32_t numComponents; // of min/max
+      float minValues[4];
+      float maxValues[4];
+   };
+   
+   struct Material
+   {
+      std::string name;
+      int32_t image;
+      slm::vec4 baseColor;
+      AlphaMode alphaMode;
+   };
+   
+   struct Mesh
+   {
+      std::string name;
+      std::vector<Primitive> primitives;
+      uint32_t numTargets;
+   };
+   
+   struct Image
+   {
+      std::string name;
+      int32_t bufferView;
+   };
+   
+   struct Scene
+   {
+      std::string name;
+      std::vector<int32_t> nodes;
+   };
+   
+   struct Channel
+   {
+      int32_t node;
+      const char* path;
+      int32_t input;
+      int32_t output;
+      Interpolation interpolation;
+   };
+   
+   struct Animation
+   {
+      std::string name;
+      std::vector<Channel> channels;
+   };
+   
+   void writeData(const void* data, uint32_t size);
+   void buildJSON(std::string& out);
+   bool writeGLB();
+   
+   std::string mPath;
+   std::string mBinPath;
+   bool mBinary;
+   bool mFailed;
+   FILE* mBinFile;
+   uint32_t mBinSize;
+   uint64_t mBytesWritten;
+   
+   std::vector<BufferView> mBufferViews;
+   std::vector<Accessor> mAccessors;
+   std::vector<Image> mImages;
+   std::vector<Material> mMaterials;
+   std::vector<Mesh> mMeshes;
+   std::vector<Node> mNodes;
+   std::vector<Scene> mScenes;
+   std::vector<Animation> mAnimations;
+};
+
+#endif
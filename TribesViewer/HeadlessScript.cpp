@@ -0,0 +1,109 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include "HeadlessScript.h"
+#include "Log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static const char* sCommandNames[HeadlessScript::Command_Count] = {
+   "load",
+   "palette",
+   "sequence",
+   "frames",
+   "stats"
+};
+
+HeadlessScript::Command& HeadlessScript::addCommand(CommandType type, const char* arg)
+{
+   Command cmd;
+   cmd.type = type;
+   cmd.arg = arg ? arg : "";
+   cmd.count = type == Command_Frames ? (uint32_t)strtoul(cmd.arg.c_str(), NULL, 10) : 0;
+   mCommands.push_back(cmd);
+   return mCommands.back();
+}
+
+bool HeadlessScript::load(const char* path)
+{
+   FILE* fp = fopen(path, "r");
+   if (fp == NULL)
+   {
+      LOG_ERROR("Couldn't open script %s", path);
+      return false;
+   }
+   
+   mCommands.clear();
+   
+   char line[1024];
+   uint32_t lineNum = 0;
+   bool ok = true;
+   
+   while (fgets(line, sizeof(line), fp))
+   {
+      lineNum++;
+      line[strcspn(line, "\r\n")] = '\0';
+      for (size_t len = strlen(line); len > 0 && (line[len-1] == ' ' || line[len-1] == '\t'); len--)
+         line[len-1] = '\0';
+      
+      char* start = line + strspn(line, " \t");
+      if (start[0] == '\0' || start[0] == '#')
+         continue;
+      
+      char* arg = start + strcspn(start, " \t");
+      if (arg[0] != '\0')
+      {
+         *arg++ = '\0';
+         arg += strspn(arg, " \t");
+      }
+      
+      uint32_t type = 0;
+      while (type < Command_Count && strcasecmp(sCommandNames[type], start) != 0)
+         type++;
+      if (type == Command_Count)
+      {
+         LOG_ERROR("%s:%u: unknown command %s", path, lineNum, start);
+         ok = false;
+         break;
+      }
+      
+      if (arg[0] == '\0' && type != Command_Stats)
+      {
+         LOG_ERROR("%s:%u: %s needs an argument", path, lineNum, start);
+         ok = false;
+         break;
+      }
+      
+      addCommand((CommandType)type, arg);
+   }
+   
+   fclose(fp);
+   return ok;
+}
+
+const char* HeadlessScript::getCommandName(CommandType type)
+{
+   return sCommandNames[type];
+}
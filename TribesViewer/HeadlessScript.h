@@ -0,0 +1,69 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _HEADLESSSCRIPT_H_
+#define _HEADLESSSCRIPT_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Commands for a headless run of the viewer (no window or GPU device).
+//
+// Either built from command line flags or read from a script, one command per line:
+//    load <path>             same as passing path on the command line
+//    palette <name>          palette used by subsequent loads
+//    sequence <name|index>   play a sequence on the loaded shape
+//    frames <count>          run count frames with a fixed timestep
+//    stats [path]            log frame, renderer and memory stats; optionally also write them as json
+//
+class HeadlessScript
+{
+public:
+   
+   enum CommandType
+   {
+      Command_Load,
+      Command_Palette,
+      Command_Sequence,
+      Command_Frames,
+      Command_Stats,
+      Command_Count
+   };
+   
+   struct Command
+   {
+      CommandType type;
+      uint32_t count;
+      std::string arg;
+   };
+   
+   std::vector<Command> mCommands;
+   
+   Command& addCommand(CommandType type, const char* arg);
+   
+   bool load(const char* path);
+   
+   static const char* getCommandName(CommandType type);
+};
+
+#endif
@@ -0,0 +1,295 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <vector>
+#include "IOBench.h"
+#include "BatchRead.h"
+#include "ContentHash.h"
+
+namespace
+{
+
+enum
+{
+   BatchSize = 64,         // MaterialPipeline::MaxInFlight
+   NumRepeats = 3,
+   NumTestRanges = 4096,
+   TestMaxRangeSize = 32 * 1024
+};
+
+struct Method
+{
+   const char* name;
+   bool batched;
+   BatchReader::Backend backend;
+};
+
+struct RunResult
+{
+   double ms;
+   uint32_t numRequests;
+   uint32_t numSpans;
+   bool ok;
+};
+
+static double elapsedMS(std::chrono::steady_clock::time_point start)
+{
+   return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Only drops clean pages, which is all a read-only benchmark leaves behind
+static void dropCache(const char* path)
+{
+#ifdef POSIX_FADV_DONTNEED
+   int fd = open(path, O_RDONLY);
+   if (fd >= 0)
+   {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      close(fd);
+   }
+#endif
+}
+
+// Hashed after the timing stops, so only the reads are measured
+static void hashBuffers(const IOBenchFile& file, std::vector<uint8_t*>& buffers, std::vector<uint64_t>& outHashes)
+{
+   for (uint32_t i=0; i<buffers.size(); i++)
+   {
+      outHashes[i] = buffers[i] ? ContentHash::hash(buffers[i], file.sizes[i]) : 0;
+      free(buffers[i]);
+      buffers[i] = NULL;
+   }
+}
+
+// What ResManager did per file before batching
+static RunResult readSequential(const IOBenchFile& file, std::vector<uint64_t>& outHashes)
+{
+   RunResult result = {0.0, 0, 0, true};
+   FILE* fp = fopen(file.path.c_str(), "rb");
+   if (fp == NULL)
+   {
+      result.ok = false;
+      return result;
+   }
+   
+   std::vector<uint8_t*> buffers(file.offsets.size(), NULL);
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   for (uint32_t i=0; i<file.offsets.size(); i++)
+   {
+      buffers[i] = (uint8_t*)malloc(std::max<uint32_t>(file.sizes[i], 1));
+      fseek(fp, (long)file.offsets[i], SEEK_SET);
+      if (file.sizes[i] != 0 && fread(buffers[i], file.sizes[i], 1, fp) != 1)
+      {
+         free(buffers[i]);
+         buffers[i] = NULL;
+         result.ok = false;
+      }
+   }
+   result.ms = elapsedMS(start);
+   result.numRequests = result.numSpans = (uint32_t)file.offsets.size();
+   
+   fclose(fp);
+   hashBuffers(file, buffers, outHashes);
+   return result;
+}
+
+static RunResult readBatched(const IOBenchFile& file, std::vector<uint64_t>& outHashes)
+{
+   RunResult result = {0.0, 0, 0, true};
+   int fd = open(file.path.c_str(), O_RDONLY);
+   if (fd < 0)
+   {
+      result.ok = false;
+      return result;
+   }
+   
+   BatchReader reader;
+   std::vector<uint8_t*> buffers(file.offsets.size(), NULL);
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   for (uint32_t first=0; first<file.offsets.size(); first+=BatchSize)
+   {
+      uint32_t count = std::min<uint32_t>(BatchSize, (uint32_t)file.offsets.size() - first);
+      for (uint32_t i=0; i<count; i++)
+         reader.add(file.offsets[first+i], file.sizes[first+i]);
+      
+      result.ok = reader.read(fd, [&](uint32_t rangeIdx, uint8_t* data, uint32_t){
+         buffers[first+rangeIdx] = data;
+      }) && result.ok;
+      
+      result.numRequests += reader.getStats().numSubmits;
+      result.numSpans += reader.getStats().numSpans;
+   }
+   result.ms = elapsedMS(start);
+   
+   close(fd);
+   hashBuffers(file, buffers, outHashes);
+   return result;
+}
+
+static RunResult runMethod(const Method& method, const IOBenchFile& file, bool cold, std::vector<uint64_t>& outHashes)
+{
+   RunResult best = {0.0, 0, 0, true};
+   BatchReader::Backend oldBackend = BatchReader::smBackend;
+   BatchReader::smBackend = method.backend;
+   
+   // Warm runs start from a read of their own
+   if (!cold)
+      method.batched ? readBatched(file, outHashes) : readSequential(file, outHashes);
+   
+   for (uint32_t i=0; i<NumRepeats; i++)
+   {
+      if (cold)
+         dropCache(file.path.c_str());
+      
+      RunResult result = method.batched ? readBatched(file, outHashes) : readSequential(file, outHashes);
+      if (i == 0 || result.ms < best.ms)
+         best = result;
+      best.ok = best.ok && result.ok;
+   }
+   
+   BatchReader::smBackend = oldBackend;
+   return best;
+}
+
+// Entries of varying size packed back to back with a header in between, like a volume
+static bool makeTestFile(IOBenchFile& outFile)
+{
+   outFile.path = (std::filesystem::temp_directory_path() / "tv_iobench.bin").string();
+   FILE* fp = fopen(outFile.path.c_str(), "wb");
+   if (fp == NULL)
+      return false;
+   
+   uint32_t seed = 1;
+   uint64_t offset = 0;
+   std::vector<uint8_t> data(TestMaxRangeSize + 8);
+   
+   for (uint32_t i=0; i<NumTestRanges; i++)
+   {
+      seed = (seed * 1664525) + 1013904223;
+      uint32_t size = 256 + ((seed >> 8) % (TestMaxRangeSize - 256));
+      for (uint32_t j=0; j<size+8; j++)
+      {
+         seed = (seed * 1664525) + 1013904223;
+         data[j] = (uint8_t)(seed >> 24);
+      }
+      
+      if (fwrite(&data[0], size+8, 1, fp) != 1)
+      {
+         fclose(fp);
+         return false;
+      }
+      
+      outFile.offsets.push_back(offset + 8);
+      outFile.sizes.push_back(size);
+      offset += size + 8;
+   }
+   
+   fclose(fp);
+   
+   // Ask in name order rather than file order
+   for (uint32_t i=(uint32_t)outFile.offsets.size()-1; i>0; i--)
+   {
+      seed = (seed * 1664525) + 1013904223;
+      uint32_t j = (seed >> 8) % (i+1);
+      std::swap(outFile.offsets[i], outFile.offsets[j]);
+      std::swap(outFile.sizes[i], outFile.sizes[j]);
+   }
+   
+   return true;
+}
+
+}
+
+int runIOBenchmarks(const std::vector<IOBenchFile>& files)
+{
+   std::vector<IOBenchFile> testFiles = files;
+   bool madeTestFile = false;
+   
+   if (testFiles.empty())
+   {
+      IOBenchFile file;
+      if (!makeTestFile(file))
+      {
+         printf("Couldn't create a test file\n");
+         return 1;
+      }
+      testFiles.push_back(file);
+      madeTestFile = true;
+   }
+   
+   std::vector<Method> methods;
+   methods.push_back({"fread", false, BatchReader::Backend_Preadv});
+   methods.push_back({"preadv", true, BatchReader::Backend_Preadv});
+   if (BatchReader::isBackendAvailable(BatchReader::Backend_IOUring))
+      methods.push_back({"io_uring", true, BatchReader::Backend_IOUring});
+   else
+      printf("io_uring not available, skipping\n");
+   
+   bool ok = true;
+   printf("\n%-24s %-10s %8s %10s %8s %10s %8s %10s %8s\n", "file", "method", "ranges", "cold ms", "speedup", "warm ms", "speedup", "requests", "check");
+   
+   for (const IOBenchFile& file : testFiles)
+   {
+      std::vector<uint64_t> refHashes(file.offsets.size(), 0);
+      std::vector<uint64_t> hashes(file.offsets.size(), 0);
+      double baseColdMS = 0.0, baseWarmMS = 0.0;
+      
+      std::string name = std::filesystem::path(file.path).filename().string();
+      if (name.size() > 24)
+         name = name.substr(name.size() - 24);
+      
+      for (uint32_t m=0; m<methods.size(); m++)
+      {
+         const Method& method = methods[m];
+         RunResult cold = runMethod(method, file, true, m == 0 ? refHashes : hashes);
+         RunResult warm = runMethod(method, file, false, m == 0 ? refHashes : hashes);
+         
+         bool matches = cold.ok && warm.ok && (m == 0 || hashes == refHashes);
+         if (m == 0)
+         {
+            baseColdMS = cold.ms;
+            baseWarmMS = warm.ms;
+         }
+         
+         printf("%-24s %-10s %8u %10.2f %7.2fx %10.2f %7.2fx %10u %8s\n", name.c_str(), method.name, (uint32_t)file.offsets.size(),
+                cold.ms, cold.ms > 0.0 ? baseColdMS / cold.ms : 0.0, warm.ms, warm.ms > 0.0 ? baseWarmMS / warm.ms : 0.0,
+                warm.numRequests, matches ? "ok" : "FAILED");
+         ok = ok && matches;
+      }
+   }
+   
+   printf("\nBatches of %u ranges. Cold runs rely on posix_fadvise, which has no effect on some filesystems.\n", (uint32_t)BatchSize);
+   
+   if (madeTestFile)
+      remove(testFiles[0].path.c_str());
+   
+   return ok ? 0 : 1;
+}
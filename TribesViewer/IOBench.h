@@ -0,0 +1,46 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _IOBENCH_H_
+#define _IOBENCH_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Ranges of one file to read, in the order they would be asked for
+struct IOBenchFile
+{
+   std::string path;
+   std::vector<uint64_t> offsets;
+   std::vector<uint32_t> sizes;
+};
+
+// Compares reading ranges one at a time with fseek and fread against BatchReader, using preadv and (when
+// available) io_uring. Each is timed cold, after asking the kernel to drop the file from the page cache,
+// and warm. Reads are done in batches the size of a material list load, and every range is checked
+// against the fread result by content hash. With no files a packed test file is made in the temp
+// directory. Results are printed to stdout. Returns 0 if everything checks out.
+//
+int runIOBenchmarks(const std::vector<IOBenchFile>& files);
+
+#endif
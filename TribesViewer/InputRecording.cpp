@@ -0,0 +1,189 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include "InputRecording.h"
+#include "Log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+static const char* sEventNames[InputRecording::Event_Count] = {
+   "move",
+   "rotate",
+   "palette",
+   "volume",
+   "file",
+   "manual",
+   "addthread",
+   "removethread",
+   "sequence",
+   "enabled",
+   "pos"
+};
+
+InputRecording::Event& InputRecording::addEvent(uint32_t frame, EventType type)
+{
+   Event evt;
+   evt.frame = frame;
+   evt.type = type;
+   evt.index = 0;
+   evt.value = 0;
+   evt.vec = slm::vec3(0);
+   mEvents.push_back(evt);
+   mNumFrames = std::max(mNumFrames, frame+1);
+   return mEvents.back();
+}
+
+uint32_t InputRecording::findFrameEvents(uint32_t frame, uint32_t& ioFirst) const
+{
+   while (ioFirst < mEvents.size() && mEvents[ioFirst].frame < frame)
+      ioFirst++;
+   
+   uint32_t count = 0;
+   while (ioFirst + count < mEvents.size() && mEvents[ioFirst + count].frame == frame)
+      count++;
+   
+   return count;
+}
+
+bool InputRecording::save(const char* path) const
+{
+   FILE* fp = fopen(path, "w");
+   if (fp == NULL)
+   {
+      LOG_ERROR("Couldn't write recording to %s", path);
+      return false;
+   }
+   
+   fprintf(fp, "TVREC 1\n");
+   fprintf(fp, "frames %u\n", mNumFrames);
+   fprintf(fp, "dt %.9g\n", mFixedDT);
+   
+   for (const Event& evt : mEvents)
+   {
+      fprintf(fp, "%u %s %i %i %.9g %.9g %.9g", evt.frame, sEventNames[evt.type], evt.index, evt.value, evt.vec.x, evt.vec.y, evt.vec.z);
+      if (!evt.str.empty())
+         fprintf(fp, " %s", evt.str.c_str());
+      fprintf(fp, "\n");
+   }
+   
+   fclose(fp);
+   LOG_INFO("Wrote %u events over %u frames to %s", (uint32_t)mEvents.size(), mNumFrames, path);
+   return true;
+}
+
+bool InputRecording::load(const char* path)
+{
+   FILE* fp = fopen(path, "r");
+   if (fp == NULL)
+   {
+      LOG_ERROR("Couldn't open recording %s", path);
+      return false;
+   }
+   
+   mEvents.clear();
+   mNumFrames = 0;
+   
+   char line[1024];
+   int version = 0;
+   if (fgets(line, sizeof(line), fp) == NULL || sscanf(line, "TVREC %i", &version) != 1 || version != 1)
+   {
+      LOG_ERROR("%s is not a recording", path);
+      fclose(fp);
+      return false;
+   }
+   
+   uint32_t numFrames = 0;
+   
+   while (fgets(line, sizeof(line), fp))
+   {
+      line[strcspn(line, "\r\n")] = '\0';
+      if (line[0] == '\0' || line[0] == '#')
+         continue;
+      
+      if (sscanf(line, "frames %u", &numFrames) == 1)
+         continue;
+      if (sscanf(line, "dt %f", &mFixedDT) == 1)
+         continue;
+      
+      Event evt;
+      char typeName[32];
+      int strOffset = 0;
+      if (sscanf(line, "%u %31s %i %i %f %f %f %n", &evt.frame, typeName, &evt.index, &evt.value, &evt.vec.x, &evt.vec.y, &evt.vec.z, &strOffset) < 7)
+      {
+         LOG_WARN("Skipping bad recording line: %s", line);
+         continue;
+      }
+      
+      uint32_t type = 0;
+      while (type < Event_Count && strcmp(sEventNames[type], typeName) != 0)
+         type++;
+      if (type == Event_Count)
+      {
+         LOG_WARN("Skipping unknown recording event: %s", typeName);
+         continue;
+      }
+      
+      evt.type = (EventType)type;
+      evt.str = line + strOffset;
+      mEvents.push_back(evt);
+      mNumFrames = std::max(mNumFrames, evt.frame+1);
+   }
+   
+   fclose(fp);
+   
+   // Events must be in frame order for playback
+   std::stable_sort(mEvents.begin(), mEvents.end(), [](const Event& a, const Event& b){ return a.frame < b.frame; });
+   mNumFrames = std::max(mNumFrames, numFrames);
+   return true;
+}
+
+const char* InputRecording::getEventName(EventType type)
+{
+   return sEventNames[type];
+}
+
+float ReplayFrameStats::getPercentile(float pct) const
+{
+   if (frameMS.empty())
+      return 0.0f;
+   
+   std::vector<float> sorted = frameMS;
+   std::sort(sorted.begin(), sorted.end());
+   
+   size_t idx = std::min(sorted.size()-1, (size_t)(pct * (sorted.size()-1) + 0.5f));
+   return sorted[idx];
+}
+
+void ReplayFrameStats::print(const char* label) const
+{
+   if (frameMS.empty())
+   {
+      LOG_INFO("%s: no frames rendered", label);
+      return;
+   }
+   
+   LOG_INFO("%s: %u frames in %.1f ms, mean %.3f ms, p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, max %.3f ms",
+            label, (uint32_t)frameMS.size(), totalMS, totalMS / frameMS.size(),
+            getPercentile(0.50f), getPercentile(0.95f), getPercentile(0.99f), getPercentile(1.0f));
+}
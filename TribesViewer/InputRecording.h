@@ -0,0 +1,99 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _INPUTRECORDING_H_
+#define _INPUTRECORDING_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <slm/slmath.h>
+
+// Recorded viewer input used for repeatable benchmark runs.
+//
+// Events are stamped with the frame they were recorded on and replayed on the same frame, with a fixed
+// timestep, so a run only depends on the recording and the data files it was started with.
+//
+// Stored as text, one event per line:
+//    <frame> <type> <index> <value> <x> <y> <z> [string]
+//
+class InputRecording
+{
+public:
+   
+   enum EventType
+   {
+      Event_Move,           // vec = movement direction
+      Event_Rotate,         // vec = rotation direction
+      Event_Palette,        // str = palette name
+      Event_SelectVolume,   // value = volume index
+      Event_SelectFile,     // str = file name
+      Event_ManualThreads,  // value = enabled
+      Event_AddThread,
+      Event_RemoveThread,   // index = thread
+      Event_ThreadSequence, // index = thread, value = sequence
+      Event_ThreadEnabled,  // index = thread, value = enabled
+      Event_ThreadPos,      // index = thread, vec.x = pos
+      Event_Count
+   };
+   
+   struct Event
+   {
+      uint32_t frame;
+      EventType type;
+      int32_t index;
+      int32_t value;
+      slm::vec3 vec;
+      std::string str;
+   };
+   
+   std::vector<Event> mEvents;
+   uint32_t mNumFrames;
+   float mFixedDT;
+   
+   InputRecording() : mNumFrames(0), mFixedDT(1.0f / 60.0f) {;}
+   
+   Event& addEvent(uint32_t frame, EventType type);
+   
+   // Returns the range of events recorded for frame, starting the search from ioFirst
+   uint32_t findFrameEvents(uint32_t frame, uint32_t& ioFirst) const;
+   
+   bool save(const char* path) const;
+   bool load(const char* path);
+   
+   static const char* getEventName(EventType type);
+};
+
+// Frame time statistics printed at the end of a replay or headless run
+struct ReplayFrameStats
+{
+   std::vector<float> frameMS;
+   double totalMS;
+   
+   ReplayFrameStats() : totalMS(0) {;}
+   
+   void record(float ms) { frameMS.push_back(ms); totalMS += ms; }
+   float getPercentile(float pct) const;
+   void print(const char* label = "Replay") const;
+};
+
+#endif
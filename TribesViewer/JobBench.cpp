@@ -0,0 +1,346 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <slm/slmath.h>
+#include "JobBench.h"
+#include "JobSystem.h"
+#include "BatchTransform.h"
+#include "ContentHash.h"
+
+namespace
+{
+
+enum
+{
+   NumHashItems = 1024,
+   HashItemSize = 16 * 1024,
+   NumTransformItems = 512,
+   TransformItemPoints = 4096,
+   NumGraphTasks = 256,
+   NumRepeats = 3
+};
+
+struct Workload
+{
+   std::vector<uint8_t> hashData;
+   std::vector<slm::vec3> points;
+   std::vector<slm::vec3> outPoints;
+   std::vector<slm::mat4> mats;
+   
+   std::vector<uint64_t> hashes;
+   std::vector<float> sums;
+};
+
+template<typename F> double timeMS(F func)
+{
+   double best = 0.0;
+   for (uint32_t i=0; i<NumRepeats; i++)
+   {
+      auto start = std::chrono::steady_clock::now();
+      func();
+      auto end = std::chrono::steady_clock::now();
+      double ms = std::chrono::duration<double, std::milli>(end - start).count();
+      best = i == 0 ? ms : std::min(best, ms);
+   }
+   return best;
+}
+
+static bool check(const char* name, bool ok)
+{
+   printf("%-32s %s\n", name, ok ? "ok" : "FAILED");
+   return ok;
+}
+
+static bool checkParallelFor()
+{
+   const uint32_t count = 10007;
+   std::vector<std::atomic<uint32_t>> visits(count);
+   bool ok = true;
+   
+   for (uint32_t grain : {0u, 1u, 7u, 64u, count, count * 2})
+   {
+      for (uint32_t i=0; i<count; i++)
+         visits[i].store(0);
+      
+      JobSystem::parallelFor(0, count, grain, [&](uint32_t start, uint32_t end){
+         for (uint32_t i=start; i<end; i++)
+            visits[i].fetch_add(1);
+      });
+      
+      for (uint32_t i=0; i<count; i++)
+         ok = ok && visits[i].load() == 1;
+   }
+   
+   // Empty ranges shouldn't call anything
+   JobSystem::parallelFor(5, 5, 0, [&](uint32_t, uint32_t){ ok = false; });
+   return ok;
+}
+
+// Each layer depends on every task in the previous one, so all of them must have finished first
+static bool checkGraphOrder()
+{
+   const uint32_t numLayers = 6;
+   const uint32_t layerWidth = 16;
+   std::atomic<uint32_t> sequence(0);
+   std::vector<uint32_t> finished(numLayers * layerWidth, 0);
+   std::atomic<bool> ok(true);
+   TaskGraph graph;
+   
+   for (uint32_t layer=0; layer<numLayers; layer++)
+   {
+      for (uint32_t i=0; i<layerWidth; i++)
+      {
+         uint32_t idx = graph.add([&, layer, i]{
+            for (uint32_t j=0; layer>0 && j<layerWidth; j++)
+            {
+               if (__atomic_load_n(&finished[((layer-1) * layerWidth) + j], __ATOMIC_ACQUIRE) == 0)
+                  ok = false;
+            }
+            __atomic_store_n(&finished[(layer * layerWidth) + i], sequence.fetch_add(1) + 1, __ATOMIC_RELEASE);
+         });
+         
+         for (uint32_t j=0; layer>0 && j<layerWidth; j++)
+            graph.addDependency(idx, ((layer-1) * layerWidth) + j);
+      }
+   }
+   
+   // Run twice to make sure graphs can be reused
+   for (uint32_t run=0; run<2; run++)
+   {
+      std::fill(finished.begin(), finished.end(), 0);
+      graph.run();
+      graph.wait();
+      ok = ok && graph.isDone() && sequence.load() == (run+1) * numLayers * layerWidth;
+   }
+   
+   return ok;
+}
+
+static uint64_t nestedSum(uint32_t start, uint32_t end)
+{
+   if (end - start <= 64)
+   {
+      uint64_t sum = 0;
+      for (uint32_t i=start; i<end; i++)
+         sum += i;
+      return sum;
+   }
+   
+   uint32_t mid = start + ((end - start) / 2);
+   uint64_t left = 0;
+   JobSystem::Counter counter;
+   JobSystem::push([&]{ left = nestedSum(start, mid); }, &counter);
+   uint64_t right = nestedSum(mid, end);
+   JobSystem::wait(counter);
+   return left + right;
+}
+
+static bool checkNestedWaits()
+{
+   const uint32_t count = 100000;
+   return nestedSum(0, count) == ((uint64_t)count * (count - 1)) / 2;
+}
+
+// Decodes on the pool, then "uploads" on the main thread once they are all done
+static bool checkMainThreadContinuation()
+{
+   std::atomic<uint32_t> numDecoded(0);
+   bool ranOnMain = false;
+   uint32_t decodedAtUpload = 0;
+   TaskGraph graph;
+   
+   uint32_t upload = graph.add([&]{
+      ranOnMain = JobSystem::isMainThread();
+      decodedAtUpload = numDecoded.load();
+   }, JobSystem::Job_MainThread);
+   
+   for (uint32_t i=0; i<32; i++)
+   {
+      uint32_t decode = graph.add([&]{ numDecoded.fetch_add(1); });
+      graph.addDependency(upload, decode);
+   }
+   
+   graph.run();
+   graph.wait();
+   return ranOnMain && decodedAtUpload == 32;
+}
+
+static bool runChecks(const char* label)
+{
+   char name[64];
+   bool ok = true;
+   
+   snprintf(name, sizeof(name), "%s parallelFor", label);
+   ok = check(name, checkParallelFor()) && ok;
+   snprintf(name, sizeof(name), "%s graph order", label);
+   ok = check(name, checkGraphOrder()) && ok;
+   snprintf(name, sizeof(name), "%s nested waits", label);
+   ok = check(name, checkNestedWaits()) && ok;
+   snprintf(name, sizeof(name), "%s main thread continuation", label);
+   ok = check(name, checkMainThreadContinuation()) && ok;
+   return ok;
+}
+
+static void runHash(Workload& work)
+{
+   JobSystem::parallelFor(0, NumHashItems, 1, [&](uint32_t start, uint32_t end){
+      for (uint32_t i=start; i<end; i++)
+         work.hashes[i] = ContentHash::hash(&work.hashData[i * HashItemSize], HashItemSize);
+   });
+}
+
+static void runTransform(Workload& work)
+{
+   JobSystem::parallelFor(0, NumTransformItems, 0, [&](uint32_t start, uint32_t end){
+      for (uint32_t i=start; i<end; i++)
+      {
+         const slm::vec3* in = &work.points[(i % 16) * TransformItemPoints];
+         slm::vec3* out = &work.outPoints[i * TransformItemPoints];
+         BatchTransform::transformPoints(work.mats[i], in, sizeof(slm::vec3), out, sizeof(slm::vec3), TransformItemPoints);
+         
+         float sum = 0.0f;
+         for (uint32_t p=0; p<TransformItemPoints; p++)
+            sum += out[p].x + out[p].y + out[p].z;
+         work.sums[i] = sum;
+      }
+   });
+}
+
+// Independent decodes feeding a single main thread upload, like a material list load
+static void runGraph(Workload& work, uint64_t& outResult)
+{
+   TaskGraph graph;
+   uint32_t upload = graph.add([&]{
+      uint64_t result = 0;
+      for (uint32_t i=0; i<NumGraphTasks; i++)
+         result ^= work.hashes[i];
+      outResult = result;
+   }, JobSystem::Job_MainThread);
+   
+   for (uint32_t i=0; i<NumGraphTasks; i++)
+   {
+      uint32_t decode = graph.add([&work, i]{
+         work.hashes[i] = ContentHash::hash(&work.hashData[(i % NumHashItems) * HashItemSize], HashItemSize, i);
+      });
+      graph.addDependency(upload, decode);
+   }
+   
+   graph.run();
+   graph.wait();
+}
+
+}
+
+int runJobBenchmarks()
+{
+   bool ok = true;
+   const uint32_t maxThreads = std::max<uint32_t>(1, std::thread::hardware_concurrency());
+   
+   JobSystem::shutdown();
+   JobSystem::init(0);
+   ok = runChecks("inline") && ok;
+   JobSystem::shutdown();
+   
+   JobSystem::init(std::max<uint32_t>(3, maxThreads - 1));
+   ok = runChecks("pool") && ok;
+   JobSystem::shutdown();
+   
+   Workload work;
+   uint32_t seed = 1;
+   work.hashData.resize(NumHashItems * HashItemSize);
+   for (uint8_t& b : work.hashData)
+   {
+      seed = (seed * 1664525) + 1013904223;
+      b = (uint8_t)(seed >> 24);
+   }
+   
+   work.points.resize(16 * TransformItemPoints);
+   for (uint32_t i=0; i<work.points.size(); i++)
+      work.points[i] = slm::vec3((float)(i % 97), (float)(i % 89), (float)(i % 83)) * 0.01f;
+   
+   work.outPoints.resize(NumTransformItems * TransformItemPoints);
+   work.mats.resize(NumTransformItems);
+   for (uint32_t i=0; i<NumTransformItems; i++)
+      work.mats[i] = slm::translation(slm::vec3((float)i, 0, 0)) * slm::rotation_z(slm::radians((float)i));
+   
+   work.hashes.resize(NumHashItems);
+   work.sums.resize(NumTransformItems);
+   
+   std::vector<uint64_t> refHashes;
+   std::vector<float> refSums;
+   uint64_t refGraph = 0;
+   double baseHashMS = 0.0, baseTransformMS = 0.0, baseGraphMS = 0.0;
+   
+   printf("\n%-8s %10s %8s %10s %8s %10s %8s %8s\n", "threads", "hash ms", "speedup", "xfm ms", "speedup", "graph ms", "speedup", "steals");
+   
+   std::vector<uint32_t> threadCounts;
+   for (uint32_t threads=1; threads<maxThreads; threads*=2)
+      threadCounts.push_back(threads);
+   threadCounts.push_back(maxThreads);
+   
+   for (uint32_t threads : threadCounts)
+   {
+      JobSystem::init(threads - 1);
+      JobSystem::resetStats();
+      
+      uint64_t graphResult = 0;
+      double hashMS = timeMS([&]{ runHash(work); });
+      double transformMS = timeMS([&]{ runTransform(work); });
+      double graphMS = timeMS([&]{ runGraph(work, graphResult); });
+      JobSystem::Stats stats = JobSystem::getStats();
+      JobSystem::shutdown();
+      
+      bool matches = true;
+      if (threads == 1)
+      {
+         refHashes = work.hashes;
+         refSums = work.sums;
+         refGraph = graphResult;
+         baseHashMS = hashMS;
+         baseTransformMS = transformMS;
+         baseGraphMS = graphMS;
+      }
+      else
+      {
+         // The graph overwrites the first hashes, so only compare the rest
+         matches = std::equal(refHashes.begin() + NumGraphTasks, refHashes.end(), work.hashes.begin() + NumGraphTasks) &&
+                   refSums == work.sums && refGraph == graphResult;
+      }
+      
+      printf("%-8u %10.2f %7.2fx %10.2f %7.2fx %10.2f %7.2fx %8llu%s\n", threads,
+             hashMS, baseHashMS / std::max(hashMS, 1e-6),
+             transformMS, baseTransformMS / std::max(transformMS, 1e-6),
+             graphMS, baseGraphMS / std::max(graphMS, 1e-6),
+             (unsigned long long)stats.numStolen, matches ? "" : "  MISMATCH");
+      ok = ok && matches;
+   }
+   
+   return ok ? 0 : 1;
+}
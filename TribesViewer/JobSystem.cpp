@@ -0,0 +1,469 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include "JobSystem.h"
+#include "Trace.h"
+
+#include <stdio.h>
+#include <assert.h>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+struct Job
+{
+   JobSystem::JobFunc func;
+   JobSystem::Counter* counter;
+};
+
+struct JobWorker
+{
+   std::mutex lock;
+   std::deque<Job> jobs;
+   std::thread thread;
+};
+
+struct JobQueues
+{
+   std::vector<JobWorker*> workers;
+   std::atomic<bool> running;
+   std::thread::id mainThread;
+   
+   // Jobs pushed from outside the pool
+   std::mutex sharedLock;
+   std::deque<Job> sharedJobs;
+   
+   std::mutex mainLock;
+   std::deque<Job> mainJobs;
+   
+   // Idle workers sleep until something is queued
+   std::mutex sleepLock;
+   std::condition_variable sleepCond;
+   std::atomic<uint32_t> numQueued;
+   
+   std::atomic<uint64_t> numJobs;
+   std::atomic<uint64_t> numStolen;
+   std::atomic<uint64_t> numMainThread;
+   std::atomic<uint64_t> numInline;
+   
+   JobQueues() : running(false), numQueued(0), numJobs(0), numStolen(0), numMainThread(0), numInline(0)
+   {
+      mainThread = std::this_thread::get_id();
+   }
+   
+   ~JobQueues()
+   {
+      // Workers need to be joined if shutdown() wasn't called (e.g. an early return from main)
+      JobSystem::shutdown();
+   }
+   
+   bool pop(int32_t workerIdx, Job& outJob);
+   void execute(Job& job);
+   void workerMain(int32_t workerIdx);
+   void wake();
+};
+
+static JobQueues sJobQueues;
+static thread_local int32_t sWorkerIndex = -1;
+
+bool JobQueues::pop(int32_t workerIdx, Job& outJob)
+{
+   if (numQueued.load(std::memory_order_acquire) == 0)
+      return false;
+   
+   // Own jobs first, newest first
+   if (workerIdx >= 0)
+   {
+      JobWorker* worker = workers[workerIdx];
+      std::lock_guard<std::mutex> guard(worker->lock);
+      if (!worker->jobs.empty())
+      {
+         outJob = std::move(worker->jobs.front());
+         worker->jobs.pop_front();
+         numQueued.fetch_sub(1, std::memory_order_relaxed);
+         return true;
+      }
+   }
+   
+   {
+      std::lock_guard<std::mutex> guard(sharedLock);
+      if (!sharedJobs.empty())
+      {
+         outJob = std::move(sharedJobs.front());
+         sharedJobs.pop_front();
+         numQueued.fetch_sub(1, std::memory_order_relaxed);
+         return true;
+      }
+   }
+   
+   // Steal the oldest job from someone else
+   const uint32_t numWorkers = (uint32_t)workers.size();
+   for (uint32_t i=1; i<=numWorkers; i++)
+   {
+      uint32_t victimIdx = (uint32_t)(workerIdx + i) % numWorkers;
+      if ((int32_t)victimIdx == workerIdx)
+         continue;
+      
+      JobWorker* victim = workers[victimIdx];
+      std::lock_guard<std::mutex> guard(victim->lock);
+      if (!victim->jobs.empty())
+      {
+         outJob = std::move(victim->jobs.back());
+         victim->jobs.pop_back();
+         numQueued.fetch_sub(1, std::memory_order_relaxed);
+         numStolen.fetch_add(1, std::memory_order_relaxed);
+         return true;
+      }
+   }
+   
+   return false;
+}
+
+void JobQueues::execute(Job& job)
+{
+   job.func();
+   numJobs.fetch_add(1, std::memory_order_relaxed);
+   
+   if (job.counter)
+   {
+      job.counter->mPending.fetch_sub(1, std::memory_order_acq_rel);
+   }
+}
+
+void JobQueues::wake()
+{
+   // Taking the lock means a worker can't miss the wakeup between checking numQueued and sleeping
+   {
+      std::lock_guard<std::mutex> guard(sleepLock);
+   }
+   sleepCond.notify_one();
+}
+
+void JobQueues::workerMain(int32_t workerIdx)
+{
+   char threadName[32];
+   snprintf(threadName, sizeof(threadName), "Jobs %i", workerIdx);
+   Trace::setThreadName(threadName);
+   sWorkerIndex = workerIdx;
+   
+   Job job;
+   while (running.load(std::memory_order_acquire))
+   {
+      if (pop(workerIdx, job))
+      {
+         execute(job);
+         job.func = NULL;
+         continue;
+      }
+      
+      std::unique_lock<std::mutex> lock(sleepLock);
+      sleepCond.wait(lock, [this]{
+         return !running.load(std::memory_order_acquire) || numQueued.load(std::memory_order_acquire) > 0;
+      });
+   }
+}
+
+void JobSystem::init(uint32_t numWorkers)
+{
+   if (sJobQueues.running.load())
+      return;
+   
+   if (numWorkers == DefaultWorkers)
+   {
+      uint32_t numCores = std::thread::hardware_concurrency();
+      numWorkers = numCores > 1 ? numCores - 1 : 0;
+   }
+   
+   sJobQueues.mainThread = std::this_thread::get_id();
+   sJobQueues.running.store(true, std::memory_order_release);
+   
+   sJobQueues.workers.resize(numWorkers);
+   for (uint32_t i=0; i<numWorkers; i++)
+   {
+      sJobQueues.workers[i] = new JobWorker();
+   }
+   
+   // NOTE: workers can steal from each other as soon as they start, so create them all first
+   for (uint32_t i=0; i<numWorkers; i++)
+   {
+      sJobQueues.workers[i]->thread = std::thread(&JobQueues::workerMain, &sJobQueues, (int32_t)i);
+   }
+}
+
+void JobSystem::shutdown()
+{
+   if (!sJobQueues.running.load())
+      return;
+   
+   // Let anything already queued finish
+   Job job;
+   while (sJobQueues.pop(-1, job))
+   {
+      sJobQueues.execute(job);
+   }
+   
+   {
+      std::lock_guard<std::mutex> guard(sJobQueues.sleepLock);
+      sJobQueues.running.store(false, std::memory_order_release);
+   }
+   sJobQueues.sleepCond.notify_all();
+   
+   // NOTE: workers look at each other's deques, so none can be freed until they have all stopped
+   for (JobWorker* worker : sJobQueues.workers)
+   {
+      worker->thread.join();
+   }
+   
+   for (JobWorker* worker : sJobQueues.workers)
+   {
+      delete worker;
+   }
+   
+   sJobQueues.workers.clear();
+   runMainThreadJobs();
+}
+
+uint32_t JobSystem::getNumWorkers()
+{
+   return (uint32_t)sJobQueues.workers.size();
+}
+
+int32_t JobSystem::getWorkerIndex()
+{
+   return sWorkerIndex;
+}
+
+bool JobSystem::isMainThread()
+{
+   return std::this_thread::get_id() == sJobQueues.mainThread;
+}
+
+void JobSystem::push(const JobFunc& func, Counter* counter, uint32_t flags)
+{
+   if (counter)
+   {
+      counter->mPending.fetch_add(1, std::memory_order_relaxed);
+   }
+   
+   Job job;
+   job.func = func;
+   job.counter = counter;
+   
+   if (flags & Job_MainThread)
+   {
+      std::lock_guard<std::mutex> guard(sJobQueues.mainLock);
+      sJobQueues.mainJobs.push_back(std::move(job));
+      return;
+   }
+   
+   if (sJobQueues.workers.empty())
+   {
+      sJobQueues.numInline.fetch_add(1, std::memory_order_relaxed);
+      sJobQueues.execute(job);
+      return;
+   }
+   
+   if (sWorkerIndex >= 0)
+   {
+      JobWorker* worker = sJobQueues.workers[sWorkerIndex];
+      std::lock_guard<std::mutex> guard(worker->lock);
+      worker->jobs.push_front(std::move(job));
+   }
+   else
+   {
+      std::lock_guard<std::mutex> guard(sJobQueues.sharedLock);
+      sJobQueues.sharedJobs.push_back(std::move(job));
+   }
+   
+   sJobQueues.numQueued.fetch_add(1, std::memory_order_release);
+   sJobQueues.wake();
+}
+
+void JobSystem::wait(Counter& counter)
+{
+   const bool onMainThread = isMainThread();
+   Job job;
+   
+   while (!counter.isDone())
+   {
+      if (onMainThread && runMainThreadJobs() > 0)
+         continue;
+      
+      if (sJobQueues.pop(sWorkerIndex, job))
+      {
+         sJobQueues.execute(job);
+         job.func = NULL;
+         continue;
+      }
+      
+      std::this_thread::yield();
+   }
+}
+
+void JobSystem::parallelFor(uint32_t start, uint32_t end, uint32_t grainSize, const RangeFunc& func)
+{
+   if (end <= start)
+      return;
+   
+   const uint32_t count = end - start;
+   const uint32_t numThreads = getNumWorkers() + 1;
+   
+   // A few chunks per thread leaves room to balance uneven work
+   if (grainSize == 0)
+   {
+      grainSize = std::max<uint32_t>(1, count / (numThreads * 4));
+   }
+   
+   if (numThreads == 1 || count <= grainSize)
+   {
+      func(start, end);
+      return;
+   }
+   
+   Counter counter;
+   for (uint32_t chunkStart = start + grainSize; chunkStart < end; chunkStart += grainSize)
+   {
+      uint32_t chunkEnd = std::min(end, chunkStart + grainSize);
+      push([&func, chunkStart, chunkEnd]{ func(chunkStart, chunkEnd); }, &counter);
+      
+      if (chunkEnd == end)
+         break;
+   }
+   
+   // Do the first chunk here, then help with the rest
+   func(start, std::min(end, start + grainSize));
+   wait(counter);
+}
+
+uint32_t JobSystem::runMainThreadJobs()
+{
+   assert(isMainThread());
+   uint32_t numRun = 0;
+   
+   while (true)
+   {
+      Job job;
+      {
+         std::lock_guard<std::mutex> guard(sJobQueues.mainLock);
+         if (sJobQueues.mainJobs.empty())
+            break;
+         
+         job = std::move(sJobQueues.mainJobs.front());
+         sJobQueues.mainJobs.pop_front();
+      }
+      
+      sJobQueues.execute(job);
+      sJobQueues.numMainThread.fetch_add(1, std::memory_order_relaxed);
+      numRun++;
+   }
+   
+   return numRun;
+}
+
+JobSystem::Stats JobSystem::getStats()
+{
+   Stats stats;
+   stats.numJobs = sJobQueues.numJobs.load(std::memory_order_relaxed);
+   stats.numStolen = sJobQueues.numStolen.load(std::memory_order_relaxed);
+   stats.numMainThread = sJobQueues.numMainThread.load(std::memory_order_relaxed);
+   stats.numInline = sJobQueues.numInline.load(std::memory_order_relaxed);
+   return stats;
+}
+
+void JobSystem::resetStats()
+{
+   sJobQueues.numJobs.store(0, std::memory_order_relaxed);
+   sJobQueues.numStolen.store(0, std::memory_order_relaxed);
+   sJobQueues.numMainThread.store(0, std::memory_order_relaxed);
+   sJobQueues.numInline.store(0, std::memory_order_relaxed);
+}
+
+TaskGraph::TaskGraph()
+{
+}
+
+uint32_t TaskGraph::add(const JobSystem::JobFunc& func, uint32_t flags)
+{
+   assert(isDone());
+   mTasks.emplace_back();
+   Task& task = mTasks.back();
+   task.func = func;
+   task.flags = flags;
+   return (uint32_t)(mTasks.size()-1);
+}
+
+void TaskGraph::addDependency(uint32_t task, uint32_t dependsOn)
+{
+   assert(isDone());
+   mTasks[dependsOn].dependents.push_back(task);
+   mTasks[task].numDeps++;
+}
+
+void TaskGraph::clear()
+{
+   assert(isDone());
+   mTasks.clear();
+}
+
+void TaskGraph::run()
+{
+   assert(isDone());
+   
+   if (mTasks.empty())
+      return;
+   
+   // Everything is counted up front so the graph can't look finished while tasks are still being released
+   mCounter.mPending.store((uint32_t)mTasks.size(), std::memory_order_release);
+   
+   for (Task& task : mTasks)
+   {
+      task.remaining.store(task.numDeps, std::memory_order_relaxed);
+   }
+   
+   for (uint32_t i=0, sz=(uint32_t)mTasks.size(); i<sz; i++)
+   {
+      if (mTasks[i].numDeps == 0)
+         launch(i);
+   }
+}
+
+void TaskGraph::launch(uint32_t idx)
+{
+   JobSystem::push([this, idx]{
+      Task& task = mTasks[idx];
+      task.func();
+      
+      for (uint32_t dependent : task.dependents)
+      {
+         if (mTasks[dependent].remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            launch(dependent);
+      }
+      
+      mCounter.mPending.fetch_sub(1, std::memory_order_acq_rel);
+   }, NULL, mTasks[idx].flags);
+}
+
+void TaskGraph::wait()
+{
+   JobSystem::wait(mCounter);
+}
@@ -0,0 +1,137 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _JOBSYSTEM_H_
+#define _JOBSYSTEM_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <vector>
+
+// Work-stealing job system shared by loaders, decoders and animation.
+//
+// init() starts a pool of workers, each with its own deque of jobs. Workers push and pop at the front of their
+// own deque so jobs they spawn run while their data is still in cache, and steal from the back of the other
+// deques once they run dry. Jobs pushed from threads outside the pool go onto a shared queue.
+//
+// Completion is tracked with a Counter. wait() runs other jobs until the counter drops to zero rather than
+// blocking, so it is safe to wait from inside a job. TaskGraph runs jobs with dependencies between them and
+// parallelFor() splits a range into chunks. Jobs flagged Job_MainThread only run on the thread which called
+// init(), either from runMainThreadJobs() or while it waits; this is where GFX uploads go.
+//
+// Without init() (or with no workers) jobs run inline when they are pushed.
+//
+class JobSystem
+{
+public:
+   
+   typedef std::function<void()> JobFunc;
+   typedef std::function<void(uint32_t start, uint32_t end)> RangeFunc;
+   
+   enum Flags
+   {
+      Job_MainThread = 1
+   };
+   
+   struct Counter
+   {
+      std::atomic<uint32_t> mPending;
+      
+      Counter() : mPending(0) {;}
+      inline bool isDone() const { return mPending.load(std::memory_order_acquire) == 0; }
+   };
+   
+   struct Stats
+   {
+      uint64_t numJobs;
+      uint64_t numStolen;
+      uint64_t numMainThread;
+      uint64_t numInline;
+   };
+   
+   // Pass DefaultWorkers for one per core, minus the calling thread
+   enum
+   {
+      DefaultWorkers = 0xFFFFFFFF
+   };
+   
+   static void init(uint32_t numWorkers=DefaultWorkers);
+   static void shutdown();
+   
+   static uint32_t getNumWorkers();
+   static int32_t getWorkerIndex(); // -1 outside of the pool
+   static bool isMainThread();
+   
+   static void push(const JobFunc& func, Counter* counter=NULL, uint32_t flags=0);
+   static void wait(Counter& counter);
+   
+   // Calls func over [start, end) in chunks of grainSize (0 picks one), returning once all chunks are done
+   static void parallelFor(uint32_t start, uint32_t end, uint32_t grainSize, const RangeFunc& func);
+   
+   // Runs queued main thread jobs, including any they queue. Returns the number run.
+   static uint32_t runMainThreadJobs();
+   
+   static Stats getStats();
+   static void resetStats();
+};
+
+// Set of jobs with dependencies between them, which must not form a cycle.
+//
+// Each task is pushed once everything it depends on has finished. The graph needs to outlive run() until
+// wait() returns (or isDone()), after which it can be run again.
+//
+class TaskGraph
+{
+public:
+   
+   TaskGraph();
+   
+   uint32_t add(const JobSystem::JobFunc& func, uint32_t flags=0);
+   void addDependency(uint32_t task, uint32_t dependsOn);
+   void clear();
+   
+   void run();
+   void wait();
+   inline bool isDone() const { return mCounter.isDone(); }
+   
+protected:
+   
+   struct Task
+   {
+      JobSystem::JobFunc func;
+      uint32_t flags;
+      uint32_t numDeps;
+      std::atomic<uint32_t> remaining;
+      std::vector<uint32_t> dependents;
+      
+      Task() : flags(0), numDeps(0), remaining(0) {;}
+   };
+   
+   std::deque<Task> mTasks;
+   JobSystem::Counter mCounter;
+   
+   void launch(uint32_t idx);
+};
+
+#endif
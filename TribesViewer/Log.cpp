@@ -0,0 +1,219 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include "Log.h"
+#include "BoundedQueue.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <thread>
+
+struct LogMessage
+{
+   Log::Level level;
+   char text[Log::MaxMessageLength];
+};
+
+// Any thread can log; only the log thread consumes
+struct LogQueue
+{
+   BoundedQueue<LogMessage, Log::QueueSize> messages;
+   
+   std::atomic<uint32_t> numPending;
+   std::atomic<uint32_t> numDropped;
+   std::atomic<bool> running;
+   std::thread thread;
+   
+   LogQueue() : numPending(0), numDropped(0), running(false)
+   {
+   }
+   
+   ~LogQueue()
+   {
+      // Flushes anything left if shutdown() wasn't called (e.g. an early return from main)
+      Log::shutdown();
+   }
+   
+   bool push(Log::Level level, const char* text);
+   bool pop(Log::Level* outLevel, char* outText);
+   void drain();
+   void threadMain();
+};
+
+static LogQueue sLogQueue;
+
+std::atomic<int> Log::smLevel(Log::Level_Info);
+
+static const char* sLevelNames[Log::Level_Count] = {
+   "trace",
+   "debug",
+   "info",
+   "warn",
+   "error"
+};
+
+static const char* sLevelPrefixes[Log::Level_Count] = {
+   "[T] ",
+   "[D] ",
+   "",
+   "[W] ",
+   "[E] "
+};
+
+static void writeMessage(Log::Level level, const char* text)
+{
+   FILE* fp = level >= Log::Level_Warn ? stderr : stdout;
+   fprintf(fp, "%s%s\n", sLevelPrefixes[level], text);
+}
+
+bool LogQueue::push(Log::Level level, const char* text)
+{
+   bool pushed = messages.pushWith([level, text](LogMessage& msg){
+      msg.level = level;
+      strncpy(msg.text, text, Log::MaxMessageLength-1);
+      msg.text[Log::MaxMessageLength-1] = '\0';
+   });
+   
+   if (!pushed)
+      return false;
+   
+   numPending.fetch_add(1, std::memory_order_release);
+   numPending.notify_one();
+   return true;
+}
+
+bool LogQueue::pop(Log::Level* outLevel, char* outText)
+{
+   return messages.popWith([outLevel, outText](const LogMessage& msg){
+      *outLevel = msg.level;
+      memcpy(outText, msg.text, Log::MaxMessageLength);
+   });
+}
+
+void LogQueue::drain()
+{
+   Log::Level level;
+   char text[Log::MaxMessageLength];
+   
+   while (pop(&level, text))
+   {
+      numPending.fetch_sub(1, std::memory_order_relaxed);
+      writeMessage(level, text);
+   }
+   
+   uint32_t dropped = numDropped.exchange(0, std::memory_order_relaxed);
+   if (dropped > 0)
+   {
+      fprintf(stderr, "[W] %u log messages dropped\n", dropped);
+   }
+   
+   fflush(stdout);
+}
+
+void LogQueue::threadMain()
+{
+   while (running.load(std::memory_order_acquire))
+   {
+      numPending.wait(0, std::memory_order_acquire);
+      drain();
+   }
+   
+   drain();
+}
+
+void Log::init()
+{
+   if (sLogQueue.running.load())
+      return;
+   
+   sLogQueue.running.store(true, std::memory_order_release);
+   sLogQueue.thread = std::thread(&LogQueue::threadMain, &sLogQueue);
+}
+
+void Log::shutdown()
+{
+   if (!sLogQueue.running.load())
+      return;
+   
+   sLogQueue.running.store(false, std::memory_order_release);
+   
+   // Wake the thread so it notices
+   sLogQueue.numPending.fetch_add(1, std::memory_order_release);
+   sLogQueue.numPending.notify_one();
+   sLogQueue.thread.join();
+   sLogQueue.numPending.store(0, std::memory_order_relaxed);
+}
+
+void Log::setLevel(Level level)
+{
+   smLevel.store(level, std::memory_order_relaxed);
+}
+
+bool Log::parseLevel(const char* name, Level* outLevel)
+{
+   for (uint32_t i=0; i<Level_Count; i++)
+   {
+      if (strcasecmp(name, sLevelNames[i]) == 0)
+      {
+         *outLevel = (Level)i;
+         return true;
+      }
+   }
+   return false;
+}
+
+void Log::write(Level level, const char* fmt, ...)
+{
+   char text[MaxMessageLength];
+   va_list args;
+   va_start(args, fmt);
+   vsnprintf(text, sizeof(text), fmt, args);
+   va_end(args);
+   
+   if (!sLogQueue.running.load(std::memory_order_acquire))
+   {
+      writeMessage(level, text);
+      return;
+   }
+   
+   if (!sLogQueue.push(level, text))
+   {
+      sLogQueue.numDropped.fetch_add(1, std::memory_order_relaxed);
+   }
+}
+
+bool Log::RateLimiter::allow(uint32_t* outSuppressed)
+{
+   int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+   int64_t next = mNextTimeMS.load(std::memory_order_relaxed);
+   
+   if (now < next || !mNextTimeMS.compare_exchange_strong(next, now + mIntervalMS, std::memory_order_relaxed))
+   {
+      mNumSuppressed.fetch_add(1, std::memory_order_relaxed);
+      return false;
+   }
+   
+   *outSuppressed = mNumSuppressed.exchange(0, std::memory_order_relaxed);
+   return true;
+}
@@ -0,0 +1,116 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+
+// Leveled logging.
+//
+// Messages are formatted on the calling thread and pushed onto a fixed size lock-free queue which a
+// background thread drains to stdout, so logging from load or render code doesn't wait on console IO.
+// If the queue is full the message is dropped and counted. Before init() (or after shutdown()) messages are
+// written directly.
+//
+// Levels below TV_LOG_MIN_LEVEL are compiled out; the remainder are filtered at runtime by setLevel().
+// LOG_RATELIMITED is intended for warnings that can fire every frame.
+//
+#ifndef TV_LOG_MIN_LEVEL
+#define TV_LOG_MIN_LEVEL 1
+#endif
+
+class Log
+{
+public:
+   
+   enum Level
+   {
+      Level_Trace,
+      Level_Debug,
+      Level_Info,
+      Level_Warn,
+      Level_Error,
+      Level_Count
+   };
+   
+   enum
+   {
+      QueueSize = 1024, // must be a power of 2
+      MaxMessageLength = 256
+   };
+   
+   // Allows one message per interval from a single call site
+   class RateLimiter
+   {
+   public:
+      std::atomic<int64_t> mNextTimeMS;
+      std::atomic<uint32_t> mNumSuppressed;
+      uint32_t mIntervalMS;
+      
+      RateLimiter(uint32_t intervalMS) : mNextTimeMS(0), mNumSuppressed(0), mIntervalMS(intervalMS) {;}
+      
+      // Returns true if the message should be written; outSuppressed is set to the number skipped since the last one
+      bool allow(uint32_t* outSuppressed);
+   };
+   
+   static void init();
+   static void shutdown();
+   
+   static inline bool isEnabled(Level level) { return level >= smLevel.load(std::memory_order_relaxed); }
+   static void setLevel(Level level);
+   static bool parseLevel(const char* name, Level* outLevel);
+   
+#if defined(__GNUC__) || defined(__clang__)
+   static void write(Level level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+#else
+   static void write(Level level, const char* fmt, ...);
+#endif
+   
+protected:
+   
+   static std::atomic<int> smLevel;
+};
+
+#define TV_LOG_CONCAT_(a, b) a##b
+#define TV_LOG_CONCAT(a, b) TV_LOG_CONCAT_(a, b)
+
+#define LOG_AT(level, fmt, ...) do { if ((int)(level) >= TV_LOG_MIN_LEVEL && Log::isEnabled(level)) Log::write(level, fmt, ##__VA_ARGS__); } while (0)
+#define LOG_TRACE(fmt, ...) LOG_AT(Log::Level_Trace, fmt, ##__VA_ARGS__)
+#define LOG_DEBUG(fmt, ...) LOG_AT(Log::Level_Debug, fmt, ##__VA_ARGS__)
+#define LOG_INFO(fmt, ...) LOG_AT(Log::Level_Info, fmt, ##__VA_ARGS__)
+#define LOG_WARN(fmt, ...) LOG_AT(Log::Level_Warn, fmt, ##__VA_ARGS__)
+#define LOG_ERROR(fmt, ...) LOG_AT(Log::Level_Error, fmt, ##__VA_ARGS__)
+
+#define LOG_RATELIMITED(level, intervalMS, fmt, ...) do { \
+   if ((int)(level) >= TV_LOG_MIN_LEVEL && Log::isEnabled(level)) { \
+      static Log::RateLimiter TV_LOG_CONCAT(logLimiter, __LINE__)(intervalMS); \
+      uint32_t logSuppressed = 0; \
+      if (TV_LOG_CONCAT(logLimiter, __LINE__).allow(&logSuppressed)) { \
+         Log::write(level, fmt, ##__VA_ARGS__); \
+         if (logSuppressed > 0) Log::write(level, "(%u similar messages suppressed)", logSuppressed); \
+      } \
+   } } while (0)
+
+#endif
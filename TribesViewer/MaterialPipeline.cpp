@@ -0,0 +1,475 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <slm/slmath.h>
+
+#include "MaterialPipeline.h"
+#include "CommonData.h"
+#include "CommonShaderTypes.h"
+#include "RendererHelper.h"
+#include "MemTrack.h"
+#include "Trace.h"
+#include "Log.h"
+
+size_t MaterialPipeline::smMaxStagingBytes = MaterialPipeline::DefaultStagingBytes;
+
+static inline uint64_t elapsedUS(std::chrono::steady_clock::time_point start)
+{
+   return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+MaterialPipeline::MaterialPipeline(ReadFunc readFunc, Palette* palette) :
+mReadFunc(readFunc),
+mPalette(palette),
+mEvents(0),
+mStagingUsed(0),
+mStagingAllocated(0),
+mLayered(false),
+mSetTexID(-1),
+mSetStagingSize(0),
+mSetPaddedWidth(0),
+mSetWidth(0),
+mSetHeight(0),
+mSetBGR(false),
+mResults(NULL)
+{
+   mStats = {};
+}
+
+MaterialPipeline::~MaterialPipeline()
+{
+   freeStaging();
+}
+
+bool MaterialPipeline::loadTextures(uint32_t count, const char** filenames, Result* outResults)
+{
+   mLayered = false;
+   mResults = outResults;
+   
+   for (uint32_t i=0; i<count; i++)
+   {
+      mResults[i] = {};
+      mResults[i].texID = -1;
+   }
+   
+   bool ok = run(count, filenames);
+   mResults = NULL;
+   return ok;
+}
+
+int32_t MaterialPipeline::loadTextureSet(uint32_t count, const char** filenames, uint32_t* outWidth, uint32_t* outHeight)
+{
+   mLayered = true;
+   mSetTexID = -1;
+   mSetStagingSize = 0;
+   
+   if (count == 0)
+      return -1;
+   
+   if (!run(count, filenames))
+   {
+      if (mSetTexID >= 0)
+         GFXDeleteTexture(mSetTexID);
+      mSetTexID = -1;
+      return -1;
+   }
+   
+   if (outWidth)
+      *outWidth = mSetWidth;
+   if (outHeight)
+      *outHeight = mSetHeight;
+   return mSetTexID;
+}
+
+bool MaterialPipeline::run(uint32_t count, const char** filenames)
+{
+   TRACE_ZONE("MaterialPipeline");
+   std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+   
+   mItems.assign(count, Item());
+   for (uint32_t i=0; i<count; i++)
+      mItems[i].sameAs = i;
+   mStats = {};
+   mStats.numItems = count;
+   
+   std::unordered_map<uint64_t, uint32_t> firstWithHash;
+   std::deque<uint32_t> waiting; // decoded, waiting for staging space
+   uint32_t nextRead = 0;
+   uint32_t numInFlight = 0;
+   uint32_t numDone = 0;
+   uint32_t lastDeferred = UINT32_MAX;
+   bool failed = false; // a layer failed, so the set is abandoned
+   
+   while (numDone < count)
+   {
+      // Read before checking the queues so a signal in between isn't missed
+      uint32_t events = mEvents.load(std::memory_order_acquire);
+      bool progress = false;
+      uint32_t idx = 0;
+      
+      // Uploads free staging space, so go first
+      while (mConverted.pop(idx))
+      {
+         if (!failed && !upload(idx))
+         {
+            mStats.numFailed++;
+            failed = mLayered;
+         }
+         
+         finishItem(idx);
+         numInFlight--;
+         numDone++;
+         progress = true;
+      }
+      
+      while (mDecoded.pop(idx))
+      {
+         waiting.push_back(idx);
+      }
+      
+      while (!waiting.empty())
+      {
+         idx = waiting.front();
+         
+         if (mItems[idx].bmp == NULL || failed)
+         {
+            if (mItems[idx].bmp == NULL)
+            {
+               mStats.numFailed++;
+               failed = mLayered;
+            }
+            
+            finishItem(idx);
+            waiting.pop_front();
+            numInFlight--;
+            numDone++;
+            progress = true;
+            continue;
+         }
+         
+         if (!startConvert(idx))
+         {
+            if (idx != lastDeferred)
+               mStats.numDeferred++;
+            lastDeferred = idx;
+            break;
+         }
+         
+         waiting.pop_front();
+         progress = true;
+      }
+      
+      // Read ahead while there is room further down, a batch at a time so the reads can be merged
+      if (nextRead < count && numInFlight < MaxInFlight && !failed)
+      {
+         uint32_t batchStart = nextRead;
+         uint32_t batchCount = std::min<uint32_t>(count - nextRead, MaxInFlight - numInFlight);
+         nextRead += batchCount;
+         progress = true;
+         
+         MemRStream* streams[MaxInFlight];
+         uint64_t hashes[MaxInFlight];
+         std::chrono::steady_clock::time_point readStart = std::chrono::steady_clock::now();
+         mReadFunc(batchCount, filenames + batchStart, streams, hashes);
+         mStats.readUS += elapsedUS(readStart);
+         
+         for (uint32_t i=0; i<batchCount; i++)
+         {
+            idx = batchStart + i;
+            MemRStream* stream = streams[i];
+            uint64_t hash = hashes[i];
+            
+            if (mResults)
+               mResults[idx].contentHash = hash;
+            
+            if (stream == NULL || failed)
+            {
+               if (stream == NULL)
+               {
+                  LOG_DEBUG("Couldn't read texture %s", filenames[idx]);
+                  mStats.numFailed++;
+                  failed = mLayered;
+               }
+               delete stream;
+               numDone++;
+               continue;
+            }
+            
+            // Layers all need uploading, but separate textures can be shared
+            if (!mLayered && hash != 0)
+            {
+               auto itr = firstWithHash.find(hash);
+               if (itr != firstWithHash.end())
+               {
+                  delete stream;
+                  mItems[idx].sameAs = itr->second;
+                  mStats.numDeduped++;
+                  numDone++;
+                  continue;
+               }
+               firstWithHash[hash] = idx;
+            }
+            
+            mItems[idx].stream = stream;
+            numInFlight++;
+            
+            JobSystem::push([this, idx](){
+               TRACE_ZONE("MaterialPipeline::decode");
+               Item& item = mItems[idx];
+               item.bmp = new Bitmap();
+               if (!item.bmp->read(*item.stream))
+               {
+                  delete item.bmp;
+                  item.bmp = NULL;
+               }
+               
+               delete item.stream;
+               item.stream = NULL;
+               
+               // Can't be full, as no more than MaxInFlight items are ever between stages
+               [[maybe_unused]] bool queued = mDecoded.push(idx);
+               assert(queued);
+               signal();
+            }, &mJobs);
+         }
+      }
+      
+      // Nothing left to start once a layer has failed
+      if (failed && nextRead < count)
+      {
+         numDone += count - nextRead;
+         nextRead = count;
+         progress = true;
+      }
+      
+      if (!progress && numDone < count)
+      {
+         TRACE_ZONE("MaterialPipeline::stall");
+         mStats.numStalls++;
+         mEvents.wait(events, std::memory_order_acquire);
+      }
+   }
+   
+   // Workers may still be returning from their last signal
+   JobSystem::wait(mJobs);
+   freeStaging();
+   
+   if (mResults)
+   {
+      for (uint32_t i=0; i<count; i++)
+      {
+         uint32_t first = mItems[i].sameAs;
+         if (first != i)
+            mResults[i] = mResults[first];
+      }
+   }
+   
+   mStats.totalUS = elapsedUS(startTime);
+   LOG_INFO("Loaded %u textures in %.2fms using %u workers (%u failed, %u duplicates, reads %.2fms, uploads %.2fms, peak staging %uKB, %u stalls)",
+            count, mStats.totalUS / 1000.0, JobSystem::getNumWorkers(), mStats.numFailed, mStats.numDeduped,
+            mStats.readUS / 1000.0, mStats.uploadUS / 1000.0, (uint32_t)(mStats.peakStagingBytes / 1024), mStats.numStalls);
+   
+   return mStats.numFailed == 0;
+}
+
+bool MaterialPipeline::startConvert(uint32_t idx)
+{
+   Item& item = mItems[idx];
+   Bitmap* bmp = item.bmp;
+   
+   uint32_t paddedWidth = 0;
+   uint32_t size = GFXGetTextureStagingSize(bmp->mWidth, bmp->mHeight, &paddedWidth);
+   
+   if (mLayered)
+   {
+      if (mSetStagingSize == 0)
+      {
+         mSetStagingSize = size;
+         mSetPaddedWidth = paddedWidth;
+         mSetWidth = bmp->mWidth;
+         mSetHeight = bmp->mHeight;
+         mSetBGR = bmp->mBGR;
+      }
+      else if (size != mSetStagingSize || paddedWidth != mSetPaddedWidth)
+      {
+         LOG_WARN("Layer %u (%ix%i) doesn't match the size of the texture set", idx, bmp->mWidth, bmp->mHeight);
+         
+         // Goes straight to the upload stage as a failure
+         item.converted = false;
+         [[maybe_unused]] bool queued = mConverted.push(idx);
+         assert(queued);
+         return true;
+      }
+   }
+   
+   item.staging = acquireStaging(size);
+   if (item.staging == NULL)
+      return false;
+   item.stagingSize = size;
+   
+   JobSystem::push([this, idx](){
+      TRACE_ZONE("MaterialPipeline::convert");
+      Item& item = mItems[idx];
+      item.converted = GFXConvertTexture(item.bmp, mPalette, item.staging);
+      
+      [[maybe_unused]] bool queued = mConverted.push(idx);
+      assert(queued);
+      signal();
+   }, &mJobs);
+   
+   return true;
+}
+
+bool MaterialPipeline::upload(uint32_t idx)
+{
+   TRACE_ZONE("MaterialPipeline::upload");
+   Item& item = mItems[idx];
+   Bitmap* bmp = item.bmp;
+   
+   if (!item.converted)
+      return false;
+   
+   std::chrono::steady_clock::time_point uploadStart = std::chrono::steady_clock::now();
+   bool ok = true;
+   
+   if (mLayered)
+   {
+      if (mSetTexID < 0)
+         mSetTexID = GFXCreateTextureSet(mItems.size(), mSetWidth, mSetHeight, mSetBGR);
+      
+      if (mSetTexID >= 0)
+         GFXUploadTextureLayer(mSetTexID, idx, item.staging);
+      else
+         ok = false;
+   }
+   else
+   {
+      Result& res = mResults[idx];
+      res.loaded = true;
+      res.texID = GFXLoadTextureStaged(bmp->mWidth, bmp->mHeight, bmp->mBGR, item.staging);
+      res.bmpFlags = bmp->mFlags;
+      res.width = bmp->mWidth;
+      res.height = bmp->mHeight;
+      ok = res.texID >= 0;
+   }
+   
+   mStats.uploadUS += elapsedUS(uploadStart);
+   return ok;
+}
+
+void MaterialPipeline::finishItem(uint32_t idx)
+{
+   Item& item = mItems[idx];
+   
+   if (mResults && item.bmp && !mResults[idx].loaded)
+   {
+      // Decoded but never uploaded
+      mResults[idx].loaded = true;
+      mResults[idx].bmpFlags = item.bmp->mFlags;
+      mResults[idx].width = item.bmp->mWidth;
+      mResults[idx].height = item.bmp->mHeight;
+   }
+   
+   if (item.staging)
+      releaseStaging(item.staging, item.stagingSize);
+   
+   delete item.bmp;
+   delete item.stream;
+   item.bmp = NULL;
+   item.stream = NULL;
+   item.staging = NULL;
+   item.stagingSize = 0;
+}
+
+void MaterialPipeline::signal()
+{
+   mEvents.fetch_add(1, std::memory_order_release);
+   mEvents.notify_one();
+}
+
+uint8_t* MaterialPipeline::acquireStaging(uint32_t size)
+{
+   if (mStagingUsed > 0 && mStagingUsed + size > smMaxStagingBytes)
+      return NULL;
+   
+   uint8_t* data = NULL;
+   
+   for (size_t i=0; i<mFreeStaging.size(); i++)
+   {
+      if (mFreeStaging[i].size == size)
+      {
+         data = mFreeStaging[i].data;
+         mFreeStaging[i] = mFreeStaging.back();
+         mFreeStaging.pop_back();
+         break;
+      }
+   }
+   
+   if (data == NULL)
+   {
+      // Drop unused buffers of other sizes to stay under the limit
+      while (!mFreeStaging.empty() && mStagingAllocated + size > smMaxStagingBytes)
+      {
+         StagingBuffer& buf = mFreeStaging.back();
+         delete[] buf.data;
+         MemTrack::remove(MemTrack::Category_GPUMirror, buf.size);
+         mStagingAllocated -= buf.size;
+         mFreeStaging.pop_back();
+      }
+      
+      data = new uint8_t[size];
+      MemTrack::add(MemTrack::Category_GPUMirror, size);
+      mStagingAllocated += size;
+      mStats.peakStagingBytes = std::max<uint64_t>(mStats.peakStagingBytes, mStagingAllocated);
+   }
+   
+   mStagingUsed += size;
+   return data;
+}
+
+void MaterialPipeline::releaseStaging(uint8_t* data, uint32_t size)
+{
+   StagingBuffer buf = {data, size};
+   mFreeStaging.push_back(buf);
+   mStagingUsed -= size;
+}
+
+void MaterialPipeline::freeStaging()
+{
+   for (StagingBuffer& buf : mFreeStaging)
+   {
+      delete[] buf.data;
+      MemTrack::remove(MemTrack::Category_GPUMirror, buf.size);
+      mStagingAllocated -= buf.size;
+   }
+   
+   mFreeStaging.clear();
+}
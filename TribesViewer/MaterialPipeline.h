@@ -0,0 +1,165 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _MATERIALPIPELINE_H_
+#define _MATERIALPIPELINE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <vector>
+#include "BoundedQueue.h"
+#include "JobSystem.h"
+
+class MemRStream;
+class Palette;
+class Bitmap;
+
+// Loads the textures for a material list in three overlapping stages:
+//
+//   1. Read and decode. Files are read in batches on the calling thread, since volume reads share file
+//      handles, and decoded with Bitmap::read on job workers.
+//   2. Convert. Palette lookups into row-padded RGBA8 staging buffers, also on job workers.
+//   3. Upload. GFX calls on the calling thread, which must be the render thread.
+//
+// Decoded and converted items are handed back through bounded queues. The calling thread only starts a read
+// while fewer than MaxInFlight items are between stages, and only starts a conversion when the staging
+// pool has room for it, so the data alive at once stays bounded however long the list is. Staging buffers
+// are recycled between items of the same size.
+//
+// Files with the same content hash (as reported by the ReadFunc) are only decoded and uploaded once when
+// loaded as separate textures; the duplicates share the texture of the first.
+//
+// Without JobSystem workers each stage runs inline, which behaves like loading the textures in turn.
+//
+class MaterialPipeline
+{
+public:
+   
+   enum
+   {
+      MaxInFlight = 64,
+      DefaultStagingBytes = 8 * 1024 * 1024
+   };
+   
+   // Reads a batch of whole files on the calling thread, setting outStreams[i] to a new stream or NULL if
+   // the file couldn't be read, and outHashes[i] to its content hash or 0 if unknown.
+   typedef std::function<void(uint32_t count, const char** filenames, MemRStream** outStreams, uint64_t* outHashes)> ReadFunc;
+   
+   struct Result
+   {
+      int32_t texID;      // -1 if the bitmap couldn't be uploaded
+      uint32_t bmpFlags;
+      uint64_t contentHash;
+      uint16_t width;
+      uint16_t height;
+      bool loaded;        // false if the file couldn't be read or decoded
+   };
+   
+   struct Stats
+   {
+      uint32_t numItems;
+      uint32_t numFailed;
+      uint32_t numStalls;        // times the calling thread waited on the workers
+      uint32_t numDeferred;      // conversions held back by the staging limit
+      uint32_t numDeduped;       // files sharing the texture of an identical one
+      uint64_t peakStagingBytes;
+      uint64_t totalUS;
+      uint64_t readUS;           // reading on the calling thread
+      uint64_t uploadUS;         // GFX uploads
+   };
+   
+   // Limit on staging memory; a single item larger than this is still converted on its own
+   static size_t smMaxStagingBytes;
+   
+   MaterialPipeline(ReadFunc readFunc, Palette* palette);
+   ~MaterialPipeline();
+   
+   // Loads each file into its own texture, filling one Result per file. Returns false if any failed.
+   bool loadTextures(uint32_t count, const char** filenames, Result* outResults);
+   
+   // Loads the files as the layers of one array texture, which needs every layer to be the same size.
+   // Returns the texture or -1, in which case nothing is kept.
+   int32_t loadTextureSet(uint32_t count, const char** filenames, uint32_t* outWidth, uint32_t* outHeight);
+   
+   inline const Stats& getStats() const { return mStats; }
+   
+protected:
+   
+   struct Item
+   {
+      MemRStream* stream;
+      Bitmap* bmp;
+      uint8_t* staging;
+      uint32_t stagingSize;
+      uint32_t sameAs;    // index of the item with the same content, or itself
+      bool converted;
+   };
+   
+   struct StagingBuffer
+   {
+      uint8_t* data;
+      uint32_t size;
+   };
+   
+   ReadFunc mReadFunc;
+   Palette* mPalette;
+   
+   std::vector<Item> mItems;
+   BoundedQueue<uint32_t, MaxInFlight> mDecoded;
+   BoundedQueue<uint32_t, MaxInFlight> mConverted;
+   std::atomic<uint32_t> mEvents; // bumped by workers whenever they queue something
+   JobSystem::Counter mJobs;
+   
+   // Staging pool; only touched by the calling thread
+   std::vector<StagingBuffer> mFreeStaging;
+   size_t mStagingUsed;
+   size_t mStagingAllocated;
+   
+   // Set in layered mode from the first item converted
+   bool mLayered;
+   int32_t mSetTexID;
+   uint32_t mSetStagingSize;
+   uint32_t mSetPaddedWidth;
+   uint32_t mSetWidth;
+   uint32_t mSetHeight;
+   bool mSetBGR;
+   
+   Result* mResults;
+   Stats mStats;
+   
+   bool run(uint32_t count, const char** filenames);
+   
+   bool startConvert(uint32_t idx);
+   bool upload(uint32_t idx);
+   void finishItem(uint32_t idx);
+   
+   void signal();
+   
+   uint8_t* acquireStaging(uint32_t size);
+   void releaseStaging(uint8_t* data, uint32_t size);
+   void freeStaging();
+};
+
+#endif
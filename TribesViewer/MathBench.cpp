@@ -0,0 +1,447 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include <chrono>
+#include <slm/slmath.h>
+#include "MathBench.h"
+#include "BatchTransform.h"
+
+namespace
+{
+
+enum
+{
+   NumItems = 1024,
+   NumIterations = 200,
+   NumRuns = 5
+};
+
+struct Mat4F
+{
+   float m[4][4];
+};
+
+struct BenchResult
+{
+   double slmNS;
+   double refNS;
+   double maxErr;
+};
+
+// Keeps results alive so the optimizer can't discard benchmark loops
+static volatile float gSink;
+
+// Best of several runs, so one slow run (e.g. from another process) doesn't decide a comparison. The
+// untimed first call faults in the output pages, which would otherwise count against whichever side runs first.
+template<typename F> double timeNS(F func)
+{
+   func();
+   double bestNS = 0;
+   for (int run=0; run<NumRuns; run++)
+   {
+      auto start = std::chrono::steady_clock::now();
+      for (int i=0; i<NumIterations; i++)
+         func();
+      auto end = std::chrono::steady_clock::now();
+      double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+      if (run == 0 || ns < bestNS)
+         bestNS = ns;
+   }
+   return bestNS / ((double)NumIterations * (double)NumItems);
+}
+
+static float randFloat(uint32_t &seed, float lo, float hi)
+{
+   seed = seed * 1664525u + 1013904223u;
+   return lo + (hi - lo) * ((seed >> 8) / 16777216.0f);
+}
+
+// Random rigid transform with scale, similar to what the viewers feed in
+static slm::mat4 randMatrix(uint32_t &seed)
+{
+   slm::vec3 axis = slm::normalize(slm::vec3(randFloat(seed, -1, 1), randFloat(seed, -1, 1), randFloat(seed, 0.1f, 1)));
+   slm::mat4 rot = slm::mat4(slm::quat(randFloat(seed, 0, 6.28f), axis));
+   slm::mat4 xfm = slm::translation(slm::vec3(randFloat(seed, -100, 100), randFloat(seed, -100, 100), randFloat(seed, -100, 100))) * rot;
+   return xfm * slm::scaling(slm::vec3(randFloat(seed, 0.5f, 2.0f)));
+}
+
+static void toRef(const slm::mat4 &src, Mat4F &dst)
+{
+   for (int c=0; c<4; c++)
+      for (int r=0; r<4; r++)
+         dst.m[c][r] = src[c][r];
+}
+
+// Double precision references for checking results
+
+static void refMul(const Mat4F &a, const Mat4F &b, double res[4][4])
+{
+   for (int c=0; c<4; c++)
+   {
+      for (int r=0; r<4; r++)
+      {
+         res[c][r] = (double)a.m[0][r]*b.m[c][0] + (double)a.m[1][r]*b.m[c][1] + (double)a.m[2][r]*b.m[c][2] + (double)a.m[3][r]*b.m[c][3];
+      }
+   }
+}
+
+static void refMulVec(const Mat4F &a, const float *v, bool transposed, double *res)
+{
+   for (int r=0; r<4; r++)
+   {
+      res[r] = 0;
+      for (int k=0; k<4; k++)
+         res[r] += (double)(transposed ? a.m[r][k] : a.m[k][r]) * v[k];
+   }
+}
+
+// Gauss-Jordan inverse with partial pivoting; T selects the working precision
+template<typename T> static bool refInverse(const Mat4F &a, T res[4][4])
+{
+   T work[4][8];
+   for (int r=0; r<4; r++)
+   {
+      for (int c=0; c<4; c++)
+      {
+         work[r][c] = a.m[c][r];
+         work[r][c+4] = (r == c) ? 1 : 0;
+      }
+   }
+   
+   for (int c=0; c<4; c++)
+   {
+      int pivot = c;
+      for (int r=c+1; r<4; r++)
+      {
+         if (fabs((double)work[r][c]) > fabs((double)work[pivot][c]))
+            pivot = r;
+      }
+      if (work[pivot][c] == 0)
+         return false;
+      if (pivot != c)
+      {
+         for (int k=0; k<8; k++)
+            std::swap(work[c][k], work[pivot][k]);
+      }
+      
+      T inv = 1 / work[c][c];
+      for (int k=0; k<8; k++)
+         work[c][k] *= inv;
+      
+      for (int r=0; r<4; r++)
+      {
+         if (r == c)
+            continue;
+         T f = work[r][c];
+         for (int k=0; k<8; k++)
+            work[r][k] -= f * work[c][k];
+      }
+   }
+   
+   for (int c=0; c<4; c++)
+      for (int r=0; r<4; r++)
+         res[c][r] = work[r][c+4];
+   return true;
+}
+
+static double relErr(double value, double expected)
+{
+   return fabs(value - expected) / std::max(1.0, fabs(expected));
+}
+
+static bool report(const char *name, const BenchResult &res, double tolerance)
+{
+   bool ok = res.maxErr <= tolerance;
+   printf("%-16s slm %7.2f ns  scalar %7.2f ns  speedup %5.2fx  max err %.3g%s\n",
+          name, res.slmNS, res.refNS, res.refNS / std::max(res.slmNS, 1e-6), res.maxErr, ok ? "" : "  FAILED");
+   return ok;
+}
+
+// Same as report, but for batch kernels where slmNS/refNS are per point
+static bool reportPoints(const char *name, const BenchResult &res, double tolerance)
+{
+   bool ok = res.maxErr <= tolerance;
+   printf("%-16s batch %7.1f Mpts/s  per-point %7.1f Mpts/s  speedup %5.2fx  max err %.3g%s\n",
+          name, 1e3 / std::max(res.slmNS, 1e-6), 1e3 / std::max(res.refNS, 1e-6), res.refNS / std::max(res.slmNS, 1e-6), res.maxErr, ok ? "" : "  FAILED");
+   return ok;
+}
+
+static double maxPointErr(const slm::vec3 *a, const slm::vec3 *b, size_t count)
+{
+   double err = 0;
+   for (size_t i=0; i<count; i++)
+   {
+      err = std::max(err, relErr(a[i].x, b[i].x));
+      err = std::max(err, relErr(a[i].y, b[i].y));
+      err = std::max(err, relErr(a[i].z, b[i].z));
+   }
+   return err;
+}
+
+}
+
+int runMathBenchmarks()
+{
+   uint32_t seed = 0x1234;
+   std::vector<slm::mat4> mats(NumItems);
+   std::vector<slm::mat4> mats2(NumItems);
+   std::vector<slm::mat4> matsOut(NumItems);
+   std::vector<slm::mat4> scalarMatsOut(NumItems);
+   std::vector<slm::vec4> vecs(NumItems);
+   std::vector<slm::vec4> vecs2(NumItems);
+   std::vector<slm::vec4> vecsOut(NumItems);
+   std::vector<slm::vec4> scalarVecsOut(NumItems);
+   std::vector<Mat4F> refMats(NumItems);
+   std::vector<Mat4F> refMats2(NumItems);
+   
+   for (int i=0; i<NumItems; i++)
+   {
+      mats[i] = randMatrix(seed);
+      mats2[i] = randMatrix(seed);
+      vecs[i] = slm::vec4(randFloat(seed, -10, 10), randFloat(seed, -10, 10), randFloat(seed, -10, 10), 1.0f);
+      vecs2[i] = slm::vec4(randFloat(seed, -10, 10), randFloat(seed, -10, 10), randFloat(seed, -10, 10), randFloat(seed, -10, 10));
+      toRef(mats[i], refMats[i]);
+      toRef(mats2[i], refMats2[i]);
+   }
+   
+   // slm::mat4 and slm::vec4 are plain floats, which is what the scalar build takes
+   const float* matData = &mats[0][0][0];
+   const float* matData2 = &mats2[0][0][0];
+   const float* vecData = &vecs[0][0];
+   const float* vecData2 = &vecs2[0][0];
+   float* scalarMatData = &scalarMatsOut[0][0][0];
+   float* scalarVecData = &scalarVecsOut[0][0];
+   
+#if defined(SLMATH_AVX)
+   printf("slm SIMD: SSE2 (built with AVX)\n");
+#elif defined(SLMATH_SSE2)
+   printf("slm SIMD: SSE2\n");
+#elif defined(SLMATH_NEON)
+   printf("slm SIMD: NEON\n");
+#else
+   printf("slm SIMD: none (both columns are the scalar build)\n");
+#endif
+   
+   bool ok = true;
+   BenchResult res;
+   
+   // mat4 * mat4
+   res.slmNS = timeNS([&]{
+      for (int i=0; i<NumItems; i++)
+         matsOut[i] = mats[i] * mats2[i];
+      gSink = matsOut[NumItems-1][3][3];
+   });
+   res.refNS = timeNS([&]{
+      MathBenchScalar::mulMat4(matData, matData2, scalarMatData, NumItems);
+      gSink = scalarMatsOut[NumItems-1][3][3];
+   });
+   res.maxErr = 0;
+   for (int i=0; i<NumItems; i++)
+   {
+      double expected[4][4];
+      refMul(refMats[i], refMats2[i], expected);
+      for (int c=0; c<4; c++)
+         for (int r=0; r<4; r++)
+            res.maxErr = std::max(res.maxErr, relErr(matsOut[i][c][r], expected[c][r]));
+   }
+   ok = report("mat4*mat4", res, 1e-5) && ok;
+   
+   // transpose, which must match exactly
+   res.slmNS = timeNS([&]{
+      for (int i=0; i<NumItems; i++)
+         matsOut[i] = slm::transpose(mats[i]);
+      gSink = matsOut[NumItems-1][3][3];
+   });
+   res.refNS = timeNS([&]{
+      MathBenchScalar::transposeMat4(matData, scalarMatData, NumItems);
+      gSink = scalarMatsOut[NumItems-1][3][3];
+   });
+   res.maxErr = 0;
+   for (int i=0; i<NumItems; i++)
+      for (int c=0; c<4; c++)
+         for (int r=0; r<4; r++)
+            res.maxErr = std::max(res.maxErr, relErr(matsOut[i][c][r], refMats[i].m[r][c]));
+   ok = report("transpose", res, 0) && ok;
+   
+   // inverse, checked against a double precision solve
+   res.slmNS = timeNS([&]{
+      for (int i=0; i<NumItems; i++)
+         matsOut[i] = slm::inverse(mats[i]);
+      gSink = matsOut[NumItems-1][3][3];
+   });
+   res.refNS = timeNS([&]{
+      MathBenchScalar::inverseMat4(matData, scalarMatData, NumItems);
+      gSink = scalarMatsOut[NumItems-1][3][3];
+   });
+   res.maxErr = 0;
+   for (int i=0; i<NumItems; i++)
+   {
+      double expected[4][4];
+      if (!refInverse<double>(refMats[i], expected))
+         continue;
+      for (int c=0; c<4; c++)
+         for (int r=0; r<4; r++)
+            res.maxErr = std::max(res.maxErr, relErr(matsOut[i][c][r], expected[c][r]));
+   }
+   ok = report("inverse", res, 1e-4) && ok;
+   
+   // mat4 * vec4
+   res.slmNS = timeNS([&]{
+      for (int i=0; i<NumItems; i++)
+         vecsOut[i] = mats[i] * vecs[i];
+      gSink = vecsOut[NumItems-1].w;
+   });
+   res.refNS = timeNS([&]{
+      MathBenchScalar::mulMat4Vec4(matData, vecData, scalarVecData, NumItems);
+      gSink = scalarVecsOut[NumItems-1].w;
+   });
+   res.maxErr = 0;
+   for (int i=0; i<NumItems; i++)
+   {
+      double expected[4];
+      refMulVec(refMats[i], &vecs[i].x, false, expected);
+      for (int k=0; k<4; k++)
+         res.maxErr = std::max(res.maxErr, relErr(vecsOut[i][k], expected[k]));
+   }
+   ok = report("mat4*vec4", res, 1e-5) && ok;
+   
+   // vec4 * mat4 (i.e. transpose(m) * v)
+   res.slmNS = timeNS([&]{
+      for (int i=0; i<NumItems; i++)
+         vecsOut[i] = vecs[i] * mats[i];
+      gSink = vecsOut[NumItems-1].w;
+   });
+   res.refNS = timeNS([&]{
+      MathBenchScalar::mulVec4Mat4(vecData, matData, scalarVecData, NumItems);
+      gSink = scalarVecsOut[NumItems-1].w;
+   });
+   res.maxErr = 0;
+   for (int i=0; i<NumItems; i++)
+   {
+      double expected[4];
+      refMulVec(refMats[i], &vecs[i].x, true, expected);
+      for (int k=0; k<4; k++)
+         res.maxErr = std::max(res.maxErr, relErr(vecsOut[i][k], expected[k]));
+   }
+   ok = report("vec4*mat4", res, 1e-5) && ok;
+   
+   // component-wise vec4 ops, checked against the scalar build
+   res.slmNS = timeNS([&]{
+      for (int i=0; i<NumItems; i++)
+         vecsOut[i] = slm::max(slm::min(vecs[i] * vecs2[i] + vecs2[i], vecs[i]), vecs2[i]);
+      gSink = vecsOut[NumItems-1].w;
+   });
+   res.refNS = timeNS([&]{
+      MathBenchScalar::madMinMaxVec4(vecData, vecData2, scalarVecData, NumItems);
+      gSink = scalarVecsOut[NumItems-1].w;
+   });
+   res.maxErr = 0;
+   for (int i=0; i<NumItems; i++)
+      for (int k=0; k<4; k++)
+         res.maxErr = std::max(res.maxErr, relErr(vecsOut[i][k], scalarVecsOut[i][k]));
+   ok = report("vec4 mad/min/max", res, 1e-6) && ok;
+   
+   // Batch point kernels, compared against transforming one point at a time
+   std::vector<slm::vec3> points(NumItems);
+   std::vector<slm::vec3> pointsOut(NumItems);
+   std::vector<slm::vec3> refPointsOut(NumItems);
+   std::vector<float> soaIn(NumItems*3);
+   std::vector<float> soaOut(NumItems*3);
+   std::vector<uint8_t> packed(NumItems*4);
+   std::vector<uint32_t> remap(NumItems);
+   for (int i=0; i<NumItems; i++)
+   {
+      points[i] = vecs[i].xyz();
+      soaIn[i] = points[i].x;
+      soaIn[NumItems+i] = points[i].y;
+      soaIn[NumItems*2+i] = points[i].z;
+      for (int k=0; k<4; k++)
+         packed[i*4+k] = (uint8_t)(randFloat(seed, 0, 255.99f));
+      remap[i] = (uint32_t)((i * 7919) % NumItems);
+   }
+   const slm::mat4 &xfm = mats[0];
+   
+   res.refNS = timeNS([&]{
+      for (int i=0; i<NumItems; i++)
+         refPointsOut[i] = (xfm * slm::vec4(points[i], 1.0f)).xyz();
+      gSink = refPointsOut[NumItems-1].z;
+   });
+   res.slmNS = timeNS([&]{
+      BatchTransform::transformPoints(xfm, &points[0], sizeof(slm::vec3), &pointsOut[0], sizeof(slm::vec3), NumItems);
+      gSink = pointsOut[NumItems-1].z;
+   });
+   res.maxErr = maxPointErr(&pointsOut[0], &refPointsOut[0], NumItems);
+   ok = reportPoints("points AoS", res, 1e-5) && ok;
+   
+   res.slmNS = timeNS([&]{
+      BatchTransform::transformPointsSoA(xfm, &soaIn[0], &soaIn[NumItems], &soaIn[NumItems*2], &soaOut[0], &soaOut[NumItems], &soaOut[NumItems*2], NumItems);
+      gSink = soaOut[NumItems*3-1];
+   });
+   for (int i=0; i<NumItems; i++)
+      pointsOut[i] = slm::vec3(soaOut[i], soaOut[NumItems+i], soaOut[NumItems*2+i]);
+   res.maxErr = maxPointErr(&pointsOut[0], &refPointsOut[0], NumItems);
+   ok = reportPoints("points SoA", res, 1e-5) && ok;
+   
+   // Clip space projection, as done for occluder vertices each frame
+   std::vector<slm::vec4> clipOut(NumItems);
+   std::vector<slm::vec4> refClipOut(NumItems);
+   res.refNS = timeNS([&]{
+      for (int i=0; i<NumItems; i++)
+         refClipOut[i] = xfm * slm::vec4(points[i], 1.0f);
+      gSink = refClipOut[NumItems-1].w;
+   });
+   res.slmNS = timeNS([&]{
+      BatchTransform::projectPointsSoA(xfm, &soaIn[0], &soaIn[NumItems], &soaIn[NumItems*2], &clipOut[0].x, sizeof(slm::vec4), NumItems);
+      gSink = clipOut[NumItems-1].w;
+   });
+   res.maxErr = 0;
+   for (int i=0; i<NumItems; i++)
+      for (int k=0; k<4; k++)
+         res.maxErr = std::max(res.maxErr, relErr(clipOut[i][k], refClipOut[i][k]));
+   ok = reportPoints("project SoA", res, 1e-5) && ok;
+   
+   const slm::vec3 scale(0.25f, 0.5f, 0.125f);
+   const slm::vec3 origin(-10.0f, 5.0f, 2.0f);
+   res.refNS = timeNS([&]{
+      for (int i=0; i<NumItems; i++)
+      {
+         const uint8_t *p = &packed[remap[i]*4];
+         refPointsOut[i] = slm::vec3(p[0] * scale.x + origin.x, p[1] * scale.y + origin.y, p[2] * scale.z + origin.z);
+      }
+      gSink = refPointsOut[NumItems-1].z;
+   });
+   res.slmNS = timeNS([&]{
+      BatchTransform::unpackPoints(&packed[0], 4, &remap[0], NumItems, scale, origin, &pointsOut[0], sizeof(slm::vec3));
+      gSink = pointsOut[NumItems-1].z;
+   });
+   res.maxErr = maxPointErr(&pointsOut[0], &refPointsOut[0], NumItems);
+   ok = reportPoints("packed unpack", res, 0) && ok;
+   
+   printf("Math benchmarks %s\n", ok ? "passed" : "FAILED");
+   return ok ? 0 : 1;
+}
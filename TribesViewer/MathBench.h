@@ -0,0 +1,48 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _MATHBENCH_H_
+#define _MATHBENCH_H_
+
+#include <stdint.h>
+
+// Micro benchmarks for the slm vector/matrix routines.
+//
+// Each operation is timed against slm's own scalar code (see MathBenchScalar) and checked against a double
+// precision reference. Results are printed to stdout. Returns 0 if all results are within tolerance.
+//
+int runMathBenchmarks();
+
+// slm's scalar paths, built with SLMATH_NO_SIMD in MathBenchScalar.cpp. Each call runs count operations
+// over arrays of column major float[16] matrices and float[4] vectors.
+namespace MathBenchScalar
+{
+   void mulMat4(const float* a, const float* b, float* out, uint32_t count);
+   void transposeMat4(const float* a, float* out, uint32_t count);
+   void inverseMat4(const float* a, float* out, uint32_t count);
+   void mulMat4Vec4(const float* a, const float* v, float* out, uint32_t count);
+   void mulVec4Mat4(const float* v, const float* a, float* out, uint32_t count);
+   // max(min(a*b + b, a), b)
+   void madMinMaxVec4(const float* a, const float* b, float* out, uint32_t count);
+}
+
+#endif
@@ -0,0 +1,79 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include "SlmScalar.h"
+#include "MathBench.h"
+
+// Arguments are arrays of column major float[16] matrices or float[4] vectors, laid out the same as the
+// SIMD build's slm::mat4 and slm::vec4.
+
+void MathBenchScalar::mulMat4(const float* a, const float* b, float* out, uint32_t count)
+{
+   const slm_scalar::mat4* ma = (const slm_scalar::mat4*)a;
+   const slm_scalar::mat4* mb = (const slm_scalar::mat4*)b;
+   slm_scalar::mat4* mo = (slm_scalar::mat4*)out;
+   for (uint32_t i=0; i<count; i++)
+      mo[i] = ma[i] * mb[i];
+}
+
+void MathBenchScalar::transposeMat4(const float* a, float* out, uint32_t count)
+{
+   const slm_scalar::mat4* ma = (const slm_scalar::mat4*)a;
+   slm_scalar::mat4* mo = (slm_scalar::mat4*)out;
+   for (uint32_t i=0; i<count; i++)
+      mo[i] = slm_scalar::transpose(ma[i]);
+}
+
+void MathBenchScalar::inverseMat4(const float* a, float* out, uint32_t count)
+{
+   const slm_scalar::mat4* ma = (const slm_scalar::mat4*)a;
+   slm_scalar::mat4* mo = (slm_scalar::mat4*)out;
+   for (uint32_t i=0; i<count; i++)
+      mo[i] = slm_scalar::inverse(ma[i]);
+}
+
+void MathBenchScalar::mulMat4Vec4(const float* a, const float* v, float* out, uint32_t count)
+{
+   const slm_scalar::mat4* ma = (const slm_scalar::mat4*)a;
+   const slm_scalar::vec4* va = (const slm_scalar::vec4*)v;
+   slm_scalar::vec4* vo = (slm_scalar::vec4*)out;
+   for (uint32_t i=0; i<count; i++)
+      vo[i] = ma[i] * va[i];
+}
+
+void MathBenchScalar::mulVec4Mat4(const float* v, const float* a, float* out, uint32_t count)
+{
+   const slm_scalar::mat4* ma = (const slm_scalar::mat4*)a;
+   const slm_scalar::vec4* va = (const slm_scalar::vec4*)v;
+   slm_scalar::vec4* vo = (slm_scalar::vec4*)out;
+   for (uint32_t i=0; i<count; i++)
+      vo[i] = va[i] * ma[i];
+}
+
+void MathBenchScalar::madMinMaxVec4(const float* a, const float* b, float* out, uint32_t count)
+{
+   const slm_scalar::vec4* va = (const slm_scalar::vec4*)a;
+   const slm_scalar::vec4* vb = (const slm_scalar::vec4*)b;
+   slm_scalar::vec4* vo = (slm_scalar::vec4*)out;
+   for (uint32_t i=0; i<count; i++)
+      vo[i] = slm_scalar::max(slm_scalar::min(va[i] * vb[i] + vb[i], va[i]), vb[i]);
+}
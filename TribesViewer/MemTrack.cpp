@@ -0,0 +1,150 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include "MemTrack.h"
+
+#include <stdio.h>
+#include "imgui.h"
+#include "Log.h"
+
+std::atomic<int64_t> MemTrack::smCurrentBytes[Category_Count];
+std::atomic<int64_t> MemTrack::smPeakBytes[Category_Count];
+std::atomic<int64_t> MemTrack::smNumLive[Category_Count];
+std::atomic<uint64_t> MemTrack::smNumTotal[Category_Count];
+std::atomic<int64_t> MemTrack::smTotalBytes(0);
+std::atomic<int64_t> MemTrack::smTotalPeakBytes(0);
+
+static const char* sCategoryNames[MemTrack::Category_Count] = {
+   "IO",
+   "Assets",
+   "GPUMirror",
+   "GPU"
+};
+
+static void updatePeak(std::atomic<int64_t>& peak, int64_t value)
+{
+   int64_t oldPeak = peak.load(std::memory_order_relaxed);
+   while (value > oldPeak && !peak.compare_exchange_weak(oldPeak, value, std::memory_order_relaxed))
+   {
+      ;
+   }
+}
+
+void MemTrack::add(Category category, size_t bytes)
+{
+   int64_t current = smCurrentBytes[category].fetch_add((int64_t)bytes, std::memory_order_relaxed) + (int64_t)bytes;
+   int64_t total = smTotalBytes.fetch_add((int64_t)bytes, std::memory_order_relaxed) + (int64_t)bytes;
+   smNumLive[category].fetch_add(1, std::memory_order_relaxed);
+   smNumTotal[category].fetch_add(1, std::memory_order_relaxed);
+   
+   updatePeak(smPeakBytes[category], current);
+   updatePeak(smTotalPeakBytes, total);
+}
+
+void MemTrack::remove(Category category, size_t bytes)
+{
+   smCurrentBytes[category].fetch_sub((int64_t)bytes, std::memory_order_relaxed);
+   smTotalBytes.fetch_sub((int64_t)bytes, std::memory_order_relaxed);
+   smNumLive[category].fetch_sub(1, std::memory_order_relaxed);
+}
+
+void MemTrack::getStats(Category category, Stats* outStats)
+{
+   outStats->currentBytes = smCurrentBytes[category].load(std::memory_order_relaxed);
+   outStats->peakBytes = smPeakBytes[category].load(std::memory_order_relaxed);
+   outStats->numLive = smNumLive[category].load(std::memory_order_relaxed);
+   outStats->numTotal = smNumTotal[category].load(std::memory_order_relaxed);
+}
+
+int64_t MemTrack::getTotalBytes()
+{
+   return smTotalBytes.load(std::memory_order_relaxed);
+}
+
+int64_t MemTrack::getTotalPeakBytes()
+{
+   return smTotalPeakBytes.load(std::memory_order_relaxed);
+}
+
+const char* MemTrack::getCategoryName(Category category)
+{
+   return sCategoryNames[category];
+}
+
+void MemTrack::drawImGui()
+{
+   ImGui::Begin("Memory");
+   
+   ImGui::Columns(5);
+   ImGui::Text("Category"); ImGui::NextColumn();
+   ImGui::Text("Current"); ImGui::NextColumn();
+   ImGui::Text("Peak"); ImGui::NextColumn();
+   ImGui::Text("Live"); ImGui::NextColumn();
+   ImGui::Text("Total"); ImGui::NextColumn();
+   ImGui::Separator();
+   
+   for (uint32_t c=0; c<Category_Count; c++)
+   {
+      Stats stats;
+      getStats((Category)c, &stats);
+      ImGui::Text("%s", sCategoryNames[c]); ImGui::NextColumn();
+      ImGui::Text("%.2f MB", stats.currentBytes / (1024.0 * 1024.0)); ImGui::NextColumn();
+      ImGui::Text("%.2f MB", stats.peakBytes / (1024.0 * 1024.0)); ImGui::NextColumn();
+      ImGui::Text("%lld", (long long)stats.numLive); ImGui::NextColumn();
+      ImGui::Text("%llu", (unsigned long long)stats.numTotal); ImGui::NextColumn();
+   }
+   
+   ImGui::Columns(1);
+   ImGui::Separator();
+   ImGui::Text("Total: %.2f MB (peak %.2f MB)", getTotalBytes() / (1024.0 * 1024.0), getTotalPeakBytes() / (1024.0 * 1024.0));
+   
+   if (ImGui::Button("Dump"))
+   {
+      dumpJSON("memory.json");
+   }
+   
+   ImGui::End();
+}
+
+bool MemTrack::dumpJSON(const char* path)
+{
+   FILE* fp = fopen(path, "w");
+   if (fp == NULL)
+   {
+      LOG_ERROR("Couldn't write memory stats to %s", path);
+      return false;
+   }
+   
+   fprintf(fp, "{\n  \"totalBytes\": %lld,\n  \"totalPeakBytes\": %lld,\n  \"categories\": {\n", (long long)getTotalBytes(), (long long)getTotalPeakBytes());
+   for (uint32_t c=0; c<Category_Count; c++)
+   {
+      Stats stats;
+      getStats((Category)c, &stats);
+      fprintf(fp, "    \"%s\": {\"currentBytes\": %lld, \"peakBytes\": %lld, \"live\": %lld, \"total\": %llu}%s\n", sCategoryNames[c],
+              (long long)stats.currentBytes, (long long)stats.peakBytes, (long long)stats.numLive, (unsigned long long)stats.numTotal,
+              c+1 < Category_Count ? "," : "");
+   }
+   fprintf(fp, "  }\n}\n");
+   
+   fclose(fp);
+   return true;
+}
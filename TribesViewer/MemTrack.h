@@ -0,0 +1,113 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _MEMTRACK_H_
+#define _MEMTRACK_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+// Tagged memory accounting.
+//
+// Allocations we care about are reported against a category by the code that owns them, either with
+// add/remove or by holding an Allocation which follows the size of the owning buffer. Counters are relaxed
+// atomics so this is cheap enough to leave enabled; it only knows about what is reported to it.
+//
+class MemTrack
+{
+public:
+   
+   enum Category
+   {
+      Category_IO,        // file data read from disk or volumes
+      Category_Assets,    // parsed shapes, bitmaps, palettes, terrain
+      Category_GPUMirror, // CPU copies of data uploaded to the GPU
+      Category_GPU,       // textures and buffers owned by the renderer
+      Category_Count
+   };
+   
+   struct Stats
+   {
+      int64_t currentBytes;
+      int64_t peakBytes;
+      int64_t numLive;
+      uint64_t numTotal;
+   };
+   
+   // Tracks a single buffer; set() whenever the owner (re)allocates it
+   class Allocation
+   {
+   public:
+      Category mCategory;
+      size_t mBytes;
+      
+      Allocation(Category category) : mCategory(category), mBytes(0) {;}
+      Allocation(const Allocation& other) : mCategory(other.mCategory), mBytes(0) { set(other.mBytes); }
+      ~Allocation() { set(0); }
+      
+      Allocation& operator=(const Allocation& other)
+      {
+         set(0);
+         mCategory = other.mCategory;
+         set(other.mBytes);
+         return *this;
+      }
+      
+      inline void set(size_t bytes)
+      {
+         if (mBytes != 0)
+            MemTrack::remove(mCategory, mBytes);
+         mBytes = bytes;
+         if (mBytes != 0)
+            MemTrack::add(mCategory, mBytes);
+      }
+   };
+   
+   static void add(Category category, size_t bytes);
+   static void remove(Category category, size_t bytes);
+   
+   static void getStats(Category category, Stats* outStats);
+   static int64_t getTotalBytes();
+   static int64_t getTotalPeakBytes();
+   static const char* getCategoryName(Category category);
+   
+   template<class T> static inline size_t getVectorBytes(const std::vector<T>& vec)
+   {
+      return vec.capacity() * sizeof(T);
+   }
+   
+   static void drawImGui();
+   static bool dumpJSON(const char* path);
+   
+protected:
+   
+   static std::atomic<int64_t> smCurrentBytes[Category_Count];
+   static std::atomic<int64_t> smPeakBytes[Category_Count];
+   static std::atomic<int64_t> smNumLive[Category_Count];
+   static std::atomic<uint64_t> smNumTotal[Category_Count];
+   static std::atomic<int64_t> smTotalBytes;
+   static std::atomic<int64_t> smTotalPeakBytes;
+};
+
+#endif
@@ -164,6 +164,11 @@ static const uint32_t TVMaxBuffersInFlight = 3;
          pipelineStateDescriptor.colorAttachments[0].sourceRGBBlendFactor = MTLBlendFactorSourceAlpha;
          pipelineStateDescriptor.colorAttachments[0].destinationRGBBlendFactor = MTLBlendFactorOneMinusSourceAlpha;
          break;
+      case ModelPipeline_DepthOnly:
+         pipelineStateDescriptor.colorAttachments[0].writeMask = MTLColorWriteMaskNone;
+         break;
+      default:
+         break;
    }
    
    pipelineStateDescriptor.depthAttachmentPixelFormat = MTLPixelFormatDepth32Float;
@@ -286,10 +291,10 @@ static const uint32_t TVMaxBuffersInFlight = 3;
    _lineFragmentProgram = [defaultLibrary newFunctionWithName:@"lineFragmentShader"];
    
    // Model states
-   _modelPipelineStates = [NSMutableArray arrayWithCapacity:4];
+   _modelPipelineStates = [NSMutableArray arrayWithCapacity:ModelPipeline_Count];
    
    MTLDepthStencilDescriptor* depthStateDesc = [[MTLDepthStencilDescriptor alloc] init];
-   depthStateDesc.depthCompareFunction = MTLCompareFunctionLess;
+   depthStateDesc.depthCompareFunction = MTLCompareFunctionLessEqual;
    depthStateDesc.depthWriteEnabled = YES;
    _modelDepthState = [_device newDepthStencilStateWithDescriptor:depthStateDesc];
    
@@ -311,6 +316,7 @@ static const uint32_t TVMaxBuffersInFlight = 3;
    [_modelPipelineStates addObject:[self createModelPipelineState:ModelPipeline_AdditiveBlend    withPixelFormat:layer.pixelFormat]];
    [_modelPipelineStates addObject:[self createModelPipelineState:ModelPipeline_SubtractiveBlend withPixelFormat:layer.pixelFormat]];
    [_modelPipelineStates addObject:[self createModelPipelineState:ModelPipeline_TranslucentBlend withPixelFormat:layer.pixelFormat]];
+   [_modelPipelineStates addObject:[self createModelPipelineState:ModelPipeline_DepthOnly        withPixelFormat:layer.pixelFormat]];
    _linePipelineState = [self createLinePipelineStateWithPixelFormat:layer.pixelFormat];
 
    _textures = [NSMutableArray arrayWithCapacity:10];
@@ -754,6 +760,41 @@ int32_t GFXLoadTexture(Bitmap* bmp, Palette*pal)
    return [gRenderHelper loadTexture:bmp defaultPalette:pal];
 }
 
+uint32_t GFXGetTextureStagingSize(uint32_t width, uint32_t height, uint32_t* outPaddedWidth)
+{
+   if (outPaddedWidth)
+      *outPaddedWidth = width * 4;
+   return width * height * 4;
+}
+
+bool GFXConvertTexture(Bitmap* bmp, Palette* pal, uint8_t* outData)
+{
+   return false;
+}
+
+int32_t GFXLoadTextureStaged(uint32_t width, uint32_t height, bool bgr, const uint8_t* data)
+{
+   return -1;
+}
+
+int32_t GFXCreateTextureSet(uint32_t numLayers, uint32_t width, uint32_t height, bool bgr)
+{
+   return -1;
+}
+
+void GFXUploadTextureLayer(int32_t texID, uint32_t layer, const uint8_t* data)
+{
+}
+
+void GFXUpdateCustomTexture(int32_t texID, uint32_t x, uint32_t y, uint32_t width, uint32_t height, const void* data)
+{
+}
+
+void* GFXGetImGuiTexture(int32_t texID)
+{
+   return NULL;
+}
+
 void GFXDeleteTexture(int32_t texID)
 {
    [gRenderHelper deleteTexture:texID];
@@ -858,6 +899,31 @@ void GFXHandleResize()
    [gRenderHelper handleResize];
 }
 
+bool GFXWarmupStep(float budgetMS)
+{
+   // Metal binds textures directly, so there's nothing to make ahead
+   return false;
+}
+
+void GFXQueueTerrainResources(uint32_t terrainID, int32_t matTexGroupID, int32_t heightMapTexID, int32_t gridMapTexID, int32_t lightmapTexGroupID)
+{
+}
+
+void GFXGetFrameStats(GFXFrameStats* outStats)
+{
+   *outStats = {};
+}
+
+int GFXSetupHeadless(uint32_t width, uint32_t height)
+{
+   return -1;
+}
+
+bool GFXIsHeadless()
+{
+   return false;
+}
+
 void GFXTestRender(slm::vec3 pos)
 {
    if ([gRenderHelper beginFrame])
@@ -0,0 +1,484 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include "OcclusionBuffer.h"
+#include "BatchTransform.h"
+#include "Trace.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OCCLUSION_SSE2
+#endif
+
+bool OcclusionBuffer::smEnabled = true;
+OcclusionBuffer::Stats OcclusionBuffer::smLastStats;
+
+OcclusionBuffer::OcclusionBuffer() : mKicked(false), mBusy(false), mQuit(false), mReady(false)
+{
+   memset(&mStats, '\0', sizeof(Stats));
+   
+   uint32_t offset = 0;
+   for (uint32_t i=0; i<NumLevels; i++)
+   {
+      mLevelOffsets[i] = offset;
+      offset += (Width >> i) * (Height >> i);
+   }
+   
+   mDepth.resize(offset, 1.0f);
+   mViewProj = slm::mat4(1);
+}
+
+OcclusionBuffer::~OcclusionBuffer()
+{
+   if (mWorker.joinable())
+   {
+      {
+         std::lock_guard<std::mutex> lock(mMutex);
+         mQuit = true;
+      }
+      mKickCond.notify_one();
+      mWorker.join();
+   }
+}
+
+void OcclusionBuffer::clearOccluders()
+{
+   wait();
+   mOccluderX.clear();
+   mOccluderY.clear();
+   mOccluderZ.clear();
+   mOccluderInds.clear();
+   mReady = false;
+}
+
+void OcclusionBuffer::addOccluder(const slm::vec3* verts, uint32_t numVerts, const uint32_t* inds, uint32_t numInds, const slm::mat4& xfm)
+{
+   wait();
+   
+   if (numVerts == 0)
+      return;
+   
+   uint32_t base = (uint32_t)mOccluderX.size();
+   mOccluderX.resize(base + numVerts);
+   mOccluderY.resize(base + numVerts);
+   mOccluderZ.resize(base + numVerts);
+   
+   float* x = &mOccluderX[base];
+   float* y = &mOccluderY[base];
+   float* z = &mOccluderZ[base];
+   for (uint32_t i=0; i<numVerts; i++)
+   {
+      x[i] = verts[i].x;
+      y[i] = verts[i].y;
+      z[i] = verts[i].z;
+   }
+   BatchTransform::transformPointsSoA(xfm, x, y, z, x, y, z, numVerts, &BatchTransform::smLoadStats);
+   
+   for (uint32_t i=0; i<numInds; i++)
+   {
+      mOccluderInds.push_back(base + inds[i]);
+   }
+}
+
+void OcclusionBuffer::addOccluderQuad(const slm::vec3& p0, const slm::vec3& p1, const slm::vec3& p2, const slm::vec3& p3)
+{
+   const uint32_t inds[6] = {0, 1, 2, 0, 2, 3};
+   const slm::vec3 verts[4] = {p0, p1, p2, p3};
+   addOccluder(verts, 4, inds, 6, slm::mat4(1));
+}
+
+void OcclusionBuffer::kick(const slm::mat4& viewProj)
+{
+   wait();
+   
+   if (!mWorker.joinable())
+   {
+      mWorker = std::thread(&OcclusionBuffer::workerMain, this);
+   }
+   
+   {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mViewProj = viewProj;
+      mKicked = true;
+      mBusy = true;
+      mReady = false;
+   }
+   
+   mKickCond.notify_one();
+}
+
+void OcclusionBuffer::wait()
+{
+   auto startTime = std::chrono::steady_clock::now();
+   
+   std::unique_lock<std::mutex> lock(mMutex);
+   if (!mBusy)
+      return;
+   
+   mDoneCond.wait(lock, [this]{ return !mBusy; });
+   
+   auto endTime = std::chrono::steady_clock::now();
+   mStats.waitTimeUS += std::chrono::duration<float, std::micro>(endTime - startTime).count();
+}
+
+void OcclusionBuffer::workerMain()
+{
+   Trace::setThreadName("Occlusion");
+   std::unique_lock<std::mutex> lock(mMutex);
+   
+   while (true)
+   {
+      mKickCond.wait(lock, [this]{ return mKicked || mQuit; });
+      if (mQuit)
+         break;
+      
+      mKicked = false;
+      lock.unlock();
+      
+      {
+         TRACE_ZONE("OcclusionBuffer::rasterize");
+         rasterize();
+      }
+      
+      lock.lock();
+      mBusy = false;
+      mReady = true;
+      mDoneCond.notify_all();
+   }
+}
+
+void OcclusionBuffer::rasterize()
+{
+   auto startTime = std::chrono::steady_clock::now();
+   
+   float* depth = getLevel(0);
+   std::fill(depth, depth + (Width * Height), 1.0f);
+   
+   // Transform everything into clip space first
+   mScreenVerts.resize(mOccluderX.size());
+   if (!mOccluderX.empty())
+   {
+      BatchTransform::projectPointsSoA(mViewProj, &mOccluderX[0], &mOccluderY[0], &mOccluderZ[0], &mScreenVerts[0].x, sizeof(ScreenVert), mOccluderX.size());
+   }
+   
+   mStats.numOccluderTris = (uint32_t)(mOccluderInds.size() / 3);
+   mStats.numSkippedTris = 0;
+   
+   for (size_t i=0; i+2<mOccluderInds.size(); i+=3)
+   {
+      const ScreenVert* tri[3] = {
+         &mScreenVerts[mOccluderInds[i]],
+         &mScreenVerts[mOccluderInds[i+1]],
+         &mScreenVerts[mOccluderInds[i+2]]
+      };
+      
+      // Clip against the near plane (z >= 0 in clip space)
+      ScreenVert poly[4];
+      uint32_t numPoly = 0;
+      
+      for (uint32_t j=0; j<3; j++)
+      {
+         const ScreenVert& cur = *tri[j];
+         const ScreenVert& next = *tri[(j+1) % 3];
+         bool curIn = cur.z >= 0.0f;
+         bool nextIn = next.z >= 0.0f;
+         
+         if (curIn)
+         {
+            poly[numPoly++] = cur;
+         }
+         
+         if (curIn != nextIn)
+         {
+            float t = cur.z / (cur.z - next.z);
+            ScreenVert& v = poly[numPoly++];
+            v.x = cur.x + ((next.x - cur.x) * t);
+            v.y = cur.y + ((next.y - cur.y) * t);
+            v.z = 0.0f;
+            v.w = cur.w + ((next.w - cur.w) * t);
+         }
+      }
+      
+      if (numPoly < 3)
+      {
+         mStats.numSkippedTris++;
+         continue;
+      }
+      
+      // Project to pixels
+      bool valid = true;
+      for (uint32_t j=0; j<numPoly; j++)
+      {
+         ScreenVert& v = poly[j];
+         if (v.w <= 1e-6f)
+         {
+            valid = false;
+            break;
+         }
+         
+         float invW = 1.0f / v.w;
+         v.x = ((v.x * invW) * 0.5f + 0.5f) * (float)Width;
+         v.y = (0.5f - (v.y * invW) * 0.5f) * (float)Height;
+         v.z = v.z * invW;
+      }
+      
+      if (!valid)
+      {
+         mStats.numSkippedTris++;
+         continue;
+      }
+      
+      for (uint32_t j=1; j+1<numPoly; j++)
+      {
+         rasterizeTriangle(poly[0], poly[j], poly[j+1]);
+      }
+   }
+   
+   buildHiZ();
+   
+   auto endTime = std::chrono::steady_clock::now();
+   mStats.rasterTimeUS = std::chrono::duration<float, std::micro>(endTime - startTime).count();
+}
+
+void OcclusionBuffer::rasterizeTriangle(const ScreenVert& v0, const ScreenVert& in1, const ScreenVert& in2)
+{
+   // Make winding consistent; occluders are two sided
+   float area = ((in1.x - v0.x) * (in2.y - v0.y)) - ((in1.y - v0.y) * (in2.x - v0.x));
+   if (std::fabs(area) < 1e-4f)
+      return;
+   
+   const ScreenVert& v1 = area > 0.0f ? in1 : in2;
+   const ScreenVert& v2 = area > 0.0f ? in2 : in1;
+   area = std::fabs(area);
+   
+   // Depth is clamped to the farthest vertex depth of the triangle
+   float triDepth = std::max(v0.z, std::max(v1.z, v2.z));
+   if (triDepth >= 1.0f)
+      return;
+   
+   // z/w is linear in screen space. Depth is evaluated at pixel centers and biased towards
+   // the farthest point within the pixel so the written value is never in front of the occluder.
+   float dzdx = (((v1.z - v0.z) * (v2.y - v0.y)) - ((v2.z - v0.z) * (v1.y - v0.y))) / area;
+   float dzdy = (((v2.z - v0.z) * (v1.x - v0.x)) - ((v1.z - v0.z) * (v2.x - v0.x))) / area;
+   float depthBias = 0.5f * (std::fabs(dzdx) + std::fabs(dzdy));
+   
+   float minXF = std::min(v0.x, std::min(v1.x, v2.x));
+   float maxXF = std::max(v0.x, std::max(v1.x, v2.x));
+   float minYF = std::min(v0.y, std::min(v1.y, v2.y));
+   float maxYF = std::max(v0.y, std::max(v1.y, v2.y));
+   
+   if (maxXF < 0.0f || maxYF < 0.0f || minXF >= (float)Width || minYF >= (float)Height)
+      return;
+   
+   int32_t minX = std::max(0, (int32_t)std::floor(minXF));
+   int32_t maxX = std::min((int32_t)Width - 1, (int32_t)std::floor(maxXF));
+   int32_t minY = std::max(0, (int32_t)std::floor(minYF));
+   int32_t maxY = std::min((int32_t)Height - 1, (int32_t)std::floor(maxYF));
+   
+   // Edge equations E(x,y) = A*x + B*y + C, positive inside. Coverage is sampled at pixel centers.
+   const ScreenVert* verts[3] = {&v0, &v1, &v2};
+   float edgeA[3], edgeB[3], edgeC[3];
+   
+   for (uint32_t i=0; i<3; i++)
+   {
+      const ScreenVert& a = *verts[i];
+      const ScreenVert& b = *verts[(i+1) % 3];
+      edgeA[i] = -(b.y - a.y);
+      edgeB[i] = (b.x - a.x);
+      edgeC[i] = ((b.y - a.y) * a.x) - ((b.x - a.x) * a.y);
+   }
+   
+   float* depth = getLevel(0);
+   int32_t startX = minX & ~3;
+   
+   for (int32_t y=minY; y<=maxY; y++)
+   {
+      float* row = depth + (y * Width);
+      float py = (float)y + 0.5f;
+      float px = (float)startX + 0.5f;
+      
+      float e0 = (edgeA[0] * px) + (edgeB[0] * py) + edgeC[0];
+      float e1 = (edgeA[1] * px) + (edgeB[1] * py) + edgeC[1];
+      float e2 = (edgeA[2] * px) + (edgeB[2] * py) + edgeC[2];
+      float z = v0.z + (dzdx * (px - v0.x)) + (dzdy * (py - v0.y)) + depthBias;
+      
+#ifdef OCCLUSION_SSE2
+      const __m128 laneIdx = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+      const __m128 zero = _mm_setzero_ps();
+      const __m128 maxZ = _mm_set1_ps(triDepth);
+      
+      __m128 vz = _mm_add_ps(_mm_set1_ps(z), _mm_mul_ps(laneIdx, _mm_set1_ps(dzdx)));
+      const __m128 stepZ = _mm_set1_ps(dzdx * 4.0f);
+      
+      __m128 ve0 = _mm_add_ps(_mm_set1_ps(e0), _mm_mul_ps(laneIdx, _mm_set1_ps(edgeA[0])));
+      __m128 ve1 = _mm_add_ps(_mm_set1_ps(e1), _mm_mul_ps(laneIdx, _mm_set1_ps(edgeA[1])));
+      __m128 ve2 = _mm_add_ps(_mm_set1_ps(e2), _mm_mul_ps(laneIdx, _mm_set1_ps(edgeA[2])));
+      const __m128 step0 = _mm_set1_ps(edgeA[0] * 4.0f);
+      const __m128 step1 = _mm_set1_ps(edgeA[1] * 4.0f);
+      const __m128 step2 = _mm_set1_ps(edgeA[2] * 4.0f);
+      
+      // NOTE: Width is a multiple of 4 so the last group never runs past the row
+      for (int32_t x=startX; x<=maxX; x+=4)
+      {
+         __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(ve0, zero), _mm_cmpge_ps(ve1, zero)), _mm_cmpge_ps(ve2, zero));
+         __m128 oldZ = _mm_loadu_ps(row + x);
+         __m128 newZ = _mm_min_ps(oldZ, _mm_min_ps(vz, maxZ));
+         _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, newZ), _mm_andnot_ps(inside, oldZ)));
+         
+         ve0 = _mm_add_ps(ve0, step0);
+         ve1 = _mm_add_ps(ve1, step1);
+         ve2 = _mm_add_ps(ve2, step2);
+         vz = _mm_add_ps(vz, stepZ);
+      }
+#else
+      for (int32_t x=startX; x<=maxX; x++)
+      {
+         float pixelZ = std::min(z, triDepth);
+         if (e0 >= 0.0f && e1 >= 0.0f && e2 >= 0.0f && row[x] > pixelZ)
+         {
+            row[x] = pixelZ;
+         }
+         
+         e0 += edgeA[0];
+         e1 += edgeA[1];
+         e2 += edgeA[2];
+         z += dzdx;
+      }
+#endif
+   }
+}
+
+void OcclusionBuffer::buildHiZ()
+{
+   // Each texel stores the farthest depth of the 4 texels below it
+   for (uint32_t level=1; level<NumLevels; level++)
+   {
+      const float* src = getLevel(level-1);
+      float* dst = getLevel(level);
+      const uint32_t srcWidth = Width >> (level-1);
+      const uint32_t dstWidth = Width >> level;
+      const uint32_t dstHeight = Height >> level;
+      
+      for (uint32_t y=0; y<dstHeight; y++)
+      {
+         const float* row0 = src + ((y*2) * srcWidth);
+         const float* row1 = row0 + srcWidth;
+         float* out = dst + (y * dstWidth);
+         
+         for (uint32_t x=0; x<dstWidth; x++)
+         {
+            out[x] = std::max(std::max(row0[x*2], row0[x*2+1]), std::max(row1[x*2], row1[x*2+1]));
+         }
+      }
+   }
+}
+
+bool OcclusionBuffer::testAABB(const slm::vec3& minP, const slm::vec3& maxP)
+{
+   if (!mReady)
+      return true;
+   
+   // Empty (inverted) or unbounded extents can't be projected, so leave them visible
+   for (uint32_t i=0; i<3; i++)
+   {
+      if (minP[i] > maxP[i] || minP[i] <= -FLT_MAX || maxP[i] >= FLT_MAX)
+         return true;
+   }
+   
+   mStats.numTested++;
+   
+   float minX = (float)Width;
+   float maxX = 0.0f;
+   float minY = (float)Height;
+   float maxY = 0.0f;
+   float minZ = 1.0f;
+   
+   for (uint32_t i=0; i<8; i++)
+   {
+      slm::vec3 corner((i & 1) ? maxP.x : minP.x,
+                       (i & 2) ? maxP.y : minP.y,
+                       (i & 4) ? maxP.z : minP.z);
+      slm::vec4 clip = mViewProj * slm::vec4(corner, 1.0f);
+      
+      // Anything crossing the near plane is treated as visible
+      if (clip.z < 0.0f || clip.w <= 1e-6f)
+         return true;
+      
+      float invW = 1.0f / clip.w;
+      float sx = ((clip.x * invW) * 0.5f + 0.5f) * (float)Width;
+      float sy = (0.5f - (clip.y * invW) * 0.5f) * (float)Height;
+      
+      minX = std::min(minX, sx);
+      maxX = std::max(maxX, sx);
+      minY = std::min(minY, sy);
+      maxY = std::max(maxY, sy);
+      minZ = std::min(minZ, clip.z * invW);
+   }
+   
+   // Off screen; leave it to the GPU
+   if (maxX < 0.0f || maxY < 0.0f || minX >= (float)Width || minY >= (float)Height)
+      return true;
+   
+   int32_t x0 = std::max(0, (int32_t)std::floor(minX));
+   int32_t x1 = std::min((int32_t)Width - 1, (int32_t)std::floor(maxX));
+   int32_t y0 = std::max(0, (int32_t)std::floor(minY));
+   int32_t y1 = std::min((int32_t)Height - 1, (int32_t)std::floor(maxY));
+   
+   // Pick the level where the bounds cover only a few texels
+   uint32_t level = 0;
+   while (level < NumLevels-1 &&
+          (((x1 >> level) - (x0 >> level) + 1) > MaxTestTexels ||
+           ((y1 >> level) - (y0 >> level) + 1) > MaxTestTexels))
+   {
+      level++;
+   }
+   
+   const float* depth = getLevel(level);
+   const uint32_t levelWidth = Width >> level;
+   
+   for (int32_t y=(y0 >> level); y<=(y1 >> level); y++)
+   {
+      for (int32_t x=(x0 >> level); x<=(x1 >> level); x++)
+      {
+         if (minZ <= depth[(y * levelWidth) + x])
+            return true;
+      }
+   }
+   
+   mStats.numCulled++;
+   return false;
+}
+
+void OcclusionBuffer::endFrame()
+{
+   smLastStats = mStats;
+   mStats.numTested = 0;
+   mStats.numCulled = 0;
+   mStats.waitTimeUS = 0.0f;
+}
@@ -0,0 +1,129 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _OCCLUSIONBUFFER_H_
+#define _OCCLUSIONBUFFER_H_
+
+#include <stdint.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <slm/slmath.h>
+
+// Low resolution software depth buffer used to cull geometry hidden behind large occluders.
+//
+// Occluder triangles are registered up-front (e.g. when an interior or terrain is loaded). Each frame
+// kick() rasterizes them on a worker thread into a depth buffer plus a max-depth mip chain, while the
+// main thread carries on with its update. Once wait() returns, testAABB() can be used to reject bounds
+// which are completely behind the occluders.
+//
+// Depth is stored as post-projection z/w in the 0..1 range, as produced by slm::perspective_fov_rh.
+// Occluder coverage is sampled at pixel centers, so silhouettes can be off by up to half a pixel. Depth is
+// kept conservative: occluders write the farthest depth within each pixel, while bounds use their nearest
+// depth and are treated as visible if they cross the near plane.
+//
+class OcclusionBuffer
+{
+public:
+   
+   enum
+   {
+      Width = 256,
+      Height = 128,
+      NumLevels = 6,  // 256x128 down to 8x4
+      MaxTestTexels = 4
+   };
+   
+   struct Stats
+   {
+      uint32_t numOccluderTris;
+      uint32_t numSkippedTris;
+      uint32_t numTested;
+      uint32_t numCulled;
+      float rasterTimeUS;
+      float waitTimeUS;
+   };
+   
+   static bool smEnabled;
+   static Stats smLastStats;
+   
+   OcclusionBuffer();
+   ~OcclusionBuffer();
+   
+   // Occluder setup
+   void clearOccluders();
+   void addOccluder(const slm::vec3* verts, uint32_t numVerts, const uint32_t* inds, uint32_t numInds, const slm::mat4& xfm);
+   void addOccluderQuad(const slm::vec3& p0, const slm::vec3& p1, const slm::vec3& p2, const slm::vec3& p3);
+   inline bool hasOccluders() const { return !mOccluderInds.empty(); }
+   
+   // Starts rasterizing occluders on the worker thread
+   void kick(const slm::mat4& viewProj);
+   // Waits for the current kick to finish
+   void wait();
+   
+   // Returns false if the bounds (in occluder space) are completely hidden. Only valid after wait().
+   bool testAABB(const slm::vec3& minP, const slm::vec3& maxP);
+   
+   // Publishes stats for this frame and resets the per-frame counters
+   void endFrame();
+   
+   inline bool isReady() const { return mReady; }
+   
+protected:
+   
+   struct ScreenVert
+   {
+      float x, y, z, w;
+   };
+   
+   void workerMain();
+   void rasterize();
+   void rasterizeTriangle(const ScreenVert& v0, const ScreenVert& v1, const ScreenVert& v2);
+   void buildHiZ();
+   
+   inline float* getLevel(uint32_t level) { return &mDepth[mLevelOffsets[level]]; }
+   
+   // Occluder vertices are kept as separate x/y/z arrays so they can be projected 4 at a time
+   std::vector<float> mOccluderX;
+   std::vector<float> mOccluderY;
+   std::vector<float> mOccluderZ;
+   std::vector<uint32_t> mOccluderInds;
+   std::vector<ScreenVert> mScreenVerts;
+   
+   std::vector<float> mDepth; // all levels
+   uint32_t mLevelOffsets[NumLevels];
+   
+   slm::mat4 mViewProj;
+   Stats mStats;
+   
+   std::thread mWorker;
+   std::mutex mMutex;
+   std::condition_variable mKickCond;
+   std::condition_variable mDoneCond;
+   bool mKicked;
+   bool mBusy;
+   bool mQuit;
+   bool mReady;
+};
+
+#endif /* _OCCLUSIONBUFFER_H_ */
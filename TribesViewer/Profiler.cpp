@@ -0,0 +1,312 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include "Profiler.h"
+
+#ifdef TV_ENABLE_PROFILER
+
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <algorithm>
+#include <vector>
+#include "imgui.h"
+#include "Log.h"
+
+std::chrono::steady_clock::time_point Profiler::smFrameStart;
+Profiler::FrameRecord Profiler::smCurrent;
+Profiler::FrameRecord Profiler::smRing[RingSize];
+std::atomic<uint64_t> Profiler::smWriteIndex(0);
+
+static const char* sPhaseNames[Profiler::Phase_Count] = {
+   "Input",
+   "Threads",
+   "Animate",
+   "Render",
+   "ImGui",
+   "EndFrame",
+   "Frame"
+};
+
+static const char* sCounterNames[Profiler::Counter_Count] = {
+   "DrawCalls",
+   "PipelineSets",
+   "BindGroupSets",
+   "BufferWrites",
+   "BufferWriteBytes",
+   "TextureUploads",
+   "TextureUploadBytes",
+   "BufferHighWaterBytes",
+   "LiveTextures",
+   "LiveModels"
+};
+
+struct PhasePercentiles
+{
+   float p50;
+   float p95;
+   float p99;
+};
+
+static float getPercentile(std::vector<float>& values, float pct)
+{
+   if (values.empty())
+      return 0.0f;
+   
+   size_t idx = std::min(values.size()-1, (size_t)(pct * (values.size()-1) + 0.5f));
+   std::nth_element(values.begin(), values.begin() + idx, values.end());
+   return values[idx];
+}
+
+static void calcPercentiles(const Profiler::FrameRecord* records, uint32_t numRecords, PhasePercentiles* outPercentiles)
+{
+   std::vector<float> values(numRecords);
+   for (uint32_t p=0; p<Profiler::Phase_Count; p++)
+   {
+      for (uint32_t i=0; i<numRecords; i++)
+      {
+         values[i] = records[i].phaseMS[p];
+      }
+      
+      outPercentiles[p].p50 = getPercentile(values, 0.50f);
+      outPercentiles[p].p95 = getPercentile(values, 0.95f);
+      outPercentiles[p].p99 = getPercentile(values, 0.99f);
+   }
+}
+
+void Profiler::addTime(Phase phase, float ms)
+{
+   smCurrent.phaseMS[phase] += ms;
+}
+
+void Profiler::setCounter(Counter counter, uint64_t value)
+{
+   smCurrent.counters[counter] = value;
+}
+
+void Profiler::beginFrame()
+{
+   smFrameStart = std::chrono::steady_clock::now();
+}
+
+void Profiler::endFrame()
+{
+   auto end = std::chrono::steady_clock::now();
+   smCurrent.phaseMS[Phase_Frame] = std::chrono::duration_cast<std::chrono::nanoseconds>(end - smFrameStart).count() / 1000000.0f;
+   
+   uint64_t idx = smWriteIndex.load(std::memory_order_relaxed);
+   smCurrent.frameIndex = idx;
+   smRing[idx & (RingSize-1)] = smCurrent;
+   smWriteIndex.store(idx+1, std::memory_order_release);
+   
+   memset(&smCurrent, '\0', sizeof(smCurrent));
+}
+
+uint32_t Profiler::getRecords(FrameRecord* outRecords, uint32_t maxRecords)
+{
+   uint64_t end = smWriteIndex.load(std::memory_order_acquire);
+   uint64_t count = std::min<uint64_t>(std::min<uint64_t>(end, RingSize), maxRecords);
+   uint64_t start = end - count;
+   
+   for (uint64_t i=0; i<count; i++)
+   {
+      outRecords[i] = smRing[(start + i) & (RingSize-1)];
+   }
+   
+   // Anything the writer lapped while we were copying is invalid
+   uint64_t newEnd = smWriteIndex.load(std::memory_order_acquire);
+   uint64_t overwritten = newEnd > (start + RingSize) ? (newEnd - (start + RingSize)) : 0;
+   if (overwritten >= count)
+      return 0;
+   
+   if (overwritten > 0)
+   {
+      memmove(outRecords, outRecords + overwritten, (count - overwritten) * sizeof(FrameRecord));
+   }
+   
+   return (uint32_t)(count - overwritten);
+}
+
+const char* Profiler::getPhaseName(Phase phase)
+{
+   return sPhaseNames[phase];
+}
+
+const char* Profiler::getCounterName(Counter counter)
+{
+   return sCounterNames[counter];
+}
+
+void Profiler::drawImGui()
+{
+   static FrameRecord records[RingSize];
+   static float graph[RingSize];
+   static int graphPhase = Phase_Frame;
+   
+   uint32_t numRecords = getRecords(records, RingSize);
+   
+   ImGui::Begin("Profiler");
+   
+   ImGui::Combo("Graph", &graphPhase, sPhaseNames, Phase_Count);
+   for (uint32_t i=0; i<numRecords; i++)
+   {
+      graph[i] = records[i].phaseMS[graphPhase];
+   }
+   ImGui::PlotLines("##phasegraph", graph, (int)numRecords, 0, "ms", 0.0f, FLT_MAX, ImVec2(0, 80));
+   
+   PhasePercentiles percentiles[Phase_Count];
+   calcPercentiles(records, numRecords, percentiles);
+   
+   ImGui::Text("%u frames", numRecords);
+   ImGui::Columns(5);
+   ImGui::Text("Phase"); ImGui::NextColumn();
+   ImGui::Text("Last"); ImGui::NextColumn();
+   ImGui::Text("p50"); ImGui::NextColumn();
+   ImGui::Text("p95"); ImGui::NextColumn();
+   ImGui::Text("p99"); ImGui::NextColumn();
+   ImGui::Separator();
+   
+   for (uint32_t p=0; p<Phase_Count; p++)
+   {
+      ImGui::Text("%s", sPhaseNames[p]); ImGui::NextColumn();
+      ImGui::Text("%.3f", numRecords > 0 ? records[numRecords-1].phaseMS[p] : 0.0f); ImGui::NextColumn();
+      ImGui::Text("%.3f", percentiles[p].p50); ImGui::NextColumn();
+      ImGui::Text("%.3f", percentiles[p].p95); ImGui::NextColumn();
+      ImGui::Text("%.3f", percentiles[p].p99); ImGui::NextColumn();
+   }
+   
+   ImGui::Columns(1);
+   
+   if (numRecords > 0 && ImGui::CollapsingHeader("Counters"))
+   {
+      for (uint32_t c=0; c<Counter_Count; c++)
+      {
+         ImGui::Text("%s: %llu", sCounterNames[c], (unsigned long long)records[numRecords-1].counters[c]);
+      }
+   }
+   
+   if (ImGui::Button("Dump"))
+   {
+      dumpCSV("frame_profile.csv");
+      dumpJSON("frame_profile.json");
+   }
+   
+   ImGui::End();
+}
+
+bool Profiler::dumpCSV(const char* path)
+{
+   std::vector<FrameRecord> records(RingSize);
+   uint32_t numRecords = getRecords(&records[0], RingSize);
+   
+   FILE* fp = fopen(path, "w");
+   if (fp == NULL)
+   {
+      LOG_ERROR("Couldn't write profile to %s", path);
+      return false;
+   }
+   
+   fprintf(fp, "frame");
+   for (uint32_t p=0; p<Phase_Count; p++)
+   {
+      fprintf(fp, ",%s", sPhaseNames[p]);
+   }
+   for (uint32_t c=0; c<Counter_Count; c++)
+   {
+      fprintf(fp, ",%s", sCounterNames[c]);
+   }
+   fprintf(fp, "\n");
+   
+   for (uint32_t i=0; i<numRecords; i++)
+   {
+      fprintf(fp, "%llu", (unsigned long long)records[i].frameIndex);
+      for (uint32_t p=0; p<Phase_Count; p++)
+      {
+         fprintf(fp, ",%.4f", records[i].phaseMS[p]);
+      }
+      for (uint32_t c=0; c<Counter_Count; c++)
+      {
+         fprintf(fp, ",%llu", (unsigned long long)records[i].counters[c]);
+      }
+      fprintf(fp, "\n");
+   }
+   
+   fclose(fp);
+   return true;
+}
+
+bool Profiler::dumpJSON(const char* path)
+{
+   std::vector<FrameRecord> records(RingSize);
+   uint32_t numRecords = getRecords(&records[0], RingSize);
+   
+   FILE* fp = fopen(path, "w");
+   if (fp == NULL)
+   {
+      LOG_ERROR("Couldn't write profile to %s", path);
+      return false;
+   }
+   
+   PhasePercentiles percentiles[Phase_Count];
+   calcPercentiles(&records[0], numRecords, percentiles);
+   
+   fprintf(fp, "{\n  \"numFrames\": %u,\n  \"summary\": {\n", numRecords);
+   for (uint32_t p=0; p<Phase_Count; p++)
+   {
+      fprintf(fp, "    \"%s\": {\"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f}%s\n", sPhaseNames[p],
+              percentiles[p].p50, percentiles[p].p95, percentiles[p].p99, p+1 < Phase_Count ? "," : "");
+   }
+   fprintf(fp, "  },\n  \"counters\": {\n");
+   for (uint32_t c=0; c<Counter_Count; c++)
+   {
+      uint64_t total = 0;
+      uint64_t maxValue = 0;
+      for (uint32_t i=0; i<numRecords; i++)
+      {
+         total += records[i].counters[c];
+         maxValue = std::max(maxValue, records[i].counters[c]);
+      }
+      fprintf(fp, "    \"%s\": {\"avg\": %.2f, \"max\": %llu}%s\n", sCounterNames[c],
+              numRecords > 0 ? (double)total / numRecords : 0.0, (unsigned long long)maxValue, c+1 < Counter_Count ? "," : "");
+   }
+   fprintf(fp, "  },\n  \"frames\": [\n");
+   
+   for (uint32_t i=0; i<numRecords; i++)
+   {
+      fprintf(fp, "    {\"frame\": %llu", (unsigned long long)records[i].frameIndex);
+      for (uint32_t p=0; p<Phase_Count; p++)
+      {
+         fprintf(fp, ", \"%s\": %.4f", sPhaseNames[p], records[i].phaseMS[p]);
+      }
+      for (uint32_t c=0; c<Counter_Count; c++)
+      {
+         fprintf(fp, ", \"%s\": %llu", sCounterNames[c], (unsigned long long)records[i].counters[c]);
+      }
+      fprintf(fp, "}%s\n", i+1 < numRecords ? "," : "");
+   }
+   
+   fprintf(fp, "  ]\n}\n");
+   fclose(fp);
+   return true;
+}
+
+#endif
@@ -0,0 +1,138 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+
+// Per-phase CPU frame timing.
+//
+// Phases are timed with PROFILE_SCOPE and accumulated into the current frame record. PROFILE_BEGIN_FRAME and
+// PROFILE_END_FRAME time the whole frame and push the record into a fixed size ring. The ring has a single writer (the main thread); readers copy out
+// the newest records and discard any that were overwritten while copying, so no locking is needed.
+//
+// Each record also carries a set of counters (e.g. renderer stats) set once per frame with PROFILE_SET_COUNTER.
+//
+// Everything compiles to nothing unless TV_ENABLE_PROFILER is defined.
+//
+class Profiler
+{
+public:
+   
+   enum Phase
+   {
+      Phase_Input,
+      Phase_Threads,
+      Phase_Animate,
+      Phase_Render,
+      Phase_ImGui,
+      Phase_EndFrame,
+      Phase_Frame, // everything before the frame delay
+      Phase_Count
+   };
+   
+   enum Counter
+   {
+      Counter_DrawCalls,
+      Counter_PipelineSets,
+      Counter_BindGroupSets,
+      Counter_BufferWrites,
+      Counter_BufferWriteBytes,
+      Counter_TextureUploads,
+      Counter_TextureUploadBytes,
+      Counter_BufferHighWaterBytes,
+      Counter_LiveTextures,
+      Counter_LiveModels,
+      Counter_Count
+   };
+   
+   enum
+   {
+      RingSize = 1024 // must be a power of 2
+   };
+   
+   struct FrameRecord
+   {
+      uint64_t frameIndex;
+      float phaseMS[Phase_Count];
+      uint64_t counters[Counter_Count];
+   };
+   
+   class Scope
+   {
+   public:
+      Phase mPhase;
+      std::chrono::steady_clock::time_point mStart;
+      
+      Scope(Phase phase) : mPhase(phase), mStart(std::chrono::steady_clock::now()) {;}
+      ~Scope()
+      {
+         auto end = std::chrono::steady_clock::now();
+         Profiler::addTime(mPhase, std::chrono::duration_cast<std::chrono::nanoseconds>(end - mStart).count() / 1000000.0f);
+      }
+   };
+   
+   static void addTime(Phase phase, float ms);
+   static void setCounter(Counter counter, uint64_t value);
+   static void beginFrame();
+   static void endFrame();
+   
+   // Copies up to maxRecords of the newest records, oldest first. Returns the number copied.
+   static uint32_t getRecords(FrameRecord* outRecords, uint32_t maxRecords);
+   
+   static const char* getPhaseName(Phase phase);
+   static const char* getCounterName(Counter counter);
+   
+   static void drawImGui();
+   static bool dumpCSV(const char* path);
+   static bool dumpJSON(const char* path);
+   
+protected:
+   
+   static std::chrono::steady_clock::time_point smFrameStart;
+   static FrameRecord smCurrent;
+   static FrameRecord smRing[RingSize];
+   static std::atomic<uint64_t> smWriteIndex;
+};
+
+#ifdef TV_ENABLE_PROFILER
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(phase) Profiler::Scope PROFILE_CONCAT(profileScope, __LINE__)(Profiler::phase)
+#define PROFILE_BEGIN_FRAME() Profiler::beginFrame()
+#define PROFILE_END_FRAME() Profiler::endFrame()
+#define PROFILE_SET_COUNTER(counter, value) Profiler::setCounter(Profiler::counter, value)
+#define PROFILE_DRAW_UI() Profiler::drawImGui()
+#define PROFILE_DUMP(csvPath, jsonPath) { Profiler::dumpCSV(csvPath); Profiler::dumpJSON(jsonPath); }
+#else
+#define PROFILE_SCOPE(phase)
+#define PROFILE_BEGIN_FRAME()
+#define PROFILE_END_FRAME()
+#define PROFILE_SET_COUNTER(counter, value)
+#define PROFILE_DRAW_UI()
+#define PROFILE_DUMP(csvPath, jsonPath)
+#endif
+
+#endif
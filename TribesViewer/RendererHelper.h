@@ -17,7 +17,31 @@ enum CustomTextureFormat
    CustomTexture_TerrainSquare
 };
 
+// Counters for the last completed frame (see GFXGetFrameStats)
+struct GFXFrameStats
+{
+   uint32_t numDrawCalls;
+   uint32_t numPipelineSets;
+   uint32_t numBindGroupSets;
+   uint32_t numBufferWrites;
+   uint64_t bufferWriteBytes;
+   uint32_t numTextureUploads;
+   uint64_t textureUploadBytes;
+   
+   // Transient buffer allocator
+   uint32_t numBufferAllocs;
+   uint64_t bufferCapacityBytes;
+   uint64_t bufferUsedBytes;
+   uint64_t bufferHighWaterBytes; // max used since setup
+   
+   uint32_t numLiveTextures;
+   uint32_t numLiveModels;
+};
+
 extern int GFXSetup(SDL_Window* window, SDL_Renderer* renderer);
+// Sets up without a window or device; textures are converted but not uploaded and draws are only counted.
+extern int GFXSetupHeadless(uint32_t width, uint32_t height);
+extern bool GFXIsHeadless();
 extern void GFXTeardown();
 extern void GFXTestRender(slm::vec3 pos);
 extern void GFXPollEvents();
@@ -27,9 +51,28 @@ extern bool GFXBeginFrame();
 extern void GFXEndFrame();
 extern void GFXHandleResize();
 
+// Makes the bind groups of loaded textures and queued terrains ahead of their first draw.
+// Call between frames with the idle time left; always makes at least one. Returns true while more are pending.
+extern bool GFXWarmupStep(float budgetMS);
+
+// Uploads done outside a frame (i.e. while loading) are counted towards the next frame.
+extern void GFXGetFrameStats(GFXFrameStats* outStats);
+
 extern int32_t GFXLoadCustomTexture(CustomTextureFormat fmt, uint32_t width, uint32_t height, void* data);
 extern int32_t GFXLoadTexture(Bitmap* bmp, Palette*pal);
 extern int32_t GFXLoadTextureSet(uint32_t numBitmaps, Bitmap** bmps, Palette*pal);
+// Staged texture loading: GFXConvertTexture fills row-padded RGBA8 data (sized by
+// GFXGetTextureStagingSize) and may be called from any thread. The functions which
+// create or upload textures from it must be called from the render thread.
+extern uint32_t GFXGetTextureStagingSize(uint32_t width, uint32_t height, uint32_t* outPaddedWidth);
+extern bool GFXConvertTexture(Bitmap* bmp, Palette* pal, uint8_t* outData);
+extern int32_t GFXLoadTextureStaged(uint32_t width, uint32_t height, bool bgr, const uint8_t* data);
+extern int32_t GFXCreateTextureSet(uint32_t numLayers, uint32_t width, uint32_t height, bool bgr);
+extern void GFXUploadTextureLayer(int32_t texID, uint32_t layer, const uint8_t* data);
+// Replaces a region of an RGBA8 texture made with GFXLoadCustomTexture
+extern void GFXUpdateCustomTexture(int32_t texID, uint32_t x, uint32_t y, uint32_t width, uint32_t height, const void* data);
+// Returns a handle usable as an ImTextureID, or NULL if the texture can't be drawn (e.g. when headless)
+extern void* GFXGetImGuiTexture(int32_t texID);
 extern void GFXDeleteTexture(int32_t texID);
 extern void GFXLoadModelData(uint32_t modelId, void* verts, void* texverts, void* inds, uint32_t numVerts, uint32_t numTexVerts, uint32_t numInds);
 extern void GFXClearModelData(uint32_t modelId);
@@ -43,5 +86,7 @@ extern void GFXBeginLinePipelineState();
 extern void GFXDrawLine(slm::vec3 start, slm::vec3 end, slm::vec4 color, float width);
 
 extern void GFXSetTerrainResources(uint32_t terrainID, int32_t matTexGroupID, int32_t heightMapTexID, int32_t gridMapTexID, int32_t lightmapTexGroupID);
+// Same as GFXSetTerrainResources, but the bind group is made later by GFXWarmupStep (or on first use)
+extern void GFXQueueTerrainResources(uint32_t terrainID, int32_t matTexGroupID, int32_t heightMapTexID, int32_t gridMapTexID, int32_t lightmapTexGroupID);
 extern void GFXBeginTerrainPipelineState(TerrainPipelineState state, uint32_t terrainID, float squareSize, float gridX, float gridY, const slm::vec4* matCoords);
 
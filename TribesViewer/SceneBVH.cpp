@@ -0,0 +1,343 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include "SceneBVH.h"
+
+#include <string.h>
+#include <float.h>
+#include <algorithm>
+#include <chrono>
+
+static inline float halfArea(const slm::vec3& minP, const slm::vec3& maxP)
+{
+   slm::vec3 d = maxP - minP;
+   return (d.x * d.y) + (d.y * d.z) + (d.z * d.x);
+}
+
+static inline slm::vec4 getRow(const slm::mat4& m, uint32_t r)
+{
+   return slm::vec4(m[0][r], m[1][r], m[2][r], m[3][r]);
+}
+
+void SceneBVH::Frustum::set(const slm::mat4& viewProj)
+{
+   slm::vec4 r0 = getRow(viewProj, 0);
+   slm::vec4 r1 = getRow(viewProj, 1);
+   slm::vec4 r2 = getRow(viewProj, 2);
+   slm::vec4 r3 = getRow(viewProj, 3);
+   
+   // NOTE: clip space depth is 0..1
+   planes[0] = r3 + r0; // left
+   planes[1] = r3 - r0; // right
+   planes[2] = r3 + r1; // bottom
+   planes[3] = r3 - r1; // top
+   planes[4] = r2;      // near
+   planes[5] = r3 - r2; // far
+   
+   for (uint32_t i=0; i<6; i++)
+   {
+      float len = slm::length(planes[i].xyz());
+      if (len > 0.0f)
+         planes[i] /= len;
+   }
+}
+
+SceneBVH::Frustum::TestResult SceneBVH::Frustum::testAABB(const slm::vec3& minP, const slm::vec3& maxP) const
+{
+   TestResult result = Inside;
+   
+   for (uint32_t i=0; i<6; i++)
+   {
+      const slm::vec4& plane = planes[i];
+      
+      // Corner furthest along the plane normal, and the one furthest against it
+      slm::vec3 pos(plane.x >= 0.0f ? maxP.x : minP.x,
+                    plane.y >= 0.0f ? maxP.y : minP.y,
+                    plane.z >= 0.0f ? maxP.z : minP.z);
+      slm::vec3 neg(plane.x >= 0.0f ? minP.x : maxP.x,
+                    plane.y >= 0.0f ? minP.y : maxP.y,
+                    plane.z >= 0.0f ? minP.z : maxP.z);
+      
+      if (slm::dot(plane.xyz(), pos) + plane.w < 0.0f)
+         return Outside;
+      
+      if (slm::dot(plane.xyz(), neg) + plane.w < 0.0f)
+         result = Intersects;
+   }
+   
+   return result;
+}
+
+SceneBVH::SceneBVH()
+{
+   memset(&mStats, '\0', sizeof(Stats));
+}
+
+void SceneBVH::clear()
+{
+   mNodes.clear();
+   mItems.clear();
+   mItemMin.clear();
+   mItemMax.clear();
+   memset(&mStats, '\0', sizeof(Stats));
+}
+
+void SceneBVH::build(const slm::vec3* minP, const slm::vec3* maxP, uint32_t numItems)
+{
+   auto buildStart = std::chrono::steady_clock::now();
+   clear();
+   
+   if (numItems == 0)
+      return;
+   
+   mItemMin.assign(minP, minP + numItems);
+   mItemMax.assign(maxP, maxP + numItems);
+   
+   mBuildItems.resize(numItems);
+   for (uint32_t i=0; i<numItems; i++)
+   {
+      BuildItem& item = mBuildItems[i];
+      item.minP = minP[i];
+      item.maxP = maxP[i];
+      item.center = (minP[i] + maxP[i]) * 0.5f;
+      item.index = i;
+   }
+   
+   mNodes.reserve(numItems * 2);
+   mNodes.push_back(Node());
+   buildNode(0, 0, numItems, 1);
+   
+   mItems.resize(numItems);
+   for (uint32_t i=0; i<numItems; i++)
+   {
+      mItems[i] = mBuildItems[i].index;
+   }
+   
+   mBuildItems.clear();
+   mBuildItems.shrink_to_fit();
+   
+   auto buildEnd = std::chrono::steady_clock::now();
+   mStats.numItems = numItems;
+   mStats.numNodes = (uint32_t)mNodes.size();
+   mStats.buildTimeUS = std::chrono::duration<float, std::micro>(buildEnd - buildStart).count();
+}
+
+void SceneBVH::buildNode(uint32_t nodeIdx, uint32_t start, uint32_t end, uint32_t depth)
+{
+   slm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+   slm::vec3 centerMin(FLT_MAX), centerMax(-FLT_MAX);
+   
+   for (uint32_t i=start; i<end; i++)
+   {
+      const BuildItem& item = mBuildItems[i];
+      boundsMin = slm::min(boundsMin, item.minP);
+      boundsMax = slm::max(boundsMax, item.maxP);
+      centerMin = slm::min(centerMin, item.center);
+      centerMax = slm::max(centerMax, item.center);
+   }
+   
+   Node& node = mNodes[nodeIdx];
+   node.minP = boundsMin;
+   node.maxP = boundsMax;
+   node.left = 0;
+   node.first = start;
+   node.count = end - start;
+   mStats.depth = std::max(mStats.depth, depth);
+   
+   if (node.count <= MaxLeafItems || depth >= MaxDepth)
+      return;
+   
+   uint32_t mid = partition(start, end, centerMin, centerMax);
+   
+   // Fall back to splitting the range in half along the widest axis
+   if (mid == start || mid == end)
+   {
+      slm::vec3 extent = centerMax - centerMin;
+      uint32_t axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+      mid = (start + end) / 2;
+      std::nth_element(mBuildItems.begin() + start, mBuildItems.begin() + mid, mBuildItems.begin() + end,
+                       [axis](const BuildItem& a, const BuildItem& b){ return a.center[axis] < b.center[axis]; });
+   }
+   
+   // NOTE: node may be invalidated by adding the children
+   uint32_t left = (uint32_t)mNodes.size();
+   mNodes[nodeIdx].left = left;
+   mNodes.push_back(Node());
+   mNodes.push_back(Node());
+   
+   buildNode(left, start, mid, depth+1);
+   buildNode(left+1, mid, end, depth+1);
+}
+
+// Splits items into bins along the widest axis of their centers, then picks the split between bins
+// with the lowest surface area cost. Returns the first item on the right side.
+uint32_t SceneBVH::partition(uint32_t start, uint32_t end, const slm::vec3& centerMin, const slm::vec3& centerMax)
+{
+   slm::vec3 extent = centerMax - centerMin;
+   uint32_t axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+   
+   if (!(extent[axis] > 0.0f))
+      return start;
+   
+   struct Bin
+   {
+      slm::vec3 minP;
+      slm::vec3 maxP;
+      uint32_t count;
+   };
+   
+   Bin bins[NumBins];
+   for (uint32_t i=0; i<NumBins; i++)
+   {
+      bins[i].minP = slm::vec3(FLT_MAX);
+      bins[i].maxP = slm::vec3(-FLT_MAX);
+      bins[i].count = 0;
+   }
+   
+   const float binScale = (float)NumBins / extent[axis];
+   auto getBin = [&](const BuildItem& item) {
+      uint32_t bin = (uint32_t)((item.center[axis] - centerMin[axis]) * binScale);
+      return std::min(bin, (uint32_t)NumBins-1);
+   };
+   
+   for (uint32_t i=start; i<end; i++)
+   {
+      Bin& bin = bins[getBin(mBuildItems[i])];
+      bin.minP = slm::min(bin.minP, mBuildItems[i].minP);
+      bin.maxP = slm::max(bin.maxP, mBuildItems[i].maxP);
+      bin.count++;
+   }
+   
+   // Sweep from the right to get the cost of everything after each split
+   float rightCost[NumBins];
+   slm::vec3 sweepMin(FLT_MAX), sweepMax(-FLT_MAX);
+   uint32_t sweepCount = 0;
+   
+   for (uint32_t i=NumBins-1; i>0; i--)
+   {
+      if (bins[i].count > 0)
+      {
+         sweepMin = slm::min(sweepMin, bins[i].minP);
+         sweepMax = slm::max(sweepMax, bins[i].maxP);
+         sweepCount += bins[i].count;
+      }
+      rightCost[i] = sweepCount > 0 ? halfArea(sweepMin, sweepMax) * sweepCount : 0.0f;
+   }
+   
+   float bestCost = FLT_MAX;
+   uint32_t bestSplit = 0;
+   sweepMin = slm::vec3(FLT_MAX);
+   sweepMax = slm::vec3(-FLT_MAX);
+   sweepCount = 0;
+   
+   for (uint32_t i=0; i<NumBins-1; i++)
+   {
+      if (bins[i].count > 0)
+      {
+         sweepMin = slm::min(sweepMin, bins[i].minP);
+         sweepMax = slm::max(sweepMax, bins[i].maxP);
+         sweepCount += bins[i].count;
+      }
+      
+      float cost = (sweepCount > 0 ? halfArea(sweepMin, sweepMax) * sweepCount : 0.0f) + rightCost[i+1];
+      if (cost < bestCost)
+      {
+         bestCost = cost;
+         bestSplit = i;
+      }
+   }
+   
+   auto itr = std::partition(mBuildItems.begin() + start, mBuildItems.begin() + end,
+                             [&](const BuildItem& item){ return getBin(item) <= bestSplit; });
+   return (uint32_t)(itr - mBuildItems.begin());
+}
+
+void SceneBVH::query(const Frustum& frustum, std::vector<uint32_t>& outItems)
+{
+   auto queryStart = std::chrono::steady_clock::now();
+   mStats.numVisitedNodes = 0;
+   mStats.numTestedItems = 0;
+   mStats.numVisible = 0;
+   
+   if (mNodes.empty())
+   {
+      mStats.queryTimeUS = 0.0f;
+      return;
+   }
+   
+   const size_t startSize = outItems.size();
+   uint32_t stack[MaxDepth * 2];
+   uint32_t stackSize = 0;
+   stack[stackSize++] = 0;
+   
+   while (stackSize > 0)
+   {
+      const Node& node = mNodes[stack[--stackSize]];
+      mStats.numVisitedNodes++;
+      
+      Frustum::TestResult result = frustum.testAABB(node.minP, node.maxP);
+      if (result == Frustum::Outside)
+         continue;
+      
+      if (result == Frustum::Inside)
+      {
+         outItems.insert(outItems.end(), mItems.begin() + node.first, mItems.begin() + node.first + node.count);
+      }
+      else if (node.left == 0)
+      {
+         for (uint32_t i=node.first; i<node.first+node.count; i++)
+         {
+            uint32_t item = mItems[i];
+            mStats.numTestedItems++;
+            if (frustum.testAABB(mItemMin[item], mItemMax[item]) != Frustum::Outside)
+               outItems.push_back(item);
+         }
+      }
+      else
+      {
+         stack[stackSize++] = node.left + 1;
+         stack[stackSize++] = node.left;
+      }
+   }
+   
+   auto queryEnd = std::chrono::steady_clock::now();
+   mStats.numVisible = (uint32_t)(outItems.size() - startSize);
+   mStats.queryTimeUS = std::chrono::duration<float, std::micro>(queryEnd - queryStart).count();
+}
+
+void SceneBVH::queryLinear(const Frustum& frustum, std::vector<uint32_t>& outItems)
+{
+   auto queryStart = std::chrono::steady_clock::now();
+   const size_t startSize = outItems.size();
+   
+   for (uint32_t i=0, sz=(uint32_t)mItemMin.size(); i<sz; i++)
+   {
+      if (frustum.testAABB(mItemMin[i], mItemMax[i]) != Frustum::Outside)
+         outItems.push_back(i);
+   }
+   
+   auto queryEnd = std::chrono::steady_clock::now();
+   mStats.numVisitedNodes = 0;
+   mStats.numTestedItems = (uint32_t)mItemMin.size();
+   mStats.numVisible = (uint32_t)(outItems.size() - startSize);
+   mStats.queryTimeUS = std::chrono::duration<float, std::micro>(queryEnd - queryStart).count();
+}
@@ -0,0 +1,122 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _SCENEBVH_H_
+#define _SCENEBVH_H_
+
+#include <stdint.h>
+#include <vector>
+#include <slm/slmath.h>
+
+// Bounding volume hierarchy over the world space bounds of every object in a scene.
+//
+// build() sorts items into a binary tree of boxes using a binned surface area heuristic, so items which
+// are clustered together (e.g. a base made of several interiors) end up under the same node. query()
+// walks the tree against a view frustum: nodes outside the frustum are skipped along with everything
+// underneath them, and nodes entirely inside it add all of their items without testing them.
+//
+// Items are referred to by the index they were passed to build() with.
+//
+class SceneBVH
+{
+public:
+   
+   enum
+   {
+      MaxLeafItems = 4,
+      NumBins = 12,
+      MaxDepth = 64
+   };
+   
+   // Every node covers a contiguous range of mItems, so a node inside the frustum can add them all at once
+   struct Node
+   {
+      slm::vec3 minP;
+      slm::vec3 maxP;
+      uint32_t left; // right child follows it; 0 for leaves
+      uint32_t first;
+      uint32_t count;
+   };
+   
+   struct Stats
+   {
+      uint32_t numItems;
+      uint32_t numNodes;
+      uint32_t depth;
+      float buildTimeUS;
+      
+      uint32_t numVisitedNodes;
+      uint32_t numTestedItems;
+      uint32_t numVisible;
+      float queryTimeUS;
+   };
+   
+   // Planes are stored as (normal, distance), with the inside being dot(normal, p) + distance >= 0
+   struct Frustum
+   {
+      enum TestResult
+      {
+         Outside,
+         Intersects,
+         Inside
+      };
+      
+      slm::vec4 planes[6];
+      
+      void set(const slm::mat4& viewProj);
+      TestResult testAABB(const slm::vec3& minP, const slm::vec3& maxP) const;
+   };
+   
+   std::vector<Node> mNodes;
+   std::vector<uint32_t> mItems;
+   std::vector<slm::vec3> mItemMin;
+   std::vector<slm::vec3> mItemMax;
+   Stats mStats;
+   
+   SceneBVH();
+   
+   void clear();
+   void build(const slm::vec3* minP, const slm::vec3* maxP, uint32_t numItems);
+   
+   // Appends the index of every item which intersects the frustum to outItems
+   void query(const Frustum& frustum, std::vector<uint32_t>& outItems);
+   
+   // Same as query, but tests each item in turn. Used to compare against the tree.
+   void queryLinear(const Frustum& frustum, std::vector<uint32_t>& outItems);
+   
+protected:
+   
+   struct BuildItem
+   {
+      slm::vec3 minP;
+      slm::vec3 maxP;
+      slm::vec3 center;
+      uint32_t index;
+   };
+   
+   std::vector<BuildItem> mBuildItems;
+   
+   void buildNode(uint32_t nodeIdx, uint32_t start, uint32_t end, uint32_t depth);
+   uint32_t partition(uint32_t start, uint32_t end, const slm::vec3& centerMin, const slm::vec3& centerMax);
+};
+
+#endif
@@ -0,0 +1,136 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include "SceneFile.h"
+#include "Log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static bool parseObjectType(const char* name, SceneFile::ObjectType& outType)
+{
+   if (strcasecmp(name, "shape") == 0)
+      outType = SceneFile::Object_Shape;
+   else if (strcasecmp(name, "interior") == 0)
+      outType = SceneFile::Object_Interior;
+   else
+      return false;
+   
+   return true;
+}
+
+void SceneFile::clear()
+{
+   mTerrain = "";
+   mPalette = "";
+   mPlacements.clear();
+   mScatters.clear();
+}
+
+bool SceneFile::load(const char* path)
+{
+   FILE* fp = fopen(path, "r");
+   if (fp == NULL)
+   {
+      LOG_ERROR("Couldn't open scene %s", path);
+      return false;
+   }
+   
+   clear();
+   
+   char line[1024];
+   uint32_t lineNum = 0;
+   bool ok = true;
+   
+   while (fgets(line, sizeof(line), fp))
+   {
+      lineNum++;
+      line[strcspn(line, "\r\n")] = '\0';
+      
+      char* start = line + strspn(line, " \t");
+      if (start[0] == '\0' || start[0] == '#')
+         continue;
+      
+      char cmd[64];
+      char name[512];
+      char filename[512];
+      int consumed = 0;
+      
+      if (sscanf(start, "%63s%n", cmd, &consumed) != 1)
+         continue;
+      
+      const char* args = start + consumed;
+      ObjectType type;
+      
+      if (strcasecmp(cmd, "terrain") == 0 && sscanf(args, "%511s", filename) == 1)
+      {
+         mTerrain = filename;
+      }
+      else if (strcasecmp(cmd, "palette") == 0 && sscanf(args, "%511s", filename) == 1)
+      {
+         mPalette = filename;
+      }
+      else if (parseObjectType(cmd, type))
+      {
+         Placement placement;
+         placement.type = type;
+         placement.rotation = 0.0f;
+         
+         if (sscanf(args, "%511s %f %f %f %f", filename, &placement.position.x, &placement.position.y, &placement.position.z, &placement.rotation) < 4)
+         {
+            LOG_ERROR("%s:%u: %s needs a file and position", path, lineNum, cmd);
+            ok = false;
+            break;
+         }
+         
+         placement.filename = filename;
+         mPlacements.push_back(placement);
+      }
+      else if (strcasecmp(cmd, "scatter") == 0)
+      {
+         Scatter scatter;
+         scatter.seed = 1;
+         
+         if (sscanf(args, "%511s %511s %u %u", name, filename, &scatter.count, &scatter.seed) < 3 ||
+             !parseObjectType(name, scatter.type))
+         {
+            LOG_ERROR("%s:%u: scatter needs a type, file and count", path, lineNum);
+            ok = false;
+            break;
+         }
+         
+         scatter.filename = filename;
+         mScatters.push_back(scatter);
+      }
+      else
+      {
+         LOG_ERROR("%s:%u: can't parse %s", path, lineNum, start);
+         ok = false;
+         break;
+      }
+   }
+   
+   fclose(fp);
+   return ok;
+}
@@ -0,0 +1,76 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _SCENEFILE_H_
+#define _SCENEFILE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <slm/slmath.h>
+
+// Layout of a scene combining a terrain grid with placed interiors and shapes.
+//
+// Read from a text file, one entry per line. Positions are in terrain units with z up, rotations are
+// in degrees around z:
+//    terrain <file.dtf>                            terrain grid to place everything on
+//    palette <name>                                palette used for everything in the scene
+//    shape <file.dts> <x> <y> <z> [rot]            placed shape
+//    interior <file.dis> <x> <y> <z> [rot]         placed interior
+//    scatter shape|interior <file> <count> [seed]  count copies placed randomly on the terrain
+//
+class SceneFile
+{
+public:
+   
+   enum ObjectType
+   {
+      Object_Shape,
+      Object_Interior
+   };
+   
+   struct Placement
+   {
+      ObjectType type;
+      std::string filename;
+      slm::vec3 position;
+      float rotation;
+   };
+   
+   struct Scatter
+   {
+      ObjectType type;
+      std::string filename;
+      uint32_t count;
+      uint32_t seed;
+   };
+   
+   std::string mTerrain;
+   std::string mPalette;
+   std::vector<Placement> mPlacements;
+   std::vector<Scatter> mScatters;
+   
+   void clear();
+   bool load(const char* path);
+};
+
+#endif
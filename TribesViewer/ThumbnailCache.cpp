@@ -0,0 +1,514 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include "ThumbnailCache.h"
+#include "ContentHash.h"
+#include "CommonShaderTypes.h"
+#include "RendererHelper.h"
+#include "MemTrack.h"
+#include "Trace.h"
+#include "Log.h"
+
+#include <SDL3/SDL.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+
+// Don't start a thumbnail unless the last frame had at least this much time to spare
+static const float MinSpareMS = 4.0f;
+
+static const char CacheIdent[4] = {'T', 'V', 'T', 'H'};
+
+struct CacheHeader
+{
+   char ident[4];
+   uint32_t version;
+   uint32_t size;
+};
+
+static const size_t PixelBytes = ThumbnailCache::Size * ThumbnailCache::Size * 4;
+
+static std::string makeKey(uint32_t mountIdx, const std::string& filename)
+{
+   return std::to_string(mountIdx) + ":" + filename;
+}
+
+ThumbnailCache::ThumbnailCache() : mIdle(false), mRunning(false), mAtlasTexID(-1), mFrame(0), mNumUploads(0)
+{
+   memset(&mStats, '\0', sizeof(mStats));
+}
+
+ThumbnailCache::~ThumbnailCache()
+{
+   shutdown();
+}
+
+bool ThumbnailCache::init(const char* cacheDir, const std::vector<std::string>& mountNames, ReadFunc readFunc, GeometryFunc geometryFunc)
+{
+   shutdown();
+   
+   std::vector<uint8_t> blank(AtlasSize * AtlasSize * 4, 0);
+   mAtlasTexID = GFXLoadCustomTexture(CustomTexture_RGBA8, AtlasSize, AtlasSize, &blank[0]);
+   if (mAtlasTexID < 0)
+   {
+      LOG_ERROR("Couldn't create thumbnail atlas");
+      return false;
+   }
+   
+   mCacheDir = cacheDir;
+   mMountNames = mountNames;
+   mReadFunc = readFunc;
+   mGeometryFunc = geometryFunc;
+   mSlots.assign(NumSlots, NULL);
+   mDiskCaches.resize(mountNames.size());
+   for (DiskCache& cache : mDiskCaches)
+   {
+      cache.fp = NULL;
+      cache.opened = false;
+   }
+   
+   mRunning = true;
+   mWorker = std::thread(&ThumbnailCache::workerMain, this);
+   return true;
+}
+
+void ThumbnailCache::shutdown()
+{
+   if (mWorker.joinable())
+   {
+      {
+         std::lock_guard<std::mutex> lock(mMutex);
+         mRunning = false;
+      }
+      mWake.notify_all();
+      mWorker.join();
+   }
+   
+   for (DiskCache& cache : mDiskCaches)
+   {
+      if (cache.fp)
+         fclose(cache.fp);
+   }
+   mDiskCaches.clear();
+   
+   for (auto& itr : mEntries)
+   {
+      MemTrack::remove(MemTrack::Category_Assets, itr.second.pixels.size());
+   }
+   mEntries.clear();
+   mQueue.clear();
+   mSlots.clear();
+   
+   if (mAtlasTexID >= 0)
+   {
+      GFXDeleteTexture(mAtlasTexID);
+      mAtlasTexID = -1;
+   }
+}
+
+void ThumbnailCache::beginFrame(float spareMS)
+{
+   mFrame++;
+   mNumUploads = 0;
+   
+   bool idle = spareMS >= MinSpareMS;
+   if (idle != mIdle.exchange(idle) && idle)
+   {
+      mWake.notify_one();
+   }
+}
+
+bool ThumbnailCache::get(uint32_t mountIdx, const char* filename, slm::vec2* outUV0, slm::vec2* outUV1)
+{
+   if (!isRunning())
+      return false;
+   
+   std::string key = makeKey(mountIdx, filename);
+   
+   std::unique_lock<std::mutex> lock(mMutex);
+   
+   auto itr = mEntries.find(key);
+   if (itr == mEntries.end())
+   {
+      Entry& entry = mEntries[key];
+      entry.state = State_Queued;
+      entry.mountIdx = mountIdx;
+      entry.filename = filename;
+      entry.slot = -1;
+      entry.lastUsedFrame = mFrame;
+      
+      // Newest requests are what's on screen now
+      mQueue.push_front(key);
+      while (mQueue.size() > MaxQueued)
+      {
+         auto dropped = mEntries.find(mQueue.back());
+         if (dropped != mEntries.end() && dropped->second.state == State_Queued)
+            mEntries.erase(dropped);
+         mQueue.pop_back();
+      }
+      
+      lock.unlock();
+      mWake.notify_one();
+      return false;
+   }
+   
+   Entry& entry = itr->second;
+   entry.lastUsedFrame = mFrame;
+   
+   if (entry.state == State_Ready && mNumUploads < MaxUploadsPerFrame)
+   {
+      int32_t slot = allocSlot();
+      if (slot >= 0)
+      {
+         GFXUpdateCustomTexture(mAtlasTexID, (slot % AtlasStride) * Size, (slot / AtlasStride) * Size, Size, Size, &entry.pixels[0]);
+         mNumUploads++;
+         
+         std::vector<uint8_t> empty;
+         setPixels(entry, empty);
+         entry.slot = slot;
+         entry.state = State_Resident;
+         mSlots[slot] = &entry;
+      }
+   }
+   
+   if (entry.state != State_Resident)
+      return false;
+   
+   const float texelSize = (float)Size / (float)AtlasSize;
+   *outUV0 = slm::vec2((entry.slot % AtlasStride) * texelSize, (entry.slot / AtlasStride) * texelSize);
+   *outUV1 = *outUV0 + slm::vec2(texelSize, texelSize);
+   return true;
+}
+
+void ThumbnailCache::cancelPending()
+{
+   std::lock_guard<std::mutex> lock(mMutex);
+   
+   for (const std::string& key : mQueue)
+   {
+      auto itr = mEntries.find(key);
+      if (itr != mEntries.end() && itr->second.state == State_Queued)
+         mEntries.erase(itr);
+   }
+   mQueue.clear();
+}
+
+void* ThumbnailCache::getTexture() const
+{
+   return mAtlasTexID >= 0 ? GFXGetImGuiTexture(mAtlasTexID) : NULL;
+}
+
+void ThumbnailCache::getStats(Stats* outStats)
+{
+   std::lock_guard<std::mutex> lock(mMutex);
+   *outStats = mStats;
+   outStats->numQueued = (uint32_t)mQueue.size();
+   outStats->numResident = 0;
+   for (Entry* entry : mSlots)
+   {
+      if (entry)
+         outStats->numResident++;
+   }
+}
+
+// Must be called with mMutex held
+int32_t ThumbnailCache::allocSlot()
+{
+   int32_t best = -1;
+   uint32_t bestFrame = mFrame;
+   
+   for (int32_t i=0; i<NumSlots; i++)
+   {
+      Entry* entry = mSlots[i];
+      if (entry == NULL)
+         return i;
+      
+      // Don't evict anything drawn this frame
+      if (entry->lastUsedFrame < bestFrame)
+      {
+         best = i;
+         bestFrame = entry->lastUsedFrame;
+      }
+   }
+   
+   if (best >= 0)
+   {
+      // Evicted thumbnails are reloaded (usually from the disk cache) if they're needed again
+      Entry* evicted = mSlots[best];
+      mSlots[best] = NULL;
+      mEntries.erase(makeKey(evicted->mountIdx, evicted->filename));
+   }
+   
+   return best;
+}
+
+// Must be called with mMutex held
+void ThumbnailCache::setPixels(Entry& entry, std::vector<uint8_t>& pixels)
+{
+   MemTrack::remove(MemTrack::Category_Assets, entry.pixels.size());
+   entry.pixels.swap(pixels);
+   entry.pixels.shrink_to_fit();
+   MemTrack::add(MemTrack::Category_Assets, entry.pixels.size());
+}
+
+void ThumbnailCache::workerMain()
+{
+   Trace::setThreadName("Thumbnails");
+   
+   // Thumbnails are only a convenience, so keep out of the way of loading and rendering
+   if (!SDL_SetCurrentThreadPriority(SDL_THREAD_PRIORITY_LOW))
+      LOG_DEBUG("Couldn't lower thumbnail worker priority: %s", SDL_GetError());
+   
+   std::unique_lock<std::mutex> lock(mMutex);
+   
+   while (true)
+   {
+      mWake.wait(lock, [this]{ return !mRunning || (mIdle && !mQueue.empty()); });
+      if (!mRunning)
+         break;
+      
+      std::string key = mQueue.front();
+      mQueue.pop_front();
+      
+      auto itr = mEntries.find(key);
+      if (itr == mEntries.end() || itr->second.state != State_Queued)
+         continue;
+      
+      itr->second.state = State_Working;
+      uint32_t mountIdx = itr->second.mountIdx;
+      std::string filename = itr->second.filename;
+      
+      lock.unlock();
+      std::vector<uint8_t> pixels;
+      bool ok = processEntry(mountIdx, filename, pixels);
+      lock.lock();
+      
+      // Working entries are never removed by the main thread
+      Entry& entry = mEntries[key];
+      if (ok)
+      {
+         setPixels(entry, pixels);
+         entry.state = State_Ready;
+      }
+      else
+      {
+         entry.state = State_Failed;
+         mStats.numFailed++;
+      }
+   }
+}
+
+bool ThumbnailCache::processEntry(uint32_t mountIdx, const std::string& filename, std::vector<uint8_t>& outPixels)
+{
+   TRACE_ZONE_DETAIL("ThumbnailCache::processEntry", filename.c_str());
+   
+   std::vector<uint8_t> data;
+   if (mountIdx >= mMountNames.size() || !mReadFunc(mountIdx, filename, data))
+      return false;
+   
+   uint64_t hash = ContentHash::hash(data.empty() ? NULL : &data[0], data.size());
+   outPixels.resize(PixelBytes);
+   
+   DiskCache& cache = openDiskCache(mountIdx);
+   auto itr = cache.offsets.find(hash);
+   if (itr != cache.offsets.end())
+   {
+      fseek(cache.fp, itr->second, SEEK_SET);
+      if (fread(&outPixels[0], PixelBytes, 1, cache.fp) == 1)
+      {
+         std::lock_guard<std::mutex> lock(mMutex);
+         mStats.numDiskHits++;
+         return true;
+      }
+   }
+   
+   std::vector<slm::vec3> tris;
+   if (!mGeometryFunc(data, tris))
+      return false;
+   
+   rasterize(tris, &outPixels[0]);
+   
+   {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mStats.numRendered++;
+   }
+   
+   if (cache.fp)
+   {
+      // Records are appended; the file is opened in append mode
+      fseek(cache.fp, 0, SEEK_END);
+      long offset = ftell(cache.fp) + sizeof(hash);
+      if (fwrite(&hash, sizeof(hash), 1, cache.fp) == 1 && fwrite(&outPixels[0], PixelBytes, 1, cache.fp) == 1)
+      {
+         fflush(cache.fp);
+         cache.offsets[hash] = offset;
+      }
+   }
+   
+   return true;
+}
+
+ThumbnailCache::DiskCache& ThumbnailCache::openDiskCache(uint32_t mountIdx)
+{
+   DiskCache& cache = mDiskCaches[mountIdx];
+   if (cache.opened)
+      return cache;
+   
+   cache.opened = true;
+   
+   char path[4096];
+   snprintf(path, sizeof(path), "%s/%016llx.thumbs", mCacheDir.c_str(), (unsigned long long)ContentHash::hashString(mMountNames[mountIdx].c_str()));
+   
+   cache.fp = fopen(path, "a+b");
+   if (cache.fp == NULL)
+   {
+      LOG_WARN("Couldn't open thumbnail cache %s", path);
+      return cache;
+   }
+   
+   CacheHeader header;
+   fseek(cache.fp, 0, SEEK_SET);
+   bool valid = fread(&header, sizeof(header), 1, cache.fp) == 1 &&
+                memcmp(header.ident, CacheIdent, sizeof(CacheIdent)) == 0 &&
+                header.version == CacheVersion && header.size == Size;
+   
+   if (!valid)
+   {
+      // Start again with an empty cache
+      fclose(cache.fp);
+      cache.fp = fopen(path, "w+b");
+      if (cache.fp == NULL)
+         return cache;
+      
+      memcpy(header.ident, CacheIdent, sizeof(CacheIdent));
+      header.version = CacheVersion;
+      header.size = Size;
+      fwrite(&header, sizeof(header), 1, cache.fp);
+      fflush(cache.fp);
+      fclose(cache.fp);
+      cache.fp = fopen(path, "a+b");
+      return cache;
+   }
+   
+   // Index the records; a partially written record at the end is ignored
+   uint64_t hash = 0;
+   while (fread(&hash, sizeof(hash), 1, cache.fp) == 1)
+   {
+      long offset = ftell(cache.fp);
+      if (fseek(cache.fp, PixelBytes, SEEK_CUR) != 0 || ftell(cache.fp) - offset != (long)PixelBytes)
+         break;
+      cache.offsets[hash] = offset;
+   }
+   
+   LOG_DEBUG("Thumbnail cache %s has %u entries", path, (uint32_t)cache.offsets.size());
+   return cache;
+}
+
+void ThumbnailCache::rasterize(const std::vector<slm::vec3>& tris, uint8_t* outPixels)
+{
+   memset(outPixels, '\0', PixelBytes);
+   
+   const size_t numPoints = tris.size() - (tris.size() % 3);
+   if (numPoints == 0)
+      return;
+   
+   // Three quarter view from the front, looking down -z
+   const slm::mat4 view = slm::rotation_x(slm::radians(20.0f)) * slm::rotation_y(slm::radians(150.0f));
+   
+   std::vector<slm::vec3> points(numPoints);
+   slm::vec3 minP(FLT_MAX);
+   slm::vec3 maxP(-FLT_MAX);
+   for (size_t i=0; i<numPoints; i++)
+   {
+      points[i] = (view * slm::vec4(tris[i], 1)).xyz();
+      minP = slm::min(minP, points[i]);
+      maxP = slm::max(maxP, points[i]);
+   }
+   
+   // Fit to the image, leaving a small border
+   const float imageSize = (float)Size;
+   const float border = 2.0f;
+   float extent = std::max(maxP.x - minP.x, maxP.y - minP.y);
+   float scale = extent > 0.0f ? (imageSize - (border * 2)) / extent : 1.0f;
+   slm::vec3 center = (minP + maxP) * 0.5f;
+   
+   for (slm::vec3& p : points)
+   {
+      p.x = ((p.x - center.x) * scale) + (imageSize * 0.5f);
+      p.y = (imageSize * 0.5f) - ((p.y - center.y) * scale);
+   }
+   
+   std::vector<float> depth(Size * Size, -FLT_MAX);
+   const slm::vec3 lightDir = slm::normalize(slm::vec3(0.4f, 0.6f, 0.7f));
+   
+   for (size_t t=0; t<numPoints; t+=3)
+   {
+      const slm::vec3& a = points[t];
+      const slm::vec3& b = points[t+1];
+      const slm::vec3& c = points[t+2];
+      
+      float area = ((b.x - a.x) * (c.y - a.y)) - ((b.y - a.y) * (c.x - a.x));
+      if (fabsf(area) < 1e-6f)
+         continue;
+      
+      // Winding isn't consistent across shapes, so light both sides
+      slm::vec3 normal = slm::cross(b - a, c - a);
+      float len = slm::length(normal);
+      float lit = len > 0.0f ? fabsf(slm::dot(normal / len, lightDir)) : 0.0f;
+      uint8_t shade = (uint8_t)(255.0f * (0.3f + (0.7f * lit)));
+      
+      int32_t minX = std::max(0, (int32_t)floorf(std::min(a.x, std::min(b.x, c.x))));
+      int32_t maxX = std::min((int32_t)Size - 1, (int32_t)ceilf(std::max(a.x, std::max(b.x, c.x))));
+      int32_t minY = std::max(0, (int32_t)floorf(std::min(a.y, std::min(b.y, c.y))));
+      int32_t maxY = std::min((int32_t)Size - 1, (int32_t)ceilf(std::max(a.y, std::max(b.y, c.y))));
+      
+      float invArea = 1.0f / area;
+      
+      for (int32_t y=minY; y<=maxY; y++)
+      {
+         for (int32_t x=minX; x<=maxX; x++)
+         {
+            float px = x + 0.5f;
+            float py = y + 0.5f;
+            float w0 = (((c.x - b.x) * (py - b.y)) - ((c.y - b.y) * (px - b.x))) * invArea;
+            float w1 = (((a.x - c.x) * (py - c.y)) - ((a.y - c.y) * (px - c.x))) * invArea;
+            float w2 = 1.0f - w0 - w1;
+            if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+               continue;
+            
+            // Larger z is nearer the viewer
+            float z = (a.z * w0) + (b.z * w1) + (c.z * w2);
+            float& dest = depth[(y * Size) + x];
+            if (z <= dest)
+               continue;
+            dest = z;
+            
+            uint8_t* pixel = outPixels + (((y * Size) + x) * 4);
+            pixel[0] = shade;
+            pixel[1] = shade;
+            pixel[2] = (uint8_t)std::min(255, shade + 24);
+            pixel[3] = 255;
+         }
+      }
+   }
+}
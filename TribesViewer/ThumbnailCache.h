@@ -0,0 +1,164 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _THUMBNAILCACHE_H_
+#define _THUMBNAILCACHE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <slm/slmath.h>
+
+// Preview thumbnails for the file browser.
+//
+// Thumbnails are requested by the browser for the files it is currently showing. Requests are handled most
+// recent first by a low priority worker, which only starts new work while the main thread reports idle time
+// at the end of its frames. The worker reads the file, looks its content hash up in an on-disk cache (one
+// packed file per mount), and otherwise software renders the geometry supplied by the caller and appends it
+// to the cache.
+//
+// Finished thumbnails are uploaded a few per frame into a shared atlas texture, and only when they are
+// asked for again, so anything scrolled past before it finished never reaches the GPU. Atlas slots are
+// recycled least recently used first.
+//
+class ThumbnailCache
+{
+public:
+   
+   enum
+   {
+      Size = 64,                 // thumbnail width and height
+      AtlasSize = 1024,
+      AtlasStride = AtlasSize / Size,
+      NumSlots = AtlasStride * AtlasStride,
+      MaxUploadsPerFrame = 4,
+      MaxQueued = 256,           // older requests are dropped beyond this
+      CacheVersion = 1
+   };
+   
+   // Called on the worker thread. Reads the whole file from the given mount.
+   typedef std::function<bool(uint32_t mountIdx, const std::string& filename, std::vector<uint8_t>& outData)> ReadFunc;
+   
+   // Called on the worker thread. Returns a triangle list (3 points per triangle, y up) to render.
+   typedef std::function<bool(const std::vector<uint8_t>& data, std::vector<slm::vec3>& outTris)> GeometryFunc;
+   
+   struct Stats
+   {
+      uint32_t numQueued;
+      uint32_t numResident;
+      uint32_t numRendered;
+      uint32_t numDiskHits;
+      uint32_t numFailed;
+   };
+   
+   ThumbnailCache();
+   ~ThumbnailCache();
+   
+   bool init(const char* cacheDir, const std::vector<std::string>& mountNames, ReadFunc readFunc, GeometryFunc geometryFunc);
+   void shutdown();
+   bool isRunning() const { return mWorker.joinable(); }
+   
+   // Call once per frame with how long the main thread was idle last frame.
+   void beginFrame(float spareMS);
+   
+   // Returns true with the atlas coordinates if the thumbnail is ready to draw, otherwise queues it.
+   bool get(uint32_t mountIdx, const char* filename, slm::vec2* outUV0, slm::vec2* outUV1);
+   
+   // Drops any queued (not yet started) requests, e.g. when the browser changes folder.
+   void cancelPending();
+   
+   // ImTextureID for the atlas, or NULL if it can't be drawn
+   void* getTexture() const;
+   
+   void getStats(Stats* outStats);
+   
+   // Renders triangles to an RGBA8 image of Size x Size, fitted to the view. Transparent where nothing is drawn.
+   static void rasterize(const std::vector<slm::vec3>& tris, uint8_t* outPixels);
+   
+protected:
+   
+   enum State
+   {
+      State_Queued,
+      State_Working,
+      State_Ready,    // has pixels, waiting to be uploaded
+      State_Resident, // in the atlas
+      State_Failed
+   };
+   
+   struct Entry
+   {
+      State state;
+      uint32_t mountIdx;
+      std::string filename;
+      std::vector<uint8_t> pixels;
+      int32_t slot;
+      uint32_t lastUsedFrame;
+   };
+   
+   struct DiskCache
+   {
+      FILE* fp;
+      bool opened;
+      std::unordered_map<uint64_t, long> offsets; // content hash -> pixel data
+   };
+   
+   void workerMain();
+   bool processEntry(uint32_t mountIdx, const std::string& filename, std::vector<uint8_t>& outPixels);
+   DiskCache& openDiskCache(uint32_t mountIdx);
+   int32_t allocSlot();
+   void setPixels(Entry& entry, std::vector<uint8_t>& pixels);
+   
+   std::string mCacheDir;
+   std::vector<std::string> mMountNames;
+   ReadFunc mReadFunc;
+   GeometryFunc mGeometryFunc;
+   
+   // Shared with the worker
+   std::mutex mMutex;
+   std::condition_variable mWake;
+   std::unordered_map<std::string, Entry> mEntries;
+   std::deque<std::string> mQueue;
+   std::atomic<bool> mIdle;
+   bool mRunning;
+   Stats mStats;
+   
+   // Worker only
+   std::thread mWorker;
+   std::vector<DiskCache> mDiskCaches;
+   
+   // Main thread only
+   int32_t mAtlasTexID;
+   std::vector<Entry*> mSlots;
+   uint32_t mFrame;
+   uint32_t mNumUploads;
+};
+
+#endif
@@ -0,0 +1,177 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#include "Trace.h"
+#include "Log.h"
+
+#include <stdio.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+struct TraceEvent
+{
+   const char* name;
+   std::string detail;
+   uint32_t threadID;
+   int64_t startUS;
+   int64_t durationUS;
+};
+
+struct TraceThreadName
+{
+   uint32_t threadID;
+   std::string name;
+};
+
+std::atomic<bool> Trace::smEnabled(false);
+
+static std::mutex sTraceMutex;
+static std::vector<TraceEvent> sTraceEvents;
+static std::vector<TraceThreadName> sTraceThreadNames;
+static std::string sTracePath;
+static std::chrono::steady_clock::time_point sTraceStart;
+static std::atomic<uint32_t> sNextThreadID(1);
+
+static uint32_t getTraceThreadID()
+{
+   thread_local uint32_t threadID = sNextThreadID.fetch_add(1);
+   return threadID;
+}
+
+static void writeJSONString(FILE* fp, const char* str)
+{
+   fputc('"', fp);
+   for (const char* c = str; *c; c++)
+   {
+      if (*c == '"' || *c == '\\')
+         fprintf(fp, "\\%c", *c);
+      else if ((uint8_t)*c < 0x20)
+         fprintf(fp, "\\u%04x", (uint8_t)*c);
+      else
+         fputc(*c, fp);
+   }
+   fputc('"', fp);
+}
+
+bool Trace::open(const char* path)
+{
+   FILE* fp = fopen(path, "w");
+   if (fp == NULL)
+   {
+      LOG_ERROR("Couldn't open trace file %s", path);
+      return false;
+   }
+   fclose(fp);
+   
+   {
+      // Zones still running on other threads may be adding events
+      std::lock_guard<std::mutex> lock(sTraceMutex);
+      sTracePath = path;
+      sTraceStart = std::chrono::steady_clock::now();
+      sTraceEvents.clear();
+      sTraceEvents.reserve(4096);
+   }
+   smEnabled.store(true, std::memory_order_release);
+   return true;
+}
+
+void Trace::close()
+{
+   if (!smEnabled.exchange(false))
+      return;
+   
+   std::lock_guard<std::mutex> lock(sTraceMutex);
+   
+   FILE* fp = fopen(sTracePath.c_str(), "w");
+   if (fp == NULL)
+   {
+      LOG_ERROR("Couldn't write trace to %s", sTracePath.c_str());
+      return;
+   }
+   
+   fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+   
+   bool first = true;
+   for (TraceThreadName& thread : sTraceThreadNames)
+   {
+      fprintf(fp, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": ", first ? "" : ",\n", thread.threadID);
+      writeJSONString(fp, thread.name.c_str());
+      fprintf(fp, "}}");
+      first = false;
+   }
+   
+   for (TraceEvent& evt : sTraceEvents)
+   {
+      fprintf(fp, "%s{\"name\": ", first ? "" : ",\n");
+      writeJSONString(fp, evt.name);
+      fprintf(fp, ", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %lld, \"dur\": %lld", evt.threadID, (long long)evt.startUS, (long long)evt.durationUS);
+      if (!evt.detail.empty())
+      {
+         fprintf(fp, ", \"args\": {\"detail\": ");
+         writeJSONString(fp, evt.detail.c_str());
+         fprintf(fp, "}");
+      }
+      fprintf(fp, "}");
+      first = false;
+   }
+   
+   fprintf(fp, "\n]}\n");
+   fclose(fp);
+   
+   LOG_INFO("Wrote %u trace events to %s", (uint32_t)sTraceEvents.size(), sTracePath.c_str());
+   sTraceEvents.clear();
+}
+
+void Trace::setThreadName(const char* name)
+{
+   uint32_t threadID = getTraceThreadID();
+   std::lock_guard<std::mutex> lock(sTraceMutex);
+   
+   for (TraceThreadName& thread : sTraceThreadNames)
+   {
+      if (thread.threadID == threadID)
+      {
+         thread.name = name;
+         return;
+      }
+   }
+   
+   TraceThreadName thread = {threadID, name};
+   sTraceThreadNames.push_back(thread);
+}
+
+void Trace::addEvent(const char* name, const std::string& detail, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+   if (!smEnabled.load(std::memory_order_acquire))
+      return;
+   
+   TraceEvent evt;
+   evt.name = name;
+   evt.detail = detail;
+   evt.threadID = getTraceThreadID();
+   evt.durationUS = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+   
+   std::lock_guard<std::mutex> lock(sTraceMutex);
+   evt.startUS = std::chrono::duration_cast<std::chrono::microseconds>(start - sTraceStart).count();
+   sTraceEvents.push_back(evt);
+}
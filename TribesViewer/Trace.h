@@ -0,0 +1,88 @@
+//-----------------------------------------------------------------------------
+// Copyright (c) 2018-2024 James S Urquhart.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//-----------------------------------------------------------------------------
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+// Chrome trace-event output (load the file in Perfetto or chrome://tracing).
+//
+// TRACE_ZONE marks a scope as a complete ("X") event tagged with the calling thread, so work done on
+// several threads shows up on separate tracks. Nothing is recorded until open() is called; when tracing is
+// off a zone costs a single relaxed atomic load. Events are buffered in memory and written out by close().
+//
+// Zone names must be string literals (or otherwise outlive the trace).
+//
+class Trace
+{
+public:
+   
+   class Zone
+   {
+   public:
+      const char* mName;
+      std::string mDetail;
+      std::chrono::steady_clock::time_point mStart;
+      bool mActive;
+      
+      Zone(const char* name, const char* detail=NULL) : mName(name), mActive(smEnabled.load(std::memory_order_relaxed))
+      {
+         if (!mActive)
+            return;
+         if (detail)
+            mDetail = detail;
+         mStart = std::chrono::steady_clock::now();
+      }
+      
+      ~Zone()
+      {
+         if (mActive)
+            Trace::addEvent(mName, mDetail, mStart, std::chrono::steady_clock::now());
+      }
+   };
+   
+   // Starts recording; events are written to path on close()
+   static bool open(const char* path);
+   static void close();
+   
+   static void setThreadName(const char* name);
+   static void addEvent(const char* name, const std::string& detail, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+   
+   static inline bool isEnabled() { return smEnabled.load(std::memory_order_relaxed); }
+   
+protected:
+   
+   // Set by open/close while zones may be running on other threads. The zone test only needs a relaxed load;
+   // addEvent re-checks with acquire before touching the state open() set up.
+   static std::atomic<bool> smEnabled;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_ZONE(name) Trace::Zone TRACE_CONCAT(traceZone, __LINE__)(name)
+#define TRACE_ZONE_DETAIL(name, detail) Trace::Zone TRACE_CONCAT(traceZone, __LINE__)(name, detail)
+
+#endif
@@ -43,6 +43,9 @@
 #include "terrainShader.wgsl.h"
 
 #include "RendererHelper.h"
+#include "Trace.h"
+#include "MemTrack.h"
+#include "Log.h"
 
 
 extern "C"
@@ -181,6 +184,9 @@ struct SDLState
       WGPUTextureView textureView;
       WGPUBindGroup texBindGroup;
       uint32_t dims[3];
+      uint64_t gpuBytes; // as uploaded (includes row padding)
+      bool cpuOnly; // headless placeholder, has no gpu objects
+      bool wantsBindGroup; // drawn with the model pipelines; texBindGroup is made by GFXWarmupStep or on first use
    };
    
    std::vector<FrameModel> models;
@@ -243,19 +249,29 @@ struct SDLState
    
    struct TerrainGPUResource
    {
-      uint32_t mMatListTexID;
-      uint32_t mHeightMapTexID;
-      uint32_t mGridMapTexID;
-      uint32_t mLightMapTexID;
+      int32_t mMatListTexID;
+      int32_t mHeightMapTexID;
+      int32_t mGridMapTexID;
+      int32_t mLightMapTexID;
       WGPUBindGroup mBindGroup;
    };
    
    std::vector<TerrainGPUResource> terrainResources;
    
+   // Bind groups still to be made ahead of their first draw (see GFXWarmupStep)
+   std::vector<int32_t> pendingTexGroups;
+   std::vector<uint32_t> pendingTerrainGroups;
+   
+   // Counters
+   GFXFrameStats frameStats;
+   GFXFrameStats lastFrameStats;
+   uint64_t bufferHighWaterBytes;
+   
    int32_t backingSize[2];
    float backingScale;
    
    GpuInitState gpuInitState; // surface ->
+   bool headless; // no device; frames only run imgui and count commands
    
    // Util funcs (mainly webgpu related)
    
@@ -279,6 +295,18 @@ struct SDLState
    WGPUBindGroup makeSimpleTextureBG(WGPUTextureView tex, WGPUSampler sampler);
    WGPUBindGroup makeTerrainTextureBG(WGPUTextureView squareMatTex, WGPUTextureView heightmapTex, WGPUTextureView mapTex, WGPUTextureView lmTex, WGPUSampler samplerPixel, WGPUSampler samplerLinear);
    WGPURenderPassDescriptor createRenderPass(bool secondary);
+   
+   WGPUBindGroup getTextureBG(int32_t texID);
+   bool buildTerrainBG(TerrainGPUResource& res, int32_t matTexListID, int32_t heightMapTexID, int32_t gridMapTexID, int32_t lightmapTexID);
+   
+   // Counted wrappers for per-frame commands
+   void setPipeline(WGPURenderPipeline pipeline);
+   void setBindGroup(uint32_t groupIndex, WGPUBindGroup group, size_t numOffsets, const uint32_t* offsets);
+   void writeBuffer(WGPUBuffer buffer, uint64_t offset, const void* data, size_t size);
+   void writeTexture(const WGPUImageCopyTexture* dest, const void* data, size_t size, const WGPUTextureDataLayout* layout, const WGPUExtent3D* extent);
+   void updateFrameStats();
+   
+   int32_t addHeadlessTexture(uint32_t width, uint32_t height, uint32_t depth);
 };
 
 
@@ -607,11 +635,13 @@ ModelProgramInfo buildModelProgram()
             break;
             
          case ModelPipeline_DefaultDiffuse:
+         case ModelPipeline_DepthOnly:
          default:
             break;
       };
       
-      colorTargetState.writeMask = WGPUColorWriteMask_All;
+      // Depth prepass only needs the depth buffer
+      colorTargetState.writeMask = state == ModelPipeline_DepthOnly ? WGPUColorWriteMask_None : WGPUColorWriteMask_All;
       
       fragmentState.targets = &colorTargetState;
       
@@ -632,7 +662,7 @@ ModelProgramInfo buildModelProgram()
       WGPUDepthStencilState depthStencilState = {};
       depthStencilState.format = WGPUTextureFormat_Depth32Float;      // Depth format
       depthStencilState.depthWriteEnabled = true;                    // Enable depth writing
-      depthStencilState.depthCompare = WGPUCompareFunction_Less;     // Use less-than comparison for depth testing
+      depthStencilState.depthCompare = WGPUCompareFunction_LessEqual; // Less-equal so prims pass again after the depth prepass
       depthStencilState.stencilFront.compare = WGPUCompareFunction_Always;
       depthStencilState.stencilFront.failOp = WGPUStencilOperation_Keep;
       depthStencilState.stencilFront.depthFailOp = WGPUStencilOperation_Keep;
@@ -697,7 +727,7 @@ int GFXSetup(SDL_Window* window, SDL_Renderer* renderer)
    {
       if (!smState.initWGPUSurface())
       {
-         printf("Problem init'ing WGPU");
+         LOG_ERROR("Problem init'ing WGPU");
          return -1;
       }
    }
@@ -896,6 +926,34 @@ int GFXSetup(SDL_Window* window, SDL_Renderer* renderer)
    return 0;
 }
 
+int GFXSetupHeadless(uint32_t width, uint32_t height)
+{
+   smState.headless = true;
+   smState.window = NULL;
+   smState.renderer = NULL;
+   smState.viewportSize = slm::vec2(width, height);
+   
+   // Init gui; there is no platform or renderer backend so we drive the io state ourselves
+   IMGUI_CHECKVERSION();
+   ImGui::CreateContext();
+   ImGuiIO& io = ImGui::GetIO();
+   io.IniFilename = NULL;
+   io.DisplaySize = ImVec2((float)width, (float)height);
+   
+   unsigned char* pixels = NULL;
+   int fontW, fontH;
+   io.Fonts->GetTexDataAsRGBA32(&pixels, &fontW, &fontH);
+   
+   ImGui::StyleColorsDark();
+   
+   return 0;
+}
+
+bool GFXIsHeadless()
+{
+   return smState.headless;
+}
+
 SDLState::SDLState()
 {
    modelCommonSampler = NULL;
@@ -933,12 +991,17 @@ SDLState::SDLState()
    depthTextureView = NULL;
    depthStencilFormat = WGPUTextureFormat_Undefined;
    
+   frameStats = {};
+   lastFrameStats = {};
+   bufferHighWaterBytes = 0;
+   
    // Frame state
    renderEncoder = NULL;
    commandEncoder = NULL;
    currentPipeline = NULL;
    
    gpuInitState = (GpuInitState)0;
+   headless = false;
 }
 
 
@@ -1110,8 +1173,8 @@ bool SDLState::initWGPUSwapchain()
    
    backingScale = (float)backingSize[0] / (float)windowSize[0];
    
-   printf("WebGPU SwapChain configured backingSize=(%u,%u), windowSize=(%u,%u)\n",
-          backingSize[0], backingSize[1], windowSize[0], windowSize[1]);
+   LOG_INFO("WebGPU SwapChain configured backingSize=(%u,%u), windowSize=(%u,%u)",
+            backingSize[0], backingSize[1], windowSize[0], windowSize[1]);
    
    // Configure surface
    gpuSurfaceConfig = {};
@@ -1151,7 +1214,7 @@ bool SDLState::initWGPUSwapchain()
 
 void GFXResetSwapChain()
 {
-   if (smState.depthTextureView == NULL)
+   if (smState.headless || smState.depthTextureView == NULL)
       return;
    
    smState.resetWGPUSwapChain();
@@ -1179,6 +1242,8 @@ void SDLState::resetWGPUSwapChain()
 void SDLState::resetWGPUState()
 {
    resetWGPUSwapChain();
+   pendingTexGroups.clear();
+   pendingTerrainGroups.clear();
    
    lineProgram.reset();
    modelProgram.reset();
@@ -1199,6 +1264,7 @@ void SDLState::resetWGPUState()
    for (auto& itr : buffers)
    {
       wgpuBufferRelease(itr.buffer);
+      MemTrack::remove(MemTrack::Category_GPU, itr.size);
    }
    
    if (gpuDevice)
@@ -1371,6 +1437,7 @@ SDLState::BufferRef SDLState::allocBuffer(size_t size, uint32_t flags, uint16_t
    newAlloc.size = bufferDesc.size;
    newAlloc.buffer = wgpuDeviceCreateBuffer(smState.gpuDevice, &bufferDesc);
    buffers.push_back(newAlloc);
+   MemTrack::add(MemTrack::Category_GPU, newAlloc.size);
    
    return allocBuffer(size, flags, alignment);
 }
@@ -1383,6 +1450,94 @@ void SDLState::resetBufferAllocs()
    }
 }
 
+void SDLState::setPipeline(WGPURenderPipeline pipeline)
+{
+   frameStats.numPipelineSets++;
+   if (headless)
+      return;
+   wgpuRenderPassEncoderSetPipeline(renderEncoder, pipeline);
+}
+
+void SDLState::setBindGroup(uint32_t groupIndex, WGPUBindGroup group, size_t numOffsets, const uint32_t* offsets)
+{
+   frameStats.numBindGroupSets++;
+   if (headless)
+      return;
+   wgpuRenderPassEncoderSetBindGroup(renderEncoder, groupIndex, group, numOffsets, offsets);
+}
+
+void SDLState::writeBuffer(WGPUBuffer buffer, uint64_t offset, const void* data, size_t size)
+{
+   wgpuQueueWriteBuffer(gpuQueue, buffer, offset, data, size);
+   frameStats.numBufferWrites++;
+   frameStats.bufferWriteBytes += size;
+}
+
+void SDLState::writeTexture(const WGPUImageCopyTexture* dest, const void* data, size_t size, const WGPUTextureDataLayout* layout, const WGPUExtent3D* extent)
+{
+   wgpuQueueWriteTexture(gpuQueue, dest, data, size, layout, extent);
+   frameStats.numTextureUploads++;
+   frameStats.textureUploadBytes += size;
+}
+
+// Registers a texture slot which only records its dimensions (see GFXSetupHeadless)
+int32_t SDLState::addHeadlessTexture(uint32_t width, uint32_t height, uint32_t depth)
+{
+   SDLState::TexInfo newInfo = {};
+   newInfo.dims[0] = width;
+   newInfo.dims[1] = height;
+   newInfo.dims[2] = depth;
+   newInfo.cpuOnly = true;
+   
+   int sz = textures.size();
+   for (int i = 0; i < sz; i++)
+   {
+      if (textures[i].texture == NULL && !textures[i].cpuOnly)
+      {
+         textures[i] = newInfo;
+         return i;
+      }
+   }
+   
+   textures.push_back(newInfo);
+   return (uint32_t)(textures.size() - 1);
+}
+
+// Snapshots the counters into lastFrameStats; must be called before resetBufferAllocs
+void SDLState::updateFrameStats()
+{
+   uint64_t capacity = 0;
+   uint64_t used = 0;
+   for (SDLState::BufferAlloc& alloc : buffers)
+   {
+      capacity += alloc.size;
+      used += alloc.head;
+   }
+   bufferHighWaterBytes = std::max(bufferHighWaterBytes, used);
+   
+   frameStats.numBufferAllocs = (uint32_t)buffers.size();
+   frameStats.bufferCapacityBytes = capacity;
+   frameStats.bufferUsedBytes = used;
+   frameStats.bufferHighWaterBytes = bufferHighWaterBytes;
+   
+   frameStats.numLiveTextures = 0;
+   for (SDLState::TexInfo& info : textures)
+   {
+      if (info.texture != NULL || info.cpuOnly)
+         frameStats.numLiveTextures++;
+   }
+   
+   frameStats.numLiveModels = 0;
+   for (SDLState::FrameModel& model : models)
+   {
+      if (model.vertData != NULL)
+         frameStats.numLiveModels++;
+   }
+   
+   lastFrameStats = frameStats;
+   frameStats = {};
+}
+
 void SDLState::beginRenderPass(bool secondary)
 {
    if (renderEncoder != NULL)
@@ -1429,6 +1584,13 @@ void SDLState::endRenderPass()
 
 void GFXTeardown()
 {
+   if (smState.headless)
+   {
+      ImGui::DestroyContext();
+      smState.headless = false;
+      return;
+   }
+   
    if (smState.gpuDevice == NULL)
       return;
    
@@ -1452,6 +1614,12 @@ bool GFXBeginFrame()
       model.inFrame = false;
    }
    
+   if (smState.headless)
+   {
+      ImGui::NewFrame();
+      return true;
+   }
+   
    // Re-use last texture if still present
    if (smState.gpuSurfaceTexture.texture == NULL)
    {
@@ -1495,6 +1663,15 @@ bool GFXBeginFrame()
 
 void GFXEndFrame()
 {
+   if (smState.headless)
+   {
+      ImGui::EndFrame();
+      ImGui::Render();
+      smState.updateFrameStats();
+      smState.resetBufferAllocs();
+      return;
+   }
+   
    smState.endRenderPass();
    
    // Render imgui
@@ -1516,11 +1693,112 @@ void GFXEndFrame()
    
    wgpuSurfacePresent(smState.gpuSurface);
    
+   smState.updateFrameStats();
    smState.resetBufferAllocs();
 }
 
+void GFXGetFrameStats(GFXFrameStats* outStats)
+{
+   *outStats = smState.lastFrameStats;
+}
+
+WGPUBindGroup SDLState::getTextureBG(int32_t texID)
+{
+   TexInfo& info = textures[texID];
+   if (info.texBindGroup == NULL && info.wantsBindGroup && info.textureView != NULL)
+   {
+      info.texBindGroup = makeSimpleTextureBG(info.textureView, modelCommonSampler);
+   }
+   return info.texBindGroup;
+}
+
+bool SDLState::buildTerrainBG(TerrainGPUResource& res, int32_t matTexListID, int32_t heightMapTexID, int32_t gridMapTexID, int32_t lightmapTexID)
+{
+   const int32_t ids[4] = {matTexListID, heightMapTexID, gridMapTexID, lightmapTexID};
+   for (uint32_t i=0; i<4; i++)
+   {
+      if (ids[i] < 0 || ids[i] >= textures.size() || textures[ids[i]].textureView == NULL)
+         return false;
+   }
+   
+   if (res.mBindGroup != NULL &&
+       res.mMatListTexID == matTexListID &&
+       res.mHeightMapTexID == heightMapTexID &&
+       res.mGridMapTexID == gridMapTexID &&
+       res.mLightMapTexID == lightmapTexID)
+   {
+      return true;
+   }
+   
+   if (res.mBindGroup != NULL)
+   {
+      wgpuBindGroupRelease(res.mBindGroup);
+   }
+   
+   res.mMatListTexID = matTexListID;
+   res.mHeightMapTexID = heightMapTexID;
+   res.mGridMapTexID = gridMapTexID;
+   res.mLightMapTexID = lightmapTexID;
+   res.mBindGroup = makeTerrainTextureBG(textures[matTexListID].textureView,
+                                         textures[heightMapTexID].textureView,
+                                         textures[gridMapTexID].textureView,
+                                         textures[lightmapTexID].textureView,
+                                         modelCommonSampler, modelCommonLinearClampSampler);
+   return res.mBindGroup != NULL;
+}
+
+bool GFXWarmupStep(float budgetMS)
+{
+   if (smState.headless || smState.gpuDevice == NULL)
+   {
+      smState.pendingTexGroups.clear();
+      smState.pendingTerrainGroups.clear();
+      return false;
+   }
+   
+   // Always make at least one, so a busy frame rate can't stall the queue forever
+   const uint64_t startTicks = SDL_GetTicksNS();
+   const uint64_t budgetNS = budgetMS > 0.0f ? (uint64_t)(budgetMS * 1000000.0f) : 0;
+   
+   do
+   {
+      if (!smState.pendingTerrainGroups.empty())
+      {
+         uint32_t terrainID = smState.pendingTerrainGroups.back();
+         smState.pendingTerrainGroups.pop_back();
+         
+         // Queued IDs are held in the resource until the group is made
+         SDLState::TerrainGPUResource& res = smState.terrainResources[terrainID];
+         if (res.mBindGroup == NULL)
+         {
+            SDLState::TerrainGPUResource wanted = res;
+            if (!smState.buildTerrainBG(res, wanted.mMatListTexID, wanted.mHeightMapTexID, wanted.mGridMapTexID, wanted.mLightMapTexID))
+               LOG_WARN("Terrain %u bind group could not be made ahead of use", terrainID);
+         }
+      }
+      else if (!smState.pendingTexGroups.empty())
+      {
+         int32_t texID = smState.pendingTexGroups.back();
+         smState.pendingTexGroups.pop_back();
+         
+         // Texture may have been deleted (or the slot reused) since it was queued
+         if (texID < smState.textures.size())
+            smState.getTextureBG(texID);
+      }
+      else
+      {
+         return false;
+      }
+   } while (SDL_GetTicksNS() - startTicks < budgetNS);
+   
+   return !smState.pendingTexGroups.empty() || !smState.pendingTerrainGroups.empty();
+}
+
 void GFXHandleResize()
 {
+   if (smState.headless)
+      return;
+   
    int w, h;
    SDL_GetWindowSize(smState.window, &w, &h);
    slm::vec2 newSize = slm::vec2(w,h);
@@ -1587,6 +1865,12 @@ int32_t GFXLoadCustomTexture(CustomTextureFormat fmt, uint32_t width, uint32_t h
       copyLMMipDirect(height, width*2, paddedWidth, (uint8_t*)data, texData);
    }
    
+   if (smState.headless)
+   {
+      delete[] texData;
+      return smState.addHeadlessTexture(pow2W, pow2H, 1);
+   }
+   
    WGPUTexture tex;
    if (texData)
    {
@@ -1623,12 +1907,11 @@ int32_t GFXLoadCustomTexture(CustomTextureFormat fmt, uint32_t width, uint32_t h
       copyInfo.origin = (WGPUOrigin3D){0, 0, 0};
       copyInfo.aspect = WGPUTextureAspect_All;
       
-      wgpuQueueWriteTexture(smState.gpuQueue,
-                            &copyInfo,
-                            texData,
-                            alignedMipSize, // Assuming padded 4 bytes per pixel (RGBA8 format)
-                            &layout,
-                            &size);
+      smState.writeTexture(&copyInfo,
+                           texData,
+                           alignedMipSize, // Assuming padded 4 bytes per pixel (RGBA8 format)
+                           &layout,
+                           &size);
       
       // Clean up texture data after uploading
       delete[] texData;
@@ -1640,6 +1923,8 @@ int32_t GFXLoadCustomTexture(CustomTextureFormat fmt, uint32_t width, uint32_t h
       newInfo.dims[0] = textureDesc.size.width;
       newInfo.dims[1] = textureDesc.size.height;
       newInfo.dims[2] = textureDesc.size.depthOrArrayLayers;
+      newInfo.gpuBytes = alignedMipSize;
+      MemTrack::add(MemTrack::Category_GPU, newInfo.gpuBytes);
       
       // Find or add texture to smState.textures
       int sz = smState.textures.size();
@@ -1665,15 +1950,20 @@ int32_t GFXLoadCustomTexture(CustomTextureFormat fmt, uint32_t width, uint32_t h
    return -1;
 }
 
-int32_t GFXLoadTexture(Bitmap* bmp, Palette* defaultPal)
+uint32_t GFXGetTextureStagingSize(uint32_t width, uint32_t height, uint32_t* outPaddedWidth)
 {
-   uint8_t* texData = NULL;
-   uint32_t pow2W = getNextPow2(bmp->mWidth);
-   uint32_t pow2H = getNextPow2(bmp->mHeight);
-   WGPUTextureFormat pixFormat = WGPUTextureFormat_Undefined;
-   
+   uint32_t pow2W = getNextPow2(width);
+   uint32_t pow2H = getNextPow2(height);
    uint32_t paddedWidth = (uint32_t)AlignSize(pow2W*4, 256);
-   uint32_t alignedMipSize = paddedWidth * pow2H;
+   if (outPaddedWidth)
+      *outPaddedWidth = paddedWidth;
+   return paddedWidth * pow2H;
+}
+
+bool GFXConvertTexture(Bitmap* bmp, Palette* defaultPal, uint8_t* outData)
+{
+   uint32_t paddedWidth = 0;
+   GFXGetTextureStagingSize(bmp->mWidth, bmp->mHeight, &paddedWidth);
    
    if (bmp->mBitDepth == 8)
    {
@@ -1685,253 +1975,282 @@ int32_t GFXLoadTexture(Bitmap* bmp, Palette* defaultPal)
          pal = defaultPal->getPaletteByIndex(bmp->mPaletteIndex);
       else
       {
-         printf("No default palette specified\n");
+         LOG_WARN("No default palette specified");
          assert(false);
          return false;
       }
       
       if (bmp->mFlags & Bitmap::FLAG_TRANSPARENT)
-      {
-         texData = new uint8_t[alignedMipSize];
-         copyMipRGBA(bmp->mWidth, bmp->mHeight, paddedWidth, pal, bmp->mMips[0], texData, 255);
-      }
+         copyMipRGBA(bmp->mWidth, bmp->mHeight, paddedWidth, pal, bmp->mMips[0], outData, 255);
       else if (bmp->mFlags & Bitmap::FLAG_TRANSLUCENT)
-      {
-         texData = new uint8_t[alignedMipSize];
-         copyMipRGBA(bmp->mWidth, bmp->mHeight, paddedWidth, pal, bmp->mMips[0], texData, 1);
-      }
+         copyMipRGBA(bmp->mWidth, bmp->mHeight, paddedWidth, pal, bmp->mMips[0], outData, 1);
       else
-      {
-         texData = new uint8_t[alignedMipSize];
-         copyMipRGBA(bmp->mWidth, bmp->mHeight, paddedWidth, pal, bmp->mMips[0], texData, 256);
-      }
+         copyMipRGBA(bmp->mWidth, bmp->mHeight, paddedWidth, pal, bmp->mMips[0], outData, 256);
    }
    else if (bmp->mBitDepth == 24)
    {
-      uint8_t* texData = new uint8_t[alignedMipSize];
-      copyMipDirectPadded(bmp->mHeight, bmp->getStride(bmp->mWidth), paddedWidth, bmp->mMips[0], texData);
+      copyMipDirectPadded(bmp->mHeight, bmp->getStride(bmp->mWidth), paddedWidth, bmp->mMips[0], outData);
    }
    else
    {
       assert(false);
-      return -1;
+      return false;
    }
    
-   WGPUTexture tex;
-   if (texData)
+   return true;
+}
+
+int32_t GFXLoadTextureStaged(uint32_t width, uint32_t height, bool bgr, const uint8_t* data)
+{
+   TRACE_ZONE("GFXLoadTextureStaged");
+   uint32_t pow2W = getNextPow2(width);
+   uint32_t pow2H = getNextPow2(height);
+   uint32_t paddedWidth = 0;
+   uint32_t alignedMipSize = GFXGetTextureStagingSize(width, height, &paddedWidth);
+   
+   if (smState.headless)
+      return smState.addHeadlessTexture(pow2W, pow2H, 1);
+   
+   // Create the texture
+   WGPUTextureDescriptor textureDesc = {};
+   textureDesc.size = (WGPUExtent3D){pow2W, pow2H, 1};
+   textureDesc.mipLevelCount = 1;      // Corresponds to GL_TEXTURE_BASE_LEVEL = 0 and GL_TEXTURE_MAX_LEVEL = 0
+   textureDesc.sampleCount = 1;
+   textureDesc.dimension = WGPUTextureDimension_2D;
+   textureDesc.format = bgr ? WGPUTextureFormat_BGRA8Unorm : WGPUTextureFormat_RGBA8Unorm;  // Corresponds to GL_RGBA in OpenGL
+   textureDesc.usage = WGPUTextureUsage_CopyDst | WGPUTextureUsage_TextureBinding;
+   WGPUTexture tex = wgpuDeviceCreateTexture(smState.gpuDevice, &textureDesc);
+   if (tex == NULL)
+      return -1;
+   
+   // Create the texture view
+   WGPUTextureViewDescriptor textureViewDesc = {};
+   textureViewDesc.format = textureDesc.format;  // Same as the texture format
+   textureViewDesc.dimension = WGPUTextureViewDimension_2D;
+   textureViewDesc.mipLevelCount = 1;
+   textureViewDesc.arrayLayerCount = 1;
+   WGPUTextureView texView = wgpuTextureCreateView(tex, &textureViewDesc);
+   
+   // Upload texture data
+   WGPUTextureDataLayout layout = {};
+   layout.offset = 0;
+   layout.bytesPerRow = paddedWidth;
+   layout.rowsPerImage = pow2H;
+   WGPUExtent3D size = {pow2W, pow2H, 1};
+   
+   WGPUImageCopyTexture copyInfo = {};
+   copyInfo.texture = tex;
+   copyInfo.mipLevel = 0;
+   copyInfo.origin = (WGPUOrigin3D){0, 0, 0};
+   copyInfo.aspect = WGPUTextureAspect_All;
+   
+   smState.writeTexture(&copyInfo,
+                        data,
+                        alignedMipSize, // Assuming padded 4 bytes per pixel (RGBA8 format)
+                        &layout,
+                        &size);
+   
+   SDLState::TexInfo newInfo = {};
+   newInfo.texture = tex;
+   newInfo.textureView = texView;
+   newInfo.dims[0] = textureDesc.size.width;
+   newInfo.dims[1] = textureDesc.size.height;
+   newInfo.dims[2] = textureDesc.size.depthOrArrayLayers;
+   newInfo.gpuBytes = alignedMipSize;
+   MemTrack::add(MemTrack::Category_GPU, newInfo.gpuBytes);
+   newInfo.texBindGroup = NULL;
+   newInfo.wantsBindGroup = true;
+   
+   // Find or add texture to smState.textures
+   int sz = smState.textures.size();
+   for (int i = 0; i < sz; i++)
    {
-      // Create the texture
-      WGPUTextureDescriptor textureDesc = {};
-      //textureDesc.label = "Texture";
-      textureDesc.size = (WGPUExtent3D){pow2W, pow2H, 1};
-      textureDesc.mipLevelCount = 1;      // Corresponds to GL_TEXTURE_BASE_LEVEL = 0 and GL_TEXTURE_MAX_LEVEL = 0
-      textureDesc.sampleCount = 1;
-      textureDesc.dimension = WGPUTextureDimension_2D;
-      textureDesc.format = bmp->mBGR ? WGPUTextureFormat_BGRA8Unorm : WGPUTextureFormat_RGBA8Unorm;  // Corresponds to GL_RGBA in OpenGL
-      textureDesc.usage = WGPUTextureUsage_CopyDst | WGPUTextureUsage_TextureBinding;
-      tex = wgpuDeviceCreateTexture(smState.gpuDevice, &textureDesc);
-      
-      // Create the texture view
-      WGPUTextureViewDescriptor textureViewDesc = {};
-      //textureViewDesc.label = "Texture View";
-      textureViewDesc.format = bmp->mBGR ? WGPUTextureFormat_BGRA8Unorm : WGPUTextureFormat_RGBA8Unorm;  // Same as the texture format
-      textureViewDesc.dimension = WGPUTextureViewDimension_2D;
-      textureViewDesc.mipLevelCount = 1;
-      textureViewDesc.arrayLayerCount = 1;
-      WGPUTextureView texView = wgpuTextureCreateView(tex, &textureViewDesc);
-      
-      // Upload texture data
-      WGPUTextureDataLayout layout = {};
-      layout.offset = 0;
-      layout.bytesPerRow = paddedWidth;
-      layout.rowsPerImage = pow2H;
-      WGPUExtent3D size = {pow2W, pow2H, 1};
-      
-      WGPUImageCopyTexture copyInfo = {};
-      copyInfo.texture = tex;
-      copyInfo.mipLevel = 0;
-      copyInfo.origin = (WGPUOrigin3D){0, 0, 0};
-      copyInfo.aspect = WGPUTextureAspect_All;
-      
-      wgpuQueueWriteTexture(smState.gpuQueue,
-                            &copyInfo,
-                            texData,
-                            alignedMipSize, // Assuming padded 4 bytes per pixel (RGBA8 format)
-                            &layout,
-                            &size);
-      
-      // Clean up texture data after uploading
-      delete[] texData;
-      
-      SDLState::TexInfo newInfo = {};
-      newInfo.texture = tex;
-      newInfo.textureView = texView;
-      newInfo.dims[0] = textureDesc.size.width;
-      newInfo.dims[1] = textureDesc.size.height;
-      newInfo.dims[2] = textureDesc.size.depthOrArrayLayers;
-      newInfo.texBindGroup = smState.makeSimpleTextureBG(texView, smState.modelCommonSampler);
-      
-      // Find or add texture to smState.textures
-      int sz = smState.textures.size();
-      for (int i = 0; i < sz; i++)
+      if (smState.textures[i].texture == NULL)
       {
-         if (smState.textures[i].texture == NULL)
-         {
-            smState.textures[i] = newInfo;
-            return i;
-         }
+         smState.textures[i] = newInfo;
+         smState.pendingTexGroups.push_back(i);
+         return i;
       }
-      
-      smState.textures.push_back(newInfo);
-      return (uint32_t)(smState.textures.size() - 1);
    }
-   else
-   {
-      // Handle the case where texture creation failed
-      delete[] texData;
+   
+   smState.textures.push_back(newInfo);
+   smState.pendingTexGroups.push_back((int32_t)(smState.textures.size() - 1));
+   return (uint32_t)(smState.textures.size() - 1);
+}
+
+int32_t GFXCreateTextureSet(uint32_t numLayers, uint32_t width, uint32_t height, bool bgr)
+{
+   TRACE_ZONE("GFXCreateTextureSet");
+   if (numLayers == 0)
       return -1;
+   
+   uint32_t pow2W = getNextPow2(width);
+   uint32_t pow2H = getNextPow2(height);
+   uint32_t alignedMipSize = GFXGetTextureStagingSize(width, height, NULL);
+   
+   if (smState.headless)
+      return smState.addHeadlessTexture(pow2W, pow2H, numLayers);
+   
+   // Create the 2D texture array with numLayers layers
+   WGPUTextureDescriptor textureDesc = {};
+   textureDesc.size = (WGPUExtent3D){pow2W, pow2H, numLayers};  // Use numLayers for the depth (layer count)
+   textureDesc.mipLevelCount = 1;
+   textureDesc.sampleCount = 1;
+   textureDesc.dimension = WGPUTextureDimension_2D;
+   textureDesc.format = bgr ? WGPUTextureFormat_BGRA8Unorm : WGPUTextureFormat_RGBA8Unorm;
+   textureDesc.usage = WGPUTextureUsage_CopyDst | WGPUTextureUsage_TextureBinding;
+   WGPUTexture tex = wgpuDeviceCreateTexture(smState.gpuDevice, &textureDesc);
+   if (tex == NULL)
+      return -1;
+   
+   WGPUTextureViewDescriptor textureViewDesc = {};
+   textureViewDesc.format = textureDesc.format;
+   textureViewDesc.dimension = WGPUTextureViewDimension_2DArray;
+   textureViewDesc.mipLevelCount = 1;
+   textureViewDesc.arrayLayerCount = numLayers;
+   
+   WGPUTextureView texView = wgpuTextureCreateView(tex, &textureViewDesc);
+   
+   // Store the texture and return the index
+   SDLState::TexInfo newInfo = {};
+   newInfo.texture = tex;
+   newInfo.textureView = texView;
+   newInfo.dims[0] = textureDesc.size.width;
+   newInfo.dims[1] = textureDesc.size.height;
+   newInfo.dims[2] = textureDesc.size.depthOrArrayLayers;
+   newInfo.gpuBytes = (uint64_t)alignedMipSize * numLayers;
+   MemTrack::add(MemTrack::Category_GPU, newInfo.gpuBytes);
+   newInfo.texBindGroup = NULL;
+   
+   // Find or add texture to smState.textures
+   int sz = smState.textures.size();
+   for (int i = 0; i < sz; i++)
+   {
+      if (smState.textures[i].texture == NULL)
+      {
+         smState.textures[i] = newInfo;
+         return i;
+      }
    }
    
-   return -1;
+   smState.textures.push_back(newInfo);
+   return (uint32_t)(smState.textures.size() - 1);
+}
+
+void GFXUploadTextureLayer(int32_t texID, uint32_t layer, const uint8_t* data)
+{
+   if (texID < 0 || texID >= smState.textures.size())
+      return;
+   
+   SDLState::TexInfo& info = smState.textures[texID];
+   if (info.texture == NULL || layer >= info.dims[2])
+      return;
+   
+   uint32_t paddedWidth = (uint32_t)AlignSize(info.dims[0]*4, 256);
+   
+   WGPUTextureDataLayout layout = {};
+   layout.offset = 0;
+   layout.bytesPerRow = paddedWidth;
+   layout.rowsPerImage = info.dims[1];
+   
+   WGPUExtent3D size = {info.dims[0], info.dims[1], 1};
+   
+   WGPUImageCopyTexture copyInfo = {};
+   copyInfo.texture = info.texture;
+   copyInfo.mipLevel = 0;
+   copyInfo.origin = (WGPUOrigin3D){0, 0, layer};  // Target the given layer of the texture
+   copyInfo.aspect = WGPUTextureAspect_All;
+   
+   smState.writeTexture(&copyInfo,
+                        data,
+                        paddedWidth * info.dims[1],  // Padded 4 bytes per pixel (RGBA8 format)
+                        &layout,
+                        &size);
+}
+
+int32_t GFXLoadTexture(Bitmap* bmp, Palette* defaultPal)
+{
+   TRACE_ZONE("GFXLoadTexture");
+   uint32_t alignedMipSize = GFXGetTextureStagingSize(bmp->mWidth, bmp->mHeight, NULL);
+   uint8_t* texData = new uint8_t[alignedMipSize];
+   
+   int32_t ret = -1;
+   if (GFXConvertTexture(bmp, defaultPal, texData))
+      ret = GFXLoadTextureStaged(bmp->mWidth, bmp->mHeight, bmp->mBGR, texData);
+   
+   delete[] texData;
+   return ret;
 }
 
 int32_t GFXLoadTextureSet(uint32_t numBitmaps, Bitmap** bmps, Palette* defaultPal)
 {
-    if (numBitmaps == 0 || bmps == nullptr)
-        return -1;
-
-    Bitmap* firstBmp = bmps[0];
-    uint32_t pow2W = getNextPow2(firstBmp->mWidth);
-    uint32_t pow2H = getNextPow2(firstBmp->mHeight);
-    uint32_t paddedWidth = (uint32_t)AlignSize(pow2W * 4, 256);
-    uint32_t alignedMipSize = paddedWidth * pow2H;
-    
-    // Allocate memory to store texture data for each bitmap layer
-    uint8_t** texDataArray = new uint8_t*[numBitmaps];
-
-    for (uint32_t i = 0; i < numBitmaps; ++i)
-    {
-        Bitmap* bmp = bmps[i];
-        Palette::Data* pal = nullptr;
-        
-        if (bmp->mBitDepth == 8)
-        {
-            if (bmp->mPal)
-                pal = bmp->mPal->getPaletteByIndex(bmp->mPaletteIndex);
-            else if (defaultPal && defaultPal->mPalettes.size() > 0)
-                pal = defaultPal->getPaletteByIndex(bmp->mPaletteIndex);
-            else
-            {
-                printf("No default palette specified\n");
-                assert(false);
-                return -1;
-            }
-
-            // Allocate texture data for the current bitmap
-            texDataArray[i] = new uint8_t[alignedMipSize];
-
-            // Depending on flags, copy the texture data
-            if (bmp->mFlags & Bitmap::FLAG_TRANSPARENT)
-            {
-                copyMipRGBA(bmp->mWidth, bmp->mHeight, paddedWidth, pal, bmp->mMips[0], texDataArray[i], 255);
-            }
-            else if (bmp->mFlags & Bitmap::FLAG_TRANSLUCENT)
-            {
-                copyMipRGBA(bmp->mWidth, bmp->mHeight, paddedWidth, pal, bmp->mMips[0], texDataArray[i], 1);
-            }
-            else
-            {
-                copyMipRGBA(bmp->mWidth, bmp->mHeight, paddedWidth, pal, bmp->mMips[0], texDataArray[i], 256);
-            }
-        }
-        else if (bmp->mBitDepth == 24)
-        {
-            texDataArray[i] = new uint8_t[alignedMipSize];
-            copyMipDirectPadded(bmp->mHeight, bmp->getStride(bmp->mWidth), paddedWidth, bmp->mMips[0], texDataArray[i]);
-        }
-        else
-        {
-            assert(false);
-            return -1;
-        }
-    }
-
-    // Create the 2D texture array with numBitmaps layers
-    WGPUTexture tex;
-    WGPUTextureDescriptor textureDesc = {};
-    textureDesc.size = (WGPUExtent3D){pow2W, pow2H, numBitmaps};  // Use numBitmaps for the depth (layer count)
-    textureDesc.mipLevelCount = 1;
-    textureDesc.sampleCount = 1;
-    textureDesc.dimension = WGPUTextureDimension_2D;
-    textureDesc.format = firstBmp->mBGR ? WGPUTextureFormat_BGRA8Unorm : WGPUTextureFormat_RGBA8Unorm;
-    textureDesc.usage = WGPUTextureUsage_CopyDst | WGPUTextureUsage_TextureBinding;
-    tex = wgpuDeviceCreateTexture(smState.gpuDevice, &textureDesc);
-
-    // Upload texture data for each layer
-    for (uint32_t i = 0; i < numBitmaps; ++i)
-    {
-        WGPUTextureDataLayout layout = {};
-        layout.offset = 0;
-        layout.bytesPerRow = paddedWidth;
-        layout.rowsPerImage = pow2H;
-
-        WGPUExtent3D size = {pow2W, pow2H, 1};
-
-        WGPUImageCopyTexture copyInfo = {};
-        copyInfo.texture = tex;
-        copyInfo.mipLevel = 0;
-        copyInfo.origin = (WGPUOrigin3D){0, 0, 0};
-        copyInfo.aspect = WGPUTextureAspect_All;
-        copyInfo.origin.z = i;  // Target the ith layer of the texture
-
-        wgpuQueueWriteTexture(smState.gpuQueue,
-                              &copyInfo,
-                              texDataArray[i],
-                              alignedMipSize,  // Padded 4 bytes per pixel (RGBA8 format)
-                              &layout,
-                              &size);
-    }
-
-    // Clean up the texture data after uploading
-    for (uint32_t i = 0; i < numBitmaps; ++i)
-    {
-        delete[] texDataArray[i];
-    }
-    delete[] texDataArray;
-
-    // Create a texture view for each layer (if necessary)
-    WGPUTextureViewDescriptor textureViewDesc = {};
-    textureViewDesc.format = firstBmp->mBGR ? WGPUTextureFormat_BGRA8Unorm : WGPUTextureFormat_RGBA8Unorm;
-    textureViewDesc.dimension = WGPUTextureViewDimension_2DArray;
-    textureViewDesc.mipLevelCount = 1;
-    textureViewDesc.arrayLayerCount = numBitmaps;
-
-    WGPUTextureView texView = wgpuTextureCreateView(tex, &textureViewDesc);
-
-    // Store the texture and return the index
-    SDLState::TexInfo newInfo = {};
-    newInfo.texture = tex;
-    newInfo.textureView = texView;
-    newInfo.dims[0] = textureDesc.size.width;
-    newInfo.dims[1] = textureDesc.size.height;
-    newInfo.dims[2] = textureDesc.size.depthOrArrayLayers;
-    newInfo.texBindGroup = NULL;//smState.makeSimpleTextureBG(texView, smState.modelCommonSampler);
-
-    // Find or add texture to smState.textures
-    int sz = smState.textures.size();
-    for (int i = 0; i < sz; i++)
-    {
-        if (smState.textures[i].texture == NULL)
-        {
-            smState.textures[i] = newInfo;
-            return i;
-        }
-    }
+   TRACE_ZONE("GFXLoadTextureSet");
+   if (numBitmaps == 0 || bmps == NULL)
+      return -1;
+   
+   // Every layer uses the dimensions of the first bitmap
+   Bitmap* firstBmp = bmps[0];
+   uint32_t paddedWidth = 0;
+   uint32_t alignedMipSize = GFXGetTextureStagingSize(firstBmp->mWidth, firstBmp->mHeight, &paddedWidth);
+   
+   int32_t texID = GFXCreateTextureSet(numBitmaps, firstBmp->mWidth, firstBmp->mHeight, firstBmp->mBGR);
+   if (texID < 0)
+      return -1;
+   
+   // Layers are converted one at a time through the same buffer
+   uint8_t* texData = new uint8_t[alignedMipSize];
+   
+   for (uint32_t i = 0; i < numBitmaps; ++i)
+   {
+      uint32_t layerPaddedWidth = 0;
+      if (GFXGetTextureStagingSize(bmps[i]->mWidth, bmps[i]->mHeight, &layerPaddedWidth) != alignedMipSize ||
+          layerPaddedWidth != paddedWidth ||
+          !GFXConvertTexture(bmps[i], defaultPal, texData))
+      {
+         delete[] texData;
+         GFXDeleteTexture(texID);
+         return -1;
+      }
+      
+      GFXUploadTextureLayer(texID, i, texData);
+   }
+   
+   delete[] texData;
+   return texID;
+}
 
-    smState.textures.push_back(newInfo);
-    return (uint32_t)(smState.textures.size() - 1);
+
+void GFXUpdateCustomTexture(int32_t texID, uint32_t x, uint32_t y, uint32_t width, uint32_t height, const void* data)
+{
+   if (texID < 0 || texID >= smState.textures.size())
+      return;
+   
+   SDLState::TexInfo& info = smState.textures[texID];
+   if (info.texture == NULL)
+      return;
+   
+   WGPUTextureDataLayout layout = {};
+   layout.offset = 0;
+   layout.bytesPerRow = width * 4;
+   layout.rowsPerImage = height;
+   WGPUExtent3D size = {width, height, 1};
+   
+   WGPUImageCopyTexture copyInfo = {};
+   copyInfo.texture = info.texture;
+   copyInfo.mipLevel = 0;
+   copyInfo.origin = (WGPUOrigin3D){x, y, 0};
+   copyInfo.aspect = WGPUTextureAspect_All;
+   
+   smState.writeTexture(&copyInfo, data, width * height * 4, &layout, &size);
 }
 
+void* GFXGetImGuiTexture(int32_t texID)
+{
+   if (texID < 0 || texID >= smState.textures.size())
+      return NULL;
+   
+   return smState.textures[texID].textureView;
+}
 
 void GFXDeleteTexture(int32_t texID)
 {
@@ -1939,14 +2258,44 @@ void GFXDeleteTexture(int32_t texID)
       return;
    
    SDLState::TexInfo& tex = smState.textures[texID];
+   if (tex.cpuOnly)
+   {
+      tex.cpuOnly = false;
+      return;
+   }
+   
    if (tex.texture == NULL)
       return;
    
+   if (tex.texBindGroup)
+      wgpuBindGroupRelease(tex.texBindGroup);
    wgpuTextureViewRelease(tex.textureView);
    wgpuTextureRelease(tex.texture);
+   MemTrack::remove(MemTrack::Category_GPU, tex.gpuBytes);
    
    tex.texture = NULL;
    tex.textureView = NULL;
+   tex.texBindGroup = NULL;
+   tex.wantsBindGroup = false;
+   
+   // The slot can be reused, so terrain groups made from it must not match by ID any more
+   for (SDLState::TerrainGPUResource& res : smState.terrainResources)
+   {
+      if (res.mBindGroup != NULL &&
+          (res.mMatListTexID == texID || res.mHeightMapTexID == texID ||
+           res.mGridMapTexID == texID || res.mLightMapTexID == texID))
+      {
+         wgpuBindGroupRelease(res.mBindGroup);
+         res.mBindGroup = NULL;
+      }
+   }
+}
+
+static size_t getModelMirrorBytes(const SDLState::FrameModel& model)
+{
+   if (model.vertData == NULL)
+      return 0;
+   return (sizeof(ModelVertex) * model.numVerts) + (sizeof(ModelTexVertex) * model.numTexVerts) + (sizeof(uint16_t) * model.numInds);
 }
 
 void GFXLoadModelData(uint32_t modelId, void* verts, void* texverts, void* inds, uint32_t numVerts, uint32_t numTexVerts, uint32_t numInds)
@@ -1958,6 +2307,9 @@ void GFXLoadModelData(uint32_t modelId, void* verts, void* texverts, void* inds,
    SDLState::FrameModel& model = smState.models[modelId];
    model.inFrame = false;
    
+   if (model.vertData)
+      MemTrack::remove(MemTrack::Category_GPUMirror, getModelMirrorBytes(model));
+   
    if (model.vertData)
       delete[] model.vertData;
    if (model.texVertData)
@@ -1976,6 +2328,8 @@ void GFXLoadModelData(uint32_t modelId, void* verts, void* texverts, void* inds,
    memcpy(model.vertData, verts, sizeof(ModelVertex) * numVerts);
    memcpy(model.texVertData, texverts, sizeof(ModelTexVertex) * numTexVerts);
    memcpy(model.indexData, inds, sizeof(uint16_t) * numInds);
+   
+   MemTrack::add(MemTrack::Category_GPUMirror, getModelMirrorBytes(model));
 }
 
 void GFXClearModelData(uint32_t modelId)
@@ -1986,6 +2340,9 @@ void GFXClearModelData(uint32_t modelId)
    SDLState::FrameModel& model = smState.models[modelId];
    model.inFrame = false;
    
+   if (model.vertData)
+      MemTrack::remove(MemTrack::Category_GPUMirror, getModelMirrorBytes(model));
+   
    if (model.vertData)
       delete[] model.vertData;
    if (model.texVertData)
@@ -2039,7 +2396,7 @@ void GFXBeginModelPipelineState(ModelPipelineState state, int32_t texID, float t
 {
    smState.currentPipeline = smState.modelProgram.pipelines[state];
    smState.currentProgram = &smState.modelProgram;
-   wgpuRenderPassEncoderSetPipeline(smState.renderEncoder, smState.currentPipeline);
+   smState.setPipeline(smState.currentPipeline);
    
    GFXSetLightPos(smState.lightPos, smState.lightColor);
    GFXSetModelViewProjection(smState.modelMatrix, smState.viewMatrix, smState.projectionMatrix);
@@ -2054,8 +2411,7 @@ void GFXBeginModelPipelineState(ModelPipelineState state, int32_t texID, float t
    }
    
    // Set texture
-   SDLState::TexInfo& info = smState.textures[texID];
-   wgpuRenderPassEncoderSetBindGroup(smState.renderEncoder, 1, info.texBindGroup, 0, NULL);
+   smState.setBindGroup(1, smState.getTextureBG(texID), 0, NULL);
 }
 
 void GFXSetModelVerts(uint32_t modelId, uint32_t vertOffset, uint32_t texOffset)
@@ -2065,16 +2421,22 @@ void GFXSetModelVerts(uint32_t modelId, uint32_t vertOffset, uint32_t texOffset)
    const size_t texVertSize = sizeof(ModelTexVertex) * model.numTexVerts;
    const size_t indexSize = AlignSize(sizeof(uint16_t) * model.numInds, sizeof(uint32_t));
    
+   if (smState.headless)
+   {
+      model.inFrame = true;
+      return;
+   }
+   
    if (model.inFrame == false)
    {
       model.indexOffset = smState.allocBuffer(model.numInds * sizeof(uint16_t), WGPUBufferUsage_CopyDst | WGPUBufferUsage_Index, sizeof(uint32_t));
-      wgpuQueueWriteBuffer(smState.gpuQueue, model.indexOffset.buffer, model.indexOffset.offset, model.indexData, indexSize);
+      smState.writeBuffer(model.indexOffset.buffer, model.indexOffset.offset, model.indexData, indexSize);
       
       model.vertOffset = smState.allocBuffer(vertSize, WGPUBufferUsage_CopyDst | WGPUBufferUsage_Vertex, sizeof(ModelVertex));
-      wgpuQueueWriteBuffer(smState.gpuQueue, model.vertOffset.buffer, model.vertOffset.offset, model.vertData, vertSize);
+      smState.writeBuffer(model.vertOffset.buffer, model.vertOffset.offset, model.vertData, vertSize);
       
       model.texVertOffset = smState.allocBuffer(texVertSize, WGPUBufferUsage_CopyDst | WGPUBufferUsage_Vertex, sizeof(ModelTexVertex));
-      wgpuQueueWriteBuffer(smState.gpuQueue, model.texVertOffset.buffer, model.texVertOffset.offset, model.texVertData, texVertSize);
+      smState.writeBuffer(model.texVertOffset.buffer, model.texVertOffset.offset, model.texVertData, texVertSize);
       
       // Load in frame
       model.inFrame = true;
@@ -2088,26 +2450,40 @@ void GFXSetModelVerts(uint32_t modelId, uint32_t vertOffset, uint32_t texOffset)
 
 void GFXDrawModelVerts(uint32_t numVerts, uint32_t startVerts)
 {
+   if (smState.headless)
+   {
+      smState.frameStats.numDrawCalls++;
+      return;
+   }
+   
    SDLState::BufferRef uniformData = smState.allocBuffer(sizeof(CommonUniformStruct), WGPUBufferUsage_CopyDst | WGPUBufferUsage_Uniform, 256);
-   wgpuQueueWriteBuffer(smState.gpuQueue, uniformData.buffer, uniformData.offset, &smState.currentProgram->uniforms, sizeof(CommonUniformStruct));
+   smState.writeBuffer(uniformData.buffer, uniformData.offset, &smState.currentProgram->uniforms, sizeof(CommonUniformStruct));
    
    uint32_t offsets[1];
    offsets[0] = uniformData.offset;
-   wgpuRenderPassEncoderSetBindGroup(smState.renderEncoder, 0, smState.commonUniformGroup, 1, offsets);
+   smState.setBindGroup(0, smState.commonUniformGroup, 1, offsets);
    
    wgpuRenderPassEncoderDraw(smState.renderEncoder, numVerts, 1, startVerts, 0);
+   smState.frameStats.numDrawCalls++;
 }
 
 void GFXDrawModelPrims(uint32_t numVerts, uint32_t numInds, uint32_t startInds, uint32_t startVerts)
 {
+   if (smState.headless)
+   {
+      smState.frameStats.numDrawCalls++;
+      return;
+   }
+   
    SDLState::BufferRef uniformData = smState.allocBuffer(sizeof(CommonUniformStruct), WGPUBufferUsage_CopyDst | WGPUBufferUsage_Uniform, 256);
-   wgpuQueueWriteBuffer(smState.gpuQueue, uniformData.buffer, uniformData.offset, &smState.currentProgram->uniforms, sizeof(CommonUniformStruct));
+   smState.writeBuffer(uniformData.buffer, uniformData.offset, &smState.currentProgram->uniforms, sizeof(CommonUniformStruct));
    
    uint32_t offsets[1];
    offsets[0] = uniformData.offset;
-   wgpuRenderPassEncoderSetBindGroup(smState.renderEncoder, 0, smState.commonUniformGroup, 1, offsets);
+   smState.setBindGroup(0, smState.commonUniformGroup, 1, offsets);
    
    wgpuRenderPassEncoderDrawIndexed(smState.renderEncoder, numInds, 1, startInds, startVerts, 0);
+   smState.frameStats.numDrawCalls++;
 }
 
 void GFXSetTerrainResources(uint32_t terrainID, int32_t matTexListID, int32_t heightMapTexID, int32_t gridMapTexID, int32_t lightmapTexID)
@@ -2116,39 +2492,60 @@ void GFXSetTerrainResources(uint32_t terrainID, int32_t matTexListID, int32_t he
    while (smState.terrainResources.size() <= terrainID)
       smState.terrainResources.push_back(blankRes);
    
+   if (smState.headless)
+      return;
+   
+   // Only rebuilt when the textures change (usually made ahead by GFXWarmupStep)
    SDLState::TerrainGPUResource& res = smState.terrainResources[terrainID];
-   if (res.mBindGroup == NULL || 
-       (res.mMatListTexID != matTexListID) || 
-        (res.mGridMapTexID != gridMapTexID) ||
-        (res.mLightMapTexID != lightmapTexID))
+   if (smState.buildTerrainBG(res, matTexListID, heightMapTexID, gridMapTexID, lightmapTexID))
    {
-      if (res.mBindGroup != NULL)
+      smState.terrainProgram.uniforms.params2.w = smState.textures[lightmapTexID].dims[0];
+   }
+}
+
+void GFXQueueTerrainResources(uint32_t terrainID, int32_t matTexListID, int32_t heightMapTexID, int32_t gridMapTexID, int32_t lightmapTexID)
+{
+   SDLState::TerrainGPUResource blankRes = {};
+   while (smState.terrainResources.size() <= terrainID)
+      smState.terrainResources.push_back(blankRes);
+   
+   if (smState.headless)
+      return;
+   
+   SDLState::TerrainGPUResource& res = smState.terrainResources[terrainID];
+   if (res.mBindGroup != NULL)
+   {
+      if (res.mMatListTexID == matTexListID &&
+          res.mHeightMapTexID == heightMapTexID &&
+          res.mGridMapTexID == gridMapTexID &&
+          res.mLightMapTexID == lightmapTexID)
       {
-         wgpuBindGroupRelease(res.mBindGroup);
+         return;
       }
       
-      WGPUTextureView squareMatView = smState.textures[matTexListID].textureView;
-      WGPUTextureView heightMapView = smState.textures[heightMapTexID].textureView;
-      WGPUTextureView gridMapView = smState.textures[gridMapTexID].textureView;
-      WGPUTextureView lightMapView = smState.textures[lightmapTexID].textureView;
-      smState.terrainProgram.uniforms.params2.w = smState.textures[lightmapTexID].dims[0];
-      
-      res.mBindGroup = smState.makeTerrainTextureBG(squareMatView, heightMapView, gridMapView, lightMapView, smState.modelCommonSampler, smState.modelCommonLinearClampSampler);
+      wgpuBindGroupRelease(res.mBindGroup);
+      res.mBindGroup = NULL;
    }
+   
+   res.mMatListTexID = matTexListID;
+   res.mHeightMapTexID = heightMapTexID;
+   res.mGridMapTexID = gridMapTexID;
+   res.mLightMapTexID = lightmapTexID;
+   smState.pendingTerrainGroups.push_back(terrainID);
 }
 
 void GFXBeginTerrainPipelineState(TerrainPipelineState state, uint32_t terrainID, float squareSize, float gridX, float gridY, const slm::vec4* matCoords)
 {
    smState.currentPipeline = smState.terrainProgram.pipelines[state];
    smState.currentProgram = &smState.terrainProgram;
-   wgpuRenderPassEncoderSetPipeline(smState.renderEncoder, smState.currentPipeline);
+   smState.setPipeline(smState.currentPipeline);
    
    smState.terrainProgram.uniforms.params2.y = squareSize;
    smState.terrainProgram.uniforms.params2.z = gridX;
    
    SDLState::TerrainGPUResource& res = smState.terrainResources[terrainID];
    
-   wgpuRenderPassEncoderSetBindGroup(smState.renderEncoder, 1, res.mBindGroup, 0, NULL);
+   smState.setBindGroup(1, res.mBindGroup, 0, NULL);
    
    memcpy(smState.currentProgram->uniforms.squareTexCoords, matCoords, sizeof(slm::vec4)*16);
    
@@ -2159,7 +2556,7 @@ void GFXBeginLinePipelineState()
 {
    smState.currentPipeline = smState.lineProgram.pipeline;
    smState.currentProgram = &smState.lineProgram;
-   wgpuRenderPassEncoderSetPipeline(smState.renderEncoder, smState.currentPipeline);
+   smState.setPipeline(smState.currentPipeline);
    
    GFXSetModelViewProjection(smState.modelMatrix, smState.viewMatrix, smState.projectionMatrix);
 }
@@ -2195,17 +2592,24 @@ void GFXDrawLine(slm::vec3 start, slm::vec3 end, slm::vec4 color, float width)
    
    smState.lineProgram.uniforms.params1 = slm::vec4(1.0f / smState.viewportSize.x, 1.0f / smState.viewportSize.y, width, 0.0f);
    
+   if (smState.headless)
+   {
+      smState.frameStats.numDrawCalls++;
+      return;
+   }
+   
    SDLState::BufferRef uniformData = smState.allocBuffer(sizeof(CommonUniformStruct), WGPUBufferUsage_CopyDst | WGPUBufferUsage_Uniform, 256);
-   wgpuQueueWriteBuffer(smState.gpuQueue, uniformData.buffer, uniformData.offset, &smState.lineProgram.uniforms, sizeof(CommonUniformStruct));
+   smState.writeBuffer(uniformData.buffer, uniformData.offset, &smState.lineProgram.uniforms, sizeof(CommonUniformStruct));
    
    SDLState::BufferRef lineData = smState.allocBuffer(sizeof(verts), WGPUBufferUsage_CopyDst | WGPUBufferUsage_Vertex, sizeof(_LineVert));
-   wgpuQueueWriteBuffer(smState.gpuQueue, lineData.buffer, lineData.offset, verts, sizeof(verts));
+   smState.writeBuffer(lineData.buffer, lineData.offset, verts, sizeof(verts));
    
    uint32_t offsets[1];
    offsets[0] = uniformData.offset;
-   wgpuRenderPassEncoderSetBindGroup(smState.renderEncoder, 0, smState.commonUniformGroup, 1, offsets);
+   smState.setBindGroup(0, smState.commonUniformGroup, 1, offsets);
    
    wgpuRenderPassEncoderSetVertexBuffer(smState.renderEncoder, 0, lineData.buffer, lineData.offset, sizeof(verts));
    
    wgpuRenderPassEncoderDraw(smState.renderEncoder, 6, 1, 0, 0);
+   smState.frameStats.numDrawCalls++;
 }
@@ -24,11 +24,19 @@
 #include <SDL3/SDL.h>
 #include <stdio.h>
 #include <strings.h>
+#include <sys/stat.h>
 #include <algorithm>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cmath>
 #include <unordered_map>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <random>
 #include <slm/slmath.h>
 
 #include "imgui.h"
@@ -52,6 +60,22 @@ namespace fs = std::filesystem;
 // The max number of command buffers in flight
 static const uint32_t TVMaxBuffersInFlight = 3;
 
+// Initial window size, also used as the view size when running headless
+static const int TVDefaultWindowWidth = 1024;
+static const int TVDefaultWindowHeight = 700;
+
+static void getViewSize(SDL_Window* window, int* w, int* h)
+{
+   if (window == NULL)
+   {
+      *w = TVDefaultWindowWidth;
+      *h = TVDefaultWindowHeight;
+      return;
+   }
+   
+   SDL_GetWindowSize(window, w, h);
+}
+
 // Run of the mill quaternion interpolator
 slm::quat CompatInterpolate( slm::quat const & q1,
                             slm::quat const & q2, float t )
@@ -138,6 +162,27 @@ void CompatQuatSetMatrix(const slm::quat rot, slm::mat4 &outMat)
 
 
 #include "CommonData.h"
+#include "OcclusionBuffer.h"
+#include "BatchTransform.h"
+#include "Profiler.h"
+#include "Trace.h"
+#include "MemTrack.h"
+#include "Log.h"
+#include "InputRecording.h"
+#include "HeadlessScript.h"
+#include "ThumbnailCache.h"
+#include "GLTFWriter.h"
+#include "SceneBVH.h"
+#include "SceneFile.h"
+#include "MathBench.h"
+#include "JobSystem.h"
+#include "JobBench.h"
+#include "IOBench.h"
+#include "MaterialPipeline.h"
+#include "ContentHash.h"
+#include "BatchRead.h"
+#include "AccessTrace.h"
+#include "DirIndex.h"
 
 class Volume
 {
@@ -170,12 +215,39 @@ public:
    };
 #pragma pack()
    
+   // Sidecar file next to the volume holding the content hash of each entry
+   struct HashIndexHeader
+   {
+      enum
+      {
+         IDENT = 0x48534856, // VHSH
+         VERSION = 1
+      };
+      
+      uint32_t ident;
+      uint32_t version;
+      uint64_t volumeSize;
+      int64_t volumeTime;
+      uint32_t numEntries;
+      uint32_t pad;
+   };
+   
    std::vector<Entry> mFiles;
    char* mStringData;
+   MemTrack::Allocation mStringTrack;
    FILE* mFilePtr;
    std::string mName;
    
-   Volume() : mStringData(NULL), mFilePtr(NULL)
+   // Content hash per entry, 0 until known. Filled in by ResManager::openFile and getEntryHash on the main
+   // thread, and kept in the hash index when there is one.
+   std::vector<uint64_t> mHashes;
+   bool mHashesDirty;
+   bool mHasHashIndex;
+   
+   // Creates hash indexes for volumes which don't have one yet
+   static bool smWriteHashIndex;
+   
+   Volume() : mStringData(NULL), mStringTrack(MemTrack::Category_IO), mFilePtr(NULL), mHashesDirty(false), mHasHashIndex(false)
    {
    }
    
@@ -192,6 +264,7 @@ public:
       
       if (mStringData) free(mStringData);
       mStringData = NULL;
+      mStringTrack.set(0);
       
       fread(&block, sizeof(IFFBlock), 1, fp);
       if (block.ident != IDENT_PVOL)
@@ -208,6 +281,7 @@ public:
       
       uint32_t real_size = block.getSize();
       mStringData = (char*)malloc(real_size);
+      mStringTrack.set(real_size);
       if (fread(mStringData, real_size, 1, fp) != 1)
       {
          return false;
@@ -229,35 +303,150 @@ public:
       
       for (Entry& e : mFiles)
       {
-         printf("%s\n", e.getFilename(mStringData));
+         LOG_TRACE("%s", e.getFilename(mStringData));
+      }
+      
+      mHashes.clear();
+      mHashes.resize(mFiles.size(), 0);
+      mHashesDirty = false;
+      return true;
+   }
+   
+   int32_t findEntry(const char* filename) const
+   {
+      for (uint32_t i=0; i<mFiles.size(); i++)
+      {
+         if (strcasecmp(filename, mFiles[i].getFilename(mStringData)) == 0)
+            return i;
       }
       
+      return -1;
+   }
+   
+   bool readEntry(FILE* fp, uint32_t idx, MemRStream& outStream) const
+   {
+      const Entry& entry = mFiles[idx];
+      fseek(fp, entry.offset+8, SEEK_SET); // skip past VBLK header
+      uint8_t* data = (uint8_t*)malloc(entry.size);
+      if (fread(data, entry.size, 1, fp) == 0)
+      {
+         free(data);
+         return false;
+      }
+      assert(entry.compressType == 0); // TODO: handle compression variants
+      outStream = MemRStream(entry.size, data, true);
       return true;
    }
    
    bool openStream(FILE* fp, const char* filename, MemRStream& outStream)
    {
-      for (std::vector<Entry>::const_iterator itr = mFiles.begin(), itrEnd = mFiles.end(); itr != itrEnd; itr++)
+      int32_t idx = findEntry(filename);
+      return idx >= 0 && readEntry(fp, idx, outStream);
+   }
+   
+   // 0 is kept to mean unknown
+   static inline uint64_t hashData(const void* data, size_t size)
+   {
+      uint64_t hash = ContentHash::hash(data, size);
+      return hash != 0 ? hash : 1;
+   }
+   
+   void setEntryHash(uint32_t idx, uint64_t hash)
+   {
+      if (mHashes[idx] != hash)
       {
-         if (strcasecmp(filename, itr->getFilename(mStringData)) == 0)
-         {
-            fseek(fp, itr->offset+8, SEEK_SET); // skip past VBLK header
-            uint8_t* data = (uint8_t*)malloc(itr->size);
-            if (fread(data, itr->size, 1, fp) == 0)
-            {
-               free(data);
-               return false;
-            }
-            assert(itr->compressType == 0); // TODO: handle compression variants
-            outStream = MemRStream(itr->size, data, true);
-            return true;
-         }
+         mHashes[idx] = hash;
+         mHashesDirty = true;
+      }
+   }
+   
+   // Reads the entry to hash it if it isn't known yet. Main thread only.
+   uint64_t getEntryHash(uint32_t idx)
+   {
+      if (mHashes[idx] == 0)
+      {
+         MemRStream stream(0, NULL);
+         if (readEntry(mFilePtr, idx, stream))
+            setEntryHash(idx, hashData(stream.mPtr, stream.mSize));
       }
       
-      return NULL;
+      return mHashes[idx];
+   }
+   
+   inline std::string getHashIndexPath() const { return mName + ".hashes"; }
+   
+   bool getHashIndexHeader(HashIndexHeader& outHeader) const
+   {
+      struct stat st;
+      if (stat(mName.c_str(), &st) != 0)
+         return false;
+      
+      outHeader = {};
+      outHeader.ident = HashIndexHeader::IDENT;
+      outHeader.version = HashIndexHeader::VERSION;
+      outHeader.volumeSize = st.st_size;
+      outHeader.volumeTime = st.st_mtime;
+      outHeader.numEntries = (uint32_t)mFiles.size();
+      return true;
+   }
+   
+   // Loads hashes from the index, unless the volume has changed since it was written
+   bool loadHashIndex()
+   {
+      HashIndexHeader expected;
+      if (!getHashIndexHeader(expected))
+         return false;
+      
+      FILE* fp = fopen(getHashIndexPath().c_str(), "rb");
+      if (fp == NULL)
+         return false;
+      
+      mHasHashIndex = true;
+      
+      HashIndexHeader header;
+      bool ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+                memcmp(&header, &expected, sizeof(header)) == 0 &&
+                (mFiles.empty() || fread(&mHashes[0], sizeof(uint64_t), mFiles.size(), fp) == mFiles.size());
+      fclose(fp);
+      
+      if (!ok)
+      {
+         LOG_INFO("Hash index for %s is out of date", mName.c_str());
+         std::fill(mHashes.begin(), mHashes.end(), 0);
+         mHashesDirty = true;
+      }
+      
+      return ok;
+   }
+   
+   bool saveHashIndex()
+   {
+      if (!mHashesDirty || !(mHasHashIndex || smWriteHashIndex))
+         return true;
+      
+      HashIndexHeader header;
+      if (!getHashIndexHeader(header))
+         return false;
+      
+      FILE* fp = fopen(getHashIndexPath().c_str(), "wb");
+      if (fp == NULL)
+      {
+         LOG_WARN("Couldn't write hash index %s", getHashIndexPath().c_str());
+         return false;
+      }
+      
+      bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+                (mFiles.empty() || fwrite(&mHashes[0], sizeof(uint64_t), mFiles.size(), fp) == mFiles.size());
+      fclose(fp);
+      
+      mHasHashIndex = true;
+      mHashesDirty = !ok;
+      return ok;
    }
 };
 
+bool Volume::smWriteHashIndex = false;
+
 class ResManager
 {
 public:
@@ -271,8 +460,42 @@ public:
       EnumEntry(const char *name, uint32_t m) : filename(name), mountIdx(m) {;}
    };
    
+   // Content hash of a loose file, valid while its size and modification time match
+   struct LocalHash
+   {
+      uint64_t size;
+      int64_t time;
+      uint64_t hash;
+   };
+   
    std::vector<Volume*> mVolumes;
    std::vector<std::string> mPaths;
+   std::unordered_map<std::string, LocalHash> mLocalHashes;
+   
+   // Lists of what each of mPaths holds, so files which only live in volumes don't probe every path
+   DirIndex mDirIndex;
+   uint64_t mNumProbes; // fopen and stat calls made looking for loose files
+   
+   ResManager() : mNumProbes(0) {;}
+   
+   // Finds where filename would be in mPaths[pathIdx]. Unless Lookup_Missing, outPath still has to be
+   // opened to find out for sure.
+   DirIndex::Lookup findLocal(uint32_t pathIdx, const char* filename, std::string& outPath)
+   {
+      while (mDirIndex.getNumDirectories() < mPaths.size())
+      {
+         mDirIndex.addDirectory(mPaths[mDirIndex.getNumDirectories()].c_str());
+      }
+      return mDirIndex.find(pathIdx, filename, outPath);
+   }
+   
+   // Picks up changes to the loose directories; called once a frame
+   void pollChanges()
+   {
+      mDirIndex.poll();
+   }
+   
+   inline uint64_t getNumFSCalls() const { return mNumProbes + mDirIndex.getStats().numFSCalls; }
    
    void addVolume(const char *filename)
    {
@@ -288,12 +511,24 @@ public:
          
          vol->mFilePtr = fp;
          vol->mName = filename;
+         vol->loadHashIndex();
          mVolumes.push_back(vol);
       }
    }
    
-   bool openFile(const char *filename, MemRStream &stream, int32_t forceMount=-1)
+   // Writes back any hashes found since the volumes were mounted
+   void saveHashIndexes()
+   {
+      for (Volume* vol : mVolumes)
+      {
+         vol->saveHashIndex();
+      }
+   }
+   
+   // outHash is set to the content hash of the file when given, hashing it if that isn't known yet
+   bool openFile(const char *filename, MemRStream &stream, int32_t forceMount=-1, uint64_t* outHash=NULL)
    {
+      TRACE_ZONE_DETAIL("ResManager::openFile", filename);
       // Check cwd
       int count = 0;
       for (std::string &path: mPaths)
@@ -303,9 +538,16 @@ public:
             count++;
             continue;
          }
-         char buffer[PATH_MAX];
-         snprintf(buffer, PATH_MAX, "%s/%s", path.c_str(), filename);
+         std::string localPath;
+         if (findLocal(count, filename, localPath) == DirIndex::Lookup_Missing)
+         {
+            count++;
+            continue;
+         }
+         
+         const char* buffer = localPath.c_str();
          FILE* fp = fopen(buffer, "rb");
+         mNumProbes++;
          if (fp)
          {
             fseek(fp, 0, SEEK_END);
@@ -316,7 +558,20 @@ public:
             {
                stream = MemRStream(size, data, true);
                fclose(fp);
-               printf("Loaded local file %s\n", buffer);
+               LOG_DEBUG("Loaded local file %s", buffer);
+               AccessTrace::record(filename, path.c_str(), -1, size);
+               
+               if (outHash)
+               {
+                  *outHash = Volume::hashData(data, size);
+                  
+                  struct stat st;
+                  if (stat(buffer, &st) == 0)
+                  {
+                     LocalHash local = {(uint64_t)st.st_size, (int64_t)st.st_mtime, *outHash};
+                     mLocalHashes[buffer] = local;
+                  }
+               }
                return true;
             }
             free(data);
@@ -334,14 +589,197 @@ public:
             count++;
             continue;
          }
-         if (vol->openStream(vol->mFilePtr, filename, stream))
+         int32_t idx = vol->findEntry(filename);
+         if (idx >= 0 && vol->readEntry(vol->mFilePtr, idx, stream))
+         {
+            LOG_DEBUG("Loaded volume file %s from volume", filename);
+            AccessTrace::record(filename, vol->mName.c_str(), idx, stream.mSize);
+            
+            if (outHash)
+            {
+               if (vol->mHashes[idx] == 0)
+                  vol->setEntryHash(idx, Volume::hashData(stream.mPtr, stream.mSize));
+               *outHash = vol->mHashes[idx];
+            }
+            return true;
+         }
+         count++;
+      }
+      
+      return false;
+   }
+   
+   // Loads several files at once, setting outStreams[i] to a new stream or NULL if the file is missing.
+   // Files in the same volume are read together in offset order through a BatchReader, rather than with a
+   // seek and read each. Loose files and compressed volume entries are loaded one at a time as openFile
+   // would. Returns the number loaded.
+   uint32_t openFiles(uint32_t count, const char** filenames, MemRStream** outStreams, int32_t forceMount=-1, uint64_t* outHashes=NULL)
+   {
+      TRACE_ZONE("ResManager::openFiles");
+      std::vector<std::vector<uint32_t>> volumeFiles(mVolumes.size());
+      std::vector<int32_t> entryIdx(count, -1);
+      uint32_t numLoaded = 0;
+      
+      auto openSingle = [&](uint32_t i, int32_t mountIdx){
+         MemRStream* stream = new MemRStream(0, NULL);
+         if (openFile(filenames[i], *stream, mountIdx, outHashes ? &outHashes[i] : NULL))
+         {
+            outStreams[i] = stream;
+            numLoaded++;
+         }
+         else
+         {
+            delete stream;
+         }
+      };
+      
+      for (uint32_t i=0; i<count; i++)
+      {
+         outStreams[i] = NULL;
+         if (outHashes)
+            outHashes[i] = 0;
+         
+         // Same search order as openFile
+         int32_t mountIdx = 0;
+         bool isLocal = false;
+         for (size_t p=0; p<mPaths.size(); p++)
+         {
+            if (forceMount >= 0 && mountIdx != forceMount)
+            {
+               mountIdx++;
+               continue;
+            }
+            std::string localPath;
+            if (findLocal(mountIdx, filenames[i], localPath) == DirIndex::Lookup_Missing)
+            {
+               mountIdx++;
+               continue;
+            }
+            
+            struct stat st;
+            mNumProbes++;
+            if (stat(localPath.c_str(), &st) == 0)
+            {
+               isLocal = true;
+               break;
+            }
+            mountIdx++;
+         }
+         
+         if (isLocal)
+         {
+            openSingle(i, mountIdx);
+            continue;
+         }
+         
+         for (uint32_t v=0; v<mVolumes.size(); v++, mountIdx++)
+         {
+            if (forceMount >= 0 && mountIdx != forceMount)
+               continue;
+            entryIdx[i] = mVolumes[v]->findEntry(filenames[i]);
+            if (entryIdx[i] >= 0)
+            {
+               // Only raw payloads can be batched; anything compressed goes through readEntry
+               if (mVolumes[v]->mFiles[entryIdx[i]].compressType != 0)
+                  openSingle(i, mountIdx);
+               else
+                  volumeFiles[v].push_back(i);
+               break;
+            }
+         }
+      }
+      
+      BatchReader reader;
+      for (uint32_t v=0; v<mVolumes.size(); v++)
+      {
+         Volume* vol = mVolumes[v];
+         const std::vector<uint32_t>& files = volumeFiles[v];
+         if (files.empty())
+            continue;
+         
+         for (uint32_t fileIdx : files)
+         {
+            const Volume::Entry& entry = vol->mFiles[entryIdx[fileIdx]];
+            reader.add((uint64_t)entry.offset + 8, entry.size); // skip past VBLK header
+         }
+         
+         reader.read(fileno(vol->mFilePtr), [&](uint32_t rangeIdx, uint8_t* data, uint32_t size){
+            uint32_t fileIdx = files[rangeIdx];
+            if (data == NULL)
+            {
+               LOG_WARN("Couldn't read %s from %s", filenames[fileIdx], vol->mName.c_str());
+               return;
+            }
+            
+            outStreams[fileIdx] = new MemRStream(size, data, true);
+            numLoaded++;
+            AccessTrace::record(filenames[fileIdx], vol->mName.c_str(), entryIdx[fileIdx], size);
+            
+            if (outHashes)
+            {
+               int32_t idx = entryIdx[fileIdx];
+               if (vol->mHashes[idx] == 0)
+                  vol->setEntryHash(idx, Volume::hashData(data, size));
+               outHashes[fileIdx] = vol->mHashes[idx];
+            }
+         });
+         
+         const BatchReader::Stats& stats = reader.getStats();
+         LOG_DEBUG("Read %u files from %s in %u spans using %s", stats.numRanges, vol->mName.c_str(),
+                   stats.numSpans, BatchReader::getBackendName(stats.backend));
+      }
+      
+      return numLoaded;
+   }
+   
+   // Looks up the content hash of the file openFile would load without reading it. Returns false if the
+   // file is missing or hasn't been hashed yet.
+   bool findFileHash(const char *filename, uint64_t& outHash, int32_t forceMount=-1)
+   {
+      int count = 0;
+      for (size_t p=0; p<mPaths.size(); p++)
+      {
+         if (forceMount >= 0 && count != forceMount)
+         {
+            count++;
+            continue;
+         }
+         std::string localPath;
+         if (findLocal(count, filename, localPath) == DirIndex::Lookup_Missing)
+         {
+            count++;
+            continue;
+         }
+         
+         struct stat st;
+         mNumProbes++;
+         if (stat(localPath.c_str(), &st) == 0)
          {
-            printf("Loaded volume file %s from volume\n", filename);
+            auto itr = mLocalHashes.find(localPath);
+            if (itr == mLocalHashes.end() || itr->second.size != (uint64_t)st.st_size || itr->second.time != (int64_t)st.st_mtime)
+               return false;
+            outHash = itr->second.hash;
             return true;
          }
          count++;
       }
       
+      for (Volume* vol: mVolumes)
+      {
+         if (forceMount >= 0 && count != forceMount)
+         {
+            count++;
+            continue;
+         }
+         int32_t idx = vol->findEntry(filename);
+         if (idx >= 0)
+         {
+            outHash = vol->mHashes[idx];
+            return outHash != 0;
+         }
+         count++;
+      }
+      
       return false;
    }
    
@@ -374,6 +812,64 @@ public:
       
    }
    
+   // Volume file handles owned by a thread other than the main one (see readFile)
+   struct ReadHandles
+   {
+      std::vector<FILE*> volumeFiles;
+      
+      ~ReadHandles()
+      {
+         for (FILE* fp : volumeFiles)
+         {
+            if (fp) fclose(fp);
+         }
+      }
+   };
+   
+   // Reads a file from a specific mount using the given handles instead of the shared volume ones, so it
+   // can be used from a worker. Mounts must not be added while workers are reading.
+   bool readFile(const char *filename, uint32_t mountIdx, ReadHandles &handles, std::vector<uint8_t> &outData)
+   {
+      if (mountIdx < mPaths.size())
+      {
+         char buffer[PATH_MAX];
+         snprintf(buffer, PATH_MAX, "%s/%s", mPaths[mountIdx].c_str(), filename);
+         FILE* fp = fopen(buffer, "rb");
+         if (fp == NULL)
+            return false;
+         
+         fseek(fp, 0, SEEK_END);
+         long size = ftell(fp);
+         fseek(fp, 0, SEEK_SET);
+         outData.resize(size);
+         bool ok = size <= 0 || fread(&outData[0], size, 1, fp) == 1;
+         fclose(fp);
+         if (ok)
+            AccessTrace::record(filename, mPaths[mountIdx].c_str(), -1, (uint32_t)size);
+         return ok;
+      }
+      
+      uint32_t volIdx = mountIdx - (uint32_t)mPaths.size();
+      if (volIdx >= mVolumes.size())
+         return false;
+      
+      if (handles.volumeFiles.size() <= volIdx)
+         handles.volumeFiles.resize(volIdx+1, NULL);
+      if (handles.volumeFiles[volIdx] == NULL)
+         handles.volumeFiles[volIdx] = fopen(mVolumes[volIdx]->mName.c_str(), "rb");
+      if (handles.volumeFiles[volIdx] == NULL)
+         return false;
+      
+      MemRStream stream(0, NULL);
+      int32_t idx = mVolumes[volIdx]->findEntry(filename);
+      if (idx < 0 || !mVolumes[volIdx]->readEntry(handles.volumeFiles[volIdx], idx, stream))
+         return false;
+      
+      outData.assign(stream.mPtr, stream.mPtr + stream.mSize);
+      AccessTrace::record(filename, mVolumes[volIdx]->mName.c_str(), idx, stream.mSize);
+      return true;
+   }
+   
    void enumerateVolume(uint32_t idx, std::vector<EnumEntry> &outList, std::vector<std::string> *restrictExts)
    {
       for (Volume::Entry &e : mVolumes[idx]->mFiles)
@@ -661,7 +1157,9 @@ public:
    std::vector<Frame> mFrames;
    std::vector<uint32_t> mFixedFrameOffsets;
    
-   CelAnimMesh()
+   MemTrack::Allocation mMemTrack;
+   
+   CelAnimMesh() : mMemTrack(MemTrack::Category_Assets)
    {
    }
    
@@ -796,6 +1294,11 @@ public:
          mem.read(numFrames * sizeof(Frame), &mFrames[0]);
       }
       
+      mMemTrack.set(MemTrack::getVectorBytes(mVerts) +
+                    MemTrack::getVectorBytes(mTexVerts) +
+                    MemTrack::getVectorBytes(mFaces) +
+                    MemTrack::getVectorBytes(mFrames));
+      
       return true;
    }
 };
@@ -1379,8 +1882,9 @@ public:
    std::vector<uint8_t> mPinMap[11];
    std::vector<uint16_t> mLightMap;
    
+   MemTrack::Allocation mMemTrack;
    
-   TerrainBlock(TerrainBlockList* owner = NULL) : mOwner(owner)
+   TerrainBlock(TerrainBlockList* owner = NULL) : mOwner(owner), mMemTrack(MemTrack::Category_Assets)
    {
    }
    
@@ -1619,6 +2123,7 @@ public:
          }
       }
       
+      updateMemTrack();
       return true;
    }
    
@@ -1640,6 +2145,20 @@ public:
    {
       mGridMapBase.resize(mSize[0] * mSize[1]);
       processGrid();
+      updateMemTrack();
+   }
+   
+   void updateMemTrack()
+   {
+      size_t bytes = MemTrack::getVectorBytes(mHeightMap) +
+                     MemTrack::getVectorBytes(mMatMap) +
+                     MemTrack::getVectorBytes(mGridMapBase) +
+                     MemTrack::getVectorBytes(mLightMap);
+      for (std::vector<uint8_t>& pinMap : mPinMap)
+      {
+         bytes += MemTrack::getVectorBytes(pinMap);
+      }
+      mMemTrack.set(bytes);
    }
    
    void processGrid()
@@ -1813,9 +2332,14 @@ inline TerrainBlockList::~TerrainBlockList()
 
 inline void TerrainBlockList::loadBlocks(ResManager& mgr, const char* baseName, int volIdx)
 {
-   for (BlockInfo& info : mBlocks)
+   // Volume reads share file handles so stay on this thread, then the blocks are decoded in parallel
+   std::vector<MemRStream*> streams(mBlocks.size(), NULL);
+   std::vector<std::string> names(mBlocks.size());
+   std::vector<const char*> nameList(mBlocks.size());
+   
+   for (uint32_t i=0; i<mBlocks.size(); i++)
    {
-      MemRStream rStream(0, NULL);
+      BlockInfo& info = mBlocks[i];
       
       if (info.instance)
       {
@@ -1825,11 +2349,22 @@ inline void TerrainBlockList::loadBlocks(ResManager& mgr, const char* baseName,
       
       char buffer[256];
       snprintf(buffer, 256, "%s#%i.dtb", baseName, info.ident);
-      
-      if (mgr.openFile(buffer, rStream, volIdx))
+      names[i] = buffer;
+      nameList[i] = names[i].c_str();
+   }
+   
+   if (!mBlocks.empty())
+      mgr.openFiles((uint32_t)mBlocks.size(), &nameList[0], &streams[0], volIdx);
+   
+   JobSystem::parallelFor(0, (uint32_t)mBlocks.size(), 1, [this, &streams](uint32_t start, uint32_t end){
+      for (uint32_t i=start; i<end; i++)
       {
+         if (streams[i] == NULL)
+            continue;
+         
+         BlockInfo& info = mBlocks[i];
          info.instance = new TerrainBlock(this);
-         if (!info.instance->read(rStream))
+         if (!info.instance->read(*streams[i]))
          {
             delete info.instance;
             info.instance = NULL;
@@ -1838,8 +2373,11 @@ inline void TerrainBlockList::loadBlocks(ResManager& mgr, const char* baseName,
          {
             info.instance->buildGridMap();
          }
+         
+         delete streams[i];
+         streams[i] = NULL;
       }
-   }
+   });
 }
 
 inline void TerrainBlockList::setSingleBlock(TerrainBlock* block)
@@ -1977,17 +2515,291 @@ public:
       NodeChildInfo() : firstChild(-1), numChildren(0) {;}
    };
    
-   // Main data
-   float mRadius;
-   slm::vec3 mCenter;
-   slm::vec3 mMinBounds;
-   slm::vec3 mMaxBounds;
+   // Record layouts from before version 8, which stored most fields as 32bit values. Each converts to the
+   // runtime struct with convert(), and readFields() reads one record a field at a time (as read() used
+   // to) so the two can be checked against each other.
    
-   std::vector<Node> mNodes;
-   std::vector<Sequence> mSequences;
-   std::vector<SubSequence> mSubSequences;
-   std::vector<Keyframe> mKeyframes;
-   std::vector<Transform> mTransforms;
+   struct NodeV7
+   {
+      int32_t name;
+      int32_t parent;
+      int32_t numSubSequences;
+      int32_t firstSubSequence;
+      int32_t defaultTransform;
+      
+      inline void convert(Node &dest) const
+      {
+         dest.name = name;
+         dest.parent = parent;
+         dest.numSubSequences = numSubSequences;
+         dest.firstSubSequence = firstSubSequence;
+         dest.defaultTransform = defaultTransform;
+      }
+      
+      static void readFields(MemRStream &mem, Node &dest)
+      {
+         int32_t tmp=0; mem.read(tmp); dest.name = tmp;
+         mem.read(tmp); dest.parent = tmp;
+         mem.read(tmp); dest.numSubSequences = tmp;
+         mem.read(tmp); dest.firstSubSequence = tmp;
+         mem.read(tmp); dest.defaultTransform = tmp;
+      }
+   };
+   
+   struct SequenceV3
+   {
+      int32_t name;
+      int32_t cyclic;
+      float duration;
+      int32_t priority;
+      
+      inline void convert(Sequence &dest) const
+      {
+         dest.name = name;
+         dest.cyclic = cyclic;
+         dest.duration = duration;
+         dest.priority = priority;
+         dest.firstTriggerFrame = dest.numTriggerFrames = 0;
+         dest.numIFLSubSequences = dest.firstIFLSubSequence = 0;
+      }
+      
+      static void readFields(MemRStream &mem, Sequence &dest)
+      {
+         mem.read(dest.name);
+         mem.read(dest.cyclic);
+         mem.read(dest.duration);
+         mem.read(dest.priority);
+         dest.firstTriggerFrame = dest.numTriggerFrames = 0;
+         dest.numIFLSubSequences = dest.firstIFLSubSequence = 0;
+      }
+   };
+   
+   struct SequenceV4
+   {
+      int32_t name;
+      int32_t cyclic;
+      float duration;
+      int32_t priority;
+      int32_t firstTriggerFrame;
+      int32_t numTriggerFrames;
+      
+      inline void convert(Sequence &dest) const
+      {
+         dest.name = name;
+         dest.cyclic = cyclic;
+         dest.duration = duration;
+         dest.priority = priority;
+         dest.firstTriggerFrame = firstTriggerFrame;
+         dest.numTriggerFrames = numTriggerFrames;
+         dest.numIFLSubSequences = dest.firstIFLSubSequence = 0;
+      }
+      
+      static void readFields(MemRStream &mem, Sequence &dest)
+      {
+         mem.read(dest.name);
+         mem.read(dest.cyclic);
+         mem.read(dest.duration);
+         mem.read(dest.priority);
+         mem.read(dest.firstTriggerFrame);
+         mem.read(dest.numTriggerFrames);
+         dest.numIFLSubSequences = dest.firstIFLSubSequence = 0;
+      }
+   };
+   
+   struct SubSequenceV7
+   {
+      int32_t sequenceIdx;
+      int32_t numKeyFrames;
+      int32_t firstKeyFrame;
+      
+      inline void convert(SubSequence &dest) const
+      {
+         dest.sequenceIdx = sequenceIdx;
+         dest.numKeyFrames = numKeyFrames;
+         dest.firstKeyFrame = firstKeyFrame;
+      }
+      
+      static void readFields(MemRStream &mem, SubSequence &dest)
+      {
+         int32_t tmp=0;
+         mem.read(tmp); dest.sequenceIdx = tmp;
+         mem.read(tmp); dest.numKeyFrames = tmp;
+         mem.read(tmp); dest.firstKeyFrame = tmp;
+      }
+   };
+   
+   struct KeyframeV2
+   {
+      float pos;
+      uint32_t key; // includes flags
+      
+      inline void convert(Keyframe &dest) const
+      {
+         dest.pos = pos;
+         dest.key = key & KEYFRAME_KEY_MASK_V2;
+         dest.matIndex = KEYFRAME_FRAME_MATTERS |
+                         ((key & KEYFRAME_VALID_V2) ? 0 : KEYFRAME_VIS_MATTERS) |
+                         ((key & KEYFRAME_VIS_V2) ? KEYFRAME_VIS : 0);
+      }
+      
+      static void readFields(MemRStream &mem, Keyframe &dest)
+      {
+         mem.read(dest.pos);
+         uint32_t tmp=0; mem.read(tmp);
+         dest.key = tmp & KEYFRAME_KEY_MASK_V2;
+         dest.matIndex = KEYFRAME_FRAME_MATTERS;
+         if (!(tmp & KEYFRAME_VALID_V2)) dest.matIndex |= KEYFRAME_VIS_MATTERS;
+         if (tmp & KEYFRAME_VIS_V2) dest.matIndex |= KEYFRAME_VIS;
+      }
+   };
+   
+   struct KeyframeV7
+   {
+      float pos;
+      uint32_t key;
+      uint32_t matIndex; // includes flags
+      
+      inline void convert(Keyframe &dest) const
+      {
+         dest.pos = pos;
+         dest.key = key;
+         dest.matIndex = (matIndex & KEYFRAME_MAT_MASK_V7) |
+                         ((matIndex & KEYFRAME_VIS_V2) ? KEYFRAME_VIS : 0) |
+                         ((matIndex & KEYFRAME_VIS_MATTERS_V7) ? KEYFRAME_VIS_MATTERS : 0) |
+                         ((matIndex & KEYFRAME_FRAME_MATTERS_V7) ? KEYFRAME_FRAME_MATTERS : 0) |
+                         ((matIndex & KEYFRAME_MAT_MATTERS_V7) ? KEYFRAME_MAT_MATTERS : 0);
+      }
+      
+      static void readFields(MemRStream &mem, Keyframe &dest)
+      {
+         mem.read(dest.pos);
+         uint32_t tmp=0; mem.read(tmp); dest.key = tmp;
+         mem.read(tmp); dest.matIndex = tmp & KEYFRAME_MAT_MASK_V7;
+         if (tmp & KEYFRAME_VIS_V2) dest.matIndex |= KEYFRAME_VIS;
+         if (tmp & KEYFRAME_VIS_MATTERS_V7) dest.matIndex |= KEYFRAME_VIS_MATTERS;
+         if (tmp & KEYFRAME_FRAME_MATTERS_V7) dest.matIndex |= KEYFRAME_FRAME_MATTERS;
+         if (tmp & KEYFRAME_MAT_MATTERS_V7) dest.matIndex |= KEYFRAME_MAT_MATTERS;
+      }
+   };
+   
+   struct TransformV6
+   {
+      slm::quat rot;
+      slm::vec3 pos;
+      slm::vec3 scale;
+      
+      inline void convert(Transform &dest) const
+      {
+         dest.rot = Quat16(rot);
+         dest.pos = pos;
+      }
+      
+      static void readFields(MemRStream &mem, Transform &dest)
+      {
+         readV6Transform(mem, dest);
+      }
+   };
+   
+   struct TransformV7
+   {
+      Quat16 rot;
+      slm::vec3 pos;
+      slm::vec3 scale;
+      
+      inline void convert(Transform &dest) const
+      {
+         dest.rot = rot;
+         dest.pos = pos;
+      }
+      
+      static void readFields(MemRStream &mem, Transform &dest)
+      {
+         readV7Transform(mem, dest);
+      }
+   };
+   
+   template<typename XfmT> struct TransitionV7
+   {
+      int32_t startSequence;
+      int32_t endSequence;
+      float startPosition;
+      float endPosition;
+      float duration;
+      XfmT transform;
+      
+      inline void convert(Transition &dest) const
+      {
+         dest.startSequence = startSequence;
+         dest.endSequence = endSequence;
+         dest.startPosition = startPosition;
+         dest.endPosition = endPosition;
+         dest.duration = duration;
+         transform.convert(dest.transform);
+      }
+      
+      static void readFields(MemRStream &mem, Transition &dest)
+      {
+         mem.read(dest.startSequence);
+         mem.read(dest.endSequence);
+         mem.read(dest.startPosition);
+         mem.read(dest.endPosition);
+         mem.read(dest.duration);
+         XfmT::readFields(mem, dest.transform);
+      }
+   };
+   
+   struct ObjectV7
+   {
+      int16_t name;
+      uint16_t flags;
+      int32_t meshIndex;
+      int32_t nodeIndex;
+      uint32_t objectFlags;
+      float rotm[9];
+      slm::vec3 offset;
+      int32_t numSubSequences;
+      int32_t firstSubSequence;
+      
+      inline void convert(Object &dest) const
+      {
+         dest.name = name;
+         dest.flags = flags;
+         dest.meshIndex = meshIndex;
+         dest.nodeIndex = nodeIndex;
+         dest.offset = offset;
+         dest.numSubSequences = numSubSequences;
+         dest.firstSubSequence = firstSubSequence;
+      }
+      
+      static void readFields(MemRStream &mem, Object &dest)
+      {
+         mem.read(dest.name);
+         mem.read(dest.flags);
+         mem.read(dest.meshIndex);
+         int32_t tmpi=0;
+         mem.read(tmpi); dest.nodeIndex = tmpi;
+         mem.setPosition(mem.mPos + sizeof(uint32_t) + (sizeof(float)*3*3)); // Skip past flags and rotm
+         mem.read(dest.offset);
+         mem.read(tmpi); dest.numSubSequences = tmpi;
+         mem.read(tmpi); dest.firstSubSequence = tmpi;
+      }
+   };
+   
+   static_assert(sizeof(NodeV7) == 20 && sizeof(SubSequenceV7) == 12 && sizeof(KeyframeV7) == 12 &&
+                 sizeof(TransformV6) == 40 && sizeof(TransformV7) == 32 && sizeof(ObjectV7) == 72,
+                 "Legacy shape records need to match the file layout");
+   
+   // Main data
+   float mRadius;
+   slm::vec3 mCenter;
+   slm::vec3 mMinBounds;
+   slm::vec3 mMaxBounds;
+   
+   std::vector<Node> mNodes;
+   std::vector<Sequence> mSequences;
+   std::vector<SubSequence> mSubSequences;
+   std::vector<Keyframe> mKeyframes;
+   std::vector<Transform> mTransforms;
    std::vector<Object> mObjects;
    std::vector<Detail> mDetails;
    std::vector<Transition> mTransitions;
@@ -1995,6 +2807,23 @@ public:
    std::vector<CelAnimMesh*> mMeshes;
    std::vector<std::string> mNames;
    
+   // Case folded hash table over mNames (open addressing, slots hold name index+1), plus the first node,
+   // sequence and object using each name. Built by setupNameIndex.
+   std::vector<uint32_t> mNameTable;
+   std::vector<int32_t> mNameNodes;
+   std::vector<int32_t> mNameSequences;
+   std::vector<int32_t> mNameObjects;
+   
+   // Where each persisted mesh sits in mMeshData. Only kept when meshes are deferred (see smDeferMeshes).
+   struct MeshSource
+   {
+      uint32_t offset;
+      uint32_t size;
+   };
+   
+   std::vector<MeshSource> mMeshSources;
+   std::vector<uint8_t> mMeshData;
+   
    MaterialList* mMaterials;
    int32_t mDefaultMaterials;
    int32_t mAlwaysNode;
@@ -2003,6 +2832,13 @@ public:
    std::vector<NodeChildInfo> mNodeChildren;
    std::vector<uint32_t> mNodeChildIds;
    
+   // Reads legacy records a field at a time instead of in bulk. Only used to check one against the other.
+   static thread_local bool smFieldwiseRecords;
+   
+   // When set, read() leaves mMeshes NULL and keeps the raw mesh data around for decodeMesh. Set per thread
+   // around createFromStream so other loaders still get fully decoded shapes.
+   static thread_local bool smDeferMeshes;
+   
    Shape() : mMaterials(NULL)
    {
    }
@@ -2012,22 +2848,63 @@ public:
       if (mMaterials) delete mMaterials;
    }
    
-   int findName(const char *name)
+   static inline uint32_t hashName(std::string_view name)
    {
-      for (int i=0, sz = mNames.size(); i<sz; i++)
+      // FNV-1a over the lower case name
+      uint32_t hash = 2166136261u;
+      for (char c : name)
       {
-         if (strcasecmp(name, mNames[i].c_str()) == 0)
-            return i;
+         hash ^= (uint8_t)tolower((uint8_t)c);
+         hash *= 16777619u;
+      }
+      return hash;
+   }
+   
+   // Case insensitive, returns -1 if the shape doesn't have the name
+   int32_t findName(std::string_view name) const
+   {
+      if (mNameTable.empty())
+         return -1;
+      
+      const uint32_t mask = (uint32_t)mNameTable.size() - 1;
+      for (uint32_t slot = hashName(name) & mask; mNameTable[slot] != 0; slot = (slot + 1) & mask)
+      {
+         const std::string& candidate = mNames[mNameTable[slot]-1];
+         if (candidate.size() == name.size() && strncasecmp(candidate.data(), name.data(), name.size()) == 0)
+            return (int32_t)mNameTable[slot]-1;
       }
       return -1;
    }
    
+   int32_t findNode(std::string_view name) const
+   {
+      int32_t nameIdx = findName(name);
+      return nameIdx < 0 ? -1 : mNameNodes[nameIdx];
+   }
+   
+   int32_t findSequence(std::string_view name) const
+   {
+      int32_t nameIdx = findName(name);
+      return nameIdx < 0 ? -1 : mNameSequences[nameIdx];
+   }
+   
+   int32_t findObject(std::string_view name) const
+   {
+      int32_t nameIdx = findName(name);
+      return nameIdx < 0 ? -1 : mNameObjects[nameIdx];
+   }
+   
    const char *getName(int32_t idx)
    {
       return mNames[idx].c_str();
    }
    
-   inline void readV6Transform(MemRStream &mem, Transform &outXfm)
+   std::string_view getNameView(int32_t idx) const
+   {
+      return mNames[idx];
+   }
+   
+   static inline void readV6Transform(MemRStream &mem, Transform &outXfm)
    {
       slm::quat rot;
       slm::vec3 scale;
@@ -2037,7 +2914,7 @@ public:
       outXfm.rot = Quat16(rot);
    }
    
-   inline void readV7Transform(MemRStream &mem, Transform &outXfm)
+   static inline void readV7Transform(MemRStream &mem, Transform &outXfm)
    {
       slm::vec3 scale;
       mem.read(outXfm.rot);
@@ -2045,6 +2922,74 @@ public:
       mem.read(scale);
    }
    
+   // Reads count records stored as DiskT and converts them. The whole block is bounds checked once and each
+   // layout gets its own loop, so converting is a run of plain loads and stores rather than a checked read
+   // per field.
+   template<typename DiskT, typename T> static bool readRecords(MemRStream &mem, uint32_t count, std::vector<T> &outList)
+   {
+      if (smFieldwiseRecords)
+      {
+         outList.resize(count);
+         for (uint32_t i=0; i<count; i++)
+            DiskT::readFields(mem, outList[i]);
+         return true;
+      }
+      
+      const uint64_t bytes = (uint64_t)count * sizeof(DiskT);
+      if (mem.mPos > mem.mSize || bytes > mem.mSize - mem.mPos)
+         return false;
+      
+      outList.resize(count);
+      const uint8_t* src = mem.mPtr + mem.mPos;
+      T* dest = outList.data();
+      for (uint32_t i=0; i<count; i++)
+      {
+         DiskT rec;
+         memcpy(&rec, src + (i * sizeof(DiskT)), sizeof(DiskT));
+         rec.convert(dest[i]);
+      }
+      
+      mem.mPos += (uint32_t)bytes;
+      return true;
+   }
+   
+   void setupNameIndex()
+   {
+      uint32_t tableSize = 1;
+      while (tableSize < mNames.size() * 2)
+         tableSize <<= 1;
+      
+      mNameTable.assign(mNames.empty() ? 0 : tableSize, 0);
+      for (uint32_t i=0; i<mNames.size(); i++)
+      {
+         const uint32_t mask = tableSize - 1;
+         uint32_t slot = hashName(mNames[i]) & mask;
+         while (mNameTable[slot] != 0)
+            slot = (slot + 1) & mask;
+         mNameTable[slot] = i+1;
+      }
+      
+      // The first user of a name wins, as with the old linear scans
+      mNameNodes.assign(mNames.size(), -1);
+      mNameSequences.assign(mNames.size(), -1);
+      mNameObjects.assign(mNames.size(), -1);
+      for (int32_t i=(int32_t)mNodes.size()-1; i>=0; i--)
+      {
+         if (mNodes[i].name >= 0 && mNodes[i].name < (int32_t)mNames.size())
+            mNameNodes[mNodes[i].name] = i;
+      }
+      for (int32_t i=(int32_t)mSequences.size()-1; i>=0; i--)
+      {
+         if (mSequences[i].name >= 0 && mSequences[i].name < (int32_t)mNames.size())
+            mNameSequences[mSequences[i].name] = i;
+      }
+      for (int32_t i=(int32_t)mObjects.size()-1; i>=0; i--)
+      {
+         if (mObjects[i].name >= 0 && mObjects[i].name < (int32_t)mNames.size())
+            mNameObjects[mObjects[i].name] = i;
+      }
+   }
+   
    void setupNodeList()
    {
       // Setup child node lists
@@ -2133,131 +3078,75 @@ public:
       
       // Arrays
       
-      mNodes.resize(numNodes);
+      bool ok = true;
       if (version <= 7)
       {
-         for (int i=0; i<numNodes; i++)
-         {
-            Node* dest = &mNodes[i];
-            int32_t tmp; mem.read(tmp); dest->name = tmp;
-            mem.read(tmp); dest->parent = tmp;
-            mem.read(tmp); dest->numSubSequences = tmp;
-            mem.read(tmp); dest->firstSubSequence = tmp;
-            mem.read(tmp); dest->defaultTransform = tmp;
-         }
+         ok = readRecords<NodeV7>(mem, numNodes, mNodes);
       }
       else
       {
+         mNodes.resize(numNodes);
          mem.read( sizeof(Node)*numNodes, &mNodes[0]);
       }
       
-      mSequences.resize(numSequences);
       if (version >= 5)
       {
+         mSequences.resize(numSequences);
          mem.read( sizeof(Sequence)*numSequences, &mSequences[0]);
       }
       else if (version >= 4)
       {
-         for (int i=0; i<numSequences; i++)
-         {
-            Sequence* dest = &mSequences[i];
-            mem.read(dest->name);
-            mem.read(dest->cyclic);
-            mem.read(dest->duration);
-            mem.read(dest->priority);
-            mem.read(dest->firstTriggerFrame);
-            mem.read(dest->numTriggerFrames);
-            dest->numIFLSubSequences = dest->numIFLSubSequences = 0;
-         }
+         ok = ok && readRecords<SequenceV4>(mem, numSequences, mSequences);
       }
       else
       {
-         for (int i=0; i<numSequences; i++)
-         {
-            Sequence* dest = &mSequences[i];
-            mem.read(dest->name);
-            mem.read(dest->cyclic);
-            mem.read(dest->duration);
-            mem.read(dest->priority);
-            dest->numTriggerFrames = dest->numTriggerFrames = dest->numIFLSubSequences = dest->numIFLSubSequences = 0;
-         }
+         ok = ok && readRecords<SequenceV3>(mem, numSequences, mSequences);
       }
       
       // SubSequences
-      mSubSequences.resize(numSubSequences);
       if (version <= 7)
       {
-         for (int i=0; i<numSubSequences; i++)
-         {
-            SubSequence* dest = &mSubSequences[i];
-            int32_t tmp=0;
-            mem.read(tmp); dest->sequenceIdx = tmp;
-            mem.read(tmp); dest->numKeyFrames = tmp;
-            mem.read(tmp); dest->firstKeyFrame = tmp;
-         }
+         ok = ok && readRecords<SubSequenceV7>(mem, numSubSequences, mSubSequences);
       }
       else
       {
+         mSubSequences.resize(numSubSequences);
          mem.read( sizeof(SubSequence)*numSubSequences, &mSubSequences[0]);
       }
       
       // Keyframes
-      mKeyframes.resize(numKeyframes);
       if (version < 3)
       {
-         for (int i=0; i<numKeyframes; i++)
-         {
-            Keyframe* dest = &mKeyframes[i];
-            mem.read(dest->pos);
-            uint32_t tmp; mem.read(tmp);
-            dest->key = tmp & KEYFRAME_KEY_MASK_V2;
-            dest->matIndex = KEYFRAME_FRAME_MATTERS;
-            if (!(tmp & KEYFRAME_VALID_V2)) dest->matIndex |= KEYFRAME_VIS_MATTERS;
-            if (tmp & KEYFRAME_VIS_V2) dest->matIndex |= KEYFRAME_VIS;
-         }
+         ok = ok && readRecords<KeyframeV2>(mem, numKeyframes, mKeyframes);
       }
       else if (version <= 7)
       {
-         for (int i=0; i<numKeyframes; i++)
-         {
-            Keyframe* dest = &mKeyframes[i];
-            mem.read(dest->pos);
-            uint32_t tmp; mem.read(tmp); dest->key = tmp;
-            mem.read(tmp); dest->matIndex = tmp & KEYFRAME_MAT_MASK_V7;
-            if (tmp & KEYFRAME_VIS_V2) dest->matIndex |= KEYFRAME_VIS;
-            if (tmp & KEYFRAME_VIS_MATTERS_V7) dest->matIndex |= KEYFRAME_VIS_MATTERS;
-            if (tmp & KEYFRAME_FRAME_MATTERS_V7) dest->matIndex |= KEYFRAME_FRAME_MATTERS;
-            if (tmp & KEYFRAME_MAT_MATTERS_V7) dest->matIndex |= KEYFRAME_MAT_MATTERS;
-         }
+         ok = ok && readRecords<KeyframeV7>(mem, numKeyframes, mKeyframes);
       }
       else
       {
+         mKeyframes.resize(numKeyframes);
          mem.read( sizeof(Keyframe)*numKeyframes, &mKeyframes[0]);
       }
       
       // Transforms
-      mTransforms.resize(numTransforms);
       if (version < 7)
       {
-         for (int i=0; i<numTransforms; i++)
-         {
-            Transform* dest = &mTransforms[i];
-            readV6Transform(mem, *dest);
-         }
+         ok = ok && readRecords<TransformV6>(mem, numTransforms, mTransforms);
       }
       else if (version == 7)
       {
-         for (int i=0; i<numTransforms; i++)
-         {
-            Transform* dest = &mTransforms[i];
-            readV7Transform(mem, *dest);
-         }
+         ok = ok && readRecords<TransformV7>(mem, numTransforms, mTransforms);
       }
       else
       {
+         mTransforms.resize(numTransforms);
          mem.read( sizeof(Transform)*numTransforms, &mTransforms[0]);
       }
       
+      if (!ok)
+         return false;
+      
       mNames.resize(numNames);
       char* tmpName = new char[numNames*24];
       mem.read(numNames*24, tmpName);
@@ -2269,25 +3158,14 @@ public:
       delete[] tmpName;
       
       // Objects
-      mObjects.resize(numObjects);
       if (version <= 7)
       {
-         for (int i=0; i<numObjects; i++)
-         {
-            Object* dest = &mObjects[i];
-            mem.read(dest->name);
-            mem.read(dest->flags);
-            mem.read(dest->meshIndex);
-            int32_t tmpi=0;
-            mem.read(tmpi); dest->nodeIndex = tmpi;
-            mem.setPosition(mem.mPos + sizeof(uint32_t) + (sizeof(float)*3*3)); // Skip past flags and rotm
-            mem.read(dest->offset);
-            mem.read(tmpi); dest->numSubSequences = tmpi;
-            mem.read(tmpi); dest->firstSubSequence = tmpi;
-         }
+         if (!readRecords<ObjectV7>(mem, numObjects, mObjects))
+            return false;
       }
       else
       {
+         mObjects.resize(numObjects);
          mem.read( sizeof(Object)*numObjects, &mObjects[0]);
       }
       
@@ -2298,35 +3176,19 @@ public:
       // Transitions
       if (version >= 2)
       {
-         mTransitions.resize(numTransitions);
          if (version < 7)
          {
-            for (int i=0; i<numTransitions; i++)
-            {
-               Transition* dest = &mTransitions[i];
-               mem.read(dest->startSequence);
-               mem.read(dest->endSequence);
-               mem.read(dest->startPosition);
-               mem.read(dest->endPosition);
-               mem.read(dest->duration);
-               readV6Transform(mem, dest->transform);
-            }
+            if (!readRecords< TransitionV7<TransformV6> >(mem, numTransitions, mTransitions))
+               return false;
          }
          else if (version == 7)
          {
-            for (int i=0; i<numTransitions; i++)
-            {
-               Transition* dest = &mTransitions[i];
-               mem.read(dest->startSequence);
-               mem.read(dest->endSequence);
-               mem.read(dest->startPosition);
-               mem.read(dest->endPosition);
-               mem.read(dest->duration);
-               readV7Transform(mem, dest->transform);
-            }
+            if (!readRecords< TransitionV7<TransformV7> >(mem, numTransitions, mTransitions))
+               return false;
          }
          else
          {
+            mTransitions.resize(numTransitions);
             mem.read( sizeof(Transition)*numTransitions, &mTransitions[0]);
          }
       }
@@ -2345,9 +3207,34 @@ public:
       
       // Meshes
       mMeshes.resize(numMeshes);
-      for (int i=0; i<numMeshes; i++)
+      if (smDeferMeshes)
+      {
+         // Skip over each mesh block, noting where it is so it can be decoded later
+         uint32_t meshStart = mem.getPosition();
+         mMeshSources.resize(numMeshes);
+         for (uint32_t i=0; i<numMeshes; i++)
+         {
+            IFFBlock block;
+            uint32_t blockStart = mem.getPosition();
+            mem.read(block);
+            uint32_t blockEnd = mem.getPosition() + block.getSize();
+            if (blockEnd > mem.mSize)
+               return false;
+            mem.setPosition(blockEnd);
+            
+            mMeshes[i] = NULL;
+            mMeshSources[i].offset = blockStart - meshStart;
+            mMeshSources[i].size = blockEnd - blockStart;
+         }
+         
+         mMeshData.assign(mem.mPtr + meshStart, mem.mPtr + mem.getPosition());
+      }
+      else
       {
-         mMeshes[i] = (CelAnimMesh*)DarkstarPersistObject::createFromStream(mem);
+         for (int i=0; i<numMeshes; i++)
+         {
+            mMeshes[i] = (CelAnimMesh*)DarkstarPersistObject::createFromStream(mem);
+         }
       }
       
       uint32_t hasMaterials;
@@ -2359,2308 +3246,6307 @@ public:
       }
       
       setupNodeList();
+      setupNameIndex();
       
       return true;
    }
+   
+   // Decodes a deferred mesh without touching the shape, so meshes can be decoded on any thread while
+   // mMeshData is left alone.
+   CelAnimMesh* decodeMesh(uint32_t meshIdx) const
+   {
+      if (meshIdx >= mMeshSources.size())
+         return NULL;
+      
+      const MeshSource& src = mMeshSources[meshIdx];
+      MemRStream mem(src.size, (void*)&mMeshData[src.offset]);
+      DarkstarPersistObject* obj = DarkstarPersistObject::createFromStream(mem);
+      CelAnimMesh* mesh = dynamic_cast<CelAnimMesh*>(obj);
+      if (mesh == NULL && obj)
+         delete obj;
+      return mesh;
+   }
+   
+   // Drops the raw mesh data once every mesh has been decoded
+   void releaseMeshData()
+   {
+      mMeshSources.clear();
+      mMeshData.clear();
+      mMeshData.shrink_to_fit();
+   }
 };
 
-void DarkstarPersistObject::initStatics()
-{
-   registerClass("TS::MaterialList", &_createClass<MaterialList>);
-   registerClass("TS::Shape", &_createClass<Shape>);
-   registerClass("TS::CelAnimMesh", &_createClass<CelAnimMesh>);
-   registerClass("ITRGeometry", &_createClass<InteriorGeom>);
-}
-
+thread_local bool Shape::smFieldwiseRecords = false;
+thread_local bool Shape::smDeferMeshes = false;
 
-class GenericViewer
+// Builds the triangles for a shape's browser thumbnail: the highest detail in its default pose.
+// Called from the thumbnail worker, so it only touches the shape it loads.
+static bool getShapeThumbnailTris(const std::vector<uint8_t>& data, std::vector<slm::vec3>& outTris)
 {
-public:
+   if (data.empty())
+      return false;
    
-   struct LoadedTexture
+   MemRStream mem((uint32_t)data.size(), (void*)&data[0]);
+   DarkstarPersistObject* obj = DarkstarPersistObject::createFromStream(mem);
+   Shape* shape = dynamic_cast<Shape*>(obj);
+   if (shape == NULL)
    {
-      int32_t texID;
-      uint32_t bmpFlags;
-      uint16_t width, height;
-      
-      LoadedTexture() {;}
-      LoadedTexture(int32_t tid, uint32_t bf) : texID(tid), bmpFlags(bf) {;}
-   };
+      if (obj) delete obj;
+      return false;
+   }
    
-   struct ActiveMaterial
+   if (shape->mDetails.empty() || shape->mNodes.empty())
    {
-      LoadedTexture tex;
-   };
-   
-   std::vector<ActiveMaterial> mActiveMaterials;
-   std::unordered_map<std::string, LoadedTexture> mLoadedTextures;
-   ActiveMaterial mSharedMaterials;
-   
-   ResManager* mResourceManager;
-   Palette* mPalette;
-   MaterialList* mMaterialList;
+      delete shape;
+      return false;
+   }
    
-   bool initVB;
-   bool useShared;
+   // Default transforms for nodes under the highest detail
+   std::vector<slm::mat4> nodeXfms(shape->mNodes.size(), slm::mat4(1));
+   std::vector<uint8_t> inDetail(shape->mNodes.size(), 0);
+   std::vector<int32_t> pending;
+   pending.push_back(shape->mDetails[0].rootNode);
    
-   slm::mat4 mProjectionMatrix;
-   slm::mat4 mModelMatrix;
-   slm::mat4 mViewMatrix;
+   while (!pending.empty())
+   {
+      int32_t nodeIdx = pending.back();
+      pending.pop_back();
+      if (nodeIdx < 0 || nodeIdx >= (int32_t)shape->mNodes.size() || inDetail[nodeIdx])
+         continue;
+      
+      Shape::Node& node = shape->mNodes[nodeIdx];
+      slm::mat4 xfmLocal(1);
+      if (node.defaultTransform >= 0 && node.defaultTransform < (int32_t)shape->mTransforms.size())
+      {
+         Shape::Transform& xfmShape = shape->mTransforms[node.defaultTransform];
+         CompatQuatSetMatrix(xfmShape.rot.toQuat(), xfmLocal);
+         xfmLocal[3] = slm::vec4(xfmShape.pos.x, xfmShape.pos.y, xfmShape.pos.z, 1);
+      }
+      
+      nodeXfms[nodeIdx] = (node.parent >= 0 && inDetail[node.parent]) ? nodeXfms[node.parent] * xfmLocal : xfmLocal;
+      inDetail[nodeIdx] = 1;
+      
+      Shape::NodeChildInfo info = shape->mNodeChildren[nodeIdx+1];
+      for (int32_t i=0; i<info.numChildren; i++)
+      {
+         pending.push_back(shape->mNodeChildIds[info.firstChild+i]);
+      }
+   }
    
-   slm::vec4 mLightColor;
-   slm::vec3 mLightPos;
+   // Same base transform as ShapeViewer::renderObjects
+   slm::mat4 baseXfm = slm::rotation_x(slm::radians(-90.0f)) * slm::inverse(nodeXfms[0]);
    
-   GenericViewer() : mResourceManager(NULL), mPalette(NULL), mMaterialList(NULL)
+   for (Shape::Object& object : shape->mObjects)
    {
-      useShared = false;
+      if (object.meshIndex < 0 || object.meshIndex >= (int32_t)shape->mMeshes.size() ||
+          object.nodeIndex < 0 || object.nodeIndex >= (int32_t)shape->mNodes.size() ||
+          !inDetail[object.nodeIndex] || (object.flags & Shape::OBJECT_INVISIBLE_DEFAULT))
+         continue;
+      
+      CelAnimMesh* mesh = shape->mMeshes[object.meshIndex];
+      if (mesh == NULL || mesh->mFrames.empty() || mesh->mVerts.empty())
+         continue;
+      
+      const CelAnimMesh::Frame& frame = mesh->mFrames[0];
+      slm::mat4 xfm = baseXfm * nodeXfms[object.nodeIndex] * slm::translation(object.offset);
+      
+      for (CelAnimMesh::Face& face : mesh->mFaces)
+      {
+         for (int i=0; i<3; i++)
+         {
+            int32_t vertIdx = frame.firstVert + face.verts[i].vi;
+            if (vertIdx < 0 || vertIdx >= (int32_t)mesh->mVerts.size())
+               vertIdx = 0;
+            
+            const CelAnimMesh::PackedVertex& packed = mesh->mVerts[vertIdx];
+            slm::vec3 pos = (slm::vec3(packed.x, packed.y, packed.z) * frame.scale) + frame.origin;
+            outTris.push_back((xfm * slm::vec4(pos, 1)).xyz());
+         }
+      }
    }
    
-   void updateMVP()
+   delete shape;
+   return !outTris.empty();
+}
+
+// Batch exports every shape, interior and terrain block on the mounts to glTF 2.0 (see -exportgltf).
+// Each file is a JobSystem job, so a few large files are balanced across the pool by work stealing. Each
+// thread reads with its own volume handles (see ResManager::readFile), and mounts aren't changed while an
+// export runs.
+class GLTFExporter
+{
+public:
+   
+   // State for one JobSystem thread; slot 0 is the thread which calls run()
+   struct Worker
    {
-      GFXSetModelViewProjection(mModelMatrix, mViewMatrix, mProjectionMatrix);
-      GFXSetLightPos(mLightPos, mLightColor);
+      ResManager::ReadHandles handles;
+   };
+   
+   ResManager* mResManager;
+   Palette* mPalette;
+   std::string mOutDir;
+   bool mBinary;
+   
+   std::vector<ResManager::EnumEntry> mFiles;
+   std::vector<std::string> mOutPaths;
+   std::vector<Worker> mWorkers;
+   
+   std::atomic<uint32_t> mNumShapes;
+   std::atomic<uint32_t> mNumInteriors;
+   std::atomic<uint32_t> mNumTerrains;
+   std::atomic<uint32_t> mNumFailed;
+   std::atomic<uint64_t> mBytesRead;
+   std::atomic<uint64_t> mBytesWritten;
+   
+   // Same as the viewers: source data is z up
+   static slm::quat getYUpRotation()
+   {
+      return slm::quat(-sinf(slm::radians(45.0f)), 0.0f, 0.0f, cosf(slm::radians(45.0f)));
    }
    
-   void initMaterials()
+   // CompatQuatSetMatrix builds the transposed matrix, so glTF wants the conjugate
+   static slm::quat getNodeRotation(const Quat16& rot)
    {
-      mActiveMaterials.clear();
+      slm::quat q = rot.toQuat();
+      float len = sqrtf((q.x*q.x) + (q.y*q.y) + (q.z*q.z) + (q.w*q.w));
+      if (len < 1e-6f)
+         return slm::quat(0,0,0,1);
+      return slm::quat(-q.x / len, -q.y / len, -q.z / len, q.w / len);
+   }
+   
+   GLTFExporter(ResManager* res, Palette* pal, const char* outDir, bool binary) :
+   mResManager(res), mPalette(pal), mOutDir(outDir), mBinary(binary),
+   mNumShapes(0), mNumInteriors(0), mNumTerrains(0), mNumFailed(0), mBytesRead(0), mBytesWritten(0)
+   {
+   }
+   
+   int run()
+   {
+      std::vector<std::string> exts;
+      exts.push_back(".dts");
+      exts.push_back(".dis");
+      exts.push_back(".dtb");
+      mResManager->enumerateFiles(mFiles, -1, &exts);
       
-      if (!mMaterialList)
+      if (mFiles.empty())
       {
-         assert(false);
-         return;
+         LOG_ERROR("Export: no shapes, interiors or terrain blocks found");
+         return 1;
       }
       
-      if (useShared)
+      // Output goes in a folder per mount, as names can repeat across volumes
+      std::vector<std::string> mountDirs;
+      mOutPaths.resize(mFiles.size());
+      for (size_t i=0; i<mFiles.size(); i++)
       {
-         // Load as single shared layered 2d texture
-         if (!loadSharedMaterials())
+         const ResManager::EnumEntry& entry = mFiles[i];
+         if (entry.mountIdx >= mountDirs.size())
+            mountDirs.resize(entry.mountIdx+1);
+         
+         if (mountDirs[entry.mountIdx].empty())
          {
-            assert(false);
+            fs::path mountPath = mResManager->getMountName(entry.mountIdx);
+            std::string mountName = mountPath.filename().string();
+            if (mountName.empty() || mountName == "." || mountName == "..")
+               mountName = "mount" + std::to_string(entry.mountIdx);
+            mountDirs[entry.mountIdx] = mOutDir + "/" + mountName;
+            
+            try
+            {
+               fs::create_directories(mountDirs[entry.mountIdx]);
+            }
+            catch (...)
+            {
+               LOG_ERROR("Export: couldn't create %s", mountDirs[entry.mountIdx].c_str());
+               return 1;
+            }
          }
+         
+         fs::path filePath = entry.filename;
+         mOutPaths[i] = mountDirs[entry.mountIdx] + "/" + filePath.stem().string() + (mBinary ? ".glb" : ".gltf");
       }
-      else
+      
+      mWorkers.resize(JobSystem::getNumWorkers() + 1);
+      LOG_INFO("Export: %u files to %s on %u threads", (uint32_t)mFiles.size(), mOutDir.c_str(), (uint32_t)mWorkers.size());
+      
+      JobSystem::resetStats();
+      auto startTime = std::chrono::steady_clock::now();
+      
+      JobSystem::Counter counter;
+      for (uint32_t i=0; i<(uint32_t)mFiles.size(); i++)
       {
-         mActiveMaterials.resize(mMaterialList->mMaterials.size());
-         for (int i=0; i<mMaterialList->mMaterials.size(); i++)
-         {
-            Material& mat = mMaterialList->mMaterials[i];
-            ActiveMaterial& amat = mActiveMaterials[i];
-            loadTexture((const char*)mat.mFilename, amat.tex);
-         }
+         JobSystem::push([this, i]{ exportFile(i); }, &counter);
       }
+      JobSystem::wait(counter);
+      
+      uint32_t numSteals = (uint32_t)JobSystem::getStats().numStolen;
+      float elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count() / 1000000.0f;
+      elapsed = std::max(elapsed, 0.000001f);
+      uint32_t numExported = mNumShapes + mNumInteriors + mNumTerrains;
+      const float MB = 1024.0f * 1024.0f;
+      
+      LOG_INFO("Export: %u shapes, %u interiors, %u terrain blocks, %u failed in %.2fs (%u steals)",
+               (uint32_t)mNumShapes, (uint32_t)mNumInteriors, (uint32_t)mNumTerrains, (uint32_t)mNumFailed, elapsed, numSteals);
+      LOG_INFO("Export: %.1f files/s, read %.1f MB (%.1f MB/s), wrote %.1f MB (%.1f MB/s)",
+               numExported / elapsed, mBytesRead / MB, (mBytesRead / MB) / elapsed, mBytesWritten / MB, (mBytesWritten / MB) / elapsed);
+      
+      return numExported > 0 ? 0 : 1;
    }
    
-   bool loadSharedMaterials()
+protected:
+   
+   void exportFile(uint32_t jobIdx)
    {
-      bool fail = false;
-      std::vector<Bitmap*> bitmaps;
-      int lastSize[2];
-      lastSize[0] = -1;
-      lastSize[1] = -1;
+      Worker& worker = mWorkers[JobSystem::getWorkerIndex() + 1];
+      const ResManager::EnumEntry& entry = mFiles[jobIdx];
+      TRACE_ZONE_DETAIL("GLTFExporter::exportFile", entry.filename.c_str());
+      ACCESS_TRACE_ASSET(entry.filename.c_str());
       
-      int count = 0;
+      std::vector<uint8_t> data;
+      fs::path filePath = entry.filename;
+      std::string ext = filePath.extension().string();
+      std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
       
-      for (Material& mat : mMaterialList->mMaterials)
+      bool ok = false;
+      GLTFWriter writer;
+      if (readFile(worker, entry.filename.c_str(), entry.mountIdx, data) && writer.open(mOutPaths[jobIdx].c_str(), mBinary))
       {
-         //mat = mMaterialList->mMaterials[98];
-         std::string fname = (const char*)mat.mFilename;
+         if (ext == ".dts")
+            ok = exportShape(worker, entry, data, writer);
+         else if (ext == ".dis")
+            ok = exportInterior(worker, entry, data, writer);
+         else if (ext == ".dtb")
+            ok = exportTerrainBlock(data, writer);
          
-         // Find in resources
-         MemRStream mem(0, NULL);
-         if (mResourceManager->openFile(fname.c_str(), mem))
-         {
-            Bitmap* bmp = new Bitmap();
-            if (!bmp->read(mem))
-            {
-               fail = true;
-               break;
-            }
-            else
-            {
-               if (lastSize[0] >= 0 && lastSize[0] != bmp->mWidth && lastSize[1] != bmp->mHeight)
-               {
-                  fail = true;
-                  break;
-               }
-               
-               lastSize[0] = bmp->mWidth;
-               lastSize[1] = bmp->mHeight;
-               bitmaps.push_back(bmp);
-            }
-         }
+         if (ok)
+            ok = writer.close();
          else
-         {
-            fail = true;
-            break;
-         }
-         
-         count++;
+            writer.abort();
       }
       
-      if (!fail)
+      if (!ok)
       {
-         mSharedMaterials.tex.bmpFlags = 0;
-         mSharedMaterials.tex.width = lastSize[0];
-         mSharedMaterials.tex.height = lastSize[1];
-         mSharedMaterials.tex.texID = GFXLoadTextureSet(bitmaps.size(), &bitmaps[0], mPalette);
+         LOG_WARN("Export: failed to export %s from %s", entry.filename.c_str(), mResManager->getMountName(entry.mountIdx));
+         mNumFailed++;
+         return;
       }
       
-      for (Bitmap* bmp : bitmaps)
+      mBytesWritten += writer.getBytesWritten();
+      if (ext == ".dts")
+         mNumShapes++;
+      else if (ext == ".dis")
+         mNumInteriors++;
+      else
+         mNumTerrains++;
+   }
+   
+   // Prefers the mount the exported file came from, then searches the rest like ResManager::openFile
+   bool readFile(Worker& worker, const char* filename, uint32_t mountIdx, std::vector<uint8_t>& outData)
+   {
+      bool found = mResManager->readFile(filename, mountIdx, worker.handles, outData);
+      uint32_t numMounts = (uint32_t)(mResManager->mPaths.size() + mResManager->mVolumes.size());
+      for (uint32_t i=0; i<numMounts && !found; i++)
       {
-         delete bmp;
+         if (i != mountIdx)
+            found = mResManager->readFile(filename, i, worker.handles, outData);
       }
       
-      return !fail;
+      if (found)
+         mBytesRead += outData.size();
+      return found;
    }
    
-   bool loadTexture(const char *filename, LoadedTexture& outTexInfo, bool force=false)
+   template<class T> T* readObject(Worker& worker, const char* filename, uint32_t mountIdx)
    {
-      bool genTex = true;
-      std::string fname = std::string(filename);
-      auto itr = mLoadedTextures.find(fname);
-      if (itr != mLoadedTextures.end())
+      std::vector<uint8_t> data;
+      if (!readFile(worker, filename, mountIdx, data) || data.empty())
+         return NULL;
+      
+      MemRStream mem((uint32_t)data.size(), &data[0]);
+      DarkstarPersistObject* obj = DarkstarPersistObject::createFromStream(mem);
+      T* typedObj = dynamic_cast<T*>(obj);
+      if (typedObj == NULL && obj)
+         delete obj;
+      return typedObj;
+   }
+   
+   // Palette converts a bitmap the same way GFXLoadTexture does
+   bool getBitmapRGBA(Bitmap& bmp, std::vector<uint8_t>& outPixels)
+   {
+      if (bmp.mWidth == 0 || bmp.mHeight == 0 || bmp.mMips[0] == NULL)
+         return false;
+      
+      outPixels.resize(bmp.mWidth * bmp.mHeight * 4);
+      
+      if (bmp.mBitDepth == 8)
       {
-         outTexInfo = itr->second;
-         genTex = false;
-         if (!force) return true;
+         Palette::Data* pal = NULL;
+         if (bmp.mPal && !bmp.mPal->mPalettes.empty())
+            pal = bmp.mPal->getPaletteByIndex(bmp.mPaletteIndex);
+         else if (mPalette && !mPalette->mPalettes.empty())
+            pal = mPalette->getPaletteByIndex(bmp.mPaletteIndex);
+         
+         if (pal == NULL)
+            return false;
+         
+         uint32_t clampAlpha = 256;
+         if (bmp.mFlags & Bitmap::FLAG_TRANSPARENT)
+            clampAlpha = 255;
+         else if (bmp.mFlags & Bitmap::FLAG_TRANSLUCENT)
+            clampAlpha = 1;
+         
+         copyMipRGBA(bmp.mWidth, bmp.mHeight, bmp.mWidth*4, pal, bmp.mMips[0], &outPixels[0], clampAlpha);
+         return true;
       }
-      
-      // Find in resources
-      MemRStream mem(0, NULL);
-      if (mResourceManager->openFile(filename, mem))
+      else if (bmp.mBitDepth == 24)
       {
-         Bitmap* bmp = new Bitmap();
-         if (bmp->read(mem))
+         for (uint32_t y=0; y<bmp.mHeight; y++)
          {
-            int32_t texID = GFXLoadTexture(bmp, mPalette);
-            if (texID >= 0)
+            const uint8_t* src = bmp.getAddress(0, 0, y);
+            uint8_t* dest = &outPixels[y * bmp.mWidth * 4];
+            for (uint32_t x=0; x<bmp.mWidth; x++)
             {
-               printf("Loaded texture %s dimensions %ix%i\n", filename, bmp->mWidth, bmp->mHeight);
-               outTexInfo.bmpFlags = bmp->mFlags;
-               outTexInfo.texID = texID;
-               outTexInfo.width = bmp->mWidth;
-               outTexInfo.height = bmp->mHeight;
+               dest[0] = src[bmp.mBGR ? 2 : 0];
+               dest[1] = src[1];
+               dest[2] = src[bmp.mBGR ? 0 : 2];
+               dest[3] = 255;
+               src += 3;
+               dest += 4;
             }
-            
-            // Done
-            mLoadedTextures[fname] = outTexInfo;
-            delete bmp;
-            return true;
          }
-         delete bmp;
+         return true;
       }
       
       return false;
    }
    
-   void clearTextures()
+   // Adds a glTF material per list entry. outSizes gets the texture sizes, which interiors need for their texture coords.
+   void addMaterials(Worker& worker, MaterialList* materials, uint32_t mountIdx, GLTFWriter& writer, std::vector<int32_t>& outMaterials, std::vector<slm::vec2>* outSizes)
    {
-      for (auto itr: mLoadedTextures) { GFXDeleteTexture(itr.second.texID); }
-      mLoadedTextures.clear();
-      if (mSharedMaterials.tex.texID != 0)
+      std::unordered_map<std::string, int32_t> images;
+      std::vector<uint8_t> data;
+      std::vector<uint8_t> pixels;
+      
+      for (Material& mat : materials->mMaterials)
       {
-         GFXDeleteTexture(mSharedMaterials.tex.texID);
-         mSharedMaterials.tex.texID = 0;
+         std::string filename = (const char*)mat.mFilename;
+         slm::vec4 baseColor(1);
+         slm::vec2 size(256, 256);
+         int32_t image = -1;
+         GLTFWriter::AlphaMode alphaMode = GLTFWriter::Alpha_Opaque;
+         
+         switch (mat.mFlags & Material::FLAG_MASK)
+         {
+            case Material::FLAG_RGB:
+               baseColor = slm::vec4(mat.mRGB[0] / 255.0f, mat.mRGB[1] / 255.0f, mat.mRGB[2] / 255.0f, 1.0f);
+               break;
+            case Material::FLAG_PALETTE:
+               if (mPalette && !mPalette->mPalettes.empty())
+               {
+                  uint8_t r, g, b;
+                  mPalette->mPalettes[0].lookupRGB(mat.mIndex & 0xFF, r, g, b);
+                  baseColor = slm::vec4(r / 255.0f, g / 255.0f, b / 255.0f, 1.0f);
+               }
+               break;
+            case Material::FLAG_TEXTURE:
+            {
+               if (filename.empty() || !readFile(worker, filename.c_str(), mountIdx, data) || data.empty())
+                  break;
+               
+               MemRStream mem((uint32_t)data.size(), &data[0]);
+               Bitmap bmp;
+               if (!bmp.read(mem))
+                  break;
+               
+               size = slm::vec2(bmp.mWidth, bmp.mHeight);
+               if (bmp.mFlags & Bitmap::FLAG_TRANSPARENT)
+                  alphaMode = GLTFWriter::Alpha_Mask;
+               else if (bmp.mFlags & (Bitmap::FLAG_TRANSLUCENT | Bitmap::FLAG_ADDITIVE | Bitmap::FLAG_SUBTRACTIVE))
+                  alphaMode = GLTFWriter::Alpha_Blend;
+               
+               auto itr = images.find(filename);
+               if (itr != images.end())
+               {
+                  image = itr->second;
+               }
+               else if (getBitmapRGBA(bmp, pixels))
+               {
+                  image = writer.addImage(filename.c_str(), bmp.mWidth, bmp.mHeight, &pixels[0]);
+                  images[filename] = image;
+               }
+            }
+               break;
+            default:
+               break;
+         }
+         
+         outMaterials.push_back(writer.addMaterial(filename.c_str(), image, baseColor, alphaMode));
+         if (outSizes)
+            outSizes->push_back(size);
       }
    }
    
-   bool setPalette(const char *filename)
+   // Nodes keep their hierarchy and default transforms. Each detail level is its own scene rooted at a
+   // y up node. Meshes are shared between details; cel animation frames become morph targets, and each
+   // sequence becomes an animation of node transforms and (stepped) morph weights.
+   bool exportShape(Worker& worker, const ResManager::EnumEntry& entry, const std::vector<uint8_t>& data, GLTFWriter& writer)
    {
-      MemRStream mem(0, NULL);
-      if (mResourceManager->openFile(filename, mem))
+      MemRStream mem((uint32_t)data.size(), (void*)&data[0]);
+      DarkstarPersistObject* obj = DarkstarPersistObject::createFromStream(mem);
+      Shape* shape = dynamic_cast<Shape*>(obj);
+      if (shape == NULL)
       {
-         Palette* newPal = new Palette();
-         if (newPal->read(mem))
+         if (obj) delete obj;
+         return false;
+      }
+      
+      std::vector<int32_t> materials;
+      if (shape->mMaterials)
+         addMaterials(worker, shape->mMaterials, entry.mountIdx, writer, materials, NULL);
+      
+      // Meshes
+      std::vector<int32_t> meshIds(shape->mMeshes.size(), -1);
+      std::vector<std::vector<int32_t> > frameTargets(shape->mMeshes.size()); // frame -> morph target (-1 for the base)
+      std::vector<uint32_t> numTargets(shape->mMeshes.size(), 0);
+      
+      std::vector<uint32_t> vertMap;
+      std::vector<uint32_t> texVertMap;
+      std::vector<CelAnimMesh::Triangle> tris;
+      std::vector<CelAnimMesh::Prim> prims;
+      std::vector<slm::vec3> basePoints;
+      std::vector<slm::vec3> points;
+      std::vector<slm::vec3> normals;
+      std::vector<slm::vec2> texCoords;
+      std::vector<uint32_t> indices;
+      
+      for (size_t m=0; m<shape->mMeshes.size(); m++)
+      {
+         CelAnimMesh* mesh = shape->mMeshes[m];
+         if (mesh == NULL || mesh->mFaces.empty() || mesh->mFrames.empty())
+            continue;
+         
+         vertMap.clear();
+         texVertMap.clear();
+         tris.clear();
+         prims.clear();
+         mesh->unpackVertStructure(vertMap, texVertMap, tris, prims);
+         
+         const uint32_t numVerts = (uint32_t)vertMap.size();
+         std::vector<GLTFWriter::Primitive> outPrims;
+         GLTFWriter::Primitive basePrim;
+         int32_t prevFirstVert = INT32_MIN;
+         
+         for (size_t f=0; f<mesh->mFrames.size(); f++)
          {
-            if (mPalette) delete mPalette;
-            mPalette = newPal;
-            clearTextures();
-            if (mMaterialList) initMaterials();
-            return true;
+            const CelAnimMesh::Frame& frame = mesh->mFrames[f];
+            
+            // Frames sharing verts with the previous one reuse its target
+            if (frame.firstVert == prevFirstVert)
+            {
+               frameTargets[m].push_back(frameTargets[m].back());
+               continue;
+            }
+            prevFirstVert = frame.firstVert;
+            
+            points.resize(numVerts);
+            normals.resize(numVerts);
+            for (uint32_t i=0; i<numVerts; i++)
+            {
+               int32_t vertIdx = frame.firstVert + (int32_t)vertMap[i];
+               if (vertIdx < 0 || vertIdx >= (int32_t)mesh->mVerts.size())
+                  vertIdx = 0;
+               const CelAnimMesh::PackedVertex& packed = mesh->mVerts[vertIdx];
+               points[i] = (slm::vec3(packed.x, packed.y, packed.z) * frame.scale) + frame.origin;
+               normals[i] = EncodedNormalTable[packed.normal];
+            }
+            
+            if (f == 0)
+            {
+               basePoints = points;
+               basePrim.position = writer.addPositions(&points[0], numVerts);
+               basePrim.normal = writer.addNormals(&normals[0], numVerts);
+               frameTargets[m].push_back(-1);
+            }
+            else
+            {
+               for (uint32_t i=0; i<numVerts; i++)
+               {
+                  points[i] -= basePoints[i];
+               }
+               basePrim.targets.push_back(writer.addPositions(&points[0], numVerts));
+               frameTargets[m].push_back((int32_t)basePrim.targets.size()-1);
+            }
+         }
+         
+         // First texture frame
+         texCoords.resize(numVerts);
+         for (uint32_t i=0; i<numVerts; i++)
+         {
+            texCoords[i] = texVertMap[i] < mesh->mTexVerts.size() ? mesh->mTexVerts[texVertMap[i]] : slm::vec2(0);
          }
+         basePrim.texCoord = writer.addTexCoords(&texCoords[0], numVerts);
+         
+         for (CelAnimMesh::Prim& prim : prims)
+         {
+            indices.clear();
+            for (uint32_t i=prim.startInds/3; i<(prim.startInds + prim.numInds)/3; i++)
+            {
+               indices.push_back(tris[i].i[0]);
+               indices.push_back(tris[i].i[1]);
+               indices.push_back(tris[i].i[2]);
+            }
+            
+            GLTFWriter::Primitive outPrim = basePrim;
+            outPrim.indices = writer.addIndices(&indices[0], (uint32_t)indices.size());
+            outPrim.material = (prim.mat >= 0 && prim.mat < (int32_t)materials.size()) ? materials[prim.mat] : -1;
+            outPrims.push_back(outPrim);
+         }
+         
+         numTargets[m] = (uint32_t)basePrim.targets.size();
+         std::string meshName = "mesh" + std::to_string(m);
+         meshIds[m] = writer.addMesh(meshName.c_str(), outPrims, numTargets[m]);
       }
-      return false;
-   }
-   
-};
-
-class ShapeViewer : public GenericViewer
-{
-public:
-   struct RuntimeMeshInfo
-   {
-      std::vector<CelAnimMesh::Prim> mPrims;
-      CelAnimMesh* mMesh;
-      uint32_t mRealVertsPerFrame;
-      uint32_t mRealTexVertsPerFrame;
       
-      RuntimeMeshInfo() {;}
-      ~RuntimeMeshInfo() {;}
-   };
-   
-   struct RuntimeObjectInfo
-   {
-      uint32_t mFrame;
-      uint32_t mTexFrame;
-      bool mDraw;
-      int32_t mLastKeyframe;
+      // Nodes, with detail roots split off into their own scenes
+      const int32_t numNodes = (int32_t)shape->mNodes.size();
+      std::vector<uint8_t> isDetailRoot(numNodes, 0);
+      for (Shape::Detail& detail : shape->mDetails)
+      {
+         if (detail.rootNode >= 0 && detail.rootNode < numNodes)
+            isDetailRoot[detail.rootNode] = 1;
+      }
       
-      RuntimeObjectInfo() : mFrame(0), mTexFrame(0), mLastKeyframe(-1), mDraw(true) {;}
-      ~RuntimeObjectInfo() {;}
-   };
-   
-   struct RuntimeDetailInfo
-   {
-      uint32_t startRenderObject;
-      uint32_t numRenderObjects;
+      for (int32_t i=0; i<numNodes; i++)
+      {
+         Shape::Node& node = shape->mNodes[i];
+         GLTFWriter::Node outNode;
+         outNode.name = (node.name >= 0 && node.name < (int32_t)shape->mNames.size()) ? shape->getName(node.name) : "node" + std::to_string(i);
+         if (node.defaultTransform >= 0 && node.defaultTransform < (int32_t)shape->mTransforms.size())
+         {
+            Shape::Transform& xfm = shape->mTransforms[node.defaultTransform];
+            outNode.hasTransform = true;
+            outNode.translation = xfm.pos;
+            outNode.rotation = getNodeRotation(xfm.rot);
+         }
+         writer.addNode(outNode);
+      }
       
-      RuntimeDetailInfo() {;}
-      RuntimeDetailInfo(uint32_t so, uint32_t nro) : startRenderObject(so), numRenderObjects(nro) {;}
-   };
-   
-   struct ShapeThread
-   {
-      enum State
+      for (int32_t i=0; i<numNodes; i++)
       {
-         STOPPED,
-         PLAYING,
-         PLAYING_TRANSITION_WAIT,
-         TRANSITIONING,
-      };
-      int32_t sequenceIdx;
-      int32_t transitionIdx;
-      uint32_t startSubsequence;
-      float pos;
+         int32_t parent = shape->mNodes[i].parent;
+         if (parent >= 0 && parent < numNodes && !isDetailRoot[i])
+            writer.getNode(parent).children.push_back(i);
+      }
       
-      State state;
-      bool enabled;
+      // Objects hang off their nodes (invisible ones only show up through animation, which glTF can't express)
+      std::vector<int32_t> objectNodes(shape->mObjects.size(), -1);
+      for (size_t i=0; i<shape->mObjects.size(); i++)
+      {
+         Shape::Object& object = shape->mObjects[i];
+         if (object.meshIndex < 0 || object.meshIndex >= (int32_t)meshIds.size() || meshIds[object.meshIndex] < 0 ||
+             object.nodeIndex < 0 || object.nodeIndex >= numNodes || (object.flags & Shape::OBJECT_INVISIBLE_DEFAULT))
+            continue;
+         
+         GLTFWriter::Node outNode;
+         outNode.name = (object.name >= 0 && object.name < (int32_t)shape->mNames.size()) ? shape->getName(object.name) : "object" + std::to_string(i);
+         outNode.mesh = meshIds[object.meshIndex];
+         outNode.hasTransform = true;
+         outNode.translation = object.offset;
+         objectNodes[i] = writer.addNode(outNode);
+         writer.getNode(object.nodeIndex).children.push_back(objectNodes[i]);
+      }
       
-      ShapeThread() : sequenceIdx(-1), transitionIdx(-1), startSubsequence(0), pos(0), enabled(true) {;}
-   };
-   
-   std::vector<ShapeThread> mThreads;
-   std::vector<int16_t> mThreadSubsequences; // Subsequence tracks for nodes + objects
-   
-   Shape* mShape;
-   
-   std::vector<slm::mat4> mNodeTransforms; // Current transform list
-   std::vector<slm::quat> mActiveRotations; // non-gl xfms
-   std::vector<slm::vec4> mActiveTranslations; // non-gl xfms
-   std::vector<uint8_t> mNodeVisiblity;
-   std::vector<RuntimeMeshInfo*> mRuntimeMeshInfos;
-   std::vector<RuntimeObjectInfo*> mRuntimeObjectInfos;
-   
-   std::vector<RuntimeDetailInfo> mRuntimeDetails;
-   std::vector<uint32_t> mObjectRenderID;
-   
-   int32_t mDefaultMaterials;
-   int32_t mAlwaysNode;
-   int32_t mCurrentDetail;
-   
-   Shape::Transform& getTransform(uint32_t i)
-   {
-      return mShape->mTransforms[i];
-   }
-   
-   Shape::Detail& getDetail(uint32_t i)
-   {
-      return mShape->mDetails[i];
-   }
-   
-   ShapeViewer(ResManager* res)
-   {
-      mPalette = NULL;
-      mShape = NULL;
-      mResourceManager = res;
-      initVB = false;
-   }
-   
-   ~ShapeViewer()
-   {
-      for (RuntimeMeshInfo* itr : mRuntimeMeshInfos) { delete itr; }
-      for (RuntimeObjectInfo* itr : mRuntimeObjectInfos) { delete itr; }
-      if (mPalette) delete mPalette;
-      clearVertexBuffer();
-      clearTextures();
-      clearRender();
-   }
-   
-   void clear()
-   {
-      clearVertexBuffer();
-      clearTextures();
+      // Scenes
+      std::vector<int32_t> sharedRoots;
+      if (shape->mAlwaysNode >= 0 && shape->mAlwaysNode < numNodes && !isDetailRoot[shape->mAlwaysNode] && shape->mNodes[shape->mAlwaysNode].parent < 0)
+      {
+         GLTFWriter::Node alwaysNode;
+         alwaysNode.name = "always";
+         alwaysNode.hasTransform = true;
+         alwaysNode.rotation = getYUpRotation();
+         alwaysNode.children.push_back(shape->mAlwaysNode);
+         sharedRoots.push_back(writer.addNode(alwaysNode));
+      }
       
-      for (RuntimeMeshInfo* itr : mRuntimeMeshInfos) { delete itr; }
-      for (RuntimeObjectInfo* itr : mRuntimeObjectInfos) { delete itr; }
-      mRuntimeObjectInfos.clear();
-      mRuntimeMeshInfos.clear();
-      mNodeTransforms.clear();
-      mThreads.clear();
-      mThreadSubsequences.clear();
-      mActiveMaterials.clear();
-      mShape = NULL;
-      mMaterialList = NULL;
-   }
-   
-   void initRender()
-   {
-      mLightColor = slm::vec4(1,1,1,1);
-      mLightPos = slm::vec3(0,2, 2);
+      std::vector<int32_t> detailWrappers(numNodes, -1);
+      for (size_t d=0; d<shape->mDetails.size(); d++)
+      {
+         int32_t rootNode = shape->mDetails[d].rootNode;
+         if (rootNode < 0 || rootNode >= numNodes)
+            continue;
+         
+         char name[64];
+         snprintf(name, sizeof(name), "detail%u_%g", (uint32_t)d, shape->mDetails[d].size);
+         
+         if (detailWrappers[rootNode] < 0)
+         {
+            GLTFWriter::Node wrapper;
+            wrapper.name = name;
+            wrapper.hasTransform = true;
+            wrapper.rotation = getYUpRotation();
+            wrapper.children.push_back(rootNode);
+            detailWrappers[rootNode] = writer.addNode(wrapper);
+         }
+         
+         std::vector<int32_t> roots = sharedRoots;
+         roots.push_back(detailWrappers[rootNode]);
+         writer.addScene(name, roots);
+      }
       
-      // TODO
-   }
-   
-   void clearRender()
-   {
-      // TODO
-   }
-   
-   // Sequence Handling
-   
-   inline uint32_t getSubsequenceStride()
-   {
-      return  (mShape->mObjects.size() + mShape->mNodes.size()) * 2;
-   }
-   
-   uint32_t addThread()
-   {
-      ShapeThread thread;
-      thread.startSubsequence = mThreadSubsequences.size();
-      mThreads.push_back(thread);
-      mThreadSubsequences.resize(mThreadSubsequences.size() + getSubsequenceStride());
-      for (uint32_t i=thread.startSubsequence; i<mThreadSubsequences.size(); i++)
+      if (shape->mDetails.empty())
       {
-         mThreadSubsequences[i] = -1;
+         GLTFWriter::Node wrapper;
+         wrapper.name = "root";
+         wrapper.hasTransform = true;
+         wrapper.rotation = getYUpRotation();
+         for (int32_t i=0; i<numNodes; i++)
+         {
+            if (shape->mNodes[i].parent < 0 && i != shape->mAlwaysNode)
+               wrapper.children.push_back(i);
+         }
+         std::vector<int32_t> roots = sharedRoots;
+         roots.push_back(writer.addNode(wrapper));
+         writer.addScene("root", roots);
       }
       
-      return mThreads.size()-1;
-   }
-   
-   void setThreadSequence(uint32_t idx, int32_t sequenceId)
-   {
-      ShapeThread &thread = mThreads[idx];
-      thread.sequenceIdx = sequenceId;
-      thread.transitionIdx = -1;
-      thread.pos = 0.0f;
-      thread.state = sequenceId < 0 ? ShapeThread::STOPPED : ShapeThread::PLAYING;
-      // Scan through nodes and objects and set subsequence track
-      memset(&mThreadSubsequences[thread.startSubsequence], '\0', sizeof(uint16_t)*getSubsequenceStride());
+      // Sequences
+      std::vector<float> times;
+      std::vector<slm::vec3> translations;
+      std::vector<slm::quat> rotations;
+      std::vector<float> weights;
       
-      for (int k=0, sz = mShape->mNodes.size(); k<sz; k++)
+      for (size_t s=0; s<shape->mSequences.size(); s++)
       {
-         Shape::Node *itr = &mShape->mNodes[k];
-         mThreadSubsequences[thread.startSubsequence + k] = -1;
-         for (int32_t i=itr->firstSubSequence, endI=itr->firstSubSequence + itr->numSubSequences; i<endI; i++)
+         Shape::Sequence& seq = shape->mSequences[s];
+         std::string seqName = (seq.name >= 0 && seq.name < (int32_t)shape->mNames.size()) ? shape->mNames[seq.name] : "sequence" + std::to_string(s);
+         int32_t animIdx = -1;
+         
+         for (int32_t n=0; n<numNodes; n++)
          {
-            if (mShape->mSubSequences[i].sequenceIdx == sequenceId)
+            Shape::SubSequence* subSeq = findSubSequence(shape, shape->mNodes[n].firstSubSequence, shape->mNodes[n].numSubSequences, (int32_t)s);
+            if (subSeq == NULL)
+               continue;
+            
+            times.clear();
+            translations.clear();
+            rotations.clear();
+            for (int32_t k=subSeq->firstKeyFrame; k<subSeq->firstKeyFrame + subSeq->numKeyFrames; k++)
             {
-               mThreadSubsequences[thread.startSubsequence + k] = i;
-               break;
+               Shape::Keyframe& kf = shape->mKeyframes[k];
+               float time = kf.pos * seq.duration;
+               if (kf.key >= shape->mTransforms.size() || (!times.empty() && time <= times.back()))
+                  continue;
+               
+               Shape::Transform& xfm = shape->mTransforms[kf.key];
+               slm::quat rot = getNodeRotation(xfm.rot);
+               
+               // Keep to the shortest path between keys
+               if (!rotations.empty())
+               {
+                  const slm::quat& prev = rotations.back();
+                  if ((prev.x*rot.x) + (prev.y*rot.y) + (prev.z*rot.z) + (prev.w*rot.w) < 0.0f)
+                     rot = slm::quat(-rot.x, -rot.y, -rot.z, -rot.w);
+               }
+               
+               times.push_back(time);
+               translations.push_back(xfm.pos);
+               rotations.push_back(rot);
             }
+            
+            if (times.empty())
+               continue;
+            
+            if (animIdx < 0)
+               animIdx = writer.addAnimation(seqName.c_str());
+            
+            int32_t input = writer.addTimes(&times[0], (uint32_t)times.size());
+            writer.addChannel(animIdx, n, "translation", input, writer.addVec3s(&translations[0], (uint32_t)translations.size()), GLTFWriter::Interpolation_Linear);
+            writer.addChannel(animIdx, n, "rotation", input, writer.addQuats(&rotations[0], (uint32_t)rotations.size()), GLTFWriter::Interpolation_Linear);
          }
-      }
-      
-      uint32_t offset = mShape->mNodes.size();
-      for (int k=0, sz = mShape->mObjects.size(); k<sz; k++)
-      {
-         Shape::Object *itr = &mShape->mObjects[k];
-         mThreadSubsequences[thread.startSubsequence + offset + k] = -1;
-         for (int32_t i=itr->firstSubSequence, endI=itr->firstSubSequence + itr->numSubSequences; i<endI; i++)
+         
+         for (size_t o=0; o<shape->mObjects.size(); o++)
          {
-            if (mShape->mSubSequences[i].sequenceIdx == sequenceId)
+            Shape::Object& object = shape->mObjects[o];
+            if (objectNodes[o] < 0 || numTargets[object.meshIndex] == 0)
+               continue;
+            
+            Shape::SubSequence* subSeq = findSubSequence(shape, object.firstSubSequence, object.numSubSequences, (int32_t)s);
+            if (subSeq == NULL)
+               continue;
+            
+            const std::vector<int32_t>& targets = frameTargets[object.meshIndex];
+            const uint32_t meshTargets = numTargets[object.meshIndex];
+            times.clear();
+            weights.clear();
+            for (int32_t k=subSeq->firstKeyFrame; k<subSeq->firstKeyFrame + subSeq->numKeyFrames; k++)
             {
-               mThreadSubsequences[thread.startSubsequence + offset + k] = i;
-               break;
+               Shape::Keyframe& kf = shape->mKeyframes[k];
+               float time = kf.pos * seq.duration;
+               if (!(kf.matIndex & Shape::KEYFRAME_FRAME_MATTERS) || (!times.empty() && time <= times.back()))
+                  continue;
+               
+               int32_t target = kf.key < targets.size() ? targets[kf.key] : -1;
+               times.push_back(time);
+               for (uint32_t t=0; t<meshTargets; t++)
+               {
+                  weights.push_back((int32_t)t == target ? 1.0f : 0.0f);
+               }
             }
+            
+            if (times.empty())
+               continue;
+            
+            if (animIdx < 0)
+               animIdx = writer.addAnimation(seqName.c_str());
+            
+            writer.addChannel(animIdx, objectNodes[o], "weights", writer.addTimes(&times[0], (uint32_t)times.size()),
+                              writer.addFloats(&weights[0], (uint32_t)weights.size()), GLTFWriter::Interpolation_Step);
          }
       }
       
-      // Reset obj states
-      for (int i=0; i<mRuntimeObjectInfos.size(); i++)
-      {
-         mRuntimeObjectInfos[i]->mLastKeyframe = -1;
-      }
+      delete shape;
+      return !writer.hasFailed();
    }
    
-   void removeThread(uint32_t idx)
+   static Shape::SubSequence* findSubSequence(Shape* shape, int32_t first, int32_t count, int32_t seqIdx)
    {
-      const uint32_t numSubSeqs = getSubsequenceStride();
-      ShapeThread thread = mThreads[idx];
-      mThreadSubsequences.erase(mThreadSubsequences.begin() + thread.startSubsequence, mThreadSubsequences.begin() + thread.startSubsequence + numSubSeqs);
-      for (uint32_t i = idx+1, sz = mThreads.size(); i<sz; i++)
+      for (int32_t i=first; i<first+count; i++)
       {
-         mThreads[i].startSubsequence -= numSubSeqs;
+         if (i < 0 || i >= (int32_t)shape->mSubSequences.size())
+            continue;
+         
+         Shape::SubSequence& subSeq = shape->mSubSequences[i];
+         if (subSeq.sequenceIdx == seqIdx && subSeq.firstKeyFrame >= 0 && subSeq.numKeyFrames > 0 &&
+             subSeq.firstKeyFrame + subSeq.numKeyFrames <= (int32_t)shape->mKeyframes.size())
+            return &subSeq;
       }
-      mThreads.erase(mThreads.begin()+idx);
+      return NULL;
    }
    
-   void advanceThreads(float dt)
+   // One mesh and scene per LOD, with a primitive per material. Texture coords are scaled as in InteriorViewer::loadInterior.
+   bool exportInterior(Worker& worker, const ResManager::EnumEntry& entry, const std::vector<uint8_t>& data, GLTFWriter& writer)
    {
-      for (ShapeThread &thread : mThreads)
+      MemRStream mem((uint32_t)data.size(), (void*)&data[0]);
+      Interior interior;
+      interior.mMaterials = NULL;
+      if (!interior.read(mem))
+         return false;
+      
+      interior.mMaterials = readObject<MaterialList>(worker, interior.getFilename(interior.mMaterialListNameIdx), entry.mountIdx);
+      if (interior.mMaterials == NULL)
+         return false;
+      
+      std::vector<int32_t> materials;
+      std::vector<slm::vec2> textureSizes;
+      addMaterials(worker, interior.mMaterials, entry.mountIdx, writer, materials, &textureSizes);
+      
+      std::vector<slm::vec3> points;
+      std::vector<slm::vec3> normals;
+      std::vector<slm::vec2> texCoords;
+      std::vector<std::vector<uint32_t> > matIndices(materials.size());
+      bool exported = false;
+      
+      for (size_t l=0; l<interior.mLods.size(); l++)
       {
-         if (thread.sequenceIdx == -1 || thread.sequenceIdx >= mShape->mSequences.size())
+         InteriorGeom* geom = readObject<InteriorGeom>(worker, interior.getFilename(interior.mLods[l].geomNameIdx), entry.mountIdx);
+         if (geom == NULL)
             continue;
          
-         Shape::Sequence &sequence = mShape->mSequences[thread.sequenceIdx];
+         points.clear();
+         normals.clear();
+         texCoords.clear();
+         for (std::vector<uint32_t>& inds : matIndices) { inds.clear(); }
          
-         switch (thread.state)
+         for (InteriorGeom::Surface& surf : geom->mSurfaces)
          {
-            case ShapeThread::STOPPED:
-               break;
-            case ShapeThread::TRANSITIONING: // TODO
-               break;
-            case ShapeThread::PLAYING_TRANSITION_WAIT: // TODO
-            case ShapeThread::PLAYING:
-               thread.pos += dt / sequence.duration;
-               if (thread.pos > 1.0)
-               {
-                  if (sequence.cyclic)
-                  {
-                     thread.pos -= 1.0;
-                     for (int i=0; i<mRuntimeObjectInfos.size(); i++)
-                     {
-                        mRuntimeObjectInfos[i]->mLastKeyframe = -1;
-                     }
-                  }
-                  else
-                  {
-                     thread.pos = 1.0;
-                     thread.state = ShapeThread::STOPPED;
-                  }
-               }
-               break;
+            if (surf.materials >= materials.size() || surf.planeIdx >= geom->mPlanes.size() ||
+                surf.vtxIdx + surf.numVerts > geom->mVerts.size())
+               continue;
+            
+            const InteriorGeom::PlaneF& plane = geom->mPlanes[surf.planeIdx];
+            slm::vec3 normal = slm::vec3(plane.x, plane.y, plane.z);
+            normal.normalize();
+            
+            const slm::vec2& texSize = textureSizes[surf.materials];
+            slm::vec2 txScale((float)((int)surf.tsX+1) / texSize.x, (float)((int)surf.tsY+1) / texSize.y);
+            slm::vec2 txOffset((float)surf.toX / texSize.x, (float)surf.toY / texSize.y);
+            
+            uint32_t startVert = (uint32_t)points.size();
+            for (uint32_t i=surf.vtxIdx; i<surf.vtxIdx + surf.numVerts; i++)
+            {
+               const InteriorGeom::Vertex& vert = geom->mVerts[i];
+               points.push_back(vert.pIdx < geom->mPoint3List.size() ? geom->mPoint3List[vert.pIdx] : slm::vec3(0));
+               normals.push_back(normal);
+               slm::vec2 tv = vert.tIdx < geom->mPoint2List.size() ? geom->mPoint2List[vert.tIdx] : slm::vec2(0);
+               texCoords.push_back((tv * txScale) + txOffset);
+            }
+            
+            // Surfaces are convex polygons
+            std::vector<uint32_t>& inds = matIndices[surf.materials];
+            for (uint32_t i=1; i+1<surf.numVerts; i++)
+            {
+               inds.push_back(startVert);
+               inds.push_back(startVert+i);
+               inds.push_back(startVert+i+1);
+            }
+         }
+         
+         delete geom;
+         
+         if (points.empty())
+            continue;
+         
+         GLTFWriter::Primitive basePrim;
+         basePrim.position = writer.addPositions(&points[0], (uint32_t)points.size());
+         basePrim.normal = writer.addNormals(&normals[0], (uint32_t)normals.size());
+         basePrim.texCoord = writer.addTexCoords(&texCoords[0], (uint32_t)texCoords.size());
+         
+         std::vector<GLTFWriter::Primitive> prims;
+         for (size_t i=0; i<matIndices.size(); i++)
+         {
+            if (matIndices[i].empty())
+               continue;
+            GLTFWriter::Primitive prim = basePrim;
+            prim.indices = writer.addIndices(&matIndices[i][0], (uint32_t)matIndices[i].size());
+            prim.material = materials[i];
+            prims.push_back(prim);
          }
+         
+         if (prims.empty())
+            continue;
+         
+         char name[64];
+         snprintf(name, sizeof(name), "lod%u_%u", (uint32_t)l, interior.mLods[l].minPixels);
+         
+         GLTFWriter::Node node;
+         node.name = name;
+         node.mesh = writer.addMesh(name, prims);
+         node.hasTransform = true;
+         node.rotation = getYUpRotation();
+         
+         std::vector<int32_t> roots;
+         roots.push_back(writer.addNode(node));
+         writer.addScene(name, roots);
+         exported = true;
       }
+      
+      return exported && !writer.hasFailed();
    }
    
-   void animateNodes()
+   // Full detail heightfield, with UVs spanning the block. Materials live in the grid file, so the mesh is untextured.
+   bool exportTerrainBlock(const std::vector<uint8_t>& data, GLTFWriter& writer)
    {
-      if (mAlwaysNode >= 0)
+      MemRStream mem((uint32_t)data.size(), (void*)&data[0]);
+      TerrainBlockList list;
+      TerrainBlock* block = new TerrainBlock(&list);
+      if (!block->read(mem))
       {
-         animateNode(mAlwaysNode);
-         animateObjects(mRuntimeDetails[0]);
+         delete block;
+         return false;
       }
+      list.setSingleBlock(block);
       
-      if (mCurrentDetail >= 0)
-      {
-         animateNode(getDetail(mCurrentDetail).rootNode);
-         animateObjects(mRuntimeDetails[mCurrentDetail+1]);
-      }
-   }
-   
-   void animateObjects(RuntimeDetailInfo& runtimeDetail)
-   {
-      for (uint32_t i=runtimeDetail.startRenderObject; i<runtimeDetail.startRenderObject+runtimeDetail.numRenderObjects; i++)
+      const uint32_t width = block->getHeightMapWidth();
+      const uint32_t height = block->getHeightMapHeight();
+      const uint32_t gridWidth = block->getGridMapWidth();
+      const uint32_t gridHeight = block->getGridMapHeight();
+      const float squareSize = (float)(1 << list.mScale);
+      if (gridWidth == 0 || gridHeight == 0 || block->mHeightMap.size() < width * height)
+         return false;
+      
+      std::vector<slm::vec3> points(width * height);
+      std::vector<slm::vec3> normals(width * height);
+      std::vector<slm::vec2> texCoords(width * height);
+      auto getHeight = [&](int32_t x, int32_t y) {
+         x = std::max<int32_t>(0, std::min<int32_t>(x, width-1));
+         y = std::max<int32_t>(0, std::min<int32_t>(y, height-1));
+         return block->mHeightMap[(y * width) + x];
+      };
+      
+      for (uint32_t y=0; y<height; y++)
       {
-         uint32_t objIDToRender = mObjectRenderID[i];
-         Shape::Object &info = mShape->mObjects[objIDToRender];
-         RuntimeObjectInfo* runtimeInfo = mRuntimeObjectInfos[objIDToRender];
-         
-         if (runtimeInfo->mLastKeyframe < 0)
+         for (uint32_t x=0; x<width; x++)
          {
-            runtimeInfo->mDraw = (info.flags & Shape::OBJECT_INVISIBLE_DEFAULT) != 0 ? false : true;
-            runtimeInfo->mFrame = 0;
-            runtimeInfo->mTexFrame = 0;
-            runtimeInfo->mLastKeyframe = 0;
+            uint32_t idx = (y * width) + x;
+            points[idx] = slm::vec3(x * squareSize, y * squareSize, getHeight(x, y));
+            slm::vec3 normal(getHeight(x-1, y) - getHeight(x+1, y), getHeight(x, y-1) - getHeight(x, y+1), 2.0f * squareSize);
+            normal.normalize();
+            normals[idx] = normal;
+            texCoords[idx] = slm::vec2((float)x / gridWidth, (float)y / gridHeight);
          }
-         
-         for (int i=0; i<mThreads.size(); i++)
+      }
+      
+      std::vector<uint32_t> indices;
+      indices.reserve(gridWidth * gridHeight * 6);
+      for (uint32_t y=0; y<gridHeight; y++)
+      {
+         for (uint32_t x=0; x<gridWidth; x++)
          {
-            Shape::Keyframe kfA;
-            ShapeThread &thread = mThreads[i];
-            if (thread.sequenceIdx == -1 || thread.sequenceIdx >= mShape->mSequences.size() || !thread.enabled)
-               continue;
-            uint32_t startSub = thread.startSubsequence;
-            int16_t subSeqIdx = mThreadSubsequences[startSub + mShape->mNodes.size() + objIDToRender];
-            if (subSeqIdx < 0)
-               continue;
-            if (mShape->mSubSequences.size() == 0)
+            uint32_t sqIdx = (y * gridWidth) + x;
+            if (sqIdx < block->mMatMap.size() && block->mMatMap[sqIdx].getEmptyDetailLevel() != 0)
                continue;
             
-            getNearestSubsequenceKeyframe(mShape->mSequences[thread.sequenceIdx],
-                                          mShape->mSubSequences[subSeqIdx],
-                                          runtimeInfo->mDraw,
-                                          &runtimeInfo->mLastKeyframe, thread.pos, kfA);
+            uint32_t i00 = (y * width) + x;
+            uint32_t i10 = i00 + 1;
+            uint32_t i01 = i00 + width;
+            uint32_t i11 = i01 + 1;
+            bool split45 = sqIdx < block->mGridMapBase.size() && (block->mGridMapBase[sqIdx].flags & TerrainBlock::GridSquare::Split45);
             
-            if (kfA.matIndex & Shape::KEYFRAME_VIS_MATTERS)
-               runtimeInfo->mDraw = (kfA.matIndex & Shape::KEYFRAME_VIS) != 0;
-            if (kfA.matIndex & Shape::KEYFRAME_FRAME_MATTERS)
-               runtimeInfo->mFrame = kfA.key;
-            if (kfA.matIndex & Shape::KEYFRAME_MAT_MATTERS)
-               runtimeInfo->mTexFrame = (kfA.matIndex & Shape::KEYFRAME_MAT_MASK);
+            if (split45)
+            {
+               uint32_t tri[6] = {i00, i10, i11, i00, i11, i01};
+               indices.insert(indices.end(), tri, tri+6);
+            }
+            else
+            {
+               uint32_t tri[6] = {i00, i10, i01, i10, i11, i01};
+               indices.insert(indices.end(), tri, tri+6);
+            }
          }
       }
+      
+      if (indices.empty())
+         return false;
+      
+      GLTFWriter::Primitive prim;
+      prim.position = writer.addPositions(&points[0], (uint32_t)points.size());
+      prim.normal = writer.addNormals(&normals[0], (uint32_t)normals.size());
+      prim.texCoord = writer.addTexCoords(&texCoords[0], (uint32_t)texCoords.size());
+      prim.indices = writer.addIndices(&indices[0], (uint32_t)indices.size());
+      
+      std::vector<GLTFWriter::Primitive> prims;
+      prims.push_back(prim);
+      
+      GLTFWriter::Node node;
+      node.name = block->mIdent;
+      node.mesh = writer.addMesh("terrain", prims);
+      node.hasTransform = true;
+      node.rotation = getYUpRotation();
+      
+      std::vector<int32_t> roots;
+      roots.push_back(writer.addNode(node));
+      writer.addScene("terrain", roots);
+      
+      return !writer.hasFailed();
+   }
+};
+
+void DarkstarPersistObject::initStatics()
+{
+   registerClass("TS::MaterialList", &_createClass<MaterialList>);
+   registerClass("TS::Shape", &_createClass<Shape>);
+   registerClass("TS::CelAnimMesh", &_createClass<CelAnimMesh>);
+   registerClass("ITRGeometry", &_createClass<InteriorGeom>);
+}
+
+
+// Collects model draws for a frame so opaque prims can be submitted front-to-back
+// (optionally after a depth-only prepass), followed by blended prims back-to-front.
+// Draws are ordered by a compact 64-bit key:
+//
+//   [63]     pass (0 = opaque, 1 = translucent)
+//   [62:39]  view depth (top 24 bits of the float, inverted for translucent)
+//   [38:36]  pipeline state
+//   [35:20]  texture
+//   [19:0]   draw index
+//
+class RenderQueue
+{
+public:
+   
+   struct Draw
+   {
+      uint32_t xfmIdx;
+      uint32_t modelId;
+      uint32_t vertOffset;
+      uint32_t texOffset;
+      int32_t texID;
+      ModelPipelineState state;
+      float testVal;
+      uint32_t numVerts;
+      uint32_t numInds;
+      uint32_t startInds;
+      uint32_t startVerts;
+   };
+   
+   struct Stats
+   {
+      uint32_t numOpaque;
+      uint32_t numTranslucent;
+      uint32_t numPrepass;
+      float sortTimeUS;
+   };
+   
+   enum
+   {
+      PassShift = 63,
+      DepthShift = 39,
+      StateShift = 36,
+      TexShift = 20,
+      DepthMask = 0xFFFFFF,
+      StateMask = 0x7,
+      TexMask = 0xFFFF,
+      IndexMask = 0xFFFFF
+   };
+   
+   std::vector<slm::mat4> mTransforms;
+   std::vector<Draw> mDraws;
+   std::vector<uint64_t> mKeys;
+   Stats mStats;
+   
+   static bool smDepthPrepass;
+   static Stats smLastStats;
+   
+   RenderQueue()
+   {
+      memset(&mStats, '\0', sizeof(Stats));
    }
    
-   void getNearestSubsequenceKeyframe(const Shape::Sequence &seq, const Shape::SubSequence &subSeq, bool lastVis, int32_t *lastKF, float pos, Shape::Keyframe &outA)
+   void clear()
    {
-      int32_t prevIDX=subSeq.firstKeyFrame-1;
-      uint32_t lastFrame=0;
-      uint32_t lastTexFrame=0;
-      uint32_t lastMatters=0;
+      mTransforms.clear();
+      mDraws.clear();
+      mKeys.clear();
+      memset(&mStats, '\0', sizeof(Stats));
+   }
+   
+   uint32_t addTransform(const slm::mat4& mat)
+   {
+      mTransforms.push_back(mat);
+      return (uint32_t)(mTransforms.size()-1);
+   }
+   
+   static bool isTranslucent(ModelPipelineState state)
+   {
+      return !(state == ModelPipeline_DefaultDiffuse || state == ModelPipeline_DepthOnly);
+   }
+   
+   // Positive floats sort the same as their bit patterns, so the top bits make a usable depth key
+   static uint64_t depthBits(float viewDepth)
+   {
+      if (!(viewDepth > 0.0f))
+         viewDepth = 0.0f;
       
-      // reset start basis if we've gone backwards
-      if (*lastKF >= subSeq.firstKeyFrame)
+      uint32_t bits = 0;
+      memcpy(&bits, &viewDepth, sizeof(uint32_t));
+      return (bits >> 7) & DepthMask;
+   }
+   
+   void addDraw(const Draw& draw, float viewDepth)
+   {
+      if (mDraws.size() > IndexMask)
       {
-         const Shape::Keyframe &kf = mShape->mKeyframes[(*lastKF)];
-         if (pos < kf.pos)
-            *lastKF = subSeq.firstKeyFrame;
+         assert(false);
+         return;
+      }
+      
+      uint64_t key = (uint64_t)mDraws.size();
+      uint64_t depth = depthBits(viewDepth);
+      
+      if (isTranslucent(draw.state))
+      {
+         key |= 1ULL << PassShift;
+         depth = DepthMask - depth;
+         mStats.numTranslucent++;
       }
       else
       {
-         *lastKF = subSeq.firstKeyFrame;
+         mStats.numOpaque++;
       }
       
-      for (uint32_t i=(*lastKF-subSeq.firstKeyFrame); i<subSeq.numKeyFrames; i++)
+      key |= depth << DepthShift;
+      key |= ((uint64_t)draw.state & StateMask) << StateShift;
+      key |= ((uint64_t)draw.texID & TexMask) << TexShift;
+      
+      mKeys.push_back(key);
+      mDraws.push_back(draw);
+   }
+   
+   void submit(const slm::mat4& viewMatrix, const slm::mat4& projMatrix)
+   {
+      auto sortStart = std::chrono::steady_clock::now();
+      std::sort(mKeys.begin(), mKeys.end());
+      auto sortEnd = std::chrono::steady_clock::now();
+      mStats.sortTimeUS = std::chrono::duration<float, std::micro>(sortEnd - sortStart).count();
+      
+      slm::mat4 view = viewMatrix;
+      slm::mat4 proj = projMatrix;
+      
+      if (smDepthPrepass)
       {
-         const Shape::Keyframe &kf = mShape->mKeyframes[subSeq.firstKeyFrame+i];
-         if (kf.pos <= pos + 0.001f)
+         const Draw* lastDraw = NULL;
+         for (uint64_t key : mKeys)
          {
-            prevIDX = subSeq.firstKeyFrame+i;
+            if (key >> PassShift)
+               break;
             
-            if (kf.matIndex & Shape::KEYFRAME_VIS_MATTERS)
-            {
-               lastMatters |= Shape::KEYFRAME_VIS_MATTERS | Shape::KEYFRAME_VIS;
-            }
-            if (kf.matIndex & Shape::KEYFRAME_FRAME_MATTERS)
-            {
-               lastFrame = (kf.key);
-               lastMatters |= Shape::KEYFRAME_FRAME_MATTERS;
-            }
-            if (kf.matIndex & Shape::KEYFRAME_MAT_MATTERS)
-            {
-               lastTexFrame = (kf.matIndex & Shape::KEYFRAME_MAT_MASK);
-               lastMatters |= Shape::KEYFRAME_MAT_MATTERS;
-            }
-         }
-         else if (kf.pos >= pos - 0.001f)
-         {
-            break;
+            const Draw& draw = mDraws[key & IndexMask];
+            issueDraw(draw, ModelPipeline_DepthOnly, 1.1f, lastDraw, view, proj);
+            lastDraw = &draw;
+            mStats.numPrepass++;
          }
       }
       
-      outA = mShape->mKeyframes[prevIDX];
-      outA.matIndex = lastTexFrame | lastMatters;
-      outA.key = lastFrame;
-      *lastKF = prevIDX;
+      const Draw* lastDraw = NULL;
+      for (uint64_t key : mKeys)
+      {
+         const Draw& draw = mDraws[key & IndexMask];
+         issueDraw(draw, draw.state, draw.testVal, lastDraw, view, proj);
+         lastDraw = &draw;
+      }
+      
+      smLastStats = mStats;
    }
    
-   void getSubsequenceKeyframes(const Shape::Sequence &seq, const Shape::SubSequence &subSeq, uint32_t nodeIdx, float pos, Shape::Keyframe &outA, Shape::Keyframe &outB, float &outInterpolation)
+protected:
+   
+   // Only sets the state which changed since the last draw
+   void issueDraw(const Draw& draw, ModelPipelineState state, float testVal, const Draw* lastDraw, slm::mat4& view, slm::mat4& proj)
    {
-      int32_t prevIDX=subSeq.firstKeyFrame-1;
-      int32_t nextIDX=subSeq.firstKeyFrame+subSeq.numKeyFrames;
-      for (uint32_t i=0; i<subSeq.numKeyFrames; i++)
+      bool newState = lastDraw == NULL || lastDraw->texID != draw.texID || lastDraw->testVal != draw.testVal ||
+                      (state != ModelPipeline_DepthOnly && lastDraw->state != draw.state);
+      bool newXfm = newState || lastDraw->xfmIdx != draw.xfmIdx;
+      bool newVerts = lastDraw == NULL || lastDraw->modelId != draw.modelId ||
+                      lastDraw->vertOffset != draw.vertOffset || lastDraw->texOffset != draw.texOffset;
+      
+      if (newState)
       {
-         const Shape::Keyframe &kf = mShape->mKeyframes[subSeq.firstKeyFrame+i];
-         if (kf.pos <= pos + 0.001f)
-         {
-            prevIDX = subSeq.firstKeyFrame+i;
-         }
-         else if (kf.pos >= pos - 0.001f)
-         {
-            nextIDX = subSeq.firstKeyFrame+i;
-            break;
-         }
+         GFXBeginModelPipelineState(state, draw.texID, testVal);
       }
       
-      // Refine and determine interpolation value
-      if (seq.cyclic)
+      if (newXfm)
       {
-         float diff = 0.0f;
-         if (prevIDX < subSeq.firstKeyFrame)
+         GFXSetModelViewProjection(mTransforms[draw.xfmIdx], view, proj);
+      }
+      
+      if (newVerts)
+      {
+         GFXSetModelVerts(draw.modelId, draw.vertOffset, draw.texOffset);
+      }
+      
+      GFXDrawModelPrims(draw.numVerts, draw.numInds, draw.startInds, draw.startVerts);
+   }
+};
+
+bool RenderQueue::smDepthPrepass = false;
+RenderQueue::Stats RenderQueue::smLastStats;
+
+class GenericViewer
+{
+public:
+   
+   struct LoadedTexture
+   {
+      int32_t texID;
+      uint32_t bmpFlags;
+      uint16_t width, height;
+      uint64_t contentKey; // key in smSharedTextures, or 0 if owned by this viewer
+      
+      LoadedTexture() : texID(-1), bmpFlags(0), width(0), height(0), contentKey(0) {;}
+      LoadedTexture(int32_t tid, uint32_t bf) : texID(tid), bmpFlags(bf), width(0), height(0), contentKey(0) {;}
+   };
+   
+   // Textures are shared between viewers by content, so a bitmap found under several names or mounts is
+   // only uploaded once. The key mixes the content hash of the bitmap(s) with the palette they were
+   // converted with.
+   struct SharedTexture
+   {
+      LoadedTexture tex;
+      uint32_t refCount;
+      uint64_t gpuBytes;
+   };
+   
+   struct DedupStats
+   {
+      uint32_t numShared;    // textures taken from smSharedTextures instead of being loaded
+      uint64_t bytesSaved;   // GPU memory those would have used
+   };
+   
+   static std::unordered_map<uint64_t, SharedTexture> smSharedTextures;
+   static DedupStats smDedupStats;
+   
+   struct ActiveMaterial
+   {
+      LoadedTexture tex;
+   };
+   
+   std::vector<ActiveMaterial> mActiveMaterials;
+   std::unordered_map<std::string, LoadedTexture> mLoadedTextures;
+   ActiveMaterial mSharedMaterials;
+   
+   ResManager* mResourceManager;
+   Palette* mPalette;
+   uint64_t mPaletteHash;
+   MaterialList* mMaterialList;
+   
+   bool initVB;
+   bool useShared;
+   
+   slm::mat4 mProjectionMatrix;
+   slm::mat4 mModelMatrix;
+   slm::mat4 mViewMatrix;
+   
+   slm::vec4 mLightColor;
+   slm::vec3 mLightPos;
+   
+   RenderQueue mRenderQueue;
+   OcclusionBuffer mOcclusion;
+   
+   uint32_t mModelId; // GFX model the geometry is loaded into
+   
+   GenericViewer() : mResourceManager(NULL), mPalette(NULL), mPaletteHash(0), mMaterialList(NULL), mModelId(0)
+   {
+      useShared = false;
+   }
+   
+   void updateMVP()
+   {
+      GFXSetModelViewProjection(mModelMatrix, mViewMatrix, mProjectionMatrix);
+      GFXSetLightPos(mLightPos, mLightColor);
+   }
+   
+   // Rough size in pixels of a sphere dist away from the camera, used to pick detail levels
+   static float getProjectedSize(float radius, float dist, int w, int h)
+   {
+      if (dist <= 0.0f)
+         return 1000.0f;
+      
+      return atan(radius/dist) * (std::max<float>(w, h) / slm::radians(90.0));
+   }
+   
+   // Starts rasterizing occluders for this frame on the worker thread. Should be called as soon
+   // as the matrices are known (see ViewController::beginView) so it overlaps the rest of the frame;
+   // the first isOccluded() call waits for it.
+   void kickOcclusion()
+   {
+      if (!OcclusionBuffer::smEnabled || !mOcclusion.hasOccluders())
+         return;
+      
+      // NOTE: occluders are stored z-up like the source geometry
+      slm::mat4 y_up = slm::rotation_x(slm::radians(-90.0f));
+      mOcclusion.kick(mProjectionMatrix * mViewMatrix * mModelMatrix * y_up);
+   }
+   
+   bool isOccluded(const slm::vec3& minP, const slm::vec3& maxP)
+   {
+      if (!OcclusionBuffer::smEnabled || !mOcclusion.hasOccluders())
+         return false;
+      
+      mOcclusion.wait();
+      return !mOcclusion.testAABB(minP, maxP);
+   }
+   
+   void endOcclusion()
+   {
+      if (!OcclusionBuffer::smEnabled || !mOcclusion.hasOccluders())
+         return;
+      
+      mOcclusion.wait();
+      mOcclusion.endFrame();
+   }
+   
+   // Picks the pipeline state and alpha test value for a material based on its bitmap flags
+   void getMaterialPipeline(int32_t matIdx, ModelPipelineState& outState, float& outTestVal)
+   {
+      uint32_t bmpFlags = mActiveMaterials[matIdx].tex.bmpFlags;
+      outTestVal = 1.1f;
+      
+      if (bmpFlags & Bitmap::FLAG_TRANSPARENT)
+      {
+         outState = ModelPipeline_TranslucentBlend;
+         outTestVal = 0.65f;
+      }
+      else if (bmpFlags & Bitmap::FLAG_ADDITIVE)
+      {
+         outState = ModelPipeline_AdditiveBlend;
+      }
+      else if (bmpFlags & Bitmap::FLAG_SUBTRACTIVE)
+      {
+         outState = ModelPipeline_SubtractiveBlend;
+      }
+      else if (bmpFlags & Bitmap::FLAG_TRANSLUCENT)
+      {
+         outState = ModelPipeline_TranslucentBlend;
+      }
+      else
+      {
+         outState = ModelPipeline_DefaultDiffuse;
+      }
+   }
+   
+   void initMaterials()
+   {
+      mActiveMaterials.clear();
+      
+      if (!mMaterialList)
+      {
+         assert(false);
+         return;
+      }
+      
+      if (useShared)
+      {
+         // Load as single shared layered 2d texture
+         if (!loadSharedMaterials())
+         {
+            assert(false);
+         }
+      }
+      else
+      {
+         mActiveMaterials.resize(mMaterialList->mMaterials.size());
+         
+         // Anything not already loaded, here or by content elsewhere, goes through the pipeline together
+         std::vector<std::string> toLoad;
+         for (Material& mat : mMaterialList->mMaterials)
+         {
+            std::string fname = (const char*)mat.mFilename;
+            if (mLoadedTextures.find(fname) != mLoadedTextures.end() ||
+                std::find(toLoad.begin(), toLoad.end(), fname) != toLoad.end())
+               continue;
+            
+            uint64_t hash = 0;
+            LoadedTexture tex;
+            if (mResourceManager->findFileHash(fname.c_str(), hash) && acquireSharedTexture(getTextureKey(hash), tex))
+               mLoadedTextures[fname] = tex;
+            else
+               toLoad.push_back(fname);
+         }
+         
+         if (!toLoad.empty())
+         {
+            std::vector<const char*> names(toLoad.size());
+            std::vector<MaterialPipeline::Result> results(toLoad.size());
+            for (uint32_t i=0; i<toLoad.size(); i++)
+               names[i] = toLoad[i].c_str();
+            
+            MaterialPipeline pipeline(getPipelineReadFunc(), mPalette);
+            pipeline.loadTextures((uint32_t)names.size(), &names[0], &results[0]);
+            
+            for (uint32_t i=0; i<toLoad.size(); i++)
+            {
+               const MaterialPipeline::Result& res = results[i];
+               if (!res.loaded)
+                  continue;
+               
+               if (res.texID >= 0)
+                  LOG_DEBUG("Loaded texture %s dimensions %ix%i", names[i], res.width, res.height);
+               
+               LoadedTexture tex(res.texID, res.bmpFlags);
+               tex.width = res.width;
+               tex.height = res.height;
+               if (res.texID >= 0 && res.contentHash != 0)
+                  addSharedTexture(getTextureKey(res.contentHash), tex);
+               mLoadedTextures[toLoad[i]] = tex;
+            }
+         }
+         
+         for (int i=0; i<mMaterialList->mMaterials.size(); i++)
+         {
+            Material& mat = mMaterialList->mMaterials[i];
+            auto itr = mLoadedTextures.find((const char*)mat.mFilename);
+            if (itr != mLoadedTextures.end())
+               mActiveMaterials[i].tex = itr->second;
+         }
+      }
+   }
+   
+   MaterialPipeline::ReadFunc getPipelineReadFunc()
+   {
+      ResManager* mgr = mResourceManager;
+      return [mgr](uint32_t count, const char** filenames, MemRStream** outStreams, uint64_t* outHashes){
+         mgr->openFiles(count, filenames, outStreams, -1, outHashes);
+      };
+   }
+   
+   inline uint64_t getTextureKey(uint64_t contentHash)
+   {
+      return ContentHash::hash(&mPaletteHash, sizeof(mPaletteHash), contentHash);
+   }
+   
+   // Key for a layered texture, if every layer has been hashed
+   bool getTextureSetKey(const std::vector<const char*>& names, uint64_t& outKey)
+   {
+      outKey = ContentHash::OffsetBasis;
+      for (const char* name : names)
+      {
+         uint64_t hash = 0;
+         if (!mResourceManager->findFileHash(name, hash))
+            return false;
+         outKey = ContentHash::hash(&hash, sizeof(hash), outKey);
+      }
+      
+      outKey = getTextureKey(outKey);
+      return true;
+   }
+   
+   bool acquireSharedTexture(uint64_t key, LoadedTexture& outTex)
+   {
+      auto itr = smSharedTextures.find(key);
+      if (itr == smSharedTextures.end())
+         return false;
+      
+      itr->second.refCount++;
+      outTex = itr->second.tex;
+      
+      smDedupStats.numShared++;
+      smDedupStats.bytesSaved += itr->second.gpuBytes;
+      return true;
+   }
+   
+   // Registers a texture which has just been loaded. If the same content was loaded meanwhile (i.e. its
+   // hash wasn't known beforehand) tex is freed and replaced by the shared one.
+   void addSharedTexture(uint64_t key, LoadedTexture& tex, uint32_t numLayers=1)
+   {
+      auto itr = smSharedTextures.find(key);
+      if (itr == smSharedTextures.end())
+      {
+         tex.contentKey = key;
+         SharedTexture shared = {tex, 1, (uint64_t)GFXGetTextureStagingSize(tex.width, tex.height, NULL) * numLayers};
+         smSharedTextures[key] = shared;
+         return;
+      }
+      
+      // Duplicates within one load already share the texture
+      if (itr->second.tex.texID != tex.texID)
+         GFXDeleteTexture(tex.texID);
+      
+      smDedupStats.numShared++;
+      smDedupStats.bytesSaved += itr->second.gpuBytes;
+      
+      itr->second.refCount++;
+      tex = itr->second.tex;
+   }
+   
+   void releaseTexture(LoadedTexture& tex)
+   {
+      if (tex.texID < 0)
+         return;
+      
+      if (tex.contentKey == 0)
+      {
+         GFXDeleteTexture(tex.texID);
+      }
+      else
+      {
+         auto itr = smSharedTextures.find(tex.contentKey);
+         if (itr != smSharedTextures.end() && --itr->second.refCount == 0)
+         {
+            GFXDeleteTexture(itr->second.tex.texID);
+            smSharedTextures.erase(itr);
+         }
+      }
+      
+      tex = LoadedTexture();
+   }
+   
+   bool loadSharedMaterials()
+   {
+      std::vector<const char*> names;
+      for (Material& mat : mMaterialList->mMaterials)
+         names.push_back((const char*)mat.mFilename);
+      
+      if (names.empty())
+         return false;
+      
+      uint64_t key = 0;
+      if (getTextureSetKey(names, key) && acquireSharedTexture(key, mSharedMaterials.tex))
+         return true;
+      
+      uint32_t width = 0;
+      uint32_t height = 0;
+      MaterialPipeline pipeline(getPipelineReadFunc(), mPalette);
+      int32_t texID = pipeline.loadTextureSet((uint32_t)names.size(), &names[0], &width, &height);
+      if (texID < 0)
+         return false;
+      
+      mSharedMaterials.tex = LoadedTexture(texID, 0);
+      mSharedMaterials.tex.width = width;
+      mSharedMaterials.tex.height = height;
+      
+      // Layers read from volumes have now been hashed
+      if (getTextureSetKey(names, key))
+         addSharedTexture(key, mSharedMaterials.tex, (uint32_t)names.size());
+      return true;
+   }
+   
+   bool loadTexture(const char *filename, LoadedTexture& outTexInfo, bool force=false)
+   {
+      bool genTex = true;
+      std::string fname = std::string(filename);
+      auto itr = mLoadedTextures.find(fname);
+      if (itr != mLoadedTextures.end())
+      {
+         outTexInfo = itr->second;
+         genTex = false;
+         if (!force) return true;
+      }
+      
+      // Find in resources
+      MemRStream mem(0, NULL);
+      if (mResourceManager->openFile(filename, mem))
+      {
+         Bitmap* bmp = new Bitmap();
+         if (bmp->read(mem))
+         {
+            int32_t texID = GFXLoadTexture(bmp, mPalette);
+            if (texID >= 0)
+            {
+               LOG_DEBUG("Loaded texture %s dimensions %ix%i", filename, bmp->mWidth, bmp->mHeight);
+               outTexInfo.bmpFlags = bmp->mFlags;
+               outTexInfo.texID = texID;
+               outTexInfo.width = bmp->mWidth;
+               outTexInfo.height = bmp->mHeight;
+            }
+            
+            // Done
+            mLoadedTextures[fname] = outTexInfo;
+            delete bmp;
+            return true;
+         }
+         delete bmp;
+      }
+      
+      return false;
+   }
+   
+   void clearTextures()
+   {
+      for (auto& itr: mLoadedTextures) { releaseTexture(itr.second); }
+      mLoadedTextures.clear();
+      releaseTexture(mSharedMaterials.tex);
+   }
+   
+   bool setPalette(const char *filename)
+   {
+      MemRStream mem(0, NULL);
+      if (mResourceManager->openFile(filename, mem))
+      {
+         Palette* newPal = new Palette();
+         uint64_t palHash = ContentHash::hash(mem.mPtr, mem.mSize);
+         if (newPal->read(mem))
+         {
+            if (mPalette) delete mPalette;
+            clearTextures();
+            mPalette = newPal;
+            mPaletteHash = palHash;
+            if (mMaterialList) initMaterials();
+            return true;
+         }
+      }
+      return false;
+   }
+   
+};
+
+std::unordered_map<uint64_t, GenericViewer::SharedTexture> GenericViewer::smSharedTextures;
+GenericViewer::DedupStats GenericViewer::smDedupStats = {};
+
+class ShapeViewer : public GenericViewer
+{
+public:
+   struct RuntimeMeshInfo
+   {
+      std::vector<CelAnimMesh::Prim> mPrims;
+      CelAnimMesh* mMesh;
+      uint32_t mRealVertsPerFrame;
+      uint32_t mRealTexVertsPerFrame;
+      
+      RuntimeMeshInfo() {;}
+      ~RuntimeMeshInfo() {;}
+   };
+   
+   struct RuntimeObjectInfo
+   {
+      uint32_t mFrame;
+      uint32_t mTexFrame;
+      bool mDraw;
+      int32_t mLastKeyframe;
+      
+      RuntimeObjectInfo() : mFrame(0), mTexFrame(0), mLastKeyframe(-1), mDraw(true) {;}
+      ~RuntimeObjectInfo() {;}
+   };
+   
+   struct RuntimeDetailInfo
+   {
+      uint32_t startRenderObject;
+      uint32_t numRenderObjects;
+      
+      RuntimeDetailInfo() {;}
+      RuntimeDetailInfo(uint32_t so, uint32_t nro) : startRenderObject(so), numRenderObjects(nro) {;}
+   };
+   
+   struct ShapeThread
+   {
+      enum State
+      {
+         STOPPED,
+         PLAYING,
+         PLAYING_TRANSITION_WAIT,
+         TRANSITIONING,
+      };
+      int32_t sequenceIdx;
+      int32_t transitionIdx;
+      uint32_t startSubsequence;
+      float pos;
+      
+      State state;
+      bool enabled;
+      
+      ShapeThread() : sequenceIdx(-1), transitionIdx(-1), startSubsequence(0), pos(0), enabled(true) {;}
+   };
+   
+   std::vector<ShapeThread> mThreads;
+   std::vector<int16_t> mThreadSubsequences; // Subsequence tracks for nodes + objects
+   
+   Shape* mShape;
+   
+   std::vector<slm::mat4> mNodeTransforms; // Current transform list
+   std::vector<slm::vec3> mNodePositions; // World space node origins, used by renderNodes
+   std::vector<slm::quat> mActiveRotations; // non-gl xfms
+   std::vector<slm::vec4> mActiveTranslations; // non-gl xfms
+   std::vector<uint8_t> mNodeVisiblity;
+   std::vector<RuntimeMeshInfo*> mRuntimeMeshInfos;
+   std::vector<RuntimeObjectInfo*> mRuntimeObjectInfos;
+   
+   std::vector<RuntimeDetailInfo> mRuntimeDetails;
+   std::vector<uint32_t> mObjectRenderID;
+   
+   int32_t mDefaultMaterials;
+   int32_t mAlwaysNode;
+   int32_t mCurrentDetail;
+   
+   // Deferred mesh decoding (see Shape::smDeferMeshes)
+   std::vector<CelAnimMesh*> mDecodedMeshes; // one slot per mesh, written by the decode jobs
+   std::vector<uint8_t> mDetailReady;
+   JobSystem::Counter mMeshJobs;
+   bool mMeshesPending;
+   
+   Shape::Transform& getTransform(uint32_t i)
+   {
+      return mShape->mTransforms[i];
+   }
+   
+   Shape::Detail& getDetail(uint32_t i)
+   {
+      return mShape->mDetails[i];
+   }
+   
+   ShapeViewer(ResManager* res)
+   {
+      mPalette = NULL;
+      mShape = NULL;
+      mResourceManager = res;
+      initVB = false;
+      mMeshesPending = false;
+   }
+   
+   ~ShapeViewer()
+   {
+      cancelMeshDecode();
+      for (RuntimeMeshInfo* itr : mRuntimeMeshInfos) { delete itr; }
+      for (RuntimeObjectInfo* itr : mRuntimeObjectInfos) { delete itr; }
+      if (mPalette) delete mPalette;
+      clearVertexBuffer();
+      clearTextures();
+      clearRender();
+   }
+   
+   void clear()
+   {
+      cancelMeshDecode();
+      clearVertexBuffer();
+      clearTextures();
+      
+      for (RuntimeMeshInfo* itr : mRuntimeMeshInfos) { delete itr; }
+      for (RuntimeObjectInfo* itr : mRuntimeObjectInfos) { delete itr; }
+      mRuntimeObjectInfos.clear();
+      mRuntimeMeshInfos.clear();
+      mNodeTransforms.clear();
+      mThreads.clear();
+      mThreadSubsequences.clear();
+      mActiveMaterials.clear();
+      mShape = NULL;
+      mMaterialList = NULL;
+   }
+   
+   void initRender()
+   {
+      mLightColor = slm::vec4(1,1,1,1);
+      mLightPos = slm::vec3(0,2, 2);
+      
+      // TODO
+   }
+   
+   void clearRender()
+   {
+      // TODO
+   }
+   
+   // Sequence Handling
+   
+   inline uint32_t getSubsequenceStride()
+   {
+      return  (mShape->mObjects.size() + mShape->mNodes.size()) * 2;
+   }
+   
+   uint32_t addThread()
+   {
+      ShapeThread thread;
+      thread.startSubsequence = mThreadSubsequences.size();
+      mThreads.push_back(thread);
+      mThreadSubsequences.resize(mThreadSubsequences.size() + getSubsequenceStride());
+      for (uint32_t i=thread.startSubsequence; i<mThreadSubsequences.size(); i++)
+      {
+         mThreadSubsequences[i] = -1;
+      }
+      
+      return mThreads.size()-1;
+   }
+   
+   void setThreadSequence(uint32_t idx, int32_t sequenceId)
+   {
+      ShapeThread &thread = mThreads[idx];
+      thread.sequenceIdx = sequenceId;
+      thread.transitionIdx = -1;
+      thread.pos = 0.0f;
+      thread.state = sequenceId < 0 ? ShapeThread::STOPPED : ShapeThread::PLAYING;
+      // Scan through nodes and objects and set subsequence track
+      memset(&mThreadSubsequences[thread.startSubsequence], '\0', sizeof(uint16_t)*getSubsequenceStride());
+      
+      for (int k=0, sz = mShape->mNodes.size(); k<sz; k++)
+      {
+         Shape::Node *itr = &mShape->mNodes[k];
+         mThreadSubsequences[thread.startSubsequence + k] = -1;
+         for (int32_t i=itr->firstSubSequence, endI=itr->firstSubSequence + itr->numSubSequences; i<endI; i++)
+         {
+            if (mShape->mSubSequences[i].sequenceIdx == sequenceId)
+            {
+               mThreadSubsequences[thread.startSubsequence + k] = i;
+               break;
+            }
+         }
+      }
+      
+      uint32_t offset = mShape->mNodes.size();
+      for (int k=0, sz = mShape->mObjects.size(); k<sz; k++)
+      {
+         Shape::Object *itr = &mShape->mObjects[k];
+         mThreadSubsequences[thread.startSubsequence + offset + k] = -1;
+         for (int32_t i=itr->firstSubSequence, endI=itr->firstSubSequence + itr->numSubSequences; i<endI; i++)
+         {
+            if (mShape->mSubSequences[i].sequenceIdx == sequenceId)
+            {
+               mThreadSubsequences[thread.startSubsequence + offset + k] = i;
+               break;
+            }
+         }
+      }
+      
+      // Reset obj states
+      for (int i=0; i<mRuntimeObjectInfos.size(); i++)
+      {
+         mRuntimeObjectInfos[i]->mLastKeyframe = -1;
+      }
+   }
+   
+   void removeThread(uint32_t idx)
+   {
+      const uint32_t numSubSeqs = getSubsequenceStride();
+      ShapeThread thread = mThreads[idx];
+      mThreadSubsequences.erase(mThreadSubsequences.begin() + thread.startSubsequence, mThreadSubsequences.begin() + thread.startSubsequence + numSubSeqs);
+      for (uint32_t i = idx+1, sz = mThreads.size(); i<sz; i++)
+      {
+         mThreads[i].startSubsequence -= numSubSeqs;
+      }
+      mThreads.erase(mThreads.begin()+idx);
+   }
+   
+   void advanceThreads(float dt)
+   {
+      for (ShapeThread &thread : mThreads)
+      {
+         if (thread.sequenceIdx == -1 || thread.sequenceIdx >= mShape->mSequences.size())
+            continue;
+         
+         Shape::Sequence &sequence = mShape->mSequences[thread.sequenceIdx];
+         
+         switch (thread.state)
+         {
+            case ShapeThread::STOPPED:
+               break;
+            case ShapeThread::TRANSITIONING: // TODO
+               break;
+            case ShapeThread::PLAYING_TRANSITION_WAIT: // TODO
+            case ShapeThread::PLAYING:
+               thread.pos += dt / sequence.duration;
+               if (thread.pos > 1.0)
+               {
+                  if (sequence.cyclic)
+                  {
+                     thread.pos -= 1.0;
+                     for (int i=0; i<mRuntimeObjectInfos.size(); i++)
+                     {
+                        mRuntimeObjectInfos[i]->mLastKeyframe = -1;
+                     }
+                  }
+                  else
+                  {
+                     thread.pos = 1.0;
+                     thread.state = ShapeThread::STOPPED;
+                  }
+               }
+               break;
+         }
+      }
+   }
+   
+   void animateNodes()
+   {
+      if (mAlwaysNode >= 0)
+      {
+         animateNode(mAlwaysNode);
+         animateObjects(mRuntimeDetails[0]);
+      }
+      
+      int32_t detail = getReadyDetail(mCurrentDetail);
+      if (detail >= 0)
+      {
+         animateNode(getDetail(detail).rootNode);
+         animateObjects(mRuntimeDetails[detail+1]);
+      }
+   }
+   
+   void animateObjects(RuntimeDetailInfo& runtimeDetail)
+   {
+      for (uint32_t i=runtimeDetail.startRenderObject; i<runtimeDetail.startRenderObject+runtimeDetail.numRenderObjects; i++)
+      {
+         uint32_t objIDToRender = mObjectRenderID[i];
+         Shape::Object &info = mShape->mObjects[objIDToRender];
+         RuntimeObjectInfo* runtimeInfo = mRuntimeObjectInfos[objIDToRender];
+         
+         if (runtimeInfo->mLastKeyframe < 0)
+         {
+            runtimeInfo->mDraw = (info.flags & Shape::OBJECT_INVISIBLE_DEFAULT) != 0 ? false : true;
+            runtimeInfo->mFrame = 0;
+            runtimeInfo->mTexFrame = 0;
+            runtimeInfo->mLastKeyframe = 0;
+         }
+         
+         for (int i=0; i<mThreads.size(); i++)
+         {
+            Shape::Keyframe kfA;
+            ShapeThread &thread = mThreads[i];
+            if (thread.sequenceIdx == -1 || thread.sequenceIdx >= mShape->mSequences.size() || !thread.enabled)
+               continue;
+            uint32_t startSub = thread.startSubsequence;
+            int16_t subSeqIdx = mThreadSubsequences[startSub + mShape->mNodes.size() + objIDToRender];
+            if (subSeqIdx < 0)
+               continue;
+            if (mShape->mSubSequences.size() == 0)
+               continue;
+            
+            getNearestSubsequenceKeyframe(mShape->mSequences[thread.sequenceIdx],
+                                          mShape->mSubSequences[subSeqIdx],
+                                          runtimeInfo->mDraw,
+                                          &runtimeInfo->mLastKeyframe, thread.pos, kfA);
+            
+            if (kfA.matIndex & Shape::KEYFRAME_VIS_MATTERS)
+               runtimeInfo->mDraw = (kfA.matIndex & Shape::KEYFRAME_VIS) != 0;
+            if (kfA.matIndex & Shape::KEYFRAME_FRAME_MATTERS)
+               runtimeInfo->mFrame = kfA.key;
+            if (kfA.matIndex & Shape::KEYFRAME_MAT_MATTERS)
+               runtimeInfo->mTexFrame = (kfA.matIndex & Shape::KEYFRAME_MAT_MASK);
+         }
+      }
+   }
+   
+   void getNearestSubsequenceKeyframe(const Shape::Sequence &seq, const Shape::SubSequence &subSeq, bool lastVis, int32_t *lastKF, float pos, Shape::Keyframe &outA)
+   {
+      int32_t prevIDX=subSeq.firstKeyFrame-1;
+      uint32_t lastFrame=0;
+      uint32_t lastTexFrame=0;
+      uint32_t lastMatters=0;
+      
+      // reset start basis if we've gone backwards
+      if (*lastKF >= subSeq.firstKeyFrame)
+      {
+         const Shape::Keyframe &kf = mShape->mKeyframes[(*lastKF)];
+         if (pos < kf.pos)
+            *lastKF = subSeq.firstKeyFrame;
+      }
+      else
+      {
+         *lastKF = subSeq.firstKeyFrame;
+      }
+      
+      for (uint32_t i=(*lastKF-subSeq.firstKeyFrame); i<subSeq.numKeyFrames; i++)
+      {
+         const Shape::Keyframe &kf = mShape->mKeyframes[subSeq.firstKeyFrame+i];
+         if (kf.pos <= pos + 0.001f)
+         {
+            prevIDX = subSeq.firstKeyFrame+i;
+            
+            if (kf.matIndex & Shape::KEYFRAME_VIS_MATTERS)
+            {
+               lastMatters |= Shape::KEYFRAME_VIS_MATTERS | Shape::KEYFRAME_VIS;
+            }
+            if (kf.matIndex & Shape::KEYFRAME_FRAME_MATTERS)
+            {
+               lastFrame = (kf.key);
+               lastMatters |= Shape::KEYFRAME_FRAME_MATTERS;
+            }
+            if (kf.matIndex & Shape::KEYFRAME_MAT_MATTERS)
+            {
+               lastTexFrame = (kf.matIndex & Shape::KEYFRAME_MAT_MASK);
+               lastMatters |= Shape::KEYFRAME_MAT_MATTERS;
+            }
+         }
+         else if (kf.pos >= pos - 0.001f)
+         {
+            break;
+         }
+      }
+      
+      outA = mShape->mKeyframes[prevIDX];
+      outA.matIndex = lastTexFrame | lastMatters;
+      outA.key = lastFrame;
+      *lastKF = prevIDX;
+   }
+   
+   void getSubsequenceKeyframes(const Shape::Sequence &seq, const Shape::SubSequence &subSeq, uint32_t nodeIdx, float pos, Shape::Keyframe &outA, Shape::Keyframe &outB, float &outInterpolation)
+   {
+      int32_t prevIDX=subSeq.firstKeyFrame-1;
+      int32_t nextIDX=subSeq.firstKeyFrame+subSeq.numKeyFrames;
+      for (uint32_t i=0; i<subSeq.numKeyFrames; i++)
+      {
+         const Shape::Keyframe &kf = mShape->mKeyframes[subSeq.firstKeyFrame+i];
+         if (kf.pos <= pos + 0.001f)
+         {
+            prevIDX = subSeq.firstKeyFrame+i;
+         }
+         else if (kf.pos >= pos - 0.001f)
+         {
+            nextIDX = subSeq.firstKeyFrame+i;
+            break;
+         }
+      }
+      
+      // Refine and determine interpolation value
+      if (seq.cyclic)
+      {
+         float diff = 0.0f;
+         if (prevIDX < subSeq.firstKeyFrame)
+         {
+            prevIDX = subSeq.firstKeyFrame + subSeq.numKeyFrames-1;
+            diff = mShape->mKeyframes[nextIDX].pos - mShape->mKeyframes[prevIDX].pos;
+            outInterpolation = (pos - mShape->mKeyframes[prevIDX].pos) / diff;
+         }
+         else if (nextIDX >= subSeq.firstKeyFrame+subSeq.numKeyFrames)
+         {
+            nextIDX = subSeq.firstKeyFrame;
+            diff = (mShape->mKeyframes[nextIDX].pos + 1.0f) - mShape->mKeyframes[prevIDX].pos;
+            outInterpolation = (pos - mShape->mKeyframes[prevIDX].pos) / diff;
+         }
+         
+         if (prevIDX == nextIDX)
+         {
+            outInterpolation = 0.0f;
+         }
+         else
+         {
+            diff = mShape->mKeyframes[nextIDX].pos - mShape->mKeyframes[prevIDX].pos;
+            if (std::fpclassify(diff) == FP_ZERO)
+            {
+               outInterpolation = std::fpclassify(pos - mShape->mKeyframes[prevIDX].pos) == FP_ZERO ? 0.0f : 1.0f;
+            }
+            else
+            {
+               outInterpolation = (pos - mShape->mKeyframes[prevIDX].pos) / diff;
+            }
+         }
+      }
+      else
+      {
+         if (prevIDX < subSeq.firstKeyFrame)
+         {
+            prevIDX = subSeq.firstKeyFrame;
+            outInterpolation = 0.0f;
+         }
+         else if (nextIDX >= subSeq.firstKeyFrame+subSeq.numKeyFrames)
+         {
+            nextIDX = subSeq.firstKeyFrame+subSeq.numKeyFrames-1;
+            outInterpolation = 1.0f;
+         }
+         else if (prevIDX == nextIDX)
+         {
+            outInterpolation = 0.0f;
+         }
+         else
+         {
+            float diff = mShape->mKeyframes[nextIDX].pos - mShape->mKeyframes[prevIDX].pos;
+            outInterpolation = (diff <= 0) ? 0.0f : (pos - mShape->mKeyframes[prevIDX].pos) / diff;
+         }
+      }
+      
+      assert(prevIDX >= subSeq.firstKeyFrame && prevIDX < subSeq.firstKeyFrame + subSeq.numKeyFrames);
+      assert(nextIDX >= subSeq.firstKeyFrame && nextIDX < subSeq.firstKeyFrame + subSeq.numKeyFrames);
+      
+      outA = mShape->mKeyframes[prevIDX];
+      outB = mShape->mKeyframes[nextIDX];
+   }
+   
+   slm::mat4 interpolateXfm(const Shape::Transform &xfmA, const Shape::Transform &xfmB, float pos)
+   {
+      slm::quat qa = xfmA.rot.toQuat();
+      slm::quat qb = xfmB.rot.toQuat();
+      
+      slm::quat qc = CompatInterpolate(qa, qb, pos);
+      float invPos = 1.0 - pos;
+      slm::vec3 pc = slm::vec3(xfmA.pos.x * invPos + xfmB.pos.x * pos,
+                               xfmA.pos.y * invPos + xfmB.pos.y * pos,
+                               xfmA.pos.z * invPos + xfmB.pos.z * pos);
+      
+      slm::mat4 outXfm(1);
+      CompatQuatSetMatrix(qc, outXfm);
+      outXfm[3] = slm::vec4(pc.x, pc.y, pc.z, 1);
+      
+      return outXfm;
+   }
+   
+   void animateNode(uint32_t nodeIdx)
+   {
+      Shape::Node &node = mShape->mNodes[nodeIdx];
+      slm::quat q;
+      slm::mat4 xfmLocal(1);
+      
+      mNodeVisiblity[nodeIdx] &= ~0x2; // clear force vis
+      
+      // Start with setting the default transform
+      {
+         Shape::Transform xfmShape = getTransform(node.defaultTransform);
+         slm::quat tquat = xfmShape.rot.toQuat();
+         CompatQuatSetMatrix(tquat, xfmLocal);
+         xfmLocal[3] = slm::vec4(xfmShape.pos.x, xfmShape.pos.y, xfmShape.pos.z, 1);
+      }
+      
+      // If we are currently being animated, use that track instead (additional tracks will override)
+      for (int i=0; i<mThreads.size(); i++)
+      {
+         ShapeThread &thread = mThreads[i];
+         if (thread.sequenceIdx == -1 || !thread.enabled)
+            continue;
+         uint32_t startSub = thread.startSubsequence;
+         
+         int16_t subSeqIdx = mThreadSubsequences[startSub + nodeIdx];
+         if (subSeqIdx != -1)
+         {
+            Shape::Keyframe kfA;
+            Shape::Keyframe kfB;
+            float xfmInterpolation = 0.0f;
+            
+            assert(subSeqIdx >= mShape->mNodes[nodeIdx].firstSubSequence &&
+                   (subSeqIdx < mShape->mNodes[nodeIdx].firstSubSequence + mShape->mNodes[nodeIdx].numSubSequences));
+            
+            getSubsequenceKeyframes(mShape->mSequences[thread.sequenceIdx], mShape->mSubSequences[subSeqIdx], nodeIdx, thread.pos, kfA, kfB, xfmInterpolation);
+            
+            if (kfA.matIndex & Shape::KEYFRAME_VIS_MATTERS)
+            {
+               if (kfA.matIndex & Shape::KEYFRAME_VIS)
+                  mNodeVisiblity[nodeIdx] &= 0x2;
+               else
+                  mNodeVisiblity[nodeIdx] |= 0x2;
+            }
+            
+            if (kfA.key == kfB.key)
+            {
+               Shape::Transform xfmShape = getTransform(kfA.key);
+               CompatQuatSetMatrix(xfmShape.rot.toQuat(), xfmLocal);
+               xfmLocal[3] = slm::vec4(xfmShape.pos.x, xfmShape.pos.y, xfmShape.pos.z, 1);
+            }
+            else
+            {
+               Shape::Transform xfmA = getTransform(kfA.key);
+               Shape::Transform xfmB = getTransform(kfB.key);
+               xfmLocal = interpolateXfm(xfmA, xfmB, xfmInterpolation);
+            }
+         }
+      }
+      
+      if (node.parent >= 0)
+      {
+         slm::mat4 parentXfm = mNodeTransforms[node.parent];
+         
+         slm::mat4 newslmXfm(1);
+         slm::vec4 tmpLocal = xfmLocal[3];
+         slm::vec4 tmpParent = parentXfm[3];
+         xfmLocal[3] = parentXfm[3] = slm::vec4(0,0,0,1);
+         newslmXfm = parentXfm * xfmLocal;
+         newslmXfm[3] = (parentXfm * tmpLocal) + tmpParent;
+         newslmXfm[3].w = 1;
+         
+         mNodeTransforms[nodeIdx] = newslmXfm;
+      }
+      else
+      {
+         mNodeTransforms[nodeIdx] = xfmLocal;
+      }
+      
+      // Recurse
+      Shape::NodeChildInfo info = mShape->mNodeChildren[nodeIdx+1];
+      for (int32_t i=0; i<info.numChildren; i++)
+      {
+         animateNode(mShape->mNodeChildIds[info.firstChild+i]);
+      }
+   }
+   
+   // Loading
+   
+   // viewSize is the projected size the shape will first be drawn at (see selectDetailSize), which picks the
+   // detail decoded straight away. The default of 0 picks the coarsest.
+   void loadShape(Shape& inShape, float viewSize=0.0f)
+   {
+      clear();
+      
+      mShape = &inShape;
+      mAlwaysNode = mShape->mAlwaysNode;
+      if (mAlwaysNode > mShape->mNodes.size()) mAlwaysNode = -1;
+      
+      selectDetailSize(viewSize);
+      
+      mNodeTransforms.resize(mShape->mNodes.size());
+      mActiveRotations.resize(mShape->mNodes.size());
+      mActiveTranslations.resize(mShape->mNodes.size());
+      mNodeVisiblity.resize(mShape->mNodes.size());
+      for (size_t i=0, sz=mNodeTransforms.size(); i<sz; i++)
+      {
+         mNodeTransforms[i] = slm::mat4(1);
+         mNodeVisiblity[i] = 0x0; // everything invisible by default
+      }
+      
+      setRuntimeDetailNodes(mAlwaysNode);
+      decodeNeededMeshes();
+      
+      mMaterialList = inShape.mMaterials;
+      initMaterials();
+      
+      // Preload vertex buffer
+      initVertexBuffer();
+      
+      mRuntimeObjectInfos.resize(mShape->mObjects.size());
+      for (int i=0; i<mShape->mObjects.size(); i++)
+      {
+         mRuntimeObjectInfos[i] = new RuntimeObjectInfo();
+      }
+      
+      // Setup default pose for nodes
+      animateNodes();
+   }
+   
+   // Decodes the meshes for the always node and the selected detail now so the shape can be drawn straight
+   // away, and queues the rest. Until those are in, other details draw using the nearest ready one.
+   void decodeNeededMeshes()
+   {
+      mDetailReady.assign(mShape->mDetails.size(), 1);
+      if (mShape->mMeshSources.empty())
+         return;
+      
+      std::vector<uint8_t> needed(mShape->mMeshes.size(), 0);
+      markDetailMeshes(mRuntimeDetails[0], needed);
+      if (mCurrentDetail >= 0 && mCurrentDetail < (int32_t)mShape->mDetails.size())
+         markDetailMeshes(mRuntimeDetails[mCurrentDetail+1], needed);
+      
+      mDecodedMeshes.assign(mShape->mMeshes.size(), NULL);
+      const Shape* shape = mShape;
+      bool queued = false;
+      for (uint32_t i=0; i<needed.size(); i++)
+      {
+         if (needed[i])
+         {
+            mShape->mMeshes[i] = mShape->decodeMesh(i);
+            continue;
+         }
+         
+         JobSystem::push([this, shape, i](){
+            mDecodedMeshes[i] = shape->decodeMesh(i);
+         }, &mMeshJobs);
+         queued = true;
+      }
+      
+      if (!queued)
+      {
+         mShape->releaseMeshData();
+         return;
+      }
+      
+      mMeshesPending = true;
+      for (uint32_t i=0; i<mDetailReady.size(); i++)
+      {
+         std::vector<uint8_t> detailMeshes(needed.size(), 0);
+         markDetailMeshes(mRuntimeDetails[i+1], detailMeshes);
+         for (uint32_t j=0; j<needed.size(); j++)
+         {
+            if (detailMeshes[j] && !needed[j])
+            {
+               mDetailReady[i] = 0;
+               break;
+            }
+         }
+      }
+   }
+   
+   void markDetailMeshes(const RuntimeDetailInfo& runtimeDetail, std::vector<uint8_t>& outMeshes)
+   {
+      for (uint32_t i=runtimeDetail.startRenderObject; i<runtimeDetail.startRenderObject+runtimeDetail.numRenderObjects; i++)
+      {
+         int32_t meshIdx = mShape->mObjects[mObjectRenderID[i]].meshIndex;
+         if (meshIdx >= 0 && meshIdx < (int32_t)outMeshes.size())
+            outMeshes[meshIdx] = 1;
+      }
+   }
+   
+   // Picks up the background meshes once they've all been decoded. The model data is uploaded in one go,
+   // so the vertex buffer is rebuilt with every mesh in it.
+   void updateMeshDecode()
+   {
+      if (!mMeshesPending || !mMeshJobs.isDone())
+         return;
+      
+      for (size_t i=0; i<mDecodedMeshes.size(); i++)
+      {
+         if (mDecodedMeshes[i])
+            mShape->mMeshes[i] = mDecodedMeshes[i];
+      }
+      
+      mDecodedMeshes.clear();
+      mShape->releaseMeshData();
+      mDetailReady.assign(mDetailReady.size(), 1);
+      mMeshesPending = false;
+      
+      initVertexBuffer();
+   }
+   
+   // Waits for any outstanding decode jobs, since they read from the shape
+   void cancelMeshDecode()
+   {
+      if (!mMeshesPending)
+         return;
+      
+      JobSystem::wait(mMeshJobs);
+      for (CelAnimMesh* mesh : mDecodedMeshes) { if (mesh) delete mesh; }
+      mDecodedMeshes.clear();
+      mMeshesPending = false;
+   }
+   
+   // Nearest detail to the one asked for which can be drawn, preferring coarser ones
+   int32_t getReadyDetail(int32_t detail) const
+   {
+      if (!mMeshesPending || detail < 0)
+         return detail;
+      
+      for (int32_t i=detail; i<(int32_t)mDetailReady.size(); i++)
+      {
+         if (mDetailReady[i])
+            return i;
+      }
+      for (int32_t i=detail-1; i>=0; i--)
+      {
+         if (mDetailReady[i])
+            return i;
+      }
+      return -1;
+   }
+   
+   void initVertexBuffer()
+   {
+      TRACE_ZONE("initVertexBuffer");
+      clearVertexBuffer();
+      
+      for (RuntimeMeshInfo* info : mRuntimeMeshInfos) { delete info; }
+      mRuntimeMeshInfos.clear();
+      
+      // Construct a buffer consisting of all the verts
+      const uint32_t vertStride = sizeof(slm::vec3) + sizeof(slm::vec3);
+      
+      mRuntimeMeshInfos.reserve(mShape->mMeshes.size());
+      
+      std::vector<slm::vec3> bufferVerts;
+      std::vector<slm::vec2> bufferTVerts;
+      std::vector<CelAnimMesh::Triangle> bufferTris;
+      
+      std::vector<uint32_t> vertMap;
+      std::vector<uint32_t> texVertMap;
+      std::vector<CelAnimMesh::Triangle> meshInds;
+      std::vector<CelAnimMesh::Prim> meshPrims;
+      
+      uint32_t vertexBufferSize = 0;
+      uint32_t primBufferSize = 0;
+      
+      for (CelAnimMesh* mesh : mShape->mMeshes)
+      {
+         // Not decoded yet
+         if (mesh == NULL)
+         {
+            RuntimeMeshInfo* info = new RuntimeMeshInfo();
+            info->mMesh = NULL;
+            mRuntimeMeshInfos.push_back(info);
+            continue;
+         }
+         
+         mesh->unpackVertStructure(vertMap, texVertMap, meshInds, meshPrims);
+         mesh->mFixedFrameOffsets.resize(mesh->mFrames.size());
+         
+         uint32_t baseVertOffset = bufferVerts.size()/2;
+         uint32_t baseIndexOffset = bufferTris.size()*3;
+         
+         if (mesh->mFaces.size() == 0)
+         {
+            RuntimeMeshInfo* info = new RuntimeMeshInfo();
+            info->mMesh = NULL;
+            mRuntimeMeshInfos.push_back(info);
+            continue;
+         }
+         
+         // Copy output prim data
+         for (CelAnimMesh::Prim& prim : meshPrims)
+         {
+            prim.startVerts += baseVertOffset;
+            prim.startInds += baseIndexOffset;
+            prim.numVerts = vertMap.size();
+         }
+         
+         uint32_t texVertFrames = 1;
+         if (mesh->mTextureVertsPerFrame > 0)
+         {
+            texVertFrames = mesh->mTexVerts.size() / mesh->mTextureVertsPerFrame;
+         }
+         
+         // Emit normal verts
+         int32_t prevVert = -1;
+         int32_t vertCount = 0;
+         for (CelAnimMesh::Frame& frame : mesh->mFrames)
+         {
+            uint32_t ofs = frame.firstVert;
+            uint32_t idx = &frame - &mesh->mFrames[0];
+            
+            if (frame.firstVert < prevVert || frame.firstVert < 0)
+            {
+               assert(false);
+            }
+            
+            // Reuse previous frame
+            if (frame.firstVert == prevVert)
+            {
+               mesh->mFixedFrameOffsets[idx] = mesh->mFixedFrameOffsets[idx-1];
+               continue;
+            }
+            
+            mesh->mFixedFrameOffsets[idx] = vertCount;
+            prevVert = frame.firstVert;
+            vertCount += (uint32_t)vertMap.size();
+            
+            // Positions and normals are interleaved
+            const uint32_t numFrameVerts = (uint32_t)vertMap.size();
+            if (numFrameVerts == 0)
+               continue;
+            
+            const size_t baseVert = bufferVerts.size();
+            bufferVerts.resize(baseVert + (numFrameVerts*2));
+            
+            BatchTransform::unpackPoints(&mesh->mVerts[ofs].x, sizeof(CelAnimMesh::PackedVertex), vertMap.data(), numFrameVerts,
+                                         frame.scale, frame.origin, &bufferVerts[baseVert], sizeof(slm::vec3)*2, &BatchTransform::smLoadStats);
+            
+            for (uint32_t i=0; i<numFrameVerts; i++)
+            {
+               bufferVerts[baseVert + (i*2) + 1] = EncodedNormalTable[mesh->mVerts[vertMap[i]+ofs].normal];
+            }
+         }
+         
+         for (int j=0; j<texVertFrames; j++)
+         {
+            uint32_t ofs = j*mesh->mTextureVertsPerFrame;
+            assert(mesh->mTextureVertsPerFrame <= texVertMap.size());
+            
+            for (uint32_t i=0, sz = (uint32_t)texVertMap.size(); i<sz; i++)
+            {
+               bufferTVerts.push_back(mesh->mTexVerts[texVertMap[i]+ofs]);
+            }
+         }
+         
+         RuntimeMeshInfo* info = new RuntimeMeshInfo();
+         info->mPrims = meshPrims;
+         info->mMesh = mesh;
+         info->mRealVertsPerFrame = (uint32_t)vertMap.size();
+         info->mRealTexVertsPerFrame = (uint32_t)texVertMap.size();
+         mRuntimeMeshInfos.push_back(info);
+         bufferTris.insert(bufferTris.end(), meshInds.begin(), meshInds.end());
+         
+         if (bufferVerts.size() > 10000)
+         {
+            LOG_WARN("Lots of verts in this model (%u)", (uint32_t)bufferVerts.size());
+            
+         }
+         
+         // Clear offsets
+         vertMap.clear();
+         texVertMap.clear();
+         meshInds.clear();
+         meshPrims.clear();
+      }
+      
+      vertexBufferSize = bufferVerts.size()*vertStride;
+      primBufferSize = bufferTris.size()*6;
+      
+      if (vertexBufferSize == 0 || primBufferSize == 0)
+         return;
+      
+      GFXLoadModelData(mModelId, &bufferVerts[0], &bufferTVerts[0], &bufferTris[0], bufferVerts.size(), bufferTVerts.size(), bufferTris.size()*3);
+   }
+   
+   void clearVertexBuffer()
+   {
+      if (!initVB)
+         return;
+      
+      GFXLoadModelData(mModelId, NULL, NULL, NULL, 0, 0, 0);
+      initVB = false;
+   }
+   
+   // Rendering
+   
+   void setRuntimeDetailNodes(int32_t alwaysNodeId)
+   {
+      mRuntimeDetails.clear();
+      mObjectRenderID.clear();
+      
+      if (mAlwaysNode > 0)
+      {
+         RuntimeDetailInfo alwaysInfo = addRuntimeDetailForNode(mAlwaysNode, mObjectRenderID);
+         mRuntimeDetails.push_back(alwaysInfo);
+      }
+      else
+      {
+         mRuntimeDetails.push_back(RuntimeDetailInfo(0,0));
+      }
+      
+      for (Shape::Detail &detail : mShape->mDetails)
+      {
+         mRuntimeDetails.emplace_back(addRuntimeDetailForNode(detail.rootNode, mObjectRenderID));
+      }
+   }
+   
+   RuntimeDetailInfo addRuntimeDetailForNode(int32_t nodeIdx, std::vector<uint32_t> &outList)
+   {
+      if (nodeIdx < 0)
+         return RuntimeDetailInfo(0,0);
+      
+      bool* outUsedOjects = new bool[mShape->mObjects.size()];
+      memset(outUsedOjects, '\0', mShape->mObjects.size());
+      markNode(outUsedOjects, &mShape->mObjects[0], mShape->mObjects.size(), nodeIdx);
+      
+      uint32_t startObj = outList.size();
+      for (int i=0; i<mShape->mObjects.size(); i++)
+      {
+         if (!outUsedOjects[i])
+            continue;
+         outList.push_back(i);
+      }
+      
+      delete[] outUsedOjects;
+      return RuntimeDetailInfo(startObj, outList.size() - startObj);
+   }
+   
+   void markNode(bool *outObjectList, const Shape::Object* objList,  uint32_t numObjects, uint32_t nodeIdx)
+   {
+      for (int i=0; i<numObjects; i++)
+      {
+         if (!outObjectList[i])
+         {
+            const Shape::Object &obj = objList[i];
+            if (obj.nodeIndex == nodeIdx)
+               outObjectList[i] = true;
+         }
+      }
+      
+      Shape::NodeChildInfo info = mShape->mNodeChildren[nodeIdx+1];
+      for (int32_t i=0; i<info.numChildren; i++)
+      {
+         markNode(outObjectList, objList, numObjects, mShape->mNodeChildIds[info.firstChild+i]);
+      }
+   }
+   
+   void updateNodeVisibility(uint32_t nodeIdx, bool parentVisible)
+   {
+      if (parentVisible)
+      {
+         if (mNodeVisiblity[nodeIdx] & 0x2)
+            parentVisible = false;
+      }
+      
+      if (parentVisible)
+      {
+         mNodeVisiblity[nodeIdx] |= 0x1;
+      }
+      
+      Shape::NodeChildInfo info = mShape->mNodeChildren[nodeIdx+1];
+      for (int32_t i=0; i<info.numChildren; i++)
+      {
+         uint32_t nodeIdx = mShape->mNodeChildIds[info.firstChild+i];
+         updateNodeVisibility(nodeIdx, parentVisible);
+      }
+   }
+   
+   void determineNodeVisibility()
+   {
+      // Hide everything by default
+      for (int i=0; i<mNodeVisiblity.size(); i++)
+      {
+         mNodeVisiblity[i] &= 0x2; // 0x2 == force invisible flag
+      }
+      
+      if (mAlwaysNode >= 0)
+      {
+         mNodeVisiblity[mAlwaysNode] = 0x1;
+         updateNodeVisibility(mAlwaysNode, true);
+      }
+      
+      int32_t detail = getReadyDetail(mCurrentDetail);
+      if (detail >= 0)
+      {
+         updateNodeVisibility(getDetail(detail).rootNode, true);
+      }
+   }
+   
+   void selectDetail(float dist, int w, int h)
+   {
+      selectDetailSize(getProjectedSize(mShape->mRadius, dist, w, h));
+   }
+   
+   void selectDetailSize(float size)
+   {
+      mCurrentDetail = 0;
+      for (int i=0; i<mShape->mDetails.size(); i++)
+      {
+         Shape::Detail &detail = mShape->mDetails[i];
+         if (size <= detail.size)
+         {
+            mCurrentDetail = i;
+         }
+      }
+   }
+   
+   void drawLine(slm::vec3 start, slm::vec3 end, slm::vec4 color, float width)
+   {
+      updateMVP();
+      GFXBeginLinePipelineState();
+      GFXDrawLine(start, end, color, width);
+   }
+   
+   void render()
+   {
+      slm::mat4 y_up = slm::rotation_x(slm::radians(-90.0f));
+      
+      mRenderQueue.clear();
+      queueDraws(mRenderQueue, mModelMatrix * y_up);
+      
+      updateMVP();
+      mRenderQueue.submit(mViewMatrix, mProjectionMatrix);
+   }
+   
+   // Adds draws for the current detail to queue. placement transforms the (z-up) shape into the world.
+   void queueDraws(RenderQueue& queue, const slm::mat4& placement)
+   {
+      updateMeshDecode();
+      determineNodeVisibility();
+      
+      if (mAlwaysNode > 0)
+      {
+         renderObjects(queue, placement, mRuntimeDetails[0]);
+      }
+      
+      int32_t detail = getReadyDetail(mCurrentDetail);
+      if (detail >= 0)
+      {
+         renderObjects(queue, placement, mRuntimeDetails[detail+1]);
+      }
+   }
+   
+   void renderObjects(RenderQueue& queue, const slm::mat4& placement, RuntimeDetailInfo& runtimeDetail)
+   {
+      const uint32_t vertStride = sizeof(slm::vec3) + sizeof(slm::vec3);
+      slm::mat4 firstXfm = slm::inverse(mNodeTransforms[0]);
+      
+      for (uint32_t i=runtimeDetail.startRenderObject; i<runtimeDetail.startRenderObject+runtimeDetail.numRenderObjects; i++)
+      {
+         uint32_t objIDToRender = mObjectRenderID[i];
+         Shape::Object &info = mShape->mObjects[objIDToRender];
+         if (info.meshIndex == -1)
+            continue;
+         
+         RuntimeObjectInfo* runtimeInfo = mRuntimeObjectInfos[objIDToRender];
+         RuntimeMeshInfo* runtimeMeshInfo = mRuntimeMeshInfos[info.meshIndex];
+         CelAnimMesh* mesh = runtimeMeshInfo->mMesh;
+         
+         if (mesh == NULL || !runtimeInfo->mDraw)
+            continue;
+         
+         if (info.nodeIndex >= 0 && ((mNodeVisiblity[info.nodeIndex] & 0x1) == 0))
+            continue;
+         
+         if (info.nodeIndex < 0)
+            continue;
+         
+         if (runtimeInfo->mFrame >= mesh->mFrames.size())
+         {
+            LOG_RATELIMITED(Log::Level_Warn, 1000, "Mesh frame invalid (%i), objID %i.", runtimeInfo->mFrame, objIDToRender);
+            runtimeInfo->mFrame= 0;
+         }
+         
+         //assert(info.offset.x == 0);
+         
+         slm::mat4 slmMat = mNodeTransforms[info.nodeIndex];
+         
+         slmMat[3] = slm::vec4(0,0,0,1);
+         //slmMat = slm::transpose(slmMat);
+         slmMat[3] = mNodeTransforms[info.nodeIndex][3];
+         
+         assert(slmMat[3].w == 1);
+         
+         slm::mat4 objectModel = placement * firstXfm * slmMat * slm::translation(info.offset);
+         
+         // Sort by the object origin in view space
+         slm::vec4 viewPos = mViewMatrix * objectModel * slm::vec4(0,0,0,1);
+         
+         RenderQueue::Draw draw = {};
+         draw.xfmIdx = queue.addTransform(objectModel);
+         draw.modelId = mModelId;
+         draw.vertOffset = mesh->mFixedFrameOffsets[runtimeInfo->mFrame];
+         draw.texOffset = runtimeMeshInfo->mRealTexVertsPerFrame * runtimeInfo->mTexFrame;
+         
+         for (CelAnimMesh::Prim& prim: runtimeMeshInfo->mPrims)
+         {
+            int32_t matIdx = prim.mat;
+            if (matIdx < 0)
+               continue;
+            
+            if (matIdx > mActiveMaterials.size())
+               matIdx = 0;
+            
+            getMaterialPipeline(matIdx, draw.state, draw.testVal);
+            draw.texID = mActiveMaterials[matIdx].tex.texID;
+            draw.numVerts = prim.numVerts;
+            draw.numInds = prim.numInds;
+            draw.startInds = prim.startInds;
+            draw.startVerts = prim.startVerts;
+            
+            queue.addDraw(draw, -viewPos.z);
+         }
+      }
+   }
+   
+   void renderNodes(int32_t rootIdx, int32_t highlightIdx)
+   {
+      if (rootIdx < 0 || mNodeTransforms.empty())
+         return;
+      
+      slm::mat4 firstXfm = slm::inverse(mNodeTransforms[0]);
+      slm::mat4 y_up = slm::rotation_x(slm::radians(-90.0f));
+      slm::mat4 xfm = mModelMatrix * y_up * firstXfm;
+      
+      // Node origins are the translation column of each transform
+      mNodePositions.resize(mNodeTransforms.size());
+      BatchTransform::transformPoints(xfm, (const slm::vec3*)&mNodeTransforms[0][3].x, sizeof(slm::mat4),
+                                      &mNodePositions[0], sizeof(slm::vec3), mNodeTransforms.size(), &BatchTransform::smLastStats);
+      
+      renderNodeLines(rootIdx, slm::vec3(0,0,0), highlightIdx);
+   }
+   
+   void renderNodeLines(int32_t nodeIdx, slm::vec3 parentPos, int32_t highlightIdx)
+   {
+      if (nodeIdx < 0)
+         return;
+      
+      assert(mNodeTransforms[nodeIdx][3].w == 1);
+      slm::vec3 pos = mNodePositions[nodeIdx];
+      
+      drawLine(pos, parentPos, nodeIdx == highlightIdx ? slm::vec4(0,1,0,1) : slm::vec4(1,0,0,1), 1);
+      
+      // Recurse
+      Shape::NodeChildInfo info = mShape->mNodeChildren[nodeIdx+1];
+      for (int32_t i=0; i<info.numChildren; i++)
+      {
+         renderNodeLines(mShape->mNodeChildIds[info.firstChild+i], pos, highlightIdx);
+      }
+   }
+};
+
+class InteriorViewer : public GenericViewer
+{
+public:
+   
+   bool initVB;
+   uint32_t mLodToRender;
+   
+   struct RenderInteriorInfo
+   {
+      InteriorGeom* geom;
+      uint32_t startSurf;
+      uint32_t numSurfs;
+      
+      uint32_t startInd;
+      uint32_t numTris;
+   };
+   
+   std::vector<RenderInteriorInfo> mRenderInfos;
+   
+   struct Triangle
+   {
+      uint16_t i[3];
+      Triangle() {;}
+   };
+   
+   struct RuntimeSurf
+   {
+      RuntimeSurf() : startVert(0), numVerts(0), startInds(0), numInds(0) {;}
+      
+      uint32_t startVert;
+      uint32_t numVerts;
+      uint32_t startInds;
+      uint32_t numInds;
+      uint32_t matIdx;
+      slm::vec3 center; // used for sorting
+      slm::vec3 minP;
+      slm::vec3 maxP;
+      uint32_t firstPoint; // into mSurfPoints
+      uint32_t numPoints;
+      float area;
+   };
+   
+   enum
+   {
+      MaxOccluderSurfs = 512
+   };
+   
+   std::vector<RuntimeSurf> mRuntimeSurfs;
+   std::vector<slm::vec3> mSurfPoints;
+   std::vector<Interior::State> mStates;
+   int32_t mOccluderLod;
+   
+   InteriorViewer(ResManager* res)
+   {
+      mResourceManager = res;
+      mPalette = NULL;
+      mLodToRender = 0;
+      mOccluderLod = -1;
+      //mInterior = NULL;
+   }
+   
+   void render()
+   {
+      // Render all surfs for now
+      mLodToRender = mStates[0].lodIdx;
+      
+      if (mOccluderLod != (int32_t)mLodToRender)
+      {
+         buildOccluders(mLodToRender);
+      }
+      
+      slm::mat4 baseModel = mModelMatrix;
+      slm::mat4 y_up = slm::rotation_x(slm::radians(-90.0f));
+      mModelMatrix = baseModel * y_up;
+      updateMVP();
+      
+      mRenderQueue.clear();
+      queueDraws(mRenderQueue, mModelMatrix, mLodToRender, true);
+      mRenderQueue.submit(mViewMatrix, mProjectionMatrix);
+      endOcclusion();
+      
+      mModelMatrix = baseModel;
+   }
+   
+   // Adds draws for a lod to queue. placement transforms the (z-up) interior into the world.
+   void queueDraws(RenderQueue& queue, const slm::mat4& placement, uint32_t lodIdx, bool useOcclusion)
+   {
+      const RenderInteriorInfo& toRender = mRenderInfos[lodIdx];
+      slm::mat4 viewModel = mViewMatrix * placement;
+      
+      RenderQueue::Draw draw = {};
+      draw.xfmIdx = queue.addTransform(placement);
+      draw.modelId = mModelId;
+      draw.vertOffset = 0;
+      draw.texOffset = 0;
+      
+      for (int i=toRender.startSurf; i<toRender.startSurf + toRender.numSurfs; i++)
+      {
+         const RuntimeSurf &surf = mRuntimeSurfs[i];
+         
+         int32_t matIdx = surf.matIdx;
+         if (matIdx < 0)
+            continue;
+         
+         if (matIdx > mActiveMaterials.size())
+            matIdx = 0;
+         
+         if (useOcclusion && isOccluded(surf.minP, surf.maxP))
+            continue;
+         
+         getMaterialPipeline(matIdx, draw.state, draw.testVal);
+         draw.texID = mActiveMaterials[matIdx].tex.texID;
+         draw.numVerts = surf.numVerts;
+         draw.numInds = surf.numInds;
+         draw.startInds = surf.startInds;
+         draw.startVerts = surf.startVert;
+         
+         slm::vec4 viewPos = viewModel * slm::vec4(surf.center, 1);
+         queue.addDraw(draw, -viewPos.z);
+      }
+   }
+   
+   // Uses the largest opaque surfaces of a lod as occluders
+   void buildOccluders(uint32_t lod)
+   {
+      mOcclusion.clearOccluders();
+      mOccluderLod = lod;
+      
+      const RenderInteriorInfo& info = mRenderInfos[lod];
+      std::vector<uint32_t> candidates;
+      
+      for (uint32_t i=info.startSurf; i<info.startSurf + info.numSurfs; i++)
+      {
+         const RuntimeSurf &surf = mRuntimeSurfs[i];
+         if (surf.matIdx >= mActiveMaterials.size() || surf.numPoints < 3)
+            continue;
+         
+         if (mActiveMaterials[surf.matIdx].tex.bmpFlags & (Bitmap::FLAG_TRANSPARENT | Bitmap::FLAG_TRANSLUCENT | Bitmap::FLAG_ADDITIVE | Bitmap::FLAG_SUBTRACTIVE))
+            continue;
+         
+         candidates.push_back(i);
+      }
+      
+      std::sort(candidates.begin(), candidates.end(), [this](uint32_t a, uint32_t b){
+         return mRuntimeSurfs[a].area > mRuntimeSurfs[b].area;
+      });
+      
+      if (candidates.size() > MaxOccluderSurfs)
+      {
+         candidates.resize(MaxOccluderSurfs);
+      }
+      
+      std::vector<uint32_t> fanInds;
+      for (uint32_t surfIdx : candidates)
+      {
+         const RuntimeSurf &surf = mRuntimeSurfs[surfIdx];
+         
+         fanInds.clear();
+         for (uint32_t i=1; i+1<surf.numPoints; i++)
+         {
+            fanInds.push_back(0);
+            fanInds.push_back(i);
+            fanInds.push_back(i+1);
+         }
+         
+         mOcclusion.addOccluder(&mSurfPoints[surf.firstPoint], surf.numPoints, &fanInds[0], (uint32_t)fanInds.size(), slm::mat4(1));
+      }
+   }
+   
+   void loadInterior(Interior& inInterior)
+   {
+      inInterior.loadResources(mResourceManager);
+      mRuntimeSurfs.clear();
+      mSurfPoints.clear();
+      mOcclusion.clearOccluders();
+      mOccluderLod = -1;
+      mRenderInfos.clear();
+      mStates = inInterior.mStates;
+      mMaterialList = inInterior.mMaterials;
+      
+      std::vector<slm::vec3> verts;
+      std::vector<slm::vec2> tverts;
+      std::vector<Triangle> tris;
+      RuntimeSurf surf;
+      
+      // Need to load materials before since we need size info from them
+      initMaterials();
+      
+      // textureScaleBits = 4
+      
+      // Prepare surface data
+      for (InteriorGeom* geom : inInterior.mLodGeomInstances)
+      {
+         RenderInteriorInfo info;
+         info.geom = geom;
+         info.startSurf = mRuntimeSurfs.size();
+         info.numSurfs = geom->mSurfaces.size();
+         info.startInd = tris.size()*3;
+         info.numTris = 0;
+         int maxMipLevel = 0;
+         
+         for (InteriorGeom::Surface &isurf : geom->mSurfaces)
+         {
+            InteriorGeom::PlaneF plane = geom->mPlanes[isurf.planeIdx];
+            
+            uint32_t startVert = verts.size()/2;
+            
+            slm::vec3 surfNormal = slm::vec3(plane.x, plane.y, plane.z);
+            surfNormal.normalize();
+            
+            surf.startVert = 0;
+            surf.startInds = tris.size() * 3;
+            surf.numInds = 0;
+            surf.matIdx = isurf.materials;
+            surf.center = slm::vec3(0);
+            surf.minP = slm::vec3(FLT_MAX);
+            surf.maxP = slm::vec3(-FLT_MAX);
+            surf.firstPoint = mSurfPoints.size();
+            surf.numPoints = 0;
+            surf.area = 0.0f;
+            
+            uint16_t lastVert = 0;
+            ActiveMaterial& amat = mActiveMaterials[surf.matIdx];
+            
+            // Tribes offsets and scales texture coords based on these surface params.
+            // The scale value is what size the texture should be from 0...1 (starting from 1), while the offset is
+            // how many texels the texture should be offset by (relative to the size of the loaded texture)
+            slm::vec2 txScale(1,1);
+            slm::vec2 txOffset(0,0);
+            
+            txScale = slm::vec2(((float)(((int)isurf.tsX+1) << maxMipLevel)) / (float)amat.tex.width,
+                                ((float)(((int)isurf.tsY+1) << maxMipLevel)) / (float)amat.tex.height);
+            txOffset = slm::vec2((float)isurf.toX / (float)amat.tex.width,
+                                 (float)isurf.toY / (float)amat.tex.height);
+            
+            // First add all the verts
+            for (int i=(int)isurf.vtxIdx; i<((int)isurf.vtxIdx) + ((int)isurf.numVerts); i++)
+            {
+               InteriorGeom::Vertex& vert = geom->mVerts[i];
+               
+               slm::vec2 tv = geom->mPoint2List[vert.tIdx];
+               tv *= txScale;
+               tv += txOffset;
+               
+               // Add the two new verts
+               verts.push_back(geom->mPoint3List[vert.pIdx]);
+               verts.push_back(surfNormal);
+               tverts.push_back(tv);
+               
+               const slm::vec3& point = geom->mPoint3List[vert.pIdx];
+               surf.center += point;
+               surf.minP = slm::min(surf.minP, point);
+               surf.maxP = slm::max(surf.maxP, point);
+               mSurfPoints.push_back(point);
+               surf.numPoints++;
+               
+               surf.numVerts++;
+            }
+            
+            if (isurf.numVerts > 0)
+            {
+               surf.center /= (float)isurf.numVerts;
+            }
+            
+            // Surfaces are convex polygons
+            for (uint32_t i=1; i+1<surf.numPoints; i++)
+            {
+               const slm::vec3& p0 = mSurfPoints[surf.firstPoint];
+               surf.area += 0.5f * slm::length(slm::cross(mSurfPoints[surf.firstPoint+i] - p0, mSurfPoints[surf.firstPoint+i+1] - p0));
+            }
+            
+            // Now add all the indices
+            // Need to insert a triangle fan for each vert starting from the origin
+            for (int i=1; i < ((int)isurf.numVerts)-1; i++)
+            {
+               Triangle t;
+               
+               t.i[0] = startVert;
+               t.i[1] = startVert+i;
+               t.i[2] = startVert+i+1;
+               tris.push_back(t);
+               
+               surf.numInds += 3;
+               info.numTris += 1;
+            }
+            
+            mRuntimeSurfs.push_back(surf);
+         }
+         
+         for (RuntimeSurf &surf : mRuntimeSurfs)
+         {
+            surf.numVerts = verts.size();
+         }
+         
+         mRenderInfos.push_back(info);
+      }
+      
+      assert(verts.size() < 0xFFFF);
+      GFXLoadModelData(mModelId, &verts[0], &tverts[0], &tris[0], verts.size(), tverts.size(), tris.size()*3);
+   }
+   
+   void clear()
+   {
+      clearTextures();
+      mMaterialList = NULL;
+      mOcclusion.clearOccluders();
+      mOccluderLod = -1;
+   }
+   
+};
+
+class ViewController
+{
+public:
+   slm::vec3 mViewPos;
+   slm::vec3 mCamRot;
+   float mViewSpeed;
+   
+   ViewController() : mViewSpeed(1)
+   {
+      
+   }
+   
+   virtual ~ViewController() {}
+   
+   // Called as soon as the camera is settled for the frame, before input, uploads and UI. Anything that
+   // only needs the view (e.g. occlusion) should start here so it overlaps the rest of the frame.
+   virtual void beginView() {}
+   virtual void update(float dt) = 0;
+   virtual bool isResourceLoaded() = 0;
+};
+
+class InteriorViewerController : public ViewController
+{
+public:
+   InteriorViewer mViewer;
+   SDL_Window* mWindow;
+   float xRot, yRot, mDetailDist;
+   
+   Interior* mInterior;
+   std::string mPaletteName;
+   
+   InteriorViewerController(SDL_Window* window, ResManager* mgr) :
+   mViewer(mgr), mInterior(NULL), mWindow(window)
+   {
+      xRot = 0.0f;
+      yRot = 0.0f;
+      mCamRot = slm::vec3(0,0,0);
+      mDetailDist = 0.0f;
+      mPaletteName = "ice.day.ppl";
+   }
+   
+   ~InteriorViewerController()
+   {
+      if (mInterior)
+         delete mInterior;
+   }
+   
+   bool isResourceLoaded()
+   {
+      return mInterior != NULL;
+   }
+   
+   void loadInterior(const char* filename, int volIdx=-1)
+   {
+      ACCESS_TRACE_ASSET(filename);
+      MemRStream rStream(0, NULL);
+      mViewer.clear();
+      if (mInterior)
+         delete mInterior;
+      mInterior = NULL;
+      
+      if (mViewer.mResourceManager->openFile(filename, rStream, volIdx))
+      {
+         Interior* obj = new Interior();
+         if (!obj->read(rStream))
+         {
+            delete obj;
+            return;
+         }
+         
+         mInterior = ((Interior*)obj);
+         mViewer.clear();
+         mViewer.setPalette(mPaletteName.c_str());
+         mViewer.loadInterior(*mInterior);
+         
+         mViewPos = slm::vec3(0, mInterior->mCenter.z, mInterior->mRadius);
+      }
+   }
+   
+   void beginView()
+   {
+      mViewer.mModelMatrix = slm::rotation_x(xRot) * slm::rotation_y(yRot);
+      slm::mat4 rotMat = slm::rotation_z(slm::radians(mCamRot.z)) * slm::rotation_y(slm::radians(mCamRot.y)) *  slm::rotation_x(slm::radians(mCamRot.x));
+      rotMat = inverse(rotMat);
+      mViewer.mViewMatrix = slm::mat4(1) * rotMat * slm::translation(-mViewPos);
+      
+      int w, h;
+      getViewSize(mWindow, &w, &h);
+      mViewer.mProjectionMatrix = slm::perspective_fov_rh( slm::radians(90.0), (float)w/(float)h, 0.01f, 10000.0f);
+      mViewer.kickOcclusion();
+   }
+   
+   void update(float dt)
+   {
+      PROFILE_SCOPE(Phase_Render);
+      mViewer.render();
+   }
+};
+
+class TerrainViewer : public GenericViewer
+{
+public:
+   
+   TerrainBlockList* mBlockList;
+   TerrainBlock* mBlock;
+   TerrainBlockList mSingleList;
+   
+   std::string mLastMLName;
+   std::vector<uint32_t> mBlockModels;
+   
+   struct BlockGPUResource
+   {
+      uint32_t mHeightMapTexID;
+      uint32_t mGridMapTexID;
+      uint32_t mLightMapTexID;
+   };
+   
+   std::vector<BlockGPUResource> mBlockResources;
+   
+   struct GridBounds
+   {
+      slm::vec3 minP;
+      slm::vec3 maxP;
+   };
+   
+   enum
+   {
+      OccluderCellSquares = 16
+   };
+   
+   std::vector<GridBounds> mGridBounds;
+   
+   TerrainViewer(ResManager* res) : mBlockList(NULL), mBlock(NULL)
+   {
+      mResourceManager = res;
+      mPalette = NULL;
+      mLastMLName = "";
+      useShared = true;
+   }
+   
+   ~TerrainViewer()
+   {
+      clear();
+   }
+   
+   void renderBlock(TerrainBlock& block, BlockGPUResource& res, float squareSize, uint32_t modelId)
+   {
+      const uint32_t numSquares = block.mSize[0] * block.mSize[1];
+      
+      GFXSetTerrainResources(modelId, mSharedMaterials.tex.texID, res.mHeightMapTexID, res.mGridMapTexID, res.mLightMapTexID);
+      
+      // Draw all at once
+      GFXBeginTerrainPipelineState(TerrainPipeline_Squares,
+                                   modelId, squareSize, block.mSize[0], block.mSize[1],
+                                   (slm::vec4*)TerrainBlock::MaterialMap::sMatCoords);
+      updateMVP();
+      GFXSetModelViewProjection(mModelMatrix, mViewMatrix, mProjectionMatrix);
+      GFXDrawModelVerts(numSquares * 6, 0);
+   }
+   
+   // Draws one cell of the grid. placement transforms the (z-up) terrain into the world.
+   void renderGridCell(int32_t x, int32_t y, const slm::mat4& placement)
+   {
+      uint32_t mapOffset = (y*mBlockList->mSize[0]) + x;
+      uint32_t realBlock = mBlockList->mBlockMap[mapOffset];
+      TerrainBlock* terrainBlock = mBlockList->mBlocks[realBlock].instance;
+      
+      int32_t blockX = x << (mBlockList->mDetailCount-1);
+      int32_t blockY = y << (mBlockList->mDetailCount-1);
+      
+      slm::vec3 blockOffset(blockX << mBlockList->mScale,
+                            blockY << mBlockList->mScale,
+                            0.0f);
+      
+      mModelMatrix = placement * slm::translation(blockOffset);
+      
+      // NOTE: the map offset identifies the terrain resources for the cell
+      renderBlock(*terrainBlock, mBlockResources[realBlock], 1<<mBlockList->mScale, mapOffset);
+   }
+   
+   // Height of the grid at a (z-up) position, or 0 outside of it
+   float getGridHeight(float px, float py)
+   {
+      if (mBlockList == NULL || mBlock != NULL)
+         return 0.0f;
+      
+      const float squareSize = (float)(1<<mBlockList->mScale);
+      const int32_t blockSquares = 1 << (mBlockList->mDetailCount-1);
+      
+      if (!(px >= 0.0f && py >= 0.0f))
+         return 0.0f;
+      
+      int32_t sx = (int32_t)(px / squareSize);
+      int32_t sy = (int32_t)(py / squareSize);
+      int32_t x = sx / blockSquares;
+      int32_t y = sy / blockSquares;
+      
+      if (x < 0 || y < 0 || (uint32_t)x >= mBlockList->mSize[0] || (uint32_t)y >= mBlockList->mSize[1])
+         return 0.0f;
+      
+      uint32_t realBlock = mBlockList->mBlockMap[(y*mBlockList->mSize[0]) + x];
+      TerrainBlock* block = mBlockList->mBlocks[realBlock].instance;
+      if (block == NULL || block->mHeightMap.empty())
+         return 0.0f;
+      
+      sx = std::min(sx - (x * blockSquares), (int32_t)block->mSize[0]);
+      sy = std::min(sy - (y * blockSquares), (int32_t)block->mSize[1]);
+      return block->mHeightMap[(sy * block->getHeightMapWidth()) + sx];
+   }
+   
+   void render()
+   {
+      // Render all surfs for now
+      slm::mat4 baseModel = mModelMatrix;
+      slm::mat4 y_up = slm::rotation_x(slm::radians(-90.0f));
+      mModelMatrix = baseModel * y_up;
+      
+      // TODO: use the grid
+      if (mBlock)
+      {
+         updateMVP();
+         renderBlock(*mBlock,
+                     mBlockResources[0],
+                     1<<mBlockList->mScale, 0);
+         
+      }
+      else
+      {
+         for (int32_t y=0; y<mBlockList->mSize[1]; y++)
+         {
+            for (int32_t x=0; x<mBlockList->mSize[0]; x++)
+            {
+               uint32_t mapOffset = (y*mBlockList->mSize[0]) + x;
+               if (mapOffset < mGridBounds.size() && isOccluded(mGridBounds[mapOffset].minP, mGridBounds[mapOffset].maxP))
+                  continue;
+               
+               renderGridCell(x, y, baseModel * y_up);
+            }
+         }
+      }
+      
+      endOcclusion();
+      mModelMatrix = baseModel;
+   }
+   
+   // Builds bounds for each block in the grid, along with coarse occluders. Each occluder cell is a flat
+   // quad at the lowest height in the cell, which always lies underneath the real terrain surface.
+   void buildOccluders()
+   {
+      mOcclusion.clearOccluders();
+      mGridBounds.clear();
+      
+      if (mBlockList == NULL || mBlock != NULL)
+         return;
+      
+      const float squareSize = (float)(1<<mBlockList->mScale);
+      mGridBounds.resize(mBlockList->mSize[0] * mBlockList->mSize[1]);
+      
+      for (uint32_t y=0; y<mBlockList->mSize[1]; y++)
+      {
+         for (uint32_t x=0; x<mBlockList->mSize[0]; x++)
+         {
+            uint32_t mapOffset = (y*mBlockList->mSize[0]) + x;
+            uint32_t realBlock = mBlockList->mBlockMap[mapOffset];
+            TerrainBlock* block = mBlockList->mBlocks[realBlock].instance;
+            GridBounds& bounds = mGridBounds[mapOffset];
+            
+            int32_t blockX = x << (mBlockList->mDetailCount-1);
+            int32_t blockY = y << (mBlockList->mDetailCount-1);
+            slm::vec3 blockOffset(blockX << mBlockList->mScale,
+                                  blockY << mBlockList->mScale,
+                                  0.0f);
+            
+            if (block == NULL || block->mHeightMap.empty())
+            {
+               // Nothing to cull against; make sure it never gets culled
+               bounds.minP = slm::vec3(-FLT_MAX);
+               bounds.maxP = slm::vec3(FLT_MAX);
+               continue;
+            }
+            
+            const uint32_t hmWidth = block->getHeightMapWidth();
+            float minHeight = FLT_MAX;
+            float maxHeight = -FLT_MAX;
+            
+            for (float height : block->mHeightMap)
+            {
+               minHeight = std::min(minHeight, height);
+               maxHeight = std::max(maxHeight, height);
+            }
+            
+            bounds.minP = blockOffset + slm::vec3(0, 0, minHeight);
+            bounds.maxP = blockOffset + slm::vec3(block->mSize[0] * squareSize, block->mSize[1] * squareSize, maxHeight);
+            
+            for (int32_t cy=0; cy<block->mSize[1]; cy+=OccluderCellSquares)
+            {
+               for (int32_t cx=0; cx<block->mSize[0]; cx+=OccluderCellSquares)
+               {
+                  int32_t endX = std::min(cx + (int32_t)OccluderCellSquares, block->mSize[0]);
+                  int32_t endY = std::min(cy + (int32_t)OccluderCellSquares, block->mSize[1]);
+                  float cellHeight = FLT_MAX;
+                  bool hasEmpty = false;
+                  
+                  for (int32_t sy=cy; sy<=endY && !hasEmpty; sy++)
+                  {
+                     for (int32_t sx=cx; sx<=endX; sx++)
+                     {
+                        cellHeight = std::min(cellHeight, block->mHeightMap[(sy * hmWidth) + sx]);
+                        
+                        if (sx < endX && sy < endY &&
+                            (block->mGridMapBase[(sy * block->mSize[0]) + sx].flags & TerrainBlock::GridSquare::HasEmpty))
+                        {
+                           hasEmpty = true;
+                           break;
+                        }
+                     }
+                  }
+                  
+                  // Holes can't occlude anything
+                  if (hasEmpty)
+                     continue;
+                  
+                  slm::vec3 p0 = blockOffset + slm::vec3(cx * squareSize, cy * squareSize, cellHeight);
+                  slm::vec3 p2 = blockOffset + slm::vec3(endX * squareSize, endY * squareSize, cellHeight);
+                  mOcclusion.addOccluderQuad(p0, slm::vec3(p2.x, p0.y, cellHeight), p2, slm::vec3(p0.x, p2.y, cellHeight));
+               }
+            }
+         }
+      }
+   }
+   
+   void loadGrid(const char* filename, int volIdx, const char* paletteName)
+   {
+      MemRStream rStream(0, NULL);
+      clear();
+      
+      if (mResourceManager->openFile(filename, rStream, volIdx))
+      {
+         mBlockList = new TerrainBlockList();
+         if (mBlockList->read(rStream))
+         {
+            std::string baseName = filename;
+            std::size_t dot_pos = baseName.find_last_of('.');
+
+            if (dot_pos != std::string::npos)
+            {
+               baseName = baseName.substr(0, dot_pos);
+            }
+            
+            mBlockList->loadBlocks(*mResourceManager, baseName.c_str(), volIdx);
+         }
+         else
+         {
+            delete mBlockList;
+            mBlockList = NULL;
+         }
+      }
+      
+      setPalette(paletteName);
+      updateMaterials();
+      buildOccluders();
+   }
+   
+   void updateMaterials()
+   {
+      if (mBlockList == NULL)
+         return;
+      
+      if (mMaterialList == NULL || mLastMLName != mBlockList->mMLName)
+      {
+         mLastMLName = mBlockList->mMLName;
+         mMaterialList = mResourceManager->openTypedObject<MaterialList>(mBlockList->mMLName.c_str());
+         initMaterials();
+      }
+      
+      mBlockResources.resize(mBlockList->mBlocks.size());
+      for (uint32_t i=0; i<mBlockList->mBlocks.size(); i++)
+      {
+         loadBlockResources(*mBlockList->mBlocks[i].instance, mBlockResources[i]);
+      }
+      
+      queueBlockResources();
+   }
+   
+   // Lets the renderer make each cell's bind group before it is first drawn (IDs match renderBlock)
+   void queueBlockResources()
+   {
+      if (mBlock)
+      {
+         BlockGPUResource& res = mBlockResources[0];
+         GFXQueueTerrainResources(0, mSharedMaterials.tex.texID, res.mHeightMapTexID, res.mGridMapTexID, res.mLightMapTexID);
+         return;
+      }
+      
+      const uint32_t numCells = mBlockList->mSize[0] * mBlockList->mSize[1];
+      for (uint32_t mapOffset=0; mapOffset<numCells; mapOffset++)
+      {
+         BlockGPUResource& res = mBlockResources[mBlockList->mBlockMap[mapOffset]];
+         GFXQueueTerrainResources(mapOffset, mSharedMaterials.tex.texID, res.mHeightMapTexID, res.mGridMapTexID, res.mLightMapTexID);
+      }
+   }
+   
+   void loadBlockResources(TerrainBlock& block, BlockGPUResource& res)
+   {
+      if (res.mHeightMapTexID != 0)
+      {
+         GFXDeleteTexture(res.mHeightMapTexID);
+         res.mHeightMapTexID = 0;
+      }
+      
+      if (res.mLightMapTexID != 0)
+      {
+         GFXDeleteTexture(res.mLightMapTexID);
+         res.mLightMapTexID = 0;
+      }
+      
+      if (res.mGridMapTexID != 0)
+      {
+         GFXDeleteTexture(res.mGridMapTexID);
+         res.mGridMapTexID = 0;
+      }
+      
+      if (block.mLightMap.size() != 0)
+      {
+         res.mLightMapTexID = GFXLoadCustomTexture(CustomTexture_LM16, block.getLightMapWidth(), block.getLightMapWidth(), &block.mLightMap[0]);
+      }
+      else
+      {
+         const uint32_t full = 0xFFFFFFFF;
+         uint32_t tex[16*16];
+         for (uint32_t i=0; i<16*16; i++)
+         {
+            tex[i] = full;
+         }
+         res.mLightMapTexID = GFXLoadCustomTexture(CustomTexture_RGBA8, 16, 16, tex);
+      }
+      
+      res.mGridMapTexID = GFXLoadCustomTexture(CustomTexture_RG8, block.getGridMapWidth(), block.getGridMapHeight(), &block.mGridMapBase[0]);
+      res.mHeightMapTexID = GFXLoadCustomTexture(CustomTexture_Float, block.getHeightMapWidth(), block.getHeightMapHeight(), &block.mHeightMap[0]);
+   }
+   
+   void clear()
+   {
+      for (BlockGPUResource& res : mBlockResources)
+      {
+         if (res.mHeightMapTexID != 0)
+         {
+            GFXDeleteTexture(res.mHeightMapTexID);
+            res.mHeightMapTexID = 0;
+         }
+         
+         if (res.mLightMapTexID != 0)
+         {
+            GFXDeleteTexture(res.mLightMapTexID);
+            res.mLightMapTexID = 0;
+         }
+         
+         if (res.mGridMapTexID != 0)
+         {
+            GFXDeleteTexture(res.mGridMapTexID);
+            res.mGridMapTexID = 0;
+         }
+      }
+      
+      mBlockResources.clear();
+      mGridBounds.clear();
+      mOcclusion.clearOccluders();
+   
+      if (mBlockList != &mSingleList)
+      {
+         delete mBlockList;
+         mBlock = NULL;
+      }
+      else
+      {
+         delete mBlock;
+      }
+      
+      mBlock = NULL;
+      mBlockList = NULL;
+      mSingleList.setSingleBlock(NULL);
+      clearTextures();
+      mMaterialList = NULL;
+   }
+};
+
+
+
+class TerrainViewerController : public ViewController
+{
+public:
+   SDL_Window* mWindow;
+   float xRot, yRot, mDetailDist;
+   
+   std::string mPaletteName;
+   TerrainViewer mViewer;
+   
+   TerrainViewerController(SDL_Window* window, ResManager* mgr) : mWindow(window), mViewer(mgr)
+   {
+      xRot = 0.0f;
+      yRot = 0.0f;
+      mCamRot = slm::vec3(0,0,0);
+      mDetailDist = 0.0f;
+      mPaletteName = "ice.day.ppl";
+      mViewSpeed = 64;
+   }
+   
+   ~TerrainViewerController()
+   {
+      mViewer.clear();
+   }
+   
+   void setOptimalView()
+   {
+      if (mViewer.mBlockList == NULL)
+         return;
+      
+      uint32_t realBlock = mViewer.mBlockList->mBlockMap[0];
+      float height = mViewer.mBlockList->mBlocks[realBlock].instance->getHeight(0,0);
+      
+      
+      //mCamRot = slm::vec3(0,90,0);
+      mViewPos = slm::vec3(0,height + 5,0);
+   }
+   
+   void loadGrid(const char* filename, int volIdx=-1)
+   {
+      ACCESS_TRACE_ASSET(filename);
+      mViewer.loadGrid(filename, volIdx, mPaletteName.c_str());
+      setOptimalView();
+   }
+   
+   void loadSingleBlock(const char* filename, int volIdx=-1)
+   {
+      ACCESS_TRACE_ASSET(filename);
+      MemRStream rStream(0, NULL);
+      mViewer.clear();
+      
+      if (mViewer.mResourceManager->openFile(filename, rStream, volIdx))
+      {
+         mViewer.mBlock = new TerrainBlock();
+         if (mViewer.mBlock->read(rStream))
+         {
+            mViewer.mBlockList = &mViewer.mSingleList;
+            mViewer.mBlockList->setSingleBlock(mViewer.mBlock);
+         }
+         else
+         {
+            delete mViewer.mBlock;
+            mViewer.mBlock = NULL;
+         }
+      }
+      
+      mViewer.setPalette(mPaletteName.c_str());
+      mViewer.updateMaterials();
+      setOptimalView();
+   }
+   
+   
+   bool isResourceLoaded()
+   {
+      return !(mViewer.mBlockList == NULL && mViewer.mBlock == NULL);
+   }
+   
+   void beginView()
+   {
+      mViewer.mModelMatrix = slm::rotation_x(xRot) * slm::rotation_y(yRot);
+      slm::mat4 rotMat = slm::rotation_z(slm::radians(mCamRot.z)) * slm::rotation_y(slm::radians(mCamRot.y)) *  slm::rotation_x(slm::radians(mCamRot.x));
+      rotMat = inverse(rotMat);
+      mViewer.mViewMatrix = slm::mat4(1) * rotMat * slm::translation(-mViewPos);
+      
+      int w, h;
+      getViewSize(mWindow, &w, &h);
+      mViewer.mProjectionMatrix = slm::perspective_fov_rh( slm::radians(90.0), (float)w/(float)h, 0.01f, 10000.0f);
+      mViewer.kickOcclusion();
+   }
+   
+   void update(float dt)
+   {
+      PROFILE_SCOPE(Phase_Render);
+      mViewer.render();
+   }
+};
+
+class ShapeViewerController : public ViewController
+{
+public:
+   ShapeViewer mViewer;
+   SDL_Window* mWindow;
+   float xRot, yRot, mDetailDist;
+   Shape* mShape;
+   int32_t mHighlightNodeIdx;
+   std::string mPaletteName;
+   
+   std::vector<const char*> mSequenceList;
+   std::vector<int> mNextSequence;
+   
+   int32_t mRemoveThreadId;
+   bool mRenderNodes;
+   bool mManualThreads;
+   
+   ShapeViewerController(SDL_Window* window, ResManager* mgr) :
+   mViewer(mgr)
+   {
+      mViewPos = slm::vec3(0,0,0);
+      mCamRot = slm::vec3(0,0,0);
+      mViewer.initRender();
+      mWindow = window;
+      xRot = mDetailDist = 0;
+      yRot = slm::radians(180.0f);
+      mShape = NULL;
+      mHighlightNodeIdx = -1;
+      mRemoveThreadId = -1;
+      mPaletteName = "ice.day.ppl";
+      mRenderNodes = true;
+      mManualThreads = false;
+   }
+   
+   ~ShapeViewerController()
+   {
+      mViewer.clear();
+      if (mShape)
+         delete mShape;
+   }
+   
+   bool isResourceLoaded()
+   {
+      return mShape != NULL;
+   }
+   
+   void updateNextSequence()
+   {
+      mNextSequence.resize(mViewer.mThreads.size());
+      for (int i=0; i<mViewer.mThreads.size(); i++)
+      {
+         mNextSequence[i] = mViewer.mThreads[i].sequenceIdx;
+      }
+   }
+   
+   // Accepts either a sequence name or index
+   int32_t findSequence(const char* name)
+   {
+      if (mShape == NULL)
+         return -1;
+      
+      int32_t seqIdx = mShape->findSequence(name);
+      if (seqIdx >= 0)
+         return seqIdx;
+      
+      char* end = NULL;
+      long idx = strtol(name, &end, 10);
+      if (end != name && *end == '\0' && idx >= 0 && idx < (long)mShape->mSequences.size())
+         return (int32_t)idx;
+      
+      return -1;
+   }
+   
+   void loadShape(const char *filename, int pathIdx=-1)
+   {
+      ACCESS_TRACE_ASSET(filename);
+      MemRStream rStream(0, NULL);
+      mViewer.clear();
+      if (mShape)
+         delete mShape;
+      mShape = NULL;
+      
+      if (mViewer.mResourceManager->openFile(filename, rStream, pathIdx))
+      {
+         // Only the details being drawn need their meshes straight away
+         Shape::smDeferMeshes = true;
+         DarkstarPersistObject* obj = DarkstarPersistObject::createFromStream(rStream);
+         Shape::smDeferMeshes = false;
+         if (obj)
+         {
+            mShape = ((Shape*)obj);
+            mViewer.clear();
+            if (!mViewer.setPalette(mPaletteName.c_str()))
+            {
+               LOG_WARN("Cant load palette %s", mPaletteName.c_str());
+            }
+            // Decode the detail the current view distance picks first
+            int w, h;
+            getViewSize(mWindow, &w, &h);
+            mViewer.loadShape(*mShape, GenericViewer::getProjectedSize(mShape->mRadius, mDetailDist, w, h));
+            
+            uint32_t thr = mViewer.addThread();
+            mViewer.setThreadSequence(thr, 0);
+            
+            mViewPos = slm::vec3(0, mViewer.mShape->mCenter.z, mViewer.mShape->mRadius);
+            
+            mSequenceList.resize(mShape->mSequences.size());
+            updateNextSequence();
+            
+            for (int i=0; i<mViewer.mShape->mSequences.size(); i++)
+            {
+               mSequenceList[i] = mShape->getName(mShape->mSequences[i].name);
+            }
+         }
+      }
+   }
+   
+   void update(float dt)
+   {
+      mViewer.mModelMatrix = slm::rotation_x(xRot) * slm::rotation_y(yRot);
+      slm::mat4 rotMat = slm::rotation_z(slm::radians(mCamRot.z)) * slm::rotation_y(slm::radians(mCamRot.y)) *  slm::rotation_x(slm::radians(mCamRot.x));
+      rotMat = inverse(rotMat);
+      mViewer.mViewMatrix = slm::mat4(1) * rotMat * slm::translation(-mViewPos);
+      
+      int w, h;
+      getViewSize(mWindow, &w, &h);
+      mViewer.mProjectionMatrix = slm::perspective_fov_rh( slm::radians(90.0), (float)w/(float)h, 0.01f, 10000.0f);
+      
+      if (!mManualThreads)
+      {
+         PROFILE_SCOPE(Phase_Threads);
+         mViewer.advanceThreads(dt);
+      }
+      mViewer.selectDetail(mDetailDist, w, h);
+      {
+         PROFILE_SCOPE(Phase_Animate);
+         mViewer.animateNodes();
+      }
+      {
+         PROFILE_SCOPE(Phase_Render);
+         mViewer.render();
+         if (mRenderNodes)
+         {
+            mViewer.renderNodes(mShape->mDetails[mViewer.mCurrentDetail].rootNode, mHighlightNodeIdx);
+         }
+      }
+      
+      // Now render gui
+      PROFILE_SCOPE(Phase_ImGui);
+      ImGui::Begin("Nodes");
+      ImGui::PushStyleVar(ImGuiStyleVar_Alpha, 0.75);
+      nodeTree(0);
+      ImGui::PopStyleVar(1);
+      ImGui::End();
+      
+      ImGui::Begin("Anim");
+      char buffer[1024];
+      
+      if (ImGui::Button("Add Thread"))
+      {
+         mViewer.addThread();
+         updateNextSequence();
+      }
+      
+      ImGui::SameLine();
+      ImGui::Checkbox("Manual Control", &mManualThreads);
+      
+      if (mRemoveThreadId >= 0)
+      {
+         mViewer.removeThread(mRemoveThreadId);
+         mRemoveThreadId = -1;
+      }
+      
+      for (ShapeViewer::ShapeThread &thread : mViewer.mThreads)
+      {
+         int32_t idx = &thread - &mViewer.mThreads[0];
+         snprintf(buffer, 1024, "Thread %i", idx);
+         
+         bool vis = ImGui::CollapsingHeader(buffer);
+         ImGui::SameLine();
+         
+         if (thread.sequenceIdx == -1 || thread.sequenceIdx >= mViewer.mShape->mSequences.size())
          {
-            prevIDX = subSeq.firstKeyFrame + subSeq.numKeyFrames-1;
-            diff = mShape->mKeyframes[nextIDX].pos - mShape->mKeyframes[prevIDX].pos;
-            outInterpolation = (pos - mShape->mKeyframes[prevIDX].pos) / diff;
+            snprintf(buffer, 1024, "INVALID");
          }
-         else if (nextIDX >= subSeq.firstKeyFrame+subSeq.numKeyFrames)
+         else
          {
-            nextIDX = subSeq.firstKeyFrame;
-            diff = (mShape->mKeyframes[nextIDX].pos + 1.0f) - mShape->mKeyframes[prevIDX].pos;
-            outInterpolation = (pos - mShape->mKeyframes[prevIDX].pos) / diff;
+            snprintf(buffer, 1024, "seq=%s pos=%f",
+                     thread.sequenceIdx == -1 ? "NULL" : mShape->getName(mShape->mSequences[thread.sequenceIdx].name),
+                     thread.pos);
          }
          
-         if (prevIDX == nextIDX)
-         {
-            outInterpolation = 0.0f;
-         }
-         else
+         ImGui::Text(buffer);
+         
+         if (vis)
          {
-            diff = mShape->mKeyframes[nextIDX].pos - mShape->mKeyframes[prevIDX].pos;
-            if (std::fpclassify(diff) == FP_ZERO)
-            {
-               outInterpolation = std::fpclassify(pos - mShape->mKeyframes[prevIDX].pos) == FP_ZERO ? 0.0f : 1.0f;
-            }
-            else
-            {
-               outInterpolation = (pos - mShape->mKeyframes[prevIDX].pos) / diff;
-            }
+            snprintf(buffer, 1024, "Enabled##th%i", idx);
+            ImGui::Checkbox(buffer, &mViewer.mThreads[idx].enabled);
+            ImGui::SameLine();
+            snprintf(buffer, 1024, "Remove##th%i", idx);
+            if (ImGui::Button(buffer))
+               mRemoveThreadId = idx;
+            snprintf(buffer, 1024, "Pos##th%i", idx);
+            ImGui::SliderFloat(buffer, &mViewer.mThreads[idx].pos, 0.0f, 1.0f);
+            ImGui::NewLine();
+            snprintf(buffer, 1024, "Sequences##th%i", idx);
+            ImGui::ListBox(buffer, &mNextSequence[idx], &mSequenceList[0], mShape->mSequences.size());
          }
       }
-      else
+      
+      ImGui::End();
+      
+      ImGui::Begin("View");
+      ImGui::SliderAngle("X Rotation", &xRot);
+      ImGui::SliderAngle("Y Rotation", &yRot);
+      ImGui::SliderFloat("Detail Distance", &mDetailDist, 0, 1000.0f);
+      ImGui::Checkbox("Render Nodes", &mRenderNodes);
+      ImGui::End();
+      
+      // Update state changed by gui
+      for (int i=0; i<mNextSequence.size(); i++)
       {
-         if (prevIDX < subSeq.firstKeyFrame)
-         {
-            prevIDX = subSeq.firstKeyFrame;
-            outInterpolation = 0.0f;
-         }
-         else if (nextIDX >= subSeq.firstKeyFrame+subSeq.numKeyFrames)
-         {
-            nextIDX = subSeq.firstKeyFrame+subSeq.numKeyFrames-1;
-            outInterpolation = 1.0f;
-         }
-         else if (prevIDX == nextIDX)
-         {
-            outInterpolation = 0.0f;
-         }
-         else
+         if (mNextSequence[i] != mViewer.mThreads[i].sequenceIdx)
          {
-            float diff = mShape->mKeyframes[nextIDX].pos - mShape->mKeyframes[prevIDX].pos;
-            outInterpolation = (diff <= 0) ? 0.0f : (pos - mShape->mKeyframes[prevIDX].pos) / diff;
+            mViewer.setThreadSequence(i, mNextSequence[i]);
          }
       }
-      
-      assert(prevIDX >= subSeq.firstKeyFrame && prevIDX < subSeq.firstKeyFrame + subSeq.numKeyFrames);
-      assert(nextIDX >= subSeq.firstKeyFrame && nextIDX < subSeq.firstKeyFrame + subSeq.numKeyFrames);
-      
-      outA = mShape->mKeyframes[prevIDX];
-      outB = mShape->mKeyframes[nextIDX];
    }
    
-   slm::mat4 interpolateXfm(const Shape::Transform &xfmA, const Shape::Transform &xfmB, float pos)
+   void nodeTree(int32_t nodeIdx)
    {
-      slm::quat qa = xfmA.rot.toQuat();
-      slm::quat qb = xfmB.rot.toQuat();
-      
-      slm::quat qc = CompatInterpolate(qa, qb, pos);
-      float invPos = 1.0 - pos;
-      slm::vec3 pc = slm::vec3(xfmA.pos.x * invPos + xfmB.pos.x * pos,
-                               xfmA.pos.y * invPos + xfmB.pos.y * pos,
-                               xfmA.pos.z * invPos + xfmB.pos.z * pos);
+      if (nodeIdx < 0)
+         return;
       
-      slm::mat4 outXfm(1);
-      CompatQuatSetMatrix(qc, outXfm);
-      outXfm[3] = slm::vec4(pc.x, pc.y, pc.z, 1);
+      Shape::NodeChildInfo info = mShape->mNodeChildren[nodeIdx+1];
+      uint32_t baseFlags = ImGuiTreeNodeFlags_OpenOnArrow | ImGuiTreeNodeFlags_OpenOnDoubleClick;
       
-      return outXfm;
-   }
-   
-   void animateNode(uint32_t nodeIdx)
-   {
-      Shape::Node &node = mShape->mNodes[nodeIdx];
-      slm::quat q;
-      slm::mat4 xfmLocal(1);
+      bool visDetail = (nodeIdx == mShape->mDetails[mViewer.mCurrentDetail].rootNode);
       
-      mNodeVisiblity[nodeIdx] &= ~0x2; // clear force vis
+      if (visDetail)
+      {
+         ImGui::PushStyleVar(ImGuiStyleVar_Alpha, 1.0);
+      }
       
-      // Start with setting the default transform
+      bool vis = ImGui::TreeNodeEx(mShape->getName(mShape->mNodes[nodeIdx].name), info.numChildren > 0 ? baseFlags : baseFlags|ImGuiTreeNodeFlags_Leaf);
+      if (ImGui::IsItemClicked())
       {
-         Shape::Transform xfmShape = getTransform(node.defaultTransform);
-         slm::quat tquat = xfmShape.rot.toQuat();
-         CompatQuatSetMatrix(tquat, xfmLocal);
-         xfmLocal[3] = slm::vec4(xfmShape.pos.x, xfmShape.pos.y, xfmShape.pos.z, 1);
+         mHighlightNodeIdx = nodeIdx;
       }
       
-      // If we are currently being animated, use that track instead (additional tracks will override)
-      for (int i=0; i<mThreads.size(); i++)
+      if (vis)
       {
-         ShapeThread &thread = mThreads[i];
-         if (thread.sequenceIdx == -1 || !thread.enabled)
-            continue;
-         uint32_t startSub = thread.startSubsequence;
-         
-         int16_t subSeqIdx = mThreadSubsequences[startSub + nodeIdx];
-         if (subSeqIdx != -1)
+         for (int32_t i=0; i<info.numChildren; i++)
          {
-            Shape::Keyframe kfA;
-            Shape::Keyframe kfB;
-            float xfmInterpolation = 0.0f;
-            
-            assert(subSeqIdx >= mShape->mNodes[nodeIdx].firstSubSequence &&
-                   (subSeqIdx < mShape->mNodes[nodeIdx].firstSubSequence + mShape->mNodes[nodeIdx].numSubSequences));
-            
-            getSubsequenceKeyframes(mShape->mSequences[thread.sequenceIdx], mShape->mSubSequences[subSeqIdx], nodeIdx, thread.pos, kfA, kfB, xfmInterpolation);
-            
-            if (kfA.matIndex & Shape::KEYFRAME_VIS_MATTERS)
-            {
-               if (kfA.matIndex & Shape::KEYFRAME_VIS)
-                  mNodeVisiblity[nodeIdx] &= 0x2;
-               else
-                  mNodeVisiblity[nodeIdx] |= 0x2;
-            }
-            
-            if (kfA.key == kfB.key)
-            {
-               Shape::Transform xfmShape = getTransform(kfA.key);
-               CompatQuatSetMatrix(xfmShape.rot.toQuat(), xfmLocal);
-               xfmLocal[3] = slm::vec4(xfmShape.pos.x, xfmShape.pos.y, xfmShape.pos.z, 1);
-            }
-            else
-            {
-               Shape::Transform xfmA = getTransform(kfA.key);
-               Shape::Transform xfmB = getTransform(kfB.key);
-               xfmLocal = interpolateXfm(xfmA, xfmB, xfmInterpolation);
-            }
+            nodeTree(mShape->mNodeChildIds[info.firstChild+i]);
          }
+         ImGui::TreePop();
       }
       
-      if (node.parent >= 0)
+      if (visDetail)
       {
-         slm::mat4 parentXfm = mNodeTransforms[node.parent];
-         
-         slm::mat4 newslmXfm(1);
-         slm::vec4 tmpLocal = xfmLocal[3];
-         slm::vec4 tmpParent = parentXfm[3];
-         xfmLocal[3] = parentXfm[3] = slm::vec4(0,0,0,1);
-         newslmXfm = parentXfm * xfmLocal;
-         newslmXfm[3] = (parentXfm * tmpLocal) + tmpParent;
-         newslmXfm[3].w = 1;
-         
-         mNodeTransforms[nodeIdx] = newslmXfm;
+         ImGui::PopStyleVar(1);
       }
-      else
+   }
+   
+};
+
+
+// Shows a terrain grid together with placed interiors and shapes (see SceneFile) under one camera.
+//
+// The world bounds of every terrain cell and object go into a SceneBVH. Each frame the BVH is queried with
+// the view frustum, visible objects pick a detail level from their projected size, and all of their draws go
+// into a single RenderQueue so they are sorted across the whole scene. Objects loaded from the same file
+// share a viewer, so instances also share animation state.
+//
+class SceneViewerController : public ViewController
+{
+public:
+   
+   enum InstanceType
+   {
+      Instance_TerrainCell,
+      Instance_Shape,
+      Instance_Interior
+   };
+   
+   struct Instance
+   {
+      InstanceType type;
+      uint32_t resIdx;     // grid map offset, or index into mShapes / mInteriors
+      uint32_t lod;        // detail picked for the current frame
+      slm::mat4 placement; // z-up
+      slm::vec3 center;
+      float radius;
+   };
+   
+   struct ShapeResource
+   {
+      std::string filename;
+      Shape* shape;
+      ShapeViewer* viewer;
+      int32_t animatedDetail;
+   };
+   
+   struct InteriorResource
+   {
+      std::string filename;
+      Interior* interior;
+      InteriorViewer* viewer;
+   };
+   
+   struct Stats
+   {
+      uint32_t numVisible[3];
+      uint32_t numTotal[3];
+      float lodTimeUS;
+   };
+   
+   SDL_Window* mWindow;
+   std::string mPaletteName;
+   
+   TerrainViewer mTerrain;
+   std::vector<ShapeResource> mShapes;
+   std::vector<InteriorResource> mInteriors;
+   std::vector<Instance> mInstances;
+   
+   SceneBVH mBVH;
+   SceneBVH::Stats mQueryStats;
+   RenderQueue mRenderQueue;
+   std::vector<uint32_t> mVisible;
+   Stats mStats;
+   
+   bool mUseBVH;
+   float mLodScale;
+   slm::vec4 mLightColor;
+   slm::vec3 mLightPos;
+   
+   SceneViewerController(SDL_Window* window, ResManager* mgr) : mWindow(window), mTerrain(mgr)
+   {
+      mCamRot = slm::vec3(0,0,0);
+      mViewPos = slm::vec3(0,0,0);
+      mPaletteName = "ice.day.ppl";
+      mViewSpeed = 64;
+      mUseBVH = true;
+      mLodScale = 1.0f;
+      mLightColor = slm::vec4(1,1,1,1);
+      mLightPos = slm::vec3(0, 2, 2);
+      memset(&mQueryStats, '\0', sizeof(mQueryStats));
+      memset(&mStats, '\0', sizeof(mStats));
+   }
+   
+   ~SceneViewerController()
+   {
+      clear();
+   }
+   
+   bool isResourceLoaded()
+   {
+      return !mInstances.empty();
+   }
+   
+   void clear()
+   {
+      for (ShapeResource& res : mShapes)
       {
-         mNodeTransforms[nodeIdx] = xfmLocal;
+         if (res.viewer)
+            GFXClearModelData(res.viewer->mModelId);
+         delete res.viewer;
+         delete res.shape;
       }
       
-      // Recurse
-      Shape::NodeChildInfo info = mShape->mNodeChildren[nodeIdx+1];
-      for (int32_t i=0; i<info.numChildren; i++)
+      for (InteriorResource& res : mInteriors)
       {
-         animateNode(mShape->mNodeChildIds[info.firstChild+i]);
+         if (res.viewer)
+         {
+            res.viewer->clear();
+            GFXClearModelData(res.viewer->mModelId);
+         }
+         delete res.viewer;
+         delete res.interior;
       }
+      
+      mShapes.clear();
+      mInteriors.clear();
+      mInstances.clear();
+      mVisible.clear();
+      mBVH.clear();
+      mTerrain.clear();
    }
    
-   // Loading
+   // Model 0 is used by the single object viewers
+   uint32_t getNextModelId()
+   {
+      return 1 + (uint32_t)(mShapes.size() + mInteriors.size());
+   }
    
-   void loadShape(Shape& inShape)
+   int32_t loadShape(const char* filename)
    {
-      clear();
-      
-      mShape = &inShape;
-      mAlwaysNode = mShape->mAlwaysNode;
-      if (mAlwaysNode > mShape->mNodes.size()) mAlwaysNode = -1;
+      for (uint32_t i=0; i<mShapes.size(); i++)
+      {
+         if (mShapes[i].filename == filename)
+            return mShapes[i].shape ? (int32_t)i : -1;
+      }
       
-      mCurrentDetail = 0;
+      ACCESS_TRACE_ASSET(filename);
+      ShapeResource res;
+      res.filename = filename;
+      res.shape = NULL;
+      res.viewer = NULL;
+      res.animatedDetail = -1;
       
-      mNodeTransforms.resize(mShape->mNodes.size());
-      mActiveRotations.resize(mShape->mNodes.size());
-      mActiveTranslations.resize(mShape->mNodes.size());
-      mNodeVisiblity.resize(mShape->mNodes.size());
-      for (size_t i=0, sz=mNodeTransforms.size(); i<sz; i++)
+      MemRStream rStream(0, NULL);
+      if (mTerrain.mResourceManager->openFile(filename, rStream))
       {
-         mNodeTransforms[i] = slm::mat4(1);
-         mNodeVisiblity[i] = 0x0; // everything invisible by default
+         res.shape = (Shape*)DarkstarPersistObject::createFromStream(rStream);
       }
       
-      setRuntimeDetailNodes(mAlwaysNode);
-      
-      mMaterialList = inShape.mMaterials;
-      initMaterials();
+      if (res.shape == NULL)
+      {
+         LOG_WARN("Scene: can't load shape %s", filename);
+         mShapes.push_back(res);
+         return -1;
+      }
       
-      // Preload vertex buffer
-      initVertexBuffer();
+      res.viewer = new ShapeViewer(mTerrain.mResourceManager);
+      res.viewer->mModelId = getNextModelId();
+      res.viewer->initRender();
+      if (!res.viewer->setPalette(mPaletteName.c_str()))
+      {
+         LOG_WARN("Cant load palette %s", mPaletteName.c_str());
+      }
+      // Instances are picked a detail once visible; until then assume they're far away
+      res.viewer->loadShape(*res.shape);
       
-      mRuntimeObjectInfos.resize(mShape->mObjects.size());
-      for (int i=0; i<mShape->mObjects.size(); i++)
+      if (!res.shape->mSequences.empty())
       {
-         mRuntimeObjectInfos[i] = new RuntimeObjectInfo();
+         uint32_t thr = res.viewer->addThread();
+         res.viewer->setThreadSequence(thr, 0);
       }
       
-      // Setup default pose for nodes
-      animateNodes();
+      mShapes.push_back(res);
+      return (int32_t)(mShapes.size()-1);
    }
    
-   void initVertexBuffer()
+   int32_t loadInterior(const char* filename)
    {
-      clearVertexBuffer();
-      
-      for (RuntimeMeshInfo* info : mRuntimeMeshInfos) { delete info; }
-      mRuntimeMeshInfos.clear();
-      
-      // Construct a buffer consisting of all the verts
-      const uint32_t vertStride = sizeof(slm::vec3) + sizeof(slm::vec3);
-      
-      mRuntimeMeshInfos.reserve(mShape->mMeshes.size());
-      
-      std::vector<slm::vec3> bufferVerts;
-      std::vector<slm::vec2> bufferTVerts;
-      std::vector<CelAnimMesh::Triangle> bufferTris;
-      
-      std::vector<uint32_t> vertMap;
-      std::vector<uint32_t> texVertMap;
-      std::vector<CelAnimMesh::Triangle> meshInds;
-      std::vector<CelAnimMesh::Prim> meshPrims;
+      for (uint32_t i=0; i<mInteriors.size(); i++)
+      {
+         if (mInteriors[i].filename == filename)
+            return mInteriors[i].interior ? (int32_t)i : -1;
+      }
       
-      uint32_t vertexBufferSize = 0;
-      uint32_t primBufferSize = 0;
+      ACCESS_TRACE_ASSET(filename);
+      InteriorResource res;
+      res.filename = filename;
+      res.interior = NULL;
+      res.viewer = NULL;
       
-      for (CelAnimMesh* mesh : mShape->mMeshes)
+      MemRStream rStream(0, NULL);
+      if (mTerrain.mResourceManager->openFile(filename, rStream))
       {
-         mesh->unpackVertStructure(vertMap, texVertMap, meshInds, meshPrims);
-         mesh->mFixedFrameOffsets.resize(mesh->mFrames.size());
-         
-         uint32_t baseVertOffset = bufferVerts.size()/2;
-         uint32_t baseIndexOffset = bufferTris.size()*3;
-         
-         if (mesh->mFaces.size() == 0)
-         {
-            RuntimeMeshInfo* info = new RuntimeMeshInfo();
-            info->mMesh = NULL;
-            mRuntimeMeshInfos.push_back(info);
-            continue;
-         }
-         
-         // Copy output prim data
-         for (CelAnimMesh::Prim& prim : meshPrims)
-         {
-            prim.startVerts += baseVertOffset;
-            prim.startInds += baseIndexOffset;
-            prim.numVerts = vertMap.size();
-         }
-         
-         uint32_t texVertFrames = 1;
-         if (mesh->mTextureVertsPerFrame > 0)
-         {
-            texVertFrames = mesh->mTexVerts.size() / mesh->mTextureVertsPerFrame;
-         }
-         
-         // Emit normal verts
-         int32_t prevVert = -1;
-         int32_t vertCount = 0;
-         for (CelAnimMesh::Frame& frame : mesh->mFrames)
-         {
-            uint32_t ofs = frame.firstVert;
-            uint32_t idx = &frame - &mesh->mFrames[0];
-            
-            if (frame.firstVert < prevVert || frame.firstVert < 0)
-            {
-               assert(false);
-            }
-            
-            // Reuse previous frame
-            if (frame.firstVert == prevVert)
-            {
-               mesh->mFixedFrameOffsets[idx] = mesh->mFixedFrameOffsets[idx-1];
-               continue;
-            }
-            
-            mesh->mFixedFrameOffsets[idx] = vertCount;
-            prevVert = frame.firstVert;
-            vertCount += (uint32_t)vertMap.size();
-            
-            slm::vec3 frameScale = frame.scale;
-            slm::vec3 frameOrigin = frame.origin;
-            
-            for (uint32_t i=0, sz = (uint32_t)vertMap.size(); i<sz; i++)
-            {
-               CelAnimMesh::PackedVertex &v = mesh->mVerts[vertMap[i]+ofs];
-               slm::vec3 xv(v.x * frameScale.x + frameOrigin.x, v.y * frameScale.y + frameOrigin.y, v.z * frameScale.z + frameOrigin.z);
-               bufferVerts.push_back(xv);
-               bufferVerts.push_back(EncodedNormalTable[v.normal]);
-            }
-         }
-         
-         for (int j=0; j<texVertFrames; j++)
-         {
-            uint32_t ofs = j*mesh->mTextureVertsPerFrame;
-            assert(mesh->mTextureVertsPerFrame <= texVertMap.size());
-            
-            for (uint32_t i=0, sz = (uint32_t)texVertMap.size(); i<sz; i++)
-            {
-               bufferTVerts.push_back(mesh->mTexVerts[texVertMap[i]+ofs]);
-            }
-         }
-         
-         RuntimeMeshInfo* info = new RuntimeMeshInfo();
-         info->mPrims = meshPrims;
-         info->mMesh = mesh;
-         info->mRealVertsPerFrame = (uint32_t)vertMap.size();
-         info->mRealTexVertsPerFrame = (uint32_t)texVertMap.size();
-         mRuntimeMeshInfos.push_back(info);
-         bufferTris.insert(bufferTris.end(), meshInds.begin(), meshInds.end());
-         
-         if (bufferVerts.size() > 10000)
+         res.interior = new Interior();
+         res.interior->mMaterials = NULL;
+         if (!res.interior->read(rStream) || res.interior->mStates.empty())
          {
-            printf("Warning: lots of verts in this model....\n");
-            
+            delete res.interior;
+            res.interior = NULL;
          }
-         
-         // Clear offsets
-         vertMap.clear();
-         texVertMap.clear();
-         meshInds.clear();
-         meshPrims.clear();
       }
       
-      vertexBufferSize = bufferVerts.size()*vertStride;
-      primBufferSize = bufferTris.size()*6;
+      if (res.interior == NULL)
+      {
+         LOG_WARN("Scene: can't load interior %s", filename);
+         mInteriors.push_back(res);
+         return -1;
+      }
       
-      if (vertexBufferSize == 0 || primBufferSize == 0)
-         return;
+      res.viewer = new InteriorViewer(mTerrain.mResourceManager);
+      res.viewer->mModelId = getNextModelId();
+      res.viewer->mLightColor = mLightColor;
+      res.viewer->mLightPos = mLightPos;
+      res.viewer->setPalette(mPaletteName.c_str());
+      res.viewer->loadInterior(*res.interior);
       
-      GFXLoadModelData(0, &bufferVerts[0], &bufferTVerts[0], &bufferTris[0], bufferVerts.size(), bufferTVerts.size(), bufferTris.size()*3);
+      mInteriors.push_back(res);
+      return (int32_t)(mInteriors.size()-1);
    }
    
-   void clearVertexBuffer()
+   void addObject(SceneFile::ObjectType type, const char* filename, const slm::vec3& position, float rotation)
    {
-      if (!initVB)
+      Instance inst;
+      inst.type = type == SceneFile::Object_Shape ? Instance_Shape : Instance_Interior;
+      inst.lod = 0;
+      inst.placement = slm::translation(position) * slm::rotation_z(slm::radians(rotation));
+      
+      int32_t resIdx = type == SceneFile::Object_Shape ? loadShape(filename) : loadInterior(filename);
+      if (resIdx < 0)
          return;
       
-      GFXLoadModelData(0, NULL, NULL, NULL, 0, 0, 0);
-      initVB = false;
-   }
-   
-   // Rendering
-   
-   void setRuntimeDetailNodes(int32_t alwaysNodeId)
-   {
-      mRuntimeDetails.clear();
-      mObjectRenderID.clear();
+      inst.resIdx = resIdx;
       
-      if (mAlwaysNode > 0)
+      if (inst.type == Instance_Shape)
       {
-         RuntimeDetailInfo alwaysInfo = addRuntimeDetailForNode(mAlwaysNode, mObjectRenderID);
-         mRuntimeDetails.push_back(alwaysInfo);
+         Shape* shape = mShapes[resIdx].shape;
+         inst.center = (inst.placement * slm::vec4(shape->mCenter, 1)).xyz();
+         inst.radius = shape->mRadius;
       }
       else
       {
-         mRuntimeDetails.push_back(RuntimeDetailInfo(0,0));
+         Interior* interior = mInteriors[resIdx].interior;
+         inst.center = (inst.placement * slm::vec4(interior->mCenter, 1)).xyz();
+         inst.radius = interior->mRadius;
       }
       
-      for (Shape::Detail &detail : mShape->mDetails)
-      {
-         mRuntimeDetails.emplace_back(addRuntimeDetailForNode(detail.rootNode, mObjectRenderID));
-      }
+      mInstances.push_back(inst);
    }
    
-   RuntimeDetailInfo addRuntimeDetailForNode(int32_t nodeIdx, std::vector<uint32_t> &outList)
+   // Places count copies of an object at random spots on the terrain
+   void scatterObjects(const SceneFile::Scatter& scatter)
    {
-      if (nodeIdx < 0)
-         return RuntimeDetailInfo(0,0);
+      TerrainBlockList* list = mTerrain.mBlockList;
+      if (list == NULL)
+      {
+         LOG_WARN("Scene: can't scatter %s without a terrain", scatter.filename.c_str());
+         return;
+      }
       
-      bool* outUsedOjects = new bool[mShape->mObjects.size()];
-      memset(outUsedOjects, '\0', mShape->mObjects.size());
-      markNode(outUsedOjects, &mShape->mObjects[0], mShape->mObjects.size(), nodeIdx);
+      const float extentX = (float)((list->mSize[0] << (list->mDetailCount-1)) << list->mScale);
+      const float extentY = (float)((list->mSize[1] << (list->mDetailCount-1)) << list->mScale);
+      std::mt19937 rng(scatter.seed);
+      std::uniform_real_distribution<float> randX(0.0f, extentX);
+      std::uniform_real_distribution<float> randY(0.0f, extentY);
+      std::uniform_real_distribution<float> randRot(0.0f, 360.0f);
       
-      uint32_t startObj = outList.size();
-      for (int i=0; i<mShape->mObjects.size(); i++)
+      for (uint32_t i=0; i<scatter.count; i++)
       {
-         if (!outUsedOjects[i])
-            continue;
-         outList.push_back(i);
+         slm::vec3 pos(randX(rng), randY(rng), 0.0f);
+         pos.z = mTerrain.getGridHeight(pos.x, pos.y);
+         addObject(scatter.type, scatter.filename.c_str(), pos, randRot(rng));
       }
-      
-      delete[] outUsedOjects;
-      return RuntimeDetailInfo(startObj, outList.size() - startObj);
    }
    
-   void markNode(bool *outObjectList, const Shape::Object* objList,  uint32_t numObjects, uint32_t nodeIdx)
+   void getInstanceBounds(const Instance& inst, slm::vec3& outMin, slm::vec3& outMax)
    {
-      for (int i=0; i<numObjects; i++)
+      if (inst.type == Instance_TerrainCell)
       {
-         if (!outObjectList[i])
-         {
-            const Shape::Object &obj = objList[i];
-            if (obj.nodeIndex == nodeIdx)
-               outObjectList[i] = true;
-         }
+         outMin = mTerrain.mGridBounds[inst.resIdx].minP;
+         outMax = mTerrain.mGridBounds[inst.resIdx].maxP;
+         return;
       }
       
-      Shape::NodeChildInfo info = mShape->mNodeChildren[nodeIdx+1];
-      for (int32_t i=0; i<info.numChildren; i++)
+      slm::vec3 minP, maxP;
+      if (inst.type == Instance_Shape)
       {
-         markNode(outObjectList, objList, numObjects, mShape->mNodeChildIds[info.firstChild+i]);
+         minP = mShapes[inst.resIdx].shape->mMinBounds;
+         maxP = mShapes[inst.resIdx].shape->mMaxBounds;
       }
-   }
-   
-   void updateNodeVisibility(uint32_t nodeIdx, bool parentVisible)
-   {
-      if (parentVisible)
+      else
       {
-         if (mNodeVisiblity[nodeIdx] & 0x2)
-            parentVisible = false;
+         InteriorGeom* geom = mInteriors[inst.resIdx].interior->mLodGeomInstances[0];
+         minP = geom->mMinBounds;
+         maxP = geom->mMaxBounds;
       }
       
-      if (parentVisible)
+      outMin = slm::vec3(FLT_MAX);
+      outMax = slm::vec3(-FLT_MAX);
+      
+      for (uint32_t i=0; i<8; i++)
       {
-         mNodeVisiblity[nodeIdx] |= 0x1;
+         slm::vec3 corner((i & 1) ? maxP.x : minP.x, (i & 2) ? maxP.y : minP.y, (i & 4) ? maxP.z : minP.z);
+         slm::vec3 p = (inst.placement * slm::vec4(corner, 1)).xyz();
+         outMin = slm::min(outMin, p);
+         outMax = slm::max(outMax, p);
       }
+   }
+   
+   void buildBVH()
+   {
+      std::vector<slm::vec3> minP(mInstances.size());
+      std::vector<slm::vec3> maxP(mInstances.size());
+      memset(mStats.numTotal, '\0', sizeof(mStats.numTotal));
       
-      Shape::NodeChildInfo info = mShape->mNodeChildren[nodeIdx+1];
-      for (int32_t i=0; i<info.numChildren; i++)
+      for (uint32_t i=0; i<mInstances.size(); i++)
       {
-         uint32_t nodeIdx = mShape->mNodeChildIds[info.firstChild+i];
-         updateNodeVisibility(nodeIdx, parentVisible);
+         getInstanceBounds(mInstances[i], minP[i], maxP[i]);
+         mStats.numTotal[mInstances[i].type]++;
       }
+      
+      mBVH.build(minP.data(), maxP.data(), (uint32_t)mInstances.size());
+      LOG_INFO("Scene: built BVH over %u cells, %u shapes, %u interiors in %.2f ms (%u nodes, depth %u)",
+               mStats.numTotal[Instance_TerrainCell], mStats.numTotal[Instance_Shape], mStats.numTotal[Instance_Interior],
+               mBVH.mStats.buildTimeUS / 1000.0f, mBVH.mStats.numNodes, mBVH.mStats.depth);
    }
    
-   void determineNodeVisibility()
+   void loadScene(const char* filename)
    {
-      // Hide everything by default
-      for (int i=0; i<mNodeVisiblity.size(); i++)
+      SceneFile scene;
+      clear();
+      
+      if (!scene.load(filename))
+         return;
+      
+      if (!scene.mPalette.empty())
       {
-         mNodeVisiblity[i] &= 0x2; // 0x2 == force invisible flag
+         mPaletteName = scene.mPalette;
       }
       
-      if (mAlwaysNode >= 0)
+      if (!scene.mTerrain.empty())
       {
-         mNodeVisiblity[mAlwaysNode] = 0x1;
-         updateNodeVisibility(mAlwaysNode, true);
+         mTerrain.loadGrid(scene.mTerrain.c_str(), -1, mPaletteName.c_str());
+         mTerrain.mLightColor = mLightColor;
+         mTerrain.mLightPos = mLightPos;
+         
+         // Cells without a block never get culled in the terrain viewer, but there is nothing to draw either
+         for (uint32_t i=0; i<mTerrain.mGridBounds.size(); i++)
+         {
+            if (mTerrain.mGridBounds[i].maxP.x == FLT_MAX)
+               continue;
+            
+            Instance inst;
+            inst.type = Instance_TerrainCell;
+            inst.resIdx = i;
+            inst.lod = 0;
+            inst.placement = slm::mat4(1);
+            inst.center = (mTerrain.mGridBounds[i].minP + mTerrain.mGridBounds[i].maxP) * 0.5f;
+            inst.radius = slm::length(mTerrain.mGridBounds[i].maxP - inst.center);
+            mInstances.push_back(inst);
+         }
       }
       
-      if (mCurrentDetail >= 0)
+      for (const SceneFile::Placement& placement : scene.mPlacements)
       {
-         updateNodeVisibility(getDetail(mCurrentDetail).rootNode, true);
+         addObject(placement.type, placement.filename.c_str(), placement.position, placement.rotation);
       }
+      
+      for (const SceneFile::Scatter& scatter : scene.mScatters)
+      {
+         scatterObjects(scatter);
+      }
+      
+      buildBVH();
+      setOptimalView();
    }
    
-   void selectDetail(float dist, int w, int h)
+   // Starts above the middle of the scene
+   void setOptimalView()
    {
-      float size;
-      if (dist <= 0.0f)
-      {
-         size = 1000.0f;
-      }
-      else
+      if (mBVH.mNodes.empty())
+         return;
+      
+      const SceneBVH::Node& root = mBVH.mNodes[0];
+      slm::vec3 pos((root.minP.x + root.maxP.x) * 0.5f, (root.minP.y + root.maxP.y) * 0.5f, root.maxP.z + 10.0f);
+      
+      // NOTE: the camera is y-up
+      mCamRot = slm::vec3(0,0,0);
+      mViewPos = slm::vec3(pos.x, pos.z, -pos.y);
+   }
+   
+   // Interior lods are ordered from most to least detailed
+   uint32_t selectInteriorLod(const InteriorResource& res, float size)
+   {
+      const Interior::State& state = res.interior->mStates[0];
+      const uint32_t endLod = std::min<uint32_t>(state.lodIdx + state.numLods, res.viewer->mRenderInfos.size());
+      uint32_t lod = state.lodIdx;
+      
+      for (uint32_t i=state.lodIdx; i<endLod; i++)
       {
-         size = atan(mShape->mRadius/dist);
-         size *= std::max<float>(w, h) / slm::radians(90.0);
+         lod = i;
+         if (size >= res.interior->mLods[i].minPixels)
+            break;
       }
       
-      mCurrentDetail = 0;
-      for (int i=0; i<mShape->mDetails.size(); i++)
+      return lod;
+   }
+   
+   void update(float dt)
+   {
+      slm::mat4 rotMat = slm::rotation_z(slm::radians(mCamRot.z)) * slm::rotation_y(slm::radians(mCamRot.y)) *  slm::rotation_x(slm::radians(mCamRot.x));
+      rotMat = inverse(rotMat);
+      slm::mat4 viewMatrix = slm::mat4(1) * rotMat * slm::translation(-mViewPos);
+      
+      int w, h;
+      getViewSize(mWindow, &w, &h);
+      slm::mat4 projMatrix = slm::perspective_fov_rh( slm::radians(90.0), (float)w/(float)h, 0.01f, 10000.0f);
+      
       {
-         Shape::Detail &detail = mShape->mDetails[i];
-         if (size <= detail.size)
+         PROFILE_SCOPE(Phase_Threads);
+         
+         // Each shape has its own viewer, so they can all advance at once
+         JobSystem::parallelFor(0, (uint32_t)mShapes.size(), 1, [this, dt, &viewMatrix](uint32_t start, uint32_t end){
+            for (uint32_t i=start; i<end; i++)
+            {
+               ShapeResource& res = mShapes[i];
+               if (res.viewer == NULL)
+                  continue;
+               
+               res.viewer->advanceThreads(dt);
+               res.viewer->mViewMatrix = viewMatrix;
+               res.animatedDetail = -1;
+            }
+         });
+         
+         for (InteriorResource& res : mInteriors)
          {
-            mCurrentDetail = i;
+            if (res.viewer)
+               res.viewer->mViewMatrix = viewMatrix;
          }
       }
-   }
-   
-   void drawLine(slm::vec3 start, slm::vec3 end, slm::vec4 color, float width)
-   {
-      updateMVP();
-      GFXBeginLinePipelineState();
-      GFXDrawLine(start, end, color, width);
-   }
-   
-   void render()
-   {
-      determineNodeVisibility();
       
-      if (mAlwaysNode > 0)
       {
-         renderObjects(mRuntimeDetails[0]);
+         PROFILE_SCOPE(Phase_Render);
+         render(viewMatrix, projMatrix, w, h);
       }
       
-      if (mCurrentDetail < 0)
-         return;
-      
-      renderObjects(mRuntimeDetails[mCurrentDetail+1]);
+      // Now render gui
+      PROFILE_SCOPE(Phase_ImGui);
+      ImGui::Begin("Scene");
+      ImGui::Text("Objects: %u cells, %u shapes, %u interiors", mStats.numTotal[Instance_TerrainCell], mStats.numTotal[Instance_Shape], mStats.numTotal[Instance_Interior]);
+      ImGui::Text("Visible: %u cells, %u shapes, %u interiors", mStats.numVisible[Instance_TerrainCell], mStats.numVisible[Instance_Shape], mStats.numVisible[Instance_Interior]);
+      ImGui::Text("BVH build: %.2f ms, %u nodes, depth %u", mBVH.mStats.buildTimeUS / 1000.0f, mBVH.mStats.numNodes, mBVH.mStats.depth);
+      ImGui::Text("Query: %.1f us, %u nodes visited, %u objects tested", mQueryStats.queryTimeUS, mQueryStats.numVisitedNodes, mQueryStats.numTestedItems);
+      ImGui::Text("Lod & queue: %.1f us", mStats.lodTimeUS);
+      ImGui::Checkbox("Use BVH", &mUseBVH);
+      ImGui::SliderFloat("Lod Scale", &mLodScale, 0.1f, 4.0f);
+      ImGui::End();
    }
    
-   void renderObjects(RuntimeDetailInfo& runtimeDetail)
+   void render(const slm::mat4& viewMatrix, const slm::mat4& projMatrix, int w, int h)
    {
-      const uint32_t vertStride = sizeof(slm::vec3) + sizeof(slm::vec3);
-      slm::mat4 firstXfm = slm::inverse(mNodeTransforms[0]);
-      slm::mat4 baseModel = mModelMatrix;
       slm::mat4 y_up = slm::rotation_x(slm::radians(-90.0f));
       
-      for (uint32_t i=runtimeDetail.startRenderObject; i<runtimeDetail.startRenderObject+runtimeDetail.numRenderObjects; i++)
+      // Instances are kept z-up
+      SceneBVH::Frustum frustum;
+      frustum.set(projMatrix * viewMatrix * y_up);
+      
+      mVisible.clear();
+      if (mUseBVH)
+         mBVH.query(frustum, mVisible);
+      else
+         mBVH.queryLinear(frustum, mVisible);
+      mQueryStats = mBVH.mStats;
+      
+      auto lodStart = std::chrono::steady_clock::now();
+      memset(mStats.numVisible, '\0', sizeof(mStats.numVisible));
+      
+      for (uint32_t idx : mVisible)
       {
-         uint32_t objIDToRender = mObjectRenderID[i];
-         Shape::Object &info = mShape->mObjects[objIDToRender];
-         if (info.meshIndex == -1)
-            continue;
-         
-         RuntimeObjectInfo* runtimeInfo = mRuntimeObjectInfos[objIDToRender];
-         RuntimeMeshInfo* runtimeMeshInfo = mRuntimeMeshInfos[info.meshIndex];
-         CelAnimMesh* mesh = runtimeMeshInfo->mMesh;
-         
-         if (mesh == NULL || !runtimeInfo->mDraw)
-            continue;
+         Instance& inst = mInstances[idx];
+         mStats.numVisible[inst.type]++;
          
-         if (info.nodeIndex >= 0 && ((mNodeVisiblity[info.nodeIndex] & 0x1) == 0))
+         if (inst.type == Instance_TerrainCell)
             continue;
          
-         if (info.nodeIndex < 0)
-            continue;
+         slm::vec4 viewPos = viewMatrix * y_up * slm::vec4(inst.center, 1);
+         float size = GenericViewer::getProjectedSize(inst.radius, slm::length(viewPos.xyz()), w, h) * mLodScale;
          
-         if (runtimeInfo->mFrame >= mesh->mFrames.size())
+         if (inst.type == Instance_Shape)
          {
-            printf("Mesh frame invalid (%i), objID %i.\n", runtimeInfo->mFrame, objIDToRender);
-            runtimeInfo->mFrame= 0;
+            ShapeViewer* viewer = mShapes[inst.resIdx].viewer;
+            viewer->selectDetailSize(size);
+            inst.lod = viewer->mCurrentDetail;
          }
+         else
+         {
+            inst.lod = selectInteriorLod(mInteriors[inst.resIdx], size);
+         }
+      }
+      
+      // Group shapes by detail so each one only gets animated once
+      std::sort(mVisible.begin(), mVisible.end(), [this](uint32_t a, uint32_t b){
+         const Instance& ia = mInstances[a];
+         const Instance& ib = mInstances[b];
+         if (ia.type != ib.type)
+            return ia.type < ib.type;
+         if (ia.resIdx != ib.resIdx)
+            return ia.resIdx < ib.resIdx;
+         return ia.lod < ib.lod;
+      });
+      
+      mRenderQueue.clear();
+      
+      for (uint32_t idx : mVisible)
+      {
+         const Instance& inst = mInstances[idx];
          
-         //assert(info.offset.x == 0);
-         
-         slm::mat4 slmMat = mNodeTransforms[info.nodeIndex];
-         
-         slmMat[3] = slm::vec4(0,0,0,1);
-         //slmMat = slm::transpose(slmMat);
-         slmMat[3] = mNodeTransforms[info.nodeIndex][3];
-         
-         assert(slmMat[3].w == 1);
-         
-         mModelMatrix = baseModel * y_up * firstXfm * slmMat * slm::translation(info.offset);
-         updateMVP();
-         
-         uint32_t ofsVerts = mesh->mFixedFrameOffsets[runtimeInfo->mFrame];
-         uint32_t ofsTexVerts = runtimeMeshInfo->mRealTexVertsPerFrame * runtimeInfo->mTexFrame;
-         
-         GFXSetModelVerts(0, ofsVerts, ofsTexVerts);
-         
-         for (CelAnimMesh::Prim& prim: runtimeMeshInfo->mPrims)
+         if (inst.type == Instance_Shape)
          {
-            int32_t matIdx = prim.mat;
-            if (matIdx < 0)
-               continue;
+            ShapeResource& res = mShapes[inst.resIdx];
+            res.viewer->mCurrentDetail = inst.lod;
             
-            if (matIdx > mActiveMaterials.size())
-               matIdx = 0;
-            
-            if (mActiveMaterials[matIdx].tex.bmpFlags &Bitmap::FLAG_TRANSPARENT)
-            {
-               GFXBeginModelPipelineState(ModelPipeline_TranslucentBlend, mActiveMaterials[matIdx].tex.texID, 0.65f);
-            }
-            else if (mActiveMaterials[matIdx].tex.bmpFlags & (Bitmap::FLAG_TRANSLUCENT | Bitmap::FLAG_ADDITIVE | Bitmap::FLAG_SUBTRACTIVE))
-            {
-               if (mActiveMaterials[matIdx].tex.bmpFlags & Bitmap::FLAG_ADDITIVE)
-               {
-                  GFXBeginModelPipelineState(ModelPipeline_AdditiveBlend, mActiveMaterials[matIdx].tex.texID, 1.1f);
-               }
-               else if (mActiveMaterials[matIdx].tex.bmpFlags & Bitmap::FLAG_SUBTRACTIVE)
-               {
-                  GFXBeginModelPipelineState(ModelPipeline_SubtractiveBlend, mActiveMaterials[matIdx].tex.texID, 1.1f);
-               }
-               else
-               {
-                  GFXBeginModelPipelineState(ModelPipeline_TranslucentBlend, mActiveMaterials[matIdx].tex.texID, 1.1f);
-               }
-            }
-            else
+            if (res.animatedDetail != (int32_t)inst.lod)
             {
-               GFXBeginModelPipelineState(ModelPipeline_DefaultDiffuse, mActiveMaterials[matIdx].tex.texID, 1.1f);
+               res.viewer->animateNodes();
+               res.animatedDetail = inst.lod;
             }
             
-            GFXDrawModelPrims(prim.numVerts, prim.numInds, prim.startInds, prim.startVerts);
+            res.viewer->queueDraws(mRenderQueue, y_up * inst.placement);
+         }
+         else if (inst.type == Instance_Interior)
+         {
+            mInteriors[inst.resIdx].viewer->queueDraws(mRenderQueue, y_up * inst.placement, inst.lod, false);
          }
       }
       
-      mModelMatrix = baseModel;
-   }
-   
-   void renderNodes(int32_t nodeIdx, slm::vec3 parentPos, int32_t highlightIdx)
-   {
-      if (nodeIdx < 0)
-         return;
-      
-      slm::mat4 firstXfm = slm::inverse(mNodeTransforms[0]);
-      slm::mat4 baseModel = mModelMatrix;
-      slm::mat4 y_up = slm::rotation_x(slm::radians(-90.0f));
+      auto lodEnd = std::chrono::steady_clock::now();
+      mStats.lodTimeUS = std::chrono::duration<float, std::micro>(lodEnd - lodStart).count();
       
-      slm::mat4 slmMat = mNodeTransforms[nodeIdx];
+      // Terrain is drawn directly, before the queue
+      mTerrain.mViewMatrix = viewMatrix;
+      mTerrain.mProjectionMatrix = projMatrix;
       
-      slmMat[3] = slm::vec4(0,0,0,1);
-      //slmMat = slm::transpose(slmMat);
-      slmMat[3] = mNodeTransforms[nodeIdx][3];
+      for (uint32_t idx : mVisible)
+      {
+         const Instance& inst = mInstances[idx];
+         if (inst.type != Instance_TerrainCell)
+            break;
+         
+         uint32_t x = inst.resIdx % mTerrain.mBlockList->mSize[0];
+         uint32_t y = inst.resIdx / mTerrain.mBlockList->mSize[0];
+         mTerrain.renderGridCell(x, y, y_up);
+      }
       
-      assert(slmMat[3].w == 1);
+      GFXSetLightPos(mLightPos, mLightColor);
+      mRenderQueue.submit(viewMatrix, projMatrix);
+   }
+};
+
+
+static const uint64_t tickMS = 1000.0 / 60;
+
+// Histogram of CPU time spent rendering each frame (from GFXBeginFrame to GFXEndFrame), used to spot hitches
+// such as pipelines or bind groups being created on first use.
+class FrameTimeHistogram
+{
+public:
+   
+   enum
+   {
+      NumBuckets = 8,
+      SwitchFrames = 4 // frames tracked after a viewer switch
+   };
+   
+   static constexpr float smBucketLimitsMS[NumBuckets-1] = {1.0f, 2.0f, 4.0f, 8.0f, 16.0f, 33.0f, 66.0f};
+   
+   uint32_t mBuckets[NumBuckets];
+   float mMaxMS;
+   float mSwitchSpikeMS; // worst frame just after the last viewer switch
+   uint32_t mSwitchFramesLeft;
+   
+   FrameTimeHistogram()
+   {
+      reset();
+   }
+   
+   void reset()
+   {
+      memset(mBuckets, '\0', sizeof(mBuckets));
+      mMaxMS = 0.0f;
+      mSwitchSpikeMS = 0.0f;
+      mSwitchFramesLeft = 0;
+   }
+   
+   void beginSwitch()
+   {
+      mSwitchSpikeMS = 0.0f;
+      mSwitchFramesLeft = SwitchFrames;
+   }
+   
+   void record(float ms)
+   {
+      uint32_t bucket = 0;
+      while (bucket < NumBuckets-1 && ms > smBucketLimitsMS[bucket])
+         bucket++;
       
-      slm::vec4 pos = baseModel * y_up * firstXfm * slmMat * slm::vec4(0,0,0,1);
+      mBuckets[bucket]++;
+      mMaxMS = std::max(mMaxMS, ms);
       
-      drawLine(pos.xyz(), parentPos, nodeIdx == highlightIdx ? slm::vec4(0,1,0,1) : slm::vec4(1,0,0,1), 1);
+      if (mSwitchFramesLeft > 0)
+      {
+         mSwitchSpikeMS = std::max(mSwitchSpikeMS, ms);
+         mSwitchFramesLeft--;
+      }
+   }
+   
+   void draw()
+   {
+      float values[NumBuckets];
+      for (uint32_t i=0; i<NumBuckets; i++)
+      {
+         values[i] = (float)mBuckets[i];
+      }
       
-      // Recurse
-      Shape::NodeChildInfo info = mShape->mNodeChildren[nodeIdx+1];
-      for (int32_t i=0; i<info.numChildren; i++)
+      ImGui::PlotHistogram("##frametimes", values, NumBuckets, 0, "<1 <2 <4 <8 <16 <33 <66 >66 ms", 0.0f, FLT_MAX, ImVec2(0, 60));
+      ImGui::Text("Worst frame: %.2f ms", mMaxMS);
+      ImGui::Text("Viewer switch spike: %.2f ms", mSwitchSpikeMS);
+      if (ImGui::Button("Reset"))
       {
-         renderNodes(mShape->mNodeChildIds[info.firstChild+i], pos.xyz(), highlightIdx);
+         reset();
       }
    }
 };
 
-class InteriorViewer : public GenericViewer
+struct MainState
 {
-public:
+   ResManager resManager;
+   ShapeViewerController* shapeController;
+   InteriorViewerController* interiorController;
+   TerrainViewerController* terrainController;
+   SceneViewerController* sceneController;
+   ViewController *currentController;
    
-   bool initVB;
-   uint32_t mLodToRender;
+   //
+   slm::vec3 deltaMovement;
+   slm::vec3 deltaRot;
+   slm::vec3 testPos;
+   uint64_t lastTicks;
    
-   struct RenderInteriorInfo
+   int selectedFileIdx;
+   int selectedVolumeIdx;
+   std::vector<ResManager::EnumEntry> fileList;
+   std::vector<std::string> restrictExtList;
+   std::vector<const char*> cFileList;
+   std::vector<std::string> sFileList;
+   std::vector<const char*> cVolumeList;
+   
+   int oldSelectedVolumeIdx;
+   int oldSelectedFileIdx;
+   //
+   
+   FrameTimeHistogram frameHistogram;
+   ViewController* lastController;
+   bool warmupEnabled;
+   bool warmupPending;
+   
+   // Record & replay (see InputRecording)
+   enum InputPhase
    {
-      InteriorGeom* geom;
-      uint32_t startSurf;
-      uint32_t numSurfs;
-      
-      uint32_t startInd;
-      uint32_t numTris;
+      InputPhase_FrameStart, // palette, volume selection
+      InputPhase_FileSelect, // after the volume file list is updated
+      InputPhase_Movement,   // after events are polled
+      InputPhase_Threads     // after the shape controller gui has run
    };
    
-   std::vector<RenderInteriorInfo> mRenderInfos;
+   InputRecording recording;
+   ReplayFrameStats replayStats;
+   bool isRecording;
+   bool isReplaying;
+   bool uncappedFrames;
+   uint32_t frameIndex;
+   uint32_t replayEventIdx;
+   
+   // Last recorded (or replayed) state
+   slm::vec3 recordedMovement;
+   slm::vec3 recordedRot;
+   std::string recordedPalette;
+   int recordedVolumeIdx;
+   bool recordedManualThreads;
+   std::vector<ShapeViewer::ShapeThread> recordedThreads;
+   
+   // Headless runs (see HeadlessScript)
+   bool isHeadless;
+   ReplayFrameStats headlessStats;
+   
+   // Browser thumbnails, started when first shown
+   ThumbnailCache thumbnails;
+   std::string thumbnailDir;
+   bool showThumbnails;
+   float lastSpareMS;
    
-   struct Triangle
+   int in_argc;
+   const char** in_argv;
+   
+   bool isGFXSetup;
+   bool running;
+   
+   SDL_Window* window;
+   
+   MainState() : shapeController(NULL), interiorController(NULL), terrainController(NULL), sceneController(NULL), currentController(NULL), in_argc(0), isGFXSetup(false)
+   {
+      lastTicks = 0;
+      selectedFileIdx = -1;
+      selectedVolumeIdx = -1;
+      oldSelectedVolumeIdx = -1;
+      oldSelectedFileIdx = -1;
+      running = false;
+      window = NULL;
+      lastController = NULL;
+      warmupEnabled = true;
+      warmupPending = false;
+      
+      isRecording = false;
+      isReplaying = false;
+      uncappedFrames = false;
+      frameIndex = 0;
+      replayEventIdx = 0;
+      recordedVolumeIdx = -1;
+      recordedManualThreads = false;
+      isHeadless = false;
+      showThumbnails = false;
+      lastSpareMS = 0.0f;
+      thumbnailDir = "thumbcache";
+      
+      testPos = slm::vec3(0);
+   }
+   
+   void init(SDL_Window* in_window, int argc, const char** argv)
+   {
+      window = in_window;
+      in_argc = argc;
+      in_argv = argv;
+      
+      shapeController = new ShapeViewerController(window, &resManager);
+      interiorController = new InteriorViewerController(window, &resManager);
+      terrainController = new TerrainViewerController(window, &resManager);
+      sceneController = new SceneViewerController(window, &resManager);
+   }
+   
+   int boot(bool requireResource=true);
+   int loop();
+   void pollEvents();
+   
+   void loadArg(const char* path);
+   void drawThumbnails();
+   int runHeadless(const HeadlessScript& script);
+   void logHeadlessStats(const char* outPath);
+   
+   void startInput();
+   void processInput(InputPhase phase);
+   void recordInput(InputPhase phase);
+   void replayInput(InputPhase phase);
+   void snapshotThreads();
+   
+   int testBoot();
+   int testLoop();
+   
+   void shutdown();
+};
+
+static MainState gMainState;
+
+
+static bool hasArg(int argc, const char * argv[], const char *name)
+{
+   for (int i=1; i<argc; i++)
+   {
+      if (strcasecmp(argv[i], name) == 0)
+         return true;
+   }
+   return false;
+}
+
+// Returns the argument following name, or NULL
+static const char* getArgValue(int argc, const char * argv[], const char *name)
+{
+   for (int i=1; i<argc-1; i++)
+   {
+      if (strcasecmp(argv[i], name) == 0)
+         return argv[i+1];
+   }
+   return NULL;
+}
+
+// Mounts the volumes and search paths given before the first flag, for the modes which run without a window
+static void mountArgs(ResManager& resManager, int argc, const char * argv[], std::string* outPaletteName)
+{
+   for (int i=1; i<argc; i++)
+   {
+      const char *path = argv[i];
+      if (path && path[0] == '-')
+         break;
+      
+      fs::path filePath = path;
+      std::string ext = filePath.extension().string();
+      std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+      
+      if (ext == ".vol" || ext == ".ted")
+         resManager.addVolume(path);
+      else if ((ext == ".ppl" || ext == ".pal") && outPaletteName)
+         *outPaletteName = path;
+      else if (ext == "")
+         resManager.mPaths.emplace_back(path);
+   }
+}
+
+// Mounts the volumes and search paths given on the command line and exports everything on them to outDir.
+// -glb writes binary files, -exportthreads sets the pool size and -exportpalette the palette for textures.
+static int runGLTFExport(int argc, const char * argv[], const char* outDir)
+{
+   ResManager resManager;
+   std::string paletteName = "ice.day.ppl";
+   
+   mountArgs(resManager, argc, argv, &paletteName);
+   
+   const char* paletteArg = getArgValue(argc, argv, "-exportpalette");
+   if (paletteArg)
+      paletteName = paletteArg;
+   
+   Palette* palette = NULL;
+   MemRStream mem(0, NULL);
+   if (resManager.openFile(paletteName.c_str(), mem))
+   {
+      palette = new Palette();
+      if (!palette->read(mem))
+      {
+         delete palette;
+         palette = NULL;
+      }
+   }
+   
+   if (palette == NULL)
+   {
+      LOG_WARN("Export: palette %s not found, only bitmaps with their own palette will be textured", paletteName.c_str());
+   }
+   
+   // Exports run on the job system, which counts the calling thread as one of the threads
+   const char* threadsArg = getArgValue(argc, argv, "-exportthreads");
+   if (threadsArg)
+   {
+      uint32_t numThreads = std::max<uint32_t>((uint32_t)strtoul(threadsArg, NULL, 10), 1);
+      JobSystem::shutdown();
+      JobSystem::init(numThreads - 1);
+   }
+   
+   int ret = 0;
    {
-      uint16_t i[3];
-      Triangle() {;}
-   };
+      GLTFExporter exporter(&resManager, palette, outDir, hasArg(argc, argv, "-glb"));
+      ret = exporter.run();
+   }
    
-   struct RuntimeSurf
+   if (palette)
+      delete palette;
+   return ret;
+}
+
+// Hashes everything mounted and reports how much of it is stored more than once, i.e. what loading by
+// content saves. Volumes with a hash index (or all of them with -hashindex) keep the hashes for next time.
+static int runDedupReport(int argc, const char * argv[])
+{
+   struct ExtStats
    {
-      RuntimeSurf() : startVert(0), numVerts(0), startInds(0), numInds(0) {;}
-      
-      uint32_t startVert;
-      uint32_t numVerts;
-      uint32_t startInds;
-      uint32_t numInds;
-      uint32_t matIdx;
+      std::string ext;
+      uint32_t numFiles;
+      uint32_t numDuplicates;
+      uint64_t bytes;
+      uint64_t duplicateBytes;
    };
    
-   std::vector<RuntimeSurf> mRuntimeSurfs;
-   std::vector<Interior::State> mStates;
+   ResManager resManager;
+   mountArgs(resManager, argc, argv, NULL);
    
-   InteriorViewer(ResManager* res)
-   {
-      mResourceManager = res;
-      mPalette = NULL;
-      mLodToRender = 0;
-      //mInterior = NULL;
-   }
+   std::unordered_map<uint64_t, uint32_t> contentCounts;
+   std::unordered_map<std::string, ExtStats> extStats;
+   uint32_t numFiles = 0;
+   uint32_t numHashed = 0;
+   uint64_t totalBytes = 0;
+   uint64_t hashedBytes = 0;
    
-   void render()
+   std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+   
+   std::vector<ResManager::EnumEntry> files;
+   resManager.enumerateFiles(files);
+   
+   for (ResManager::EnumEntry& entry : files)
    {
-      // Render all surfs for now
-      mLodToRender = mStates[0].lodIdx;
-      
-      const RenderInteriorInfo& toRender = mRenderInfos[mLodToRender];
-      
-      slm::mat4 baseModel = mModelMatrix;
-      slm::mat4 y_up = slm::rotation_x(slm::radians(-90.0f));
-      mModelMatrix = baseModel * y_up;
-      updateMVP();
+      uint64_t hash = 0;
+      uint32_t size = 0;
       
-      GFXSetModelVerts(0, 0, 0);
-      
-      for (int i=toRender.startSurf; i<toRender.startSurf + toRender.numSurfs; i++)
+      if (entry.mountIdx < resManager.mPaths.size())
       {
-         const RuntimeSurf &surf = mRuntimeSurfs[i];
-         
-         int32_t matIdx = surf.matIdx;
-         if (matIdx < 0)
+         MemRStream mem(0, NULL);
+         if (!resManager.openFile(entry.filename.c_str(), mem, entry.mountIdx, &hash))
+            continue;
+         size = mem.mSize;
+         numHashed++;
+         hashedBytes += size;
+      }
+      else
+      {
+         Volume* vol = resManager.mVolumes[entry.mountIdx - resManager.mPaths.size()];
+         int32_t idx = vol->findEntry(entry.filename.c_str());
+         if (idx < 0)
             continue;
          
-         if (matIdx > mActiveMaterials.size())
-            matIdx = 0;
-         
-         if (mActiveMaterials[matIdx].tex.bmpFlags &Bitmap::FLAG_TRANSPARENT)
-         {
-            GFXBeginModelPipelineState(ModelPipeline_TranslucentBlend, mActiveMaterials[matIdx].tex.texID, 0.65f);
-         }
-         else if (mActiveMaterials[matIdx].tex.bmpFlags & (Bitmap::FLAG_TRANSLUCENT | Bitmap::FLAG_ADDITIVE | Bitmap::FLAG_SUBTRACTIVE))
-         {
-            if (mActiveMaterials[matIdx].tex.bmpFlags & Bitmap::FLAG_ADDITIVE)
-            {
-               GFXBeginModelPipelineState(ModelPipeline_AdditiveBlend, mActiveMaterials[matIdx].tex.texID, 1.1f);
-            }
-            else if (mActiveMaterials[matIdx].tex.bmpFlags & Bitmap::FLAG_SUBTRACTIVE)
-            {
-               GFXBeginModelPipelineState(ModelPipeline_SubtractiveBlend, mActiveMaterials[matIdx].tex.texID, 1.1f);
-            }
-            else
-            {
-               GFXBeginModelPipelineState(ModelPipeline_TranslucentBlend, mActiveMaterials[matIdx].tex.texID, 1.1f);
-            }
-         }
-         else
+         size = vol->mFiles[idx].size;
+         if (vol->mHashes[idx] == 0)
          {
-            GFXBeginModelPipelineState(ModelPipeline_DefaultDiffuse, mActiveMaterials[matIdx].tex.texID, 1.1f);
+            numHashed++;
+            hashedBytes += size;
          }
          
-         GFXDrawModelPrims(surf.numVerts, surf.numInds, surf.startInds, surf.startVert);
+         hash = vol->getEntryHash(idx);
+         if (hash == 0)
+            continue;
       }
       
-      mModelMatrix = baseModel;
-   }
-   
-   void loadInterior(Interior& inInterior)
-   {
-      inInterior.loadResources(mResourceManager);
-      mRuntimeSurfs.clear();
-      mRenderInfos.clear();
-      mStates = inInterior.mStates;
-      mMaterialList = inInterior.mMaterials;
-      
-      std::vector<slm::vec3> verts;
-      std::vector<slm::vec2> tverts;
-      std::vector<Triangle> tris;
-      RuntimeSurf surf;
-      
-      // Need to load materials before since we need size info from them
-      initMaterials();
+      std::string ext = fs::path(entry.filename).extension().string();
+      std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
       
-      // textureScaleBits = 4
+      ExtStats& stats = extStats[ext];
+      stats.ext = ext;
+      stats.numFiles++;
+      stats.bytes += size;
       
-      // Prepare surface data
-      for (InteriorGeom* geom : inInterior.mLodGeomInstances)
+      if (contentCounts[hash]++ > 0)
       {
-         RenderInteriorInfo info;
-         info.geom = geom;
-         info.startSurf = mRuntimeSurfs.size();
-         info.numSurfs = geom->mSurfaces.size();
-         info.startInd = tris.size()*3;
-         info.numTris = 0;
-         int maxMipLevel = 0;
-         
-         for (InteriorGeom::Surface &isurf : geom->mSurfaces)
-         {
-            InteriorGeom::PlaneF plane = geom->mPlanes[isurf.planeIdx];
-            
-            uint32_t startVert = verts.size()/2;
-            
-            slm::vec3 surfNormal = slm::vec3(plane.x, plane.y, plane.z);
-            surfNormal.normalize();
-            
-            surf.startVert = 0;
-            surf.startInds = tris.size() * 3;
-            surf.numInds = 0;
-            surf.matIdx = isurf.materials;
-            
-            uint16_t lastVert = 0;
-            ActiveMaterial& amat = mActiveMaterials[surf.matIdx];
-            
-            // Tribes offsets and scales texture coords based on these surface params.
-            // The scale value is what size the texture should be from 0...1 (starting from 1), while the offset is
-            // how many texels the texture should be offset by (relative to the size of the loaded texture)
-            slm::vec2 txScale(1,1);
-            slm::vec2 txOffset(0,0);
-            
-            txScale = slm::vec2(((float)(((int)isurf.tsX+1) << maxMipLevel)) / (float)amat.tex.width,
-                                ((float)(((int)isurf.tsY+1) << maxMipLevel)) / (float)amat.tex.height);
-            txOffset = slm::vec2((float)isurf.toX / (float)amat.tex.width,
-                                 (float)isurf.toY / (float)amat.tex.height);
-            
-            // First add all the verts
-            for (int i=(int)isurf.vtxIdx; i<((int)isurf.vtxIdx) + ((int)isurf.numVerts); i++)
-            {
-               InteriorGeom::Vertex& vert = geom->mVerts[i];
-               
-               slm::vec2 tv = geom->mPoint2List[vert.tIdx];
-               tv *= txScale;
-               tv += txOffset;
-               
-               // Add the two new verts
-               verts.push_back(geom->mPoint3List[vert.pIdx]);
-               verts.push_back(surfNormal);
-               tverts.push_back(tv);
-               
-               surf.numVerts++;
-            }
-            
-            // Now add all the indices
-            // Need to insert a triangle fan for each vert starting from the origin
-            for (int i=1; i < ((int)isurf.numVerts)-1; i++)
-            {
-               Triangle t;
-               
-               t.i[0] = startVert;
-               t.i[1] = startVert+i;
-               t.i[2] = startVert+i+1;
-               tris.push_back(t);
-               
-               surf.numInds += 3;
-               info.numTris += 1;
-            }
-            
-            mRuntimeSurfs.push_back(surf);
-         }
-         
-         for (RuntimeSurf &surf : mRuntimeSurfs)
-         {
-            surf.numVerts = verts.size();
-         }
-         
-         mRenderInfos.push_back(info);
+         stats.numDuplicates++;
+         stats.duplicateBytes += size;
       }
       
-      assert(verts.size() < 0xFFFF);
-      GFXLoadModelData(0, &verts[0], &tverts[0], &tris[0], verts.size(), tverts.size(), tris.size()*3);
+      numFiles++;
+      totalBytes += size;
    }
    
-   void clear()
+   resManager.saveHashIndexes();
+   
+   std::vector<ExtStats> sortedStats;
+   uint32_t numDuplicates = 0;
+   uint64_t duplicateBytes = 0;
+   for (auto& itr : extStats)
    {
-      clearTextures();
-      mMaterialList = NULL;
+      sortedStats.push_back(itr.second);
+      numDuplicates += itr.second.numDuplicates;
+      duplicateBytes += itr.second.duplicateBytes;
    }
    
-};
+   std::sort(sortedStats.begin(), sortedStats.end(), [](const ExtStats& a, const ExtStats& b){
+      return a.duplicateBytes > b.duplicateBytes;
+   });
+   
+   double totalMS = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+   
+   printf("Dedup report: %u files on %u mounts, %.1f KB\n", numFiles, (uint32_t)(resManager.mPaths.size() + resManager.mVolumes.size()), totalBytes / 1024.0);
+   printf("  unique contents: %u (%.1f KB)\n", (uint32_t)contentCounts.size(), (totalBytes - duplicateBytes) / 1024.0);
+   printf("  duplicates: %u files, %.1f KB saved (%.1f%%)\n", numDuplicates, duplicateBytes / 1024.0,
+          totalBytes ? (duplicateBytes * 100.0) / totalBytes : 0.0);
+   printf("  hashed %u files (%.1f KB) in %.2fms, %u from hash indexes\n", numHashed, hashedBytes / 1024.0, totalMS, numFiles - numHashed);
+   printf("\n  %-8s %8s %8s %12s %12s\n", "ext", "files", "dups", "KB", "dup KB");
+   
+   for (ExtStats& stats : sortedStats)
+   {
+      printf("  %-8s %8u %8u %12.1f %12.1f\n", stats.ext.empty() ? "(none)" : stats.ext.c_str(),
+             stats.numFiles, stats.numDuplicates, stats.bytes / 1024.0, stats.duplicateBytes / 1024.0);
+   }
+   
+   return 0;
+}
 
-class ViewController
+// Times reading every entry of the mounted volumes one at a time against batched reads. Entries are asked
+// for in name order, as the viewer loads them.
+static int runIOBench(int argc, const char * argv[])
 {
-public:
-   slm::vec3 mViewPos;
-   slm::vec3 mCamRot;
-   float mViewSpeed;
+   ResManager resManager;
+   mountArgs(resManager, argc, argv, NULL);
    
-   ViewController() : mViewSpeed(1)
+   std::vector<IOBenchFile> files;
+   for (Volume* vol : resManager.mVolumes)
    {
+      std::vector<uint32_t> order(vol->mFiles.size());
+      for (uint32_t i=0; i<order.size(); i++)
+         order[i] = i;
+      
+      std::sort(order.begin(), order.end(), [vol](uint32_t a, uint32_t b){
+         return strcasecmp(vol->mFiles[a].getFilename(vol->mStringData), vol->mFiles[b].getFilename(vol->mStringData)) < 0;
+      });
       
+      IOBenchFile file;
+      file.path = vol->mName;
+      for (uint32_t idx : order)
+      {
+         file.offsets.push_back((uint64_t)vol->mFiles[idx].offset + 8); // skip past VBLK header
+         file.sizes.push_back(vol->mFiles[idx].size);
+      }
+      files.push_back(file);
    }
    
-   virtual void update(float dt) = 0;
-   virtual bool isResourceLoaded() = 0;
-};
+   return runIOBenchmarks(files);
+}
 
-class InteriorViewerController : public ViewController
+// Opens every file in the mounted volumes, probing each loose directory and then through the directory
+// index, and prints the filesystem calls each took
+static int runLookupBench(int argc, const char * argv[])
 {
-public:
-   InteriorViewer mViewer;
-   SDL_Window* mWindow;
-   float xRot, yRot, mDetailDist;
+   std::vector<ResManager::EnumEntry> files;
    
-   Interior* mInterior;
-   std::string mPaletteName;
-   
-   InteriorViewerController(SDL_Window* window, ResManager* mgr) :
-   mViewer(mgr), mInterior(NULL), mWindow(window)
+   printf("%-8s %8s %10s %10s %10s\n", "lookup", "files", "fs calls", "per file", "ms");
+   for (uint32_t pass=0; pass<2; pass++)
    {
-      xRot = 0.0f;
-      yRot = 0.0f;
-      mCamRot = slm::vec3(0,0,0);
-      mDetailDist = 0.0f;
-      mPaletteName = "ice.day.ppl";
+      ResManager resManager;
+      mountArgs(resManager, argc, argv, NULL);
+      DirIndex::smEnabled = pass == 1;
+      
+      if (files.empty())
+      {
+         for (uint32_t i=0; i<resManager.mVolumes.size(); i++)
+            resManager.enumerateVolume(i, files, NULL);
+      }
+      
+      std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+      uint32_t numLoaded = 0;
+      for (ResManager::EnumEntry& entry : files)
+      {
+         MemRStream mem(0, NULL);
+         if (resManager.openFile(entry.filename.c_str(), mem))
+            numLoaded++;
+      }
+      double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+      
+      uint64_t numCalls = resManager.getNumFSCalls();
+      printf("%-8s %8u %10llu %10.2f %10.2f\n", pass == 0 ? "probe" : "index", numLoaded, (unsigned long long)numCalls,
+             numLoaded ? (double)numCalls / numLoaded : 0.0, ms);
    }
    
-   ~InteriorViewerController()
+   DirIndex::smEnabled = true;
+   return 0;
+}
+
+template<typename T> static bool sameRecords(const std::vector<T>& a, const std::vector<T>& b)
+{
+   // Both lists are value initialized, so padding compares equal too
+   return a.size() == b.size() && (a.empty() || memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0);
+}
+
+// Parses every shape on the mounts with the bulk legacy record readers and again a field at a time,
+// reporting any shape where the two disagree along with how long each took per file version.
+static int runShapeVerify(int argc, const char * argv[])
+{
+   enum
    {
-      if (mInterior)
-         delete mInterior;
-   }
+      MaxVersion = 8, // newer versions are counted with 8, they don't use the legacy readers
+      Repeats = 10
+   };
    
-   bool isResourceLoaded()
+   struct VersionStats
    {
-      return mInterior != NULL;
-   }
+      uint32_t numShapes;
+      uint32_t numMismatched;
+      double bulkMS;
+      double fieldMS;
+   };
    
-   void loadInterior(const char* filename, int volIdx=-1)
+   ResManager resManager;
+   mountArgs(resManager, argc, argv, NULL);
+   
+   std::vector<std::string> exts;
+   exts.push_back(".dts");
+   std::vector<ResManager::EnumEntry> files;
+   resManager.enumerateFiles(files, -1, &exts);
+   
+   VersionStats stats[MaxVersion+1] = {};
+   uint32_t numFailed = 0;
+   
+   // Meshes don't go through the legacy readers, so leave them out of the timings
+   Shape::smDeferMeshes = true;
+   
+   for (ResManager::EnumEntry& entry : files)
    {
-      MemRStream rStream(0, NULL);
-      mViewer.clear();
-      if (mInterior)
-         delete mInterior;
-      mInterior = NULL;
+      MemRStream mem(0, NULL);
+      if (!resManager.openFile(entry.filename.c_str(), mem, entry.mountIdx))
+         continue;
       
-      if (mViewer.mResourceManager->openFile(filename, rStream, volIdx))
+      IFFBlock block;
+      std::string className;
+      uint32_t version = 0;
+      MemRStream header(mem.mSize, mem.mPtr);
+      if (!header.read(block) || block.ident != DarkstarPersistObject::IDENT_PERS || !header.readSString(className) || !header.read(version))
+         continue;
+      
+      Shape* shapes[2] = {};
+      double ms[2] = {};
+      for (uint32_t pass=0; pass<2; pass++)
       {
-         Interior* obj = new Interior();
-         if (!obj->read(rStream))
+         Shape::smFieldwiseRecords = pass == 1;
+         std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+         for (uint32_t i=0; i<Repeats; i++)
+         {
+            if (shapes[pass]) delete shapes[pass];
+            mem.setPosition(0);
+            DarkstarPersistObject* obj = DarkstarPersistObject::createFromStream(mem);
+            shapes[pass] = dynamic_cast<Shape*>(obj);
+            if (shapes[pass] == NULL && obj)
+               delete obj;
+         }
+         ms[pass] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count() / (double)Repeats;
+      }
+      Shape::smFieldwiseRecords = false;
+      
+      VersionStats& vs = stats[std::min<uint32_t>(version, MaxVersion)];
+      if (shapes[0] == NULL || shapes[1] == NULL)
+      {
+         numFailed++;
+      }
+      else
+      {
+         const Shape& a = *shapes[0];
+         const Shape& b = *shapes[1];
+         bool same = sameRecords(a.mNodes, b.mNodes) && sameRecords(a.mSequences, b.mSequences) &&
+                     sameRecords(a.mSubSequences, b.mSubSequences) && sameRecords(a.mKeyframes, b.mKeyframes) &&
+                     sameRecords(a.mTransforms, b.mTransforms) && sameRecords(a.mObjects, b.mObjects) &&
+                     sameRecords(a.mTransitions, b.mTransitions);
+         if (!same)
          {
-            delete obj;
-            return;
+            printf("mismatch: %s (version %u)\n", entry.filename.c_str(), version);
+            vs.numMismatched++;
          }
          
-         mInterior = ((Interior*)obj);
-         mViewer.clear();
-         mViewer.setPalette(mPaletteName.c_str());
-         mViewer.loadInterior(*mInterior);
-         
-         mViewPos = slm::vec3(0, mInterior->mCenter.z, mInterior->mRadius);
+         vs.numShapes++;
+         vs.bulkMS += ms[0];
+         vs.fieldMS += ms[1];
       }
+      
+      if (shapes[0]) delete shapes[0];
+      if (shapes[1]) delete shapes[1];
    }
    
-   void update(float dt)
+   Shape::smDeferMeshes = false;
+   
+   uint32_t numMismatched = 0;
+   printf("%-8s %8s %10s %10s %10s %8s\n", "version", "shapes", "mismatched", "bulk ms", "field ms", "speedup");
+   for (uint32_t i=0; i<=MaxVersion; i++)
    {
-      mViewer.mModelMatrix = slm::rotation_x(xRot) * slm::rotation_y(yRot);
-      slm::mat4 rotMat = slm::rotation_z(slm::radians(mCamRot.z)) * slm::rotation_y(slm::radians(mCamRot.y)) *  slm::rotation_x(slm::radians(mCamRot.x));
-      rotMat = inverse(rotMat);
-      mViewer.mViewMatrix = slm::mat4(1) * rotMat * slm::translation(-mViewPos);
-      
-      int w, h;
-      SDL_GetWindowSize(mWindow, &w, &h);
-      mViewer.mProjectionMatrix = slm::perspective_fov_rh( slm::radians(90.0), (float)w/(float)h, 0.01f, 10000.0f);
-      
-      mViewer.render();
+      const VersionStats& vs = stats[i];
+      if (vs.numShapes == 0)
+         continue;
+      printf("%-8s %8u %10u %10.3f %10.3f %7.2fx\n", i == MaxVersion ? "8+" : std::to_string(i).c_str(), vs.numShapes,
+             vs.numMismatched, vs.bulkMS, vs.fieldMS, vs.bulkMS > 0 ? vs.fieldMS / vs.bulkMS : 0.0);
+      numMismatched += vs.numMismatched;
    }
-};
+   
+   if (numFailed)
+      printf("%u shapes failed to load\n", numFailed);
+   
+   // Nothing checked counts as a failure, so a wrong data path doesn't pass as a test
+   uint32_t numChecked = 0;
+   for (uint32_t i=0; i<=MaxVersion; i++)
+      numChecked += stats[i].numShapes;
+   if (numChecked == 0)
+      printf("no shapes found to verify\n");
+   
+   return (numMismatched == 0 && numFailed == 0 && numChecked > 0) ? 0 : 1;
+}
 
-class TerrainViewer : public GenericViewer
+// Writes a copy of a volume with its entries laid out in the order they are loaded, so loading one object
+// reads neighbouring pages instead of seeking around the file.
+//
+// Entries named in an order file (one name per line, as recorded from a session) come first in that
+// order. The rest follow grouped by type, each shape, interior and material list followed by the entries
+// it loads from the same volume. Payloads are aligned so that none touches more pages than its size needs:
+// large ones start on a page boundary, small ones only move when they would straddle one. The index keeps
+// its original order and format, so the result reads the same through Volume::read.
+//
+class VolumeRepacker
 {
 public:
    
-   TerrainBlockList* mBlockList;
-   TerrainBlock* mBlock;
-   TerrainBlockList mSingleList;
-   
-   std::string mLastMLName;
-   std::vector<uint32_t> mBlockModels;
-   
-   struct BlockGPUResource
+   enum
    {
-      uint32_t mHeightMapTexID;
-      uint32_t mGridMapTexID;
-      uint32_t mLightMapTexID;
+      DefaultAlignment = 4096
    };
    
-   std::vector<BlockGPUResource> mBlockResources;
-   
-   TerrainViewer(ResManager* res)
+   struct Stats
    {
-      mResourceManager = res;
-      mPalette = NULL;
-      mLastMLName = "";
-      useShared = true;
-   }
+      uint32_t numEntries;
+      uint32_t numOrdered;     // placed by the order file
+      uint32_t numGrouped;     // placed after the entry that loads them
+      uint64_t payloadBytes;
+      uint64_t paddingBytes;
+      uint32_t oldBreaks;      // places in load order where the next entry isn't within a page of the last
+      uint32_t newBreaks;
+   };
    
-   ~TerrainViewer()
+   VolumeRepacker(Volume* volume, uint32_t alignment) : mVolume(volume), mAlignment(std::max<uint32_t>(alignment, 1))
    {
-      clear();
+      mStats = {};
    }
    
-   void renderBlock(TerrainBlock& block, BlockGPUResource& res, float squareSize, uint32_t modelId)
+   // Returns false if the file couldn't be read; names not in the volume are skipped
+   bool loadOrder(const char* filename)
    {
-      const uint32_t numSquares = block.mSize[0] * block.mSize[1];
+      FILE* fp = fopen(filename, "r");
+      if (fp == NULL)
+         return false;
       
-      GFXSetTerrainResources(modelId, mSharedMaterials.tex.texID, res.mHeightMapTexID, res.mGridMapTexID, res.mLightMapTexID);
+      char line[PATH_MAX];
+      while (fgets(line, sizeof(line), fp))
+      {
+         char* name = line;
+         while (*name == ' ' || *name == '\t')
+            name++;
+         
+         size_t len = strlen(name);
+         while (len > 0 && (name[len-1] == '\n' || name[len-1] == '\r' || name[len-1] == ' ' || name[len-1] == '\t'))
+            name[--len] = '\0';
+         
+         if (len == 0 || name[0] == '#')
+            continue;
+         
+         int32_t idx = mVolume->findEntry(name);
+         if (idx >= 0)
+            mOrder.push_back((uint32_t)idx);
+      }
       
-      // Draw all at once
-      GFXBeginTerrainPipelineState(TerrainPipeline_Squares,
-                                   modelId, squareSize, block.mSize[0], block.mSize[1],
-                                   (slm::vec4*)TerrainBlock::MaterialMap::sMatCoords);
-      updateMVP();
-      GFXSetModelViewProjection(mModelMatrix, mViewMatrix, mProjectionMatrix);
-      GFXDrawModelVerts(numSquares * 6, 0);
+      fclose(fp);
+      return true;
    }
    
-   void render()
+   bool write(const char* outPath)
    {
-      // Render all surfs for now
-      slm::mat4 baseModel = mModelMatrix;
-      slm::mat4 y_up = slm::rotation_x(slm::radians(-90.0f));
-      mModelMatrix = baseModel * y_up;
+      buildLayout();
       
-      // TODO: use the grid
-      if (mBlock)
+      FILE* fp = fopen(outPath, "wb");
+      if (fp == NULL)
       {
-         updateMVP();
-         renderBlock(*mBlock,
-                     mBlockResources[0],
-                     1<<mBlockList->mScale, 0);
-         
+         LOG_ERROR("Repack: couldn't create %s", outPath);
+         return false;
       }
-      else
+      
+      std::vector<Volume::Entry> entries = mVolume->mFiles;
+      std::vector<uint8_t> zeros(mAlignment, 0);
+      uint64_t pos = 8;
+      bool ok = true;
+      
+      // Header is filled in once the string table position is known
+      IFFBlock header;
+      ok = ok && fwrite(&header, sizeof(header), 1, fp) == 1;
+      
+      for (uint32_t idx : mLayout)
       {
-         slm::vec3 offset(0,0,0);
-         uint32_t blockSize = 1<<mBlockList->mScale;
-         uint32_t count = 0;
+         Volume::Entry& entry = entries[idx];
          
-         for (int32_t y=0; y<mBlockList->mSize[1]; y++)
+         IFFBlock block;
+         MemRStream stream(0, NULL);
+         if (fseek(mVolume->mFilePtr, entry.offset, SEEK_SET) != 0 ||
+             fread(&block, sizeof(block), 1, mVolume->mFilePtr) != 1 ||
+             !mVolume->readEntry(mVolume->mFilePtr, idx, stream))
          {
-            for (int32_t x=0; x<mBlockList->mSize[0]; x++)
-            {
-               uint32_t mapOffset = (y*mBlockList->mSize[0]) + x;
-               uint32_t realBlock = mBlockList->mBlockMap[mapOffset];
-               TerrainBlock* terrainBlock = mBlockList->mBlocks[realBlock].instance;
-               
-               int32_t blockX = x << (mBlockList->mDetailCount-1);
-               int32_t blockY = y << (mBlockList->mDetailCount-1);
-               
-               slm::vec3 blockOffset(blockX << mBlockList->mScale,
-                                     blockY << mBlockList->mScale,
-                                     0.0f);
-               
-               slm::mat4 adjMat = baseModel;
-               adjMat *= y_up * slm::translation(blockOffset);
-               mModelMatrix = adjMat;
-               
-               renderBlock(*terrainBlock, mBlockResources[realBlock], blockSize, count++);
-            }
+            LOG_ERROR("Repack: couldn't read %s", entry.getFilename(mVolume->mStringData));
+            ok = false;
+            break;
          }
+         
+         uint64_t payloadPos = alignPayload(pos + 8, entry.size);
+         uint64_t padding = payloadPos - 8 - pos;
+         if (payloadPos + entry.size > INT32_MAX)
+         {
+            LOG_ERROR("Repack: output is too large for a volume");
+            ok = false;
+            break;
+         }
+         
+         ok = ok && (padding == 0 || fwrite(&zeros[0], padding, 1, fp) == 1);
+         ok = ok && fwrite(&block, sizeof(block), 1, fp) == 1;
+         ok = ok && (entry.size == 0 || fwrite(stream.mPtr, entry.size, 1, fp) == 1);
+         
+         entry.offset = (int32_t)(payloadPos - 8);
+         pos = payloadPos + entry.size;
+         mStats.paddingBytes += padding;
+         mStats.payloadBytes += entry.size;
       }
       
-      mModelMatrix = baseModel;
-   }
-   
-   void updateMaterials()
-   {
-      if (mBlockList == NULL)
-         return;
-      
-      if (mMaterialList == NULL || mLastMLName != mBlockList->mMLName)
+      // Names are rewritten in index order, padded to the even size IFFBlock expects
+      std::vector<char> strings;
+      for (Volume::Entry& entry : entries)
       {
-         mLastMLName = mBlockList->mMLName;
-         mMaterialList = mResourceManager->openTypedObject<MaterialList>(mBlockList->mMLName.c_str());
-         initMaterials();
+         const char* name = entry.getFilename(mVolume->mStringData);
+         entry.pFilename = (int32_t)strings.size();
+         strings.insert(strings.end(), name, name + strlen(name) + 1);
       }
+      if (strings.size() & 1)
+         strings.push_back('\0');
       
-      mBlockResources.resize(mBlockList->mBlocks.size());
-      for (uint32_t i=0; i<mBlockList->mBlocks.size(); i++)
+      uint32_t stringsPos = (uint32_t)pos;
+      uint32_t blockData[2] = {Volume::IDENT_vols, (uint32_t)strings.size()};
+      ok = ok && fwrite(blockData, sizeof(blockData), 1, fp) == 1;
+      ok = ok && (strings.empty() || fwrite(&strings[0], strings.size(), 1, fp) == 1);
+      
+      uint32_t indexSize = (uint32_t)(entries.size() * sizeof(Volume::Entry));
+      blockData[0] = Volume::IDENT_voli;
+      blockData[1] = indexSize;
+      ok = ok && fwrite(blockData, sizeof(blockData), 1, fp) == 1;
+      ok = ok && (entries.empty() || fwrite(&entries[0], indexSize, 1, fp) == 1);
+      ok = ok && ((indexSize & 1) == 0 || fwrite(&zeros[0], 1, 1, fp) == 1);
+      
+      blockData[0] = Volume::IDENT_PVOL;
+      blockData[1] = stringsPos;
+      ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(blockData, sizeof(blockData), 1, fp) == 1;
+      ok = fclose(fp) == 0 && ok;
+      
+      if (!ok)
       {
-         loadBlockResources(*mBlockList->mBlocks[i].instance, mBlockResources[i]);
+         LOG_ERROR("Repack: failed writing %s", outPath);
+         remove(outPath);
+         return false;
       }
+      
+      mStats.numEntries = (uint32_t)entries.size();
+      mStats.oldBreaks = countBreaks(mVolume->mFiles);
+      mStats.newBreaks = countBreaks(entries);
+      return true;
    }
    
-   void loadBlockResources(TerrainBlock& block, BlockGPUResource& res)
+   // Reads the output back through Volume::read and checks every entry against the source
+   bool verify(const char* outPath)
    {
-      if (res.mHeightMapTexID != 0)
-      {
-         GFXDeleteTexture(res.mHeightMapTexID);
-         res.mHeightMapTexID = 0;
-      }
+      FILE* fp = fopen(outPath, "rb");
+      if (fp == NULL)
+         return false;
       
-      if (res.mLightMapTexID != 0)
-      {
-         GFXDeleteTexture(res.mLightMapTexID);
-         res.mLightMapTexID = 0;
-      }
+      Volume copy;
+      copy.mFilePtr = fp;
+      copy.mName = outPath;
+      if (!copy.read(fp) || copy.mFiles.size() != mVolume->mFiles.size())
+         return false;
       
-      if (res.mGridMapTexID != 0)
+      for (uint32_t i=0; i<copy.mFiles.size(); i++)
       {
-         GFXDeleteTexture(res.mGridMapTexID);
-         res.mGridMapTexID = 0;
+         MemRStream a(0, NULL), b(0, NULL);
+         if (strcmp(copy.mFiles[i].getFilename(copy.mStringData), mVolume->mFiles[i].getFilename(mVolume->mStringData)) != 0 ||
+             !copy.readEntry(fp, i, a) || !mVolume->readEntry(mVolume->mFilePtr, i, b) ||
+             a.mSize != b.mSize || memcmp(a.mPtr, b.mPtr, a.mSize) != 0)
+         {
+            LOG_ERROR("Repack: %s differs in %s", mVolume->mFiles[i].getFilename(mVolume->mStringData), outPath);
+            return false;
+         }
       }
       
-      if (block.mLightMap.size() != 0)
+      return true;
+   }
+   
+   inline const Stats& getStats() const { return mStats; }
+   
+protected:
+   
+   Volume* mVolume;
+   uint32_t mAlignment;
+   std::vector<uint32_t> mOrder;    // from the order file
+   std::vector<uint32_t> mLayout;   // entry indices in output order
+   std::vector<uint32_t> mLoadOrder; // expected load order, for counting breaks
+   std::vector<bool> mPlaced;
+   Stats mStats;
+   
+   uint64_t alignPayload(uint64_t pos, uint32_t size) const
+   {
+      uint64_t aligned = ((pos + mAlignment - 1) / mAlignment) * mAlignment;
+      if (mAlignment <= 1 || aligned == pos)
+         return pos;
+      if (size >= mAlignment || (pos % mAlignment) + size > mAlignment)
+         return aligned;
+      return pos;
+   }
+   
+   static uint32_t getTypeRank(const char* filename)
+   {
+      static const char* sOrder[] = {".dts", ".dis", ".dml", ".dig", ".dil", ".bmp", ".dtf", ".dtb"};
+      const char* ext = strrchr(filename, '.');
+      for (uint32_t i=0; ext && i<sizeof(sOrder)/sizeof(sOrder[0]); i++)
       {
-         res.mLightMapTexID = GFXLoadCustomTexture(CustomTexture_LM16, block.getLightMapWidth(), block.getLightMapWidth(), &block.mLightMap[0]);
+         if (strcasecmp(ext, sOrder[i]) == 0)
+            return i;
       }
-      else
+      return sizeof(sOrder)/sizeof(sOrder[0]);
+   }
+   
+   void addMaterials(MaterialList* materials)
+   {
+      for (Material& mat : materials->mMaterials)
       {
-         const uint32_t full = 0xFFFFFFFF;
-         uint32_t tex[16*16];
-         for (uint32_t i=0; i<16*16; i++)
-         {
-            tex[i] = full;
-         }
-         res.mLightMapTexID = GFXLoadCustomTexture(CustomTexture_RGBA8, 16, 16, tex);
+         if (mat.mFilename[0] != '\0')
+            place((const char*)mat.mFilename);
       }
-      
-      res.mGridMapTexID = GFXLoadCustomTexture(CustomTexture_RG8, block.getGridMapWidth(), block.getGridMapHeight(), &block.mGridMapBase[0]);
-      res.mHeightMapTexID = GFXLoadCustomTexture(CustomTexture_Float, block.getHeightMapWidth(), block.getHeightMapHeight(), &block.mHeightMap[0]);
    }
    
-   void clear()
+   // Places the entry, then what loading it would open
+   void place(const char* filename)
    {
-      for (BlockGPUResource& res : mBlockResources)
+      int32_t idx = mVolume->findEntry(filename);
+      if (idx >= 0)
+         place((uint32_t)idx, true);
+   }
+   
+   void place(uint32_t idx, bool isDependency)
+   {
+      if (mPlaced[idx])
+         return;
+      
+      mPlaced[idx] = true;
+      mLayout.push_back(idx);
+      mLoadOrder.push_back(idx);
+      if (isDependency)
+         mStats.numGrouped++;
+      
+      const char* filename = mVolume->mFiles[idx].getFilename(mVolume->mStringData);
+      const char* ext = strrchr(filename, '.');
+      if (ext == NULL || (strcasecmp(ext, ".dts") != 0 && strcasecmp(ext, ".dis") != 0 && strcasecmp(ext, ".dml") != 0))
+         return;
+      
+      MemRStream mem(0, NULL);
+      if (!mVolume->readEntry(mVolume->mFilePtr, idx, mem))
+         return;
+      
+      if (strcasecmp(ext, ".dis") == 0)
       {
-         if (res.mHeightMapTexID != 0)
-         {
-            GFXDeleteTexture(res.mHeightMapTexID);
-            res.mHeightMapTexID = 0;
-         }
-         
-         if (res.mLightMapTexID != 0)
-         {
-            GFXDeleteTexture(res.mLightMapTexID);
-            res.mLightMapTexID = 0;
-         }
+         Interior interior;
+         interior.mMaterials = NULL;
+         if (!interior.read(mem))
+            return;
          
-         if (res.mGridMapTexID != 0)
-         {
-            GFXDeleteTexture(res.mGridMapTexID);
-            res.mGridMapTexID = 0;
-         }
+         place(interior.getFilename(interior.mMaterialListNameIdx));
+         for (Interior::Lod& lod : interior.mLods)
+            place(interior.getFilename(lod.geomNameIdx));
+         return;
       }
       
-      mBlockResources.clear();
+      DarkstarPersistObject* obj = DarkstarPersistObject::createFromStream(mem);
+      Shape* shape = dynamic_cast<Shape*>(obj);
+      MaterialList* materials = dynamic_cast<MaterialList*>(obj);
+      if (shape && shape->mMaterials)
+         addMaterials(shape->mMaterials);
+      else if (materials)
+         addMaterials(materials);
+      delete obj;
+   }
    
-      if (mBlockList != &mSingleList)
+   void buildLayout()
+   {
+      mLayout.clear();
+      mLoadOrder.clear();
+      mPlaced.assign(mVolume->mFiles.size(), false);
+      
+      // The order file is already in load order, so nothing is pulled in after its entries
+      for (uint32_t idx : mOrder)
       {
-         delete mBlockList;
-         mBlock = NULL;
+         if (mPlaced[idx])
+            continue;
+         mPlaced[idx] = true;
+         mLayout.push_back(idx);
+         mStats.numOrdered++;
       }
-      else
+      mLoadOrder = mOrder;
+      
+      std::vector<uint32_t> rest;
+      for (uint32_t i=0; i<mVolume->mFiles.size(); i++)
       {
-         delete mBlock;
+         if (!mPlaced[i])
+            rest.push_back(i);
       }
       
-      mBlock = NULL;
-      mBlockList = NULL;
-      mSingleList.setSingleBlock(NULL);
-      clearTextures();
-      mMaterialList = NULL;
+      const char* strings = mVolume->mStringData;
+      const std::vector<Volume::Entry>& files = mVolume->mFiles;
+      std::sort(rest.begin(), rest.end(), [&](uint32_t a, uint32_t b){
+         const char* nameA = files[a].getFilename(strings);
+         const char* nameB = files[b].getFilename(strings);
+         uint32_t rankA = getTypeRank(nameA);
+         uint32_t rankB = getTypeRank(nameB);
+         return rankA != rankB ? rankA < rankB : strcasecmp(nameA, nameB) < 0;
+      });
+      
+      for (uint32_t idx : rest)
+         place(idx, false);
+   }
+   
+   // Counts how often reading in load order has to jump, given a layout
+   uint32_t countBreaks(const std::vector<Volume::Entry>& entries) const
+   {
+      uint32_t breaks = 0;
+      for (uint32_t i=1; i<mLoadOrder.size(); i++)
+      {
+         const Volume::Entry& last = entries[mLoadOrder[i-1]];
+         const Volume::Entry& next = entries[mLoadOrder[i]];
+         int64_t gap = (int64_t)next.offset - ((int64_t)last.offset + 8 + last.size);
+         if (gap < 0 || gap > 4096)
+            breaks++;
+      }
+      return breaks;
    }
 };
 
+// Repacks the first volume given on the command line to outPath
+static int runRepack(int argc, const char * argv[], const char* outPath)
+{
+   ResManager resManager;
+   mountArgs(resManager, argc, argv, NULL);
+   
+   if (resManager.mVolumes.empty())
+   {
+      LOG_ERROR("Repack: no volume given");
+      return 1;
+   }
+   
+   const char* alignArg = getArgValue(argc, argv, "-repackalign");
+   uint32_t alignment = alignArg ? (uint32_t)strtoul(alignArg, NULL, 10) : (uint32_t)VolumeRepacker::DefaultAlignment;
+   
+   Volume* vol = resManager.mVolumes[0];
+   VolumeRepacker repacker(vol, alignment);
+   
+   const char* orderPath = getArgValue(argc, argv, "-repackorder");
+   if (orderPath && !repacker.loadOrder(orderPath))
+   {
+      LOG_ERROR("Repack: couldn't read order file %s", orderPath);
+      return 1;
+   }
+   
+   if (!repacker.write(outPath) || !repacker.verify(outPath))
+      return 1;
+   
+   const VolumeRepacker::Stats& stats = repacker.getStats();
+   printf("Repacked %s to %s: %u entries, %u from the order file, %u grouped with what loads them\n",
+          vol->mName.c_str(), outPath, stats.numEntries, stats.numOrdered, stats.numGrouped);
+   printf("  payload %.1f KB, alignment padding %.1f KB (%u byte alignment)\n",
+          stats.payloadBytes / 1024.0, stats.paddingBytes / 1024.0, std::max<uint32_t>(alignment, 1));
+   printf("  jumps when reading in load order: %u before, %u after\n", stats.oldBreaks, stats.newBreaks);
+   return 0;
+}
 
+// Stops the subsystems main() starts, on every way out of it. Each of these may be called when it was never
+// started, so the guard can be set up before any of them. gMainState (viewers, resources, GFX and SDL) is
+// only shut down once it has been initialized.
+struct MainTeardown
+{
+   bool mMainState;
+   
+   MainTeardown() : mMainState(false) {;}
+   
+   ~MainTeardown()
+   {
+      if (mMainState)
+         gMainState.shutdown();
+      JobSystem::shutdown();
+      Trace::close();
+      AccessTrace::close();
+      Log::shutdown();
+   }
+};
 
-class TerrainViewerController : public ViewController
+int main(int argc, const char * argv[])
 {
-public:
-   SDL_Window* mWindow;
-   float xRot, yRot, mDetailDist;
+   SDL_Window* window = NULL;
+   SDL_Renderer* renderer = NULL;
+   
+   assert(sizeof(slm::vec2) == 8);
+   assert(sizeof(slm::vec3) == 12);
+   assert(sizeof(slm::vec4) == 16);
    
-   std::string mPaletteName;
-   TerrainViewer mViewer;
+   DarkstarPersistObject::initStatics();
    
-   TerrainViewerController(SDL_Window* window, ResManager* mgr) : mWindow(window), mViewer(mgr)
+   const char* logLevelName = getArgValue(argc, argv, "-loglevel");
+   Log::Level logLevel = Log::Level_Info;
+   if (logLevelName && Log::parseLevel(logLevelName, &logLevel))
    {
-      xRot = 0.0f;
-      yRot = 0.0f;
-      mCamRot = slm::vec3(0,0,0);
-      mDetailDist = 0.0f;
-      mPaletteName = "ice.day.ppl";
-      mViewSpeed = 64;
+      Log::setLevel(logLevel);
    }
+   Log::init();
+   MainTeardown teardown;
    
-   ~TerrainViewerController()
+   // slm is built for the SIMD level the compiler was given, so check this CPU has it before using it
+   if (!slm::isValidCPU())
    {
-      mViewer.clear();
+      LOG_ERROR("This CPU doesn't support the SIMD instructions TribesViewer was built with");
+      return 1;
    }
    
-   void setOptimalView()
+   if (hasArg(argc, argv, "-benchmath"))
    {
-      if (mViewer.mBlockList == NULL)
-         return;
-      
-      uint32_t realBlock = mViewer.mBlockList->mBlockMap[0];
-      float height = mViewer.mBlockList->mBlocks[realBlock].instance->getHeight(0,0);
-      
-      
-      //mCamRot = slm::vec3(0,90,0);
-      mViewPos = slm::vec3(0,height + 5,0);
+      return runMathBenchmarks();
    }
    
-   void loadGrid(const char* filename, int volIdx=-1)
+   if (hasArg(argc, argv, "-benchjobs"))
    {
-      MemRStream rStream(0, NULL);
-      mViewer.clear();
-      
-      if (mViewer.mResourceManager->openFile(filename, rStream, volIdx))
-      {
-         mViewer.mBlockList = new TerrainBlockList();
-         if (mViewer.mBlockList->read(rStream))
-         {
-            std::string baseName = filename;
-            std::size_t dot_pos = baseName.find_last_of('.');
-
-            if (dot_pos != std::string::npos)
-            {
-               baseName = baseName.substr(0, dot_pos);
-            }
-            
-            mViewer.mBlockList->loadBlocks(*mViewer.mResourceManager, baseName.c_str(), volIdx);
-         }
-         else
-         {
-            delete mViewer.mBlockList;
-            mViewer.mBlockList = NULL;
-         }
-      }
-      
-      mViewer.setPalette(mPaletteName.c_str());
-      mViewer.updateMaterials();
-      setOptimalView();
+      return runJobBenchmarks();
    }
    
-   void loadSingleBlock(const char* filename, int volIdx=-1)
+   // Summarize an access trace, optionally writing an order file for -repackorder
+   const char* traceSummary = getArgValue(argc, argv, "-tracesummary");
+   if (traceSummary)
    {
-      MemRStream rStream(0, NULL);
-      mViewer.clear();
-      
-      if (mViewer.mResourceManager->openFile(filename, rStream, volIdx))
-      {
-         mViewer.mBlock = new TerrainBlock();
-         if (mViewer.mBlock->read(rStream))
-         {
-            mViewer.mBlockList = &mViewer.mSingleList;
-            mViewer.mBlockList->setSingleBlock(mViewer.mBlock);
-         }
-         else
-         {
-            delete mViewer.mBlock;
-            mViewer.mBlock = NULL;
-         }
-      }
-      
-      mViewer.setPalette(mPaletteName.c_str());
-      mViewer.updateMaterials();
-      setOptimalView();
+      return AccessTrace::summarize(traceSummary, getArgValue(argc, argv, "-traceorder"));
    }
    
+   // Workers for loading and animation; "-jobthreads 0" runs everything on the main thread
+   const char* jobThreads = getArgValue(argc, argv, "-jobthreads");
+   JobSystem::init(jobThreads ? (uint32_t)strtoul(jobThreads, NULL, 10) : (uint32_t)JobSystem::DefaultWorkers);
    
-   bool isResourceLoaded()
+   // Caps the RGBA staging memory used while loading material lists
+   const char* stagingMB = getArgValue(argc, argv, "-stagingmb");
+   if (stagingMB)
+      MaterialPipeline::smMaxStagingBytes = (size_t)strtoul(stagingMB, NULL, 10) * 1024 * 1024;
+   
+   // Record load zones as a chrome trace
+   const char* traceOut = getArgValue(argc, argv, "-trace");
+   if (traceOut && Trace::open(traceOut))
    {
-      return !(mViewer.mBlockList == NULL && mViewer.mBlock == NULL);
+      Trace::setThreadName("Main");
    }
    
-   void update(float dt)
+   // Backend for batched volume reads: auto, io_uring or preadv
+   const char* ioRead = getArgValue(argc, argv, "-ioread");
+   for (uint32_t i=0; ioRead && i<BatchReader::Backend_Count; i++)
    {
-      mViewer.mModelMatrix = slm::rotation_x(xRot) * slm::rotation_y(yRot);
-      slm::mat4 rotMat = slm::rotation_z(slm::radians(mCamRot.z)) * slm::rotation_y(slm::radians(mCamRot.y)) *  slm::rotation_x(slm::radians(mCamRot.x));
-      rotMat = inverse(rotMat);
-      mViewer.mViewMatrix = slm::mat4(1) * rotMat * slm::translation(-mViewPos);
-      
-      int w, h;
-      SDL_GetWindowSize(mWindow, &w, &h);
-      mViewer.mProjectionMatrix = slm::perspective_fov_rh( slm::radians(90.0), (float)w/(float)h, 0.01f, 10000.0f);
-      
-      mViewer.render();
+      if (strcasecmp(ioRead, BatchReader::getBackendName((BatchReader::Backend)i)) == 0)
+         BatchReader::smBackend = (BatchReader::Backend)i;
    }
-};
-
-class ShapeViewerController : public ViewController
-{
-public:
-   ShapeViewer mViewer;
-   SDL_Window* mWindow;
-   float xRot, yRot, mDetailDist;
-   Shape* mShape;
-   int32_t mHighlightNodeIdx;
-   std::string mPaletteName;
    
-   std::vector<const char*> mSequenceList;
-   std::vector<int> mNextSequence;
+   if (hasArg(argc, argv, "-benchio"))
+   {
+      return runIOBench(argc, argv);
+   }
    
-   int32_t mRemoveThreadId;
-   bool mRenderNodes;
-   bool mManualThreads;
+   // Record every file opened, and what for
+   const char* accessTraceOut = getArgValue(argc, argv, "-accesstrace");
+   if (accessTraceOut)
+   {
+      AccessTrace::open(accessTraceOut);
+   }
    
-   ShapeViewerController(SDL_Window* window, ResManager* mgr) :
-   mViewer(mgr)
+   // Probe every loose directory for each file instead of keeping a list of what they hold
+   DirIndex::smEnabled = !hasArg(argc, argv, "-nodirindex");
+   
+   // Create content hash indexes next to volumes which don't have one
+   Volume::smWriteHashIndex = hasArg(argc, argv, "-hashindex");
+   
+   if (hasArg(argc, argv, "-dedupreport"))
    {
-      mViewPos = slm::vec3(0,0,0);
-      mCamRot = slm::vec3(0,0,0);
-      mViewer.initRender();
-      mWindow = window;
-      xRot = mDetailDist = 0;
-      yRot = slm::radians(180.0f);
-      mShape = NULL;
-      mHighlightNodeIdx = -1;
-      mRemoveThreadId = -1;
-      mPaletteName = "ice.day.ppl";
-      mRenderNodes = true;
-      mManualThreads = false;
+      return runDedupReport(argc, argv);
    }
    
-   ~ShapeViewerController()
+   if (hasArg(argc, argv, "-benchlookup"))
    {
-      if (mShape)
-         delete mShape;
+      return runLookupBench(argc, argv);
    }
    
-   bool isResourceLoaded()
+   if (hasArg(argc, argv, "-verifyshapes"))
    {
-      return mShape != NULL;
+      return runShapeVerify(argc, argv);
    }
    
-   void updateNextSequence()
+   // Rewrite a volume in load order
+   const char* repackPath = getArgValue(argc, argv, "-repack");
+   if (repackPath)
    {
-      mNextSequence.resize(mViewer.mThreads.size());
-      for (int i=0; i<mViewer.mThreads.size(); i++)
-      {
-         mNextSequence[i] = mViewer.mThreads[i].sequenceIdx;
-      }
+      return runRepack(argc, argv, repackPath);
    }
    
-   void loadShape(const char *filename, int pathIdx=-1)
+   // Convert everything mounted to glTF without opening a window
+   const char* exportDir = getArgValue(argc, argv, "-exportgltf");
+   if (exportDir)
    {
-      MemRStream rStream(0, NULL);
-      mViewer.clear();
-      if (mShape)
-         delete mShape;
-      mShape = NULL;
-      
-      if (mViewer.mResourceManager->openFile(filename, rStream, pathIdx))
-      {
-         DarkstarPersistObject* obj = DarkstarPersistObject::createFromStream(rStream);
-         if (obj)
-         {
-            mShape = ((Shape*)obj);
-            mViewer.clear();
-            if (!mViewer.setPalette(mPaletteName.c_str()))
-            {
-               printf("Warning: cant load palette %s\n", mPaletteName.c_str());
-            }
-            mViewer.loadShape(*mShape);
-            
-            uint32_t thr = mViewer.addThread();
-            mViewer.setThreadSequence(thr, 0);
-            
-            mViewPos = slm::vec3(0, mViewer.mShape->mCenter.z, mViewer.mShape->mRadius);
-            
-            mSequenceList.resize(mShape->mSequences.size());
-            updateNextSequence();
-            
-            for (int i=0; i<mViewer.mShape->mSequences.size(); i++)
-            {
-               mSequenceList[i] = mShape->getName(mShape->mSequences[i].name);
-            }
-         }
-      }
+      return runGLTFExport(argc, argv, exportDir);
    }
    
-   void update(float dt)
+   // Skip bind group warmup, to compare first-use hitches
+   gMainState.warmupEnabled = !hasArg(argc, argv, "-nowarmup");
+   
+   // Where browser thumbnails are cached
+   const char* thumbnailDir = getArgValue(argc, argv, "-thumbcache");
+   if (thumbnailDir)
    {
-      mViewer.mModelMatrix = slm::rotation_x(xRot) * slm::rotation_y(yRot);
-      slm::mat4 rotMat = slm::rotation_z(slm::radians(mCamRot.z)) * slm::rotation_y(slm::radians(mCamRot.y)) *  slm::rotation_x(slm::radians(mCamRot.x));
-      rotMat = inverse(rotMat);
-      mViewer.mViewMatrix = slm::mat4(1) * rotMat * slm::translation(-mViewPos);
-      
-      int w, h;
-      SDL_GetWindowSize(mWindow, &w, &h);
-      mViewer.mProjectionMatrix = slm::perspective_fov_rh( slm::radians(90.0), (float)w/(float)h, 0.01f, 10000.0f);
-      
-      if (!mManualThreads)
-         mViewer.advanceThreads(dt);
-      mViewer.selectDetail(mDetailDist, w, h);
-      mViewer.animateNodes();
-      mViewer.render();
-      if (mRenderNodes)
-      {
-         mViewer.renderNodes(mShape->mDetails[mViewer.mCurrentDetail].rootNode, slm::vec3(0,0,0), mHighlightNodeIdx);
-      }
-      
-      // Now render gui
-      ImGui::Begin("Nodes");
-      ImGui::PushStyleVar(ImGuiStyleVar_Alpha, 0.75);
-      nodeTree(0);
-      ImGui::PopStyleVar(1);
-      ImGui::End();
-      
-      ImGui::Begin("Anim");
-      char buffer[1024];
-      
-      if (ImGui::Button("Add Thread"))
-      {
-         mViewer.addThread();
-         updateNextSequence();
-      }
-      
-      ImGui::SameLine();
-      ImGui::Checkbox("Manual Control", &mManualThreads);
-      
-      if (mRemoveThreadId >= 0)
-      {
-         mViewer.removeThread(mRemoveThreadId);
-         mRemoveThreadId = -1;
-      }
-      
-      for (ShapeViewer::ShapeThread &thread : mViewer.mThreads)
-      {
-         int32_t idx = &thread - &mViewer.mThreads[0];
-         snprintf(buffer, 1024, "Thread %i", idx);
-         
-         bool vis = ImGui::CollapsingHeader(buffer);
-         ImGui::SameLine();
-         
-         if (thread.sequenceIdx == -1 || thread.sequenceIdx >= mViewer.mShape->mSequences.size())
-         {
-            snprintf(buffer, 1024, "INVALID");
-         }
-         else
-         {
-            snprintf(buffer, 1024, "seq=%s pos=%f",
-                     thread.sequenceIdx == -1 ? "NULL" : mShape->getName(mShape->mSequences[thread.sequenceIdx].name),
-                     thread.pos);
-         }
-         
-         ImGui::Text(buffer);
-         
-         if (vis)
-         {
-            snprintf(buffer, 1024, "Enabled##th%i", idx);
-            ImGui::Checkbox(buffer, &mViewer.mThreads[idx].enabled);
-            ImGui::SameLine();
-            snprintf(buffer, 1024, "Remove##th%i", idx);
-            if (ImGui::Button(buffer))
-               mRemoveThreadId = idx;
-            snprintf(buffer, 1024, "Pos##th%i", idx);
-            ImGui::SliderFloat(buffer, &mViewer.mThreads[idx].pos, 0.0f, 1.0f);
-            ImGui::NewLine();
-            snprintf(buffer, 1024, "Sequences##th%i", idx);
-            ImGui::ListBox(buffer, &mNextSequence[idx], &mSequenceList[0], mShape->mSequences.size());
-         }
-      }
-      
-      ImGui::End();
-      
-      ImGui::Begin("View");
-      ImGui::SliderAngle("X Rotation", &xRot);
-      ImGui::SliderAngle("Y Rotation", &yRot);
-      ImGui::SliderFloat("Detail Distance", &mDetailDist, 0, 1000.0f);
-      ImGui::Checkbox("Render Nodes", &mRenderNodes);
-      ImGui::End();
+      gMainState.thumbnailDir = thumbnailDir;
+   }
+   
+   // Run without a window or GPU device, driven by -script or -sequence/-frames/-statsout
+   gMainState.isHeadless = hasArg(argc, argv, "-headless") || hasArg(argc, argv, "--headless");
+   
+   if (SDL_Init(gMainState.isHeadless ? SDL_INIT_EVENTS : (SDL_INIT_VIDEO | SDL_INIT_EVENTS)) < 0) {
+      LOG_ERROR("Couldn't initialize SDL: %s", SDL_GetError());
+      return (1);
+   }
+   
+   if (gMainState.isHeadless)
+   {
+      gMainState.init(NULL, argc, argv);
+      teardown.mMainState = true;
       
-      // Update state changed by gui
-      for (int i=0; i<mNextSequence.size(); i++)
+      if (GFXSetupHeadless(TVDefaultWindowWidth, TVDefaultWindowHeight) < 0)
       {
-         if (mNextSequence[i] != mViewer.mThreads[i].sequenceIdx)
-         {
-            mViewer.setThreadSequence(i, mNextSequence[i]);
-         }
+         return 1;
       }
+      
+      gMainState.warmupEnabled = false;
    }
-   
-   void nodeTree(int32_t nodeIdx)
+   else
    {
-      if (nodeIdx < 0)
-         return;
+      if (!SDL_CreateWindowAndRenderer("DTS Viewer", TVDefaultWindowWidth, TVDefaultWindowHeight, SDL_WINDOW_HIGH_PIXEL_DENSITY | SDL_WINDOW_RESIZABLE, &window, &renderer)) {
+         LOG_ERROR("Window could not be created! SDL_Error: %s", SDL_GetError());
+         return (1);
+      }
       
-      Shape::NodeChildInfo info = mShape->mNodeChildren[nodeIdx+1];
-      uint32_t baseFlags = ImGuiTreeNodeFlags_OpenOnArrow | ImGuiTreeNodeFlags_OpenOnDoubleClick;
+      // Init basic main
+      gMainState.init(window, argc, argv);
+      teardown.mMainState = true;
       
-      bool visDetail = (nodeIdx == mShape->mDetails[mViewer.mCurrentDetail].rootNode);
+      int setupCode = GFXSetup(window, renderer);
       
-      if (visDetail)
+      if (setupCode < 0)
       {
-         ImGui::PushStyleVar(ImGuiStyleVar_Alpha, 1.0);
+         return 1;
       }
       
-      bool vis = ImGui::TreeNodeEx(mShape->getName(mShape->mNodes[nodeIdx].name), info.numChildren > 0 ? baseFlags : baseFlags|ImGuiTreeNodeFlags_Leaf);
-      if (ImGui::IsItemClicked())
+      // Non-Emscripten setup
+      while (setupCode != 0)
       {
-         mHighlightNodeIdx = nodeIdx;
+         setupCode = GFXSetup(window, renderer);
       }
-      
-      if (vis)
+   }
+   
+   // Record input for -replay, which plays it back with a fixed timestep
+   const char* recordOut = getArgValue(argc, argv, "-record");
+   const char* replayIn = getArgValue(argc, argv, "-replay");
+   gMainState.uncappedFrames = gMainState.isHeadless || hasArg(argc, argv, "-uncapped");
+   if (replayIn)
+   {
+      if (!gMainState.recording.load(replayIn))
+         return 1;
+      gMainState.isReplaying = true;
+   }
+   else if (recordOut)
+   {
+      gMainState.isRecording = true;
+   }
+   
+   // Headless replays just run the recording; otherwise build the command list
+   HeadlessScript script;
+   bool runScript = gMainState.isHeadless && !gMainState.isReplaying;
+   if (runScript)
+   {
+      const char* scriptIn = getArgValue(argc, argv, "-script");
+      if (scriptIn)
       {
-         for (int32_t i=0; i<info.numChildren; i++)
-         {
-            nodeTree(mShape->mNodeChildIds[info.firstChild+i]);
-         }
-         ImGui::TreePop();
+         if (!script.load(scriptIn))
+            return 1;
       }
+      else
+      {
+         const char* sequenceName = getArgValue(argc, argv, "-sequence");
+         const char* numFrames = getArgValue(argc, argv, "-frames");
+         if (sequenceName)
+            script.addCommand(HeadlessScript::Command_Sequence, sequenceName);
+         script.addCommand(HeadlessScript::Command_Frames, numFrames ? numFrames : "600");
+         script.addCommand(HeadlessScript::Command_Stats, getArgValue(argc, argv, "-statsout"));
+      }
+   }
+   
+   // Scripts may load everything themselves
+   int ret = gMainState.boot(!runScript);
+   if (ret != 0)
+      return ret;
+   
+   if (runScript)
+   {
+      ret = gMainState.runHeadless(script);
+   }
+   else
+   {
+      gMainState.startInput();
       
-      if (visDetail)
+      while (gMainState.loop() == 0)
       {
-         ImGui::PopStyleVar(1);
+         ;
       }
    }
    
-};
-
+   if (gMainState.isRecording)
+   {
+      gMainState.recording.mNumFrames = gMainState.frameIndex;
+      gMainState.recording.save(recordOut);
+   }
+   else if (gMainState.isReplaying)
+   {
+      gMainState.replayStats.print();
+   }
+   
+#ifdef TV_ENABLE_PROFILER
+   const char* profileOut = getArgValue(argc, argv, "-profileout");
+   if (profileOut)
+   {
+      std::string prefix = profileOut;
+      PROFILE_DUMP((prefix + ".csv").c_str(), (prefix + ".json").c_str());
+   }
+#endif
+   
+   const char* memOut = getArgValue(argc, argv, "-memout");
+   if (memOut)
+   {
+      MemTrack::dumpJSON(memOut);
+   }
+   
+   return ret;
+}
 
-static const uint64_t tickMS = 1000.0 / 60;
+void MainState::shutdown()
+{
+   if (shapeController)
+   {
+      delete shapeController;
+      delete interiorController;
+      delete terrainController;
+      delete sceneController;
+      shapeController = NULL;
+      interiorController = NULL;
+      terrainController = NULL;
+      sceneController = NULL;
+   }
+   
+   thumbnails.shutdown();
+   resManager.saveHashIndexes();
+   GFXTeardown();
+   if (gMainState.window)
+      SDL_DestroyWindow( gMainState.window );
+   SDL_Quit();
+}
 
-struct MainState
+// Loads a file, volume, palette or search path given on the command line
+void MainState::loadArg(const char* path)
 {
-   ResManager resManager;
-   ShapeViewerController* shapeController;
-   InteriorViewerController* interiorController;
-   TerrainViewerController* terrainController;
-   ViewController *currentController;
+   fs::path filePath = path;
+   std::string  ext = filePath.extension();
+   std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
    
-   //
-   slm::vec3 deltaMovement;
-   slm::vec3 deltaRot;
-   slm::vec3 testPos;
-   uint64_t lastTicks;
+   if (ext == ".dts")
+   {
+      shapeController->loadShape(path);
+      currentController = shapeController;
+   }
+   else if (ext == ".vol" || ext == ".ted")
+   {
+      resManager.addVolume(path);
+   }
+   else if (ext == ".ppl" || ext == ".pal")
+   {
+      shapeController->mPaletteName = path;
+      interiorController->mPaletteName = path;
+      terrainController->mPaletteName = path;
+      sceneController->mPaletteName = path;
+   }
+   else if (ext == ".dis")
+   {
+      interiorController->loadInterior(path);
+      currentController = interiorController;
+   }
+   else if (ext == ".dtf")
+   {
+      terrainController->loadGrid(path);
+      currentController = terrainController;
+   }
+   else if (ext == ".dtb")
+   {
+      terrainController->loadSingleBlock(path);
+      currentController = terrainController;
+   }
+   else if (ext == ".scene")
+   {
+      sceneController->loadScene(path);
+      currentController = sceneController;
+   }
+   else if (ext == "")
+   {
+      resManager.mPaths.emplace_back(path);
+   }
+}
+
+int MainState::boot(bool requireResource)
+{
+   currentController = shapeController;
    
-   int selectedFileIdx;
-   int selectedVolumeIdx;
-   std::vector<ResManager::EnumEntry> fileList;
-   std::vector<std::string> restrictExtList;
-   std::vector<const char*> cFileList;
-   std::vector<std::string> sFileList;
-   std::vector<const char*> cVolumeList;
+   for (int i=1; i<in_argc; i++)
+   {
+      const char *path = in_argv[i];
+      if (path && path[0] == '-')
+         break;
+      
+      loadArg(path);
+   }
    
-   int oldSelectedVolumeIdx;
-   int oldSelectedFileIdx;
-   //
+   if (requireResource && !currentController->isResourceLoaded())
+   {
+      LOG_ERROR("please specify a starting shape or interior or terrain or scene to load");
+      return 1;
+   }
    
-   int in_argc;
-   const char** in_argv;
+   running = true;
    
-   bool isGFXSetup;
-   bool running;
+   deltaMovement = slm::vec3(0);
+   deltaRot = slm::vec3(0);
+   lastTicks = SDL_GetTicks();
    
-   SDL_Window* window;
+   selectedFileIdx = -1;
+   selectedVolumeIdx = -1;
+   restrictExtList.clear();
+   fileList.clear();
+   restrictExtList.push_back(".dts");
+   restrictExtList.push_back(".dis");
+   restrictExtList.push_back(".dtb");
+   restrictExtList.push_back(".dtf");
+   resManager.enumerateFiles(fileList, selectedVolumeIdx, &restrictExtList);
+   sFileList.resize(fileList.size());
    
-   MainState() : shapeController(NULL), interiorController(NULL), terrainController(NULL), currentController(NULL), in_argc(0), isGFXSetup(false)
+   for (int i=0; i<fileList.size(); i++)
    {
-      lastTicks = 0;
-      selectedFileIdx = -1;
-      selectedVolumeIdx = -1;
-      oldSelectedVolumeIdx = -1;
-      oldSelectedFileIdx = -1;
-      running = false;
-      window = NULL;
-      
-      testPos = slm::vec3(0);
+      sFileList[i] = fileList[i].filename;
    }
    
-   void init(SDL_Window* in_window, int argc, const char** argv)
+   for (int i=0; i<fileList.size(); i++)
    {
-      window = in_window;
-      in_argc = argc;
-      in_argv = argv;
-      
-      shapeController = new ShapeViewerController(window, &resManager);
-      interiorController = new InteriorViewerController(window, &resManager);
-      terrainController = new TerrainViewerController(window, &resManager);
+      cFileList.push_back(sFileList[i].c_str());
    }
    
-   int boot();
-   int loop();
+   resManager.enumerateSearchPaths(cVolumeList);
    
-   int testBoot();
-   int testLoop();
+   oldSelectedVolumeIdx = -1;
+   oldSelectedFileIdx = -1;
    
-   void shutdown();
-};
-
-static MainState gMainState;
+   return 0;
+}
 
+int MainState::runHeadless(const HeadlessScript& script)
+{
+   for (const HeadlessScript::Command& cmd : script.mCommands)
+   {
+      switch (cmd.type)
+      {
+         case HeadlessScript::Command_Load:
+            loadArg(cmd.arg.c_str());
+            break;
+         case HeadlessScript::Command_Palette:
+            shapeController->mPaletteName = cmd.arg;
+            interiorController->mPaletteName = cmd.arg;
+            terrainController->mPaletteName = cmd.arg;
+            sceneController->mPaletteName = cmd.arg;
+            break;
+         case HeadlessScript::Command_Sequence:
+         {
+            int32_t seqIdx = shapeController->findSequence(cmd.arg.c_str());
+            if (seqIdx < 0 || shapeController->mViewer.mThreads.empty())
+            {
+               LOG_ERROR("Headless: sequence %s not found", cmd.arg.c_str());
+               return 1;
+            }
+            shapeController->mViewer.setThreadSequence(0, seqIdx);
+            shapeController->mNextSequence[0] = seqIdx;
+         }
+            break;
+         case HeadlessScript::Command_Frames:
+            if (!currentController->isResourceLoaded())
+            {
+               LOG_ERROR("Headless: nothing loaded to run frames on");
+               return 1;
+            }
+            for (uint32_t i=0; i<cmd.count; i++)
+            {
+               auto frameStart = std::chrono::steady_clock::now();
+               int frameRet = loop();
+               auto frameEnd = std::chrono::steady_clock::now();
+               headlessStats.record(std::chrono::duration_cast<std::chrono::microseconds>(frameEnd - frameStart).count() / 1000.0f);
+               
+               if (frameRet != 0)
+                  return 0;
+            }
+            break;
+         case HeadlessScript::Command_Stats:
+            logHeadlessStats(cmd.arg.empty() ? NULL : cmd.arg.c_str());
+            headlessStats = ReplayFrameStats();
+            break;
+         default:
+            break;
+      }
+   }
+   
+   return 0;
+}
 
-int main(int argc, const char * argv[])
+// Logs stats for the frames run since the last stats command, and optionally writes them as json
+void MainState::logHeadlessStats(const char* outPath)
 {
-   SDL_Window* window = NULL;
-   SDL_Renderer* renderer = NULL;
+   GFXFrameStats gfxStats;
+   GFXGetFrameStats(&gfxStats);
    
-   assert(sizeof(slm::vec2) == 8);
-   assert(sizeof(slm::vec3) == 12);
-   assert(sizeof(slm::vec4) == 16);
+   headlessStats.print("Headless");
+   LOG_INFO("Headless: last frame %u draws, %u pipelines, %u bind groups, %u live textures, %u live models",
+            gfxStats.numDrawCalls, gfxStats.numPipelineSets, gfxStats.numBindGroupSets, gfxStats.numLiveTextures, gfxStats.numLiveModels);
+   LOG_INFO("Headless: tracked memory %.1f KB (peak %.1f KB)", MemTrack::getTotalBytes() / 1024.0, MemTrack::getTotalPeakBytes() / 1024.0);
+   LOG_INFO("Headless: %u textures shared by content (%.1f KB not uploaded)",
+            GenericViewer::smDedupStats.numShared, GenericViewer::smDedupStats.bytesSaved / 1024.0);
    
-   DarkstarPersistObject::initStatics();
+   const DirIndex::Stats& dirStats = resManager.mDirIndex.getStats();
+   LOG_INFO("Headless: %llu loose file lookups, %llu filesystem calls (%llu negative lookups answered without a syscall)",
+            (unsigned long long)dirStats.numLookups, (unsigned long long)resManager.getNumFSCalls(), (unsigned long long)dirStats.numMissing);
    
-   if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS) < 0) {
-      printf("Couldn't initialize SDL: %s\n", SDL_GetError());
-      return (1);
+   if (outPath == NULL)
+      return;
+   
+   FILE* fp = fopen(outPath, "w");
+   if (fp == NULL)
+   {
+      LOG_ERROR("Couldn't write stats to %s", outPath);
+      return;
    }
    
-   if (!SDL_CreateWindowAndRenderer("DTS Viewer", 1024, 700, SDL_WINDOW_HIGH_PIXEL_DENSITY | SDL_WINDOW_RESIZABLE, &window, &renderer)) {
-      printf( "Window could not be created! SDL_Error: %s\n", SDL_GetError() );
-      return (1);
+   uint32_t numFrames = (uint32_t)headlessStats.frameMS.size();
+   fprintf(fp, "{\n  \"frames\": %u,\n  \"totalMS\": %.3f,\n  \"meanMS\": %.3f,\n", numFrames, headlessStats.totalMS, numFrames ? headlessStats.totalMS / numFrames : 0.0);
+   fprintf(fp, "  \"p50MS\": %.3f,\n  \"p95MS\": %.3f,\n  \"p99MS\": %.3f,\n  \"maxMS\": %.3f,\n",
+           headlessStats.getPercentile(0.50f), headlessStats.getPercentile(0.95f), headlessStats.getPercentile(0.99f), headlessStats.getPercentile(1.0f));
+   fprintf(fp, "  \"gfx\": {\"drawCalls\": %u, \"pipelineSets\": %u, \"bindGroupSets\": %u, \"liveTextures\": %u, \"liveModels\": %u},\n",
+           gfxStats.numDrawCalls, gfxStats.numPipelineSets, gfxStats.numBindGroupSets, gfxStats.numLiveTextures, gfxStats.numLiveModels);
+   fprintf(fp, "  \"dedup\": {\"sharedTextures\": %u, \"bytesSaved\": %llu},\n",
+           GenericViewer::smDedupStats.numShared, (unsigned long long)GenericViewer::smDedupStats.bytesSaved);
+   fprintf(fp, "  \"files\": {\"lookups\": %llu, \"fsCalls\": %llu, \"negativeLookups\": %llu},\n",
+           (unsigned long long)dirStats.numLookups, (unsigned long long)resManager.getNumFSCalls(), (unsigned long long)dirStats.numMissing);
+   fprintf(fp, "  \"memory\": {");
+   for (uint32_t c=0; c<MemTrack::Category_Count; c++)
+   {
+      MemTrack::Stats memStats;
+      MemTrack::getStats((MemTrack::Category)c, &memStats);
+      fprintf(fp, "\"%s\": %lld, ", MemTrack::getCategoryName((MemTrack::Category)c), (long long)memStats.currentBytes);
+   }
+   fprintf(fp, "\"peak\": %lld}\n}\n", (long long)MemTrack::getTotalPeakBytes());
+   
+   fclose(fp);
+}
+
+void MainState::pollEvents()
+{
+   SDL_Event event;
+   
+   while (SDL_PollEvent(&event))
+   {
+      if (!isHeadless)
+         ImGui_ImplSDL3_ProcessEvent(&event);
+      
+      switch (event.type)
+      {
+         case SDL_EVENT_WINDOW_PIXEL_SIZE_CHANGED:
+         case SDL_EVENT_WINDOW_RESIZED:
+            GFXHandleResize();
+            break;
+            
+         case SDL_EVENT_KEY_DOWN:
+         case SDL_EVENT_KEY_UP:
+         {
+            slm::vec3 forwardVec = slm::vec3();
+            switch (event.key.key)
+            {
+               case SDLK_A:  deltaMovement.x = event.type == SDL_EVENT_KEY_DOWN ? -1 : 0; break;
+               case SDLK_D:  deltaMovement.x = event.type == SDL_EVENT_KEY_DOWN ? 1 : 0; break;
+               case SDLK_Q:  deltaMovement.y = event.type == SDL_EVENT_KEY_DOWN ? 1 : 0; break;
+               case SDLK_E:  deltaMovement.y = event.type == SDL_EVENT_KEY_DOWN ? -1 : 0; break;
+               case SDLK_W:  deltaMovement.z = event.type == SDL_EVENT_KEY_DOWN ? -1 : 0; break;
+               case SDLK_S:  deltaMovement.z = event.type == SDL_EVENT_KEY_DOWN ? 1 : 0; break;
+               case SDLK_LEFT:  deltaRot.y = event.type == SDL_EVENT_KEY_DOWN ? 1 : 0; break;
+               case SDLK_RIGHT: deltaRot.y = event.type == SDL_EVENT_KEY_DOWN ? -1 : 0; break;
+               case SDLK_UP:  deltaRot.x = event.type == SDL_EVENT_KEY_DOWN ? 1 : 0; break;
+               case SDLK_DOWN: deltaRot.x = event.type == SDL_EVENT_KEY_DOWN ? -1 : 0; break;
+            }
+         }
+            break;
+            
+         case SDL_EVENT_QUIT:
+            running = false;
+            break;
+      }
    }
-   
-   // Init basic main
-   gMainState.init(window, argc, argv);
-   
-   int setupCode = GFXSetup(window, renderer);
-   
-   if (setupCode < 0)
-   {
-      return 1;
+}
+
+static MainState::InputPhase getInputEventPhase(InputRecording::EventType type)
+{
+   switch (type)
+   {
+      case InputRecording::Event_Palette:
+      case InputRecording::Event_SelectVolume:
+         return MainState::InputPhase_FrameStart;
+      case InputRecording::Event_SelectFile:
+         return MainState::InputPhase_FileSelect;
+      case InputRecording::Event_Move:
+      case InputRecording::Event_Rotate:
+         return MainState::InputPhase_Movement;
+      default:
+         return MainState::InputPhase_Threads;
    }
+}
+
+void MainState::startInput()
+{
+   frameIndex = 0;
+   replayEventIdx = 0;
+   recordedMovement = slm::vec3(0);
+   recordedRot = slm::vec3(0);
+   recordedVolumeIdx = selectedVolumeIdx;
+   snapshotThreads();
    
-   // Non-Emscripten setup
-   while (setupCode != 0)
+   // Palette comes from the command line, so note it at the start
+   recordedPalette = isReplaying ? "" : shapeController->mPaletteName;
+   if (isRecording)
    {
-      setupCode = GFXSetup(window, renderer);
+      recording.addEvent(0, InputRecording::Event_Palette).str = recordedPalette;
    }
-   
-   int ret = gMainState.boot();
-   if (ret != 0)
-      return ret;
-   
-   while (gMainState.loop() == 0)
+}
+
+void MainState::processInput(InputPhase phase)
+{
+   if (isReplaying)
+      replayInput(phase);
+   else if (isRecording)
+      recordInput(phase);
+}
+
+void MainState::snapshotThreads()
+{
+   if (shapeController->mShape == NULL)
    {
-      ;
+      recordedThreads.clear();
+      return;
    }
    
-   gMainState.shutdown();
-   
-   return 0;
+   recordedThreads = shapeController->mViewer.mThreads;
+   recordedManualThreads = shapeController->mManualThreads;
 }
 
-void MainState::shutdown()
+void MainState::recordInput(InputPhase phase)
 {
-   if (shapeController)
+   switch (phase)
    {
-      delete shapeController;
-      delete interiorController;
-      delete terrainController;
-      shapeController = NULL;
-      interiorController = NULL;
-      terrainController = NULL;
+      case InputPhase_FrameStart:
+         if (shapeController->mPaletteName != recordedPalette)
+         {
+            recordedPalette = shapeController->mPaletteName;
+            recording.addEvent(frameIndex, InputRecording::Event_Palette).str = recordedPalette;
+         }
+         if (selectedVolumeIdx != recordedVolumeIdx)
+         {
+            recordedVolumeIdx = selectedVolumeIdx;
+            recording.addEvent(frameIndex, InputRecording::Event_SelectVolume).value = selectedVolumeIdx;
+         }
+         break;
+         
+      case InputPhase_FileSelect:
+         if (selectedFileIdx != oldSelectedFileIdx && selectedFileIdx >= 0)
+         {
+            recording.addEvent(frameIndex, InputRecording::Event_SelectFile).str = cFileList[selectedFileIdx];
+         }
+         break;
+         
+      case InputPhase_Movement:
+         if (deltaMovement != recordedMovement)
+         {
+            recordedMovement = deltaMovement;
+            recording.addEvent(frameIndex, InputRecording::Event_Move).vec = deltaMovement;
+         }
+         if (deltaRot != recordedRot)
+         {
+            recordedRot = deltaRot;
+            recording.addEvent(frameIndex, InputRecording::Event_Rotate).vec = deltaRot;
+         }
+         break;
+         
+      case InputPhase_Threads:
+      {
+         if (currentController != shapeController || shapeController->mShape == NULL)
+            break;
+         
+         std::vector<ShapeViewer::ShapeThread>& threads = shapeController->mViewer.mThreads;
+         
+         if (shapeController->mManualThreads != recordedManualThreads)
+         {
+            recordedManualThreads = shapeController->mManualThreads;
+            recording.addEvent(frameIndex, InputRecording::Event_ManualThreads).value = recordedManualThreads;
+         }
+         
+         // Thread gui changes are applied immediately, apart from removal which happens on the next update
+         while (recordedThreads.size() < threads.size())
+         {
+            recording.addEvent(frameIndex, InputRecording::Event_AddThread);
+            recordedThreads.push_back(ShapeViewer::ShapeThread());
+         }
+         
+         for (uint32_t i=0; i<threads.size(); i++)
+         {
+            if (threads[i].sequenceIdx != recordedThreads[i].sequenceIdx)
+            {
+               InputRecording::Event& evt = recording.addEvent(frameIndex, InputRecording::Event_ThreadSequence);
+               evt.index = i;
+               evt.value = threads[i].sequenceIdx;
+            }
+            if (threads[i].enabled != recordedThreads[i].enabled)
+            {
+               InputRecording::Event& evt = recording.addEvent(frameIndex, InputRecording::Event_ThreadEnabled);
+               evt.index = i;
+               evt.value = threads[i].enabled;
+            }
+            if (recordedManualThreads && threads[i].pos != recordedThreads[i].pos)
+            {
+               InputRecording::Event& evt = recording.addEvent(frameIndex, InputRecording::Event_ThreadPos);
+               evt.index = i;
+               evt.vec.x = threads[i].pos;
+            }
+         }
+         
+         recordedThreads = threads;
+         
+         if (shapeController->mRemoveThreadId >= 0 && shapeController->mRemoveThreadId < (int32_t)recordedThreads.size())
+         {
+            recording.addEvent(frameIndex, InputRecording::Event_RemoveThread).index = shapeController->mRemoveThreadId;
+            recordedThreads.erase(recordedThreads.begin() + shapeController->mRemoveThreadId);
+         }
+      }
+         break;
    }
-   
-   GFXTeardown();
-   SDL_DestroyWindow( gMainState.window );
-   SDL_Quit();
 }
 
-int MainState::boot()
+void MainState::replayInput(InputPhase phase)
 {
-   currentController = shapeController;
+   uint32_t numEvents = recording.findFrameEvents(frameIndex, replayEventIdx);
    
-   for (int i=1; i<in_argc; i++)
+   for (uint32_t i=0; i<numEvents; i++)
    {
-      const char *path = in_argv[i];
-      if (path && path[0] == '-')
-         break;
+      const InputRecording::Event& evt = recording.mEvents[replayEventIdx + i];
+      if (getInputEventPhase(evt.type) != phase)
+         continue;
       
-      fs::path filePath = path;
-      std::string  ext = filePath.extension();
-      std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+      bool hasThread = shapeController->mShape != NULL && evt.index >= 0 && evt.index < (int32_t)shapeController->mViewer.mThreads.size();
       
-      if (ext == ".dts")
-      {
-         shapeController->loadShape(path);
-         currentController = shapeController;
-      }
-      else if (ext == ".vol" || ext == ".ted")
-      {
-         resManager.addVolume(path);
-      }
-      else if (ext == ".ppl" || ext == ".pal")
+      switch (evt.type)
       {
-         shapeController->mPaletteName = path;
-         interiorController->mPaletteName = path;
-         terrainController->mPaletteName = path;
-      }
-      else if (ext == ".dis")
-      {
-         interiorController->loadInterior(path);
-         currentController = interiorController;
-      }
-      else if (ext == ".dtf")
-      {
-         terrainController->loadGrid(path);
-         currentController = terrainController;
+         case InputRecording::Event_Move:
+            recordedMovement = evt.vec;
+            break;
+         case InputRecording::Event_Rotate:
+            recordedRot = evt.vec;
+            break;
+         case InputRecording::Event_Palette:
+            shapeController->mPaletteName = evt.str;
+            interiorController->mPaletteName = evt.str;
+            terrainController->mPaletteName = evt.str;
+            sceneController->mPaletteName = evt.str;
+            break;
+         case InputRecording::Event_SelectVolume:
+            if (evt.value < (int32_t)cVolumeList.size())
+               selectedVolumeIdx = evt.value;
+            break;
+         case InputRecording::Event_SelectFile:
+         {
+            auto itr = std::find(sFileList.begin(), sFileList.end(), evt.str);
+            if (itr != sFileList.end())
+               selectedFileIdx = (int)(itr - sFileList.begin());
+            else
+               LOG_WARN("Replay: %s not found", evt.str.c_str());
+         }
+            break;
+         case InputRecording::Event_ManualThreads:
+            shapeController->mManualThreads = evt.value != 0;
+            break;
+         case InputRecording::Event_AddThread:
+            if (shapeController->mShape)
+            {
+               shapeController->mViewer.addThread();
+               shapeController->updateNextSequence();
+            }
+            break;
+         case InputRecording::Event_RemoveThread:
+            if (hasThread)
+               shapeController->mRemoveThreadId = evt.index;
+            break;
+         case InputRecording::Event_ThreadSequence:
+            if (hasThread)
+            {
+               shapeController->mViewer.setThreadSequence(evt.index, evt.value);
+               shapeController->mNextSequence[evt.index] = evt.value;
+            }
+            break;
+         case InputRecording::Event_ThreadEnabled:
+            if (hasThread)
+               shapeController->mViewer.mThreads[evt.index].enabled = evt.value != 0;
+            break;
+         case InputRecording::Event_ThreadPos:
+            if (hasThread)
+               shapeController->mViewer.mThreads[evt.index].pos = evt.vec.x;
+            break;
+         default:
+            break;
       }
-      else if (ext == ".dtb")
+   }
+   
+   // Keyboard input is ignored while replaying
+   if (phase == InputPhase_Movement)
+   {
+      deltaMovement = recordedMovement;
+      deltaRot = recordedRot;
+   }
+}
+
+// Grid view of the current file list. Only visible cells request thumbnails, so the cache works on
+// (and uploads) whatever is on screen first.
+void MainState::drawThumbnails()
+{
+   if (!thumbnails.isRunning())
+   {
+      std::vector<const char*> mountNames;
+      resManager.enumerateSearchPaths(mountNames);
+      
+      try
       {
-         terrainController->loadSingleBlock(path);
-         currentController = terrainController;
+         fs::create_directories(thumbnailDir.c_str());
       }
-      else if (ext == "")
+      catch (...)
       {
-         resManager.mPaths.emplace_back(path);
+         LOG_WARN("Couldn't create thumbnail cache directory %s", thumbnailDir.c_str());
       }
+      
+      std::shared_ptr<ResManager::ReadHandles> handles = std::make_shared<ResManager::ReadHandles>();
+      ResManager* mgr = &resManager;
+      thumbnails.init(thumbnailDir.c_str(), std::vector<std::string>(mountNames.begin(), mountNames.end()),
+                      [mgr, handles](uint32_t mountIdx, const std::string& filename, std::vector<uint8_t>& outData) {
+                         return mgr->readFile(filename.c_str(), mountIdx, *handles, outData);
+                      },
+                      getShapeThumbnailTris);
    }
    
-   if (!currentController->isResourceLoaded())
-   {
-      fprintf(stderr, "please specify a starting shape or interior or terrain to load\n");
-      return 1;
-   }
-   
-   running = true;
+   const float cellSize = (float)ThumbnailCache::Size + 8.0f;
    
-   deltaMovement = slm::vec3(0);
-   deltaRot = slm::vec3(0);
-   lastTicks = SDL_GetTicks();
+   ImGui::SetNextWindowSize(ImVec2(cellSize * 6 + 24, 420), ImGuiCond_FirstUseEver);
+   ImGui::Begin("Thumbnails", &showThumbnails);
    
-   selectedFileIdx = -1;
-   selectedVolumeIdx = -1;
-   restrictExtList.clear();
-   fileList.clear();
-   restrictExtList.push_back(".dts");
-   restrictExtList.push_back(".dis");
-   restrictExtList.push_back(".dtb");
-   restrictExtList.push_back(".dtf");
-   resManager.enumerateFiles(fileList, selectedVolumeIdx, &restrictExtList);
-   sFileList.resize(fileList.size());
+   ThumbnailCache::Stats stats;
+   thumbnails.getStats(&stats);
+   ImGui::Text("Queued %u, resident %u, rendered %u, cached %u, failed %u", stats.numQueued, stats.numResident, stats.numRendered, stats.numDiskHits, stats.numFailed);
    
-   for (int i=0; i<fileList.size(); i++)
-   {
-      sFileList[i] = fileList[i].filename;
-   }
+   ImTextureID atlas = (ImTextureID)thumbnails.getTexture();
+   int numCols = std::max(1, (int)(ImGui::GetContentRegionAvail().x / cellSize));
+   int numRows = ((int)fileList.size() + numCols - 1) / numCols;
    
-   for (int i=0; i<fileList.size(); i++)
+   ImGuiListClipper clipper;
+   clipper.Begin(numRows, cellSize + ImGui::GetStyle().ItemSpacing.y);
+   while (clipper.Step())
    {
-      cFileList.push_back(sFileList[i].c_str());
+      for (int row=clipper.DisplayStart; row<clipper.DisplayEnd; row++)
+      {
+         for (int col=0; col<numCols; col++)
+         {
+            int idx = (row * numCols) + col;
+            if (idx >= (int)fileList.size())
+               break;
+            
+            if (col > 0)
+               ImGui::SameLine();
+            
+            ImGui::PushID(idx);
+            
+            const ResManager::EnumEntry& entry = fileList[idx];
+            fs::path filePath = entry.filename;
+            std::string ext = filePath.extension();
+            std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+            
+            slm::vec2 uv0, uv1;
+            bool clicked = false;
+            ImVec2 size(ThumbnailCache::Size, ThumbnailCache::Size);
+            if (atlas && ext == ".dts" && thumbnails.get(entry.mountIdx, entry.filename.c_str(), &uv0, &uv1))
+            {
+               clicked = ImGui::ImageButton("##thumb", atlas, size, ImVec2(uv0.x, uv0.y), ImVec2(uv1.x, uv1.y));
+            }
+            else
+            {
+               clicked = ImGui::Button(ext.c_str(), ImVec2(size.x + (ImGui::GetStyle().FramePadding.x * 2), size.y + (ImGui::GetStyle().FramePadding.y * 2)));
+            }
+            
+            if (ImGui::IsItemHovered())
+               ImGui::SetTooltip("%s", entry.filename.c_str());
+            if (clicked)
+               selectedFileIdx = idx;
+            
+            ImGui::PopID();
+         }
+      }
    }
    
-   resManager.enumerateSearchPaths(cVolumeList);
-   
-   oldSelectedVolumeIdx = -1;
-   oldSelectedFileIdx = -1;
-   
-   return 0;
+   ImGui::End();
 }
 
 int MainState::loop()
@@ -4668,15 +9554,26 @@ int MainState::loop()
    if (!running)
       return 1;
    
-   ImGui::StyleColorsDark();
+   PROFILE_BEGIN_FRAME();
    
-   SDL_Event event;
+   resManager.pollChanges();
+   
+   ImGui::StyleColorsDark();
    
+   auto frameStart = std::chrono::steady_clock::now();
    uint64_t curTicks = SDL_GetTicks();
    uint64_t oldLastTicks = lastTicks;
    float dt = ((float)(curTicks - lastTicks)) / 1000.0f;
    lastTicks = curTicks;
    
+   // Headless runs use the same fixed timestep as replays
+   if (isReplaying || isHeadless)
+   {
+      dt = recording.mFixedDT;
+   }
+   
+   processInput(InputPhase_FrameStart);
+   
    currentController->mCamRot += deltaRot * dt * 100;
    slm::mat4 rotMat = slm::rotation_z(slm::radians(currentController->mCamRot.z)) * slm::rotation_y(slm::radians(currentController->mCamRot.y)) *  slm::rotation_x(slm::radians(currentController->mCamRot.x));
    //rotMat = inverse(rotMat);
@@ -4684,12 +9581,15 @@ int MainState::loop()
    currentController->mViewPos += forwardVec.xyz() * currentController->mViewSpeed * dt;
    
    int w, h;
-   SDL_GetWindowSize(window, &w, &h);
+   getViewSize(window, &w, &h);
    
    //glViewport(0,0,w,h);
    
+   thumbnails.beginFrame(lastSpareMS);
+   
    if (oldSelectedVolumeIdx != selectedVolumeIdx)
    {
+      thumbnails.cancelPending();
       fileList.clear();
       resManager.enumerateFiles(fileList, selectedVolumeIdx, &restrictExtList);
       oldSelectedVolumeIdx = selectedVolumeIdx;
@@ -4708,6 +9608,8 @@ int MainState::loop()
       oldSelectedFileIdx = selectedFileIdx = -1;
    }
    
+   processInput(InputPhase_FileSelect);
+   
    if (oldSelectedFileIdx != selectedFileIdx)
    {
       fs::path filePath = cFileList[selectedFileIdx];
@@ -4734,65 +9636,140 @@ int MainState::loop()
          currentController = shapeController;
       }
       oldSelectedFileIdx = selectedFileIdx;
+      snapshotThreads();
    }
    
-   while (SDL_PollEvent(&event))
+   // The view is final from here, so start anything that depends on it before the rest of the frame
+   currentController->beginView();
+   
    {
-      ImGui_ImplSDL3_ProcessEvent(&event);
-      
-      switch (event.type)
-      {
-         case SDL_EVENT_WINDOW_PIXEL_SIZE_CHANGED:
-         case SDL_EVENT_WINDOW_RESIZED:
-            GFXHandleResize();
-            break;
-            
-         case SDL_EVENT_KEY_DOWN:
-         case SDL_EVENT_KEY_UP:
-         {
-            slm::vec3 forwardVec = slm::vec3();
-            switch (event.key.key)
-            {
-               case SDLK_A:  deltaMovement.x = event.type == SDL_EVENT_KEY_DOWN ? -1 : 0; break;
-               case SDLK_D:  deltaMovement.x = event.type == SDL_EVENT_KEY_DOWN ? 1 : 0; break;
-               case SDLK_Q:  deltaMovement.y = event.type == SDL_EVENT_KEY_DOWN ? 1 : 0; break;
-               case SDLK_E:  deltaMovement.y = event.type == SDL_EVENT_KEY_DOWN ? -1 : 0; break;
-               case SDLK_W:  deltaMovement.z = event.type == SDL_EVENT_KEY_DOWN ? -1 : 0; break;
-               case SDLK_S:  deltaMovement.z = event.type == SDL_EVENT_KEY_DOWN ? 1 : 0; break;
-               case SDLK_LEFT:  deltaRot.y = event.type == SDL_EVENT_KEY_DOWN ? 1 : 0; break;
-               case SDLK_RIGHT: deltaRot.y = event.type == SDL_EVENT_KEY_DOWN ? -1 : 0; break;
-               case SDLK_UP:  deltaRot.x = event.type == SDL_EVENT_KEY_DOWN ? 1 : 0; break;
-               case SDLK_DOWN: deltaRot.x = event.type == SDL_EVENT_KEY_DOWN ? -1 : 0; break;
-            }
-         }
-            break;
-            
-         case SDL_EVENT_QUIT:
-            running = false;
-            break;
-      }
+      PROFILE_SCOPE(Phase_Input);
+      pollEvents();
+   }
+   
+   processInput(InputPhase_Movement);
+   
+   // Continuations queued by jobs, e.g. GFX uploads
+   JobSystem::runMainThreadJobs();
+   
+   if (currentController != lastController)
+   {
+      frameHistogram.beginSwitch();
+      lastController = currentController;
    }
    
+   auto renderStart = std::chrono::steady_clock::now();
+   
    if (GFXBeginFrame())
    {
+      RenderQueue::smLastStats = RenderQueue::Stats();
+      OcclusionBuffer::smLastStats = OcclusionBuffer::Stats();
+      BatchTransform::smLastStats = BatchTransform::Stats();
       currentController->update(dt);
+      processInput(InputPhase_Threads);
+      
+      {
+         PROFILE_SCOPE(Phase_ImGui);
+         ImGui::Begin("Browse");
+         ImGui::Columns(2);
+         ImGui::ListBox("##bvols", &selectedVolumeIdx, &cVolumeList[0], cVolumeList.size());
+         ImGui::NextColumn();
+         ImGui::ListBox("##bfiles", &selectedFileIdx, &cFileList[0], cFileList.size());
+         ImGui::Columns(1);
+         ImGui::Checkbox("Thumbnails", &showThumbnails);
+         ImGui::End();
+         
+         if (showThumbnails)
+         {
+            drawThumbnails();
+         }
       
-      ImGui::Begin("Browse");
-      ImGui::Columns(2);
-      ImGui::ListBox("##bvols", &selectedVolumeIdx, &cVolumeList[0], cVolumeList.size());
-      ImGui::NextColumn();
-      ImGui::ListBox("##bfiles", &selectedFileIdx, &cFileList[0], cFileList.size());
-      ImGui::End();
+         ImGui::Begin("Render");
+         ImGui::Checkbox("Depth prepass", &RenderQueue::smDepthPrepass);
+         ImGui::Text("Opaque draws: %u", RenderQueue::smLastStats.numOpaque);
+         ImGui::Text("Translucent draws: %u", RenderQueue::smLastStats.numTranslucent);
+         ImGui::Text("Prepass draws: %u", RenderQueue::smLastStats.numPrepass);
+         ImGui::Text("Sort time: %.2f us", RenderQueue::smLastStats.sortTimeUS);
+         ImGui::Separator();
+         ImGui::Checkbox("Occlusion culling", &OcclusionBuffer::smEnabled);
+         ImGui::Text("Occluder tris: %u (%u clipped)", OcclusionBuffer::smLastStats.numOccluderTris, OcclusionBuffer::smLastStats.numSkippedTris);
+         ImGui::Text("Culled: %u / %u", OcclusionBuffer::smLastStats.numCulled, OcclusionBuffer::smLastStats.numTested);
+         ImGui::Text("Raster time: %.2f us", OcclusionBuffer::smLastStats.rasterTimeUS);
+         ImGui::Text("Wait time: %.2f us", OcclusionBuffer::smLastStats.waitTimeUS);
+         ImGui::Separator();
+         ImGui::Text("Batch transform: %llu pts, %.2f Mpts/s", (unsigned long long)BatchTransform::smLastStats.numPoints, BatchTransform::smLastStats.getPointsPerSec() / 1e6);
+         ImGui::Text("Load transforms: %llu pts, %.2f Mpts/s", (unsigned long long)BatchTransform::smLoadStats.numPoints, BatchTransform::smLoadStats.getPointsPerSec() / 1e6);
+         ImGui::Separator();
+         ImGui::Text("Bind group warmup: %s", !warmupEnabled ? "off" : warmupPending ? "in progress" : "done");
+         ImGui::Separator();
+         {
+            GFXFrameStats gfxStats;
+            GFXGetFrameStats(&gfxStats);
+            ImGui::Text("GFX draws: %u, pipelines: %u, bind groups: %u", gfxStats.numDrawCalls, gfxStats.numPipelineSets, gfxStats.numBindGroupSets);
+            ImGui::Text("Buffer writes: %u (%.1f KB)", gfxStats.numBufferWrites, gfxStats.bufferWriteBytes / 1024.0);
+            ImGui::Text("Texture uploads: %u (%.1f KB)", gfxStats.numTextureUploads, gfxStats.textureUploadBytes / 1024.0);
+            ImGui::Text("Frame buffers: %u, %.1f / %.1f KB (peak %.1f KB)", gfxStats.numBufferAllocs, gfxStats.bufferUsedBytes / 1024.0,
+                        gfxStats.bufferCapacityBytes / 1024.0, gfxStats.bufferHighWaterBytes / 1024.0);
+            ImGui::Text("Live textures: %u, models: %u", gfxStats.numLiveTextures, gfxStats.numLiveModels);
+         }
+         frameHistogram.draw();
+         ImGui::End();
+      
+         PROFILE_DRAW_UI();
+         MemTrack::drawImGui();
+      }
+      
+      {
+         PROFILE_SCOPE(Phase_EndFrame);
+         GFXEndFrame();
+      }
+      
+#ifdef TV_ENABLE_PROFILER
+      GFXFrameStats gfxStats;
+      GFXGetFrameStats(&gfxStats);
+      PROFILE_SET_COUNTER(Counter_DrawCalls, gfxStats.numDrawCalls);
+      PROFILE_SET_COUNTER(Counter_PipelineSets, gfxStats.numPipelineSets);
+      PROFILE_SET_COUNTER(Counter_BindGroupSets, gfxStats.numBindGroupSets);
+      PROFILE_SET_COUNTER(Counter_BufferWrites, gfxStats.numBufferWrites);
+      PROFILE_SET_COUNTER(Counter_BufferWriteBytes, gfxStats.bufferWriteBytes);
+      PROFILE_SET_COUNTER(Counter_TextureUploads, gfxStats.numTextureUploads);
+      PROFILE_SET_COUNTER(Counter_TextureUploadBytes, gfxStats.textureUploadBytes);
+      PROFILE_SET_COUNTER(Counter_BufferHighWaterBytes, gfxStats.bufferHighWaterBytes);
+      PROFILE_SET_COUNTER(Counter_LiveTextures, gfxStats.numLiveTextures);
+      PROFILE_SET_COUNTER(Counter_LiveModels, gfxStats.numLiveModels);
+#endif
       
-      GFXEndFrame();
+      auto renderEnd = std::chrono::steady_clock::now();
+      frameHistogram.record(std::chrono::duration_cast<std::chrono::microseconds>(renderEnd - renderStart).count() / 1000.0f);
    }
    else
    {
       lastTicks = oldLastTicks;
    }
    
+   // Use part of the remaining frame time to create anything the renderer would otherwise build on first use
+   if (warmupEnabled)
+   {
+      uint64_t usedMS = SDL_GetTicks() - lastTicks;
+      float spareMS = usedMS < tickMS ? (tickMS - usedMS) * 0.5f : 0.0f;
+      warmupPending = GFXWarmupStep(spareMS);
+   }
+   
+   PROFILE_END_FRAME();
+   
+   frameIndex++;
+   if (isReplaying)
+   {
+      auto frameEnd = std::chrono::steady_clock::now();
+      replayStats.record(std::chrono::duration_cast<std::chrono::microseconds>(frameEnd - frameStart).count() / 1000.0f);
+      
+      if (frameIndex >= recording.mNumFrames)
+         running = false;
+   }
+   
    uint64_t endTicks = SDL_GetTicks();
-   if (endTicks - lastTicks < tickMS)
+   lastSpareMS = endTicks - lastTicks < tickMS ? (float)(tickMS - (endTicks - lastTicks)) : 0.0f;
+   if (!uncappedFrames && endTicks - lastTicks < tickMS)
    {
       SDL_Delay(tickMS - (endTicks - lastTicks));
    }
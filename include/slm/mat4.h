@@ -24,7 +24,7 @@ class quat;
 #ifdef SWIG
 class mat4
 #else
-SLMATH_ALIGN16 class mat4
+class SLMATH_ALIGN16 mat4
 #endif
 {
 public:
@@ -35,14 +35,32 @@ inline vec4 operator*( const vec4& v, const mat4& m )
 {
 	SLMATH_VEC_ASSERT( check(v) );
 	SLMATH_VEC_ASSERT( check(m) );
+#ifdef SLMATH_SIMD
+	const m128_t* const mp = m.m128();
+	m128_t r0 = SLMATH_MUL_PS( mp[0], v.m128() );
+	m128_t r1 = SLMATH_MUL_PS( mp[1], v.m128() );
+	m128_t r2 = SLMATH_MUL_PS( mp[2], v.m128() );
+	m128_t r3 = SLMATH_MUL_PS( mp[3], v.m128() );
+	SLMATH_TRANSPOSE4_PS( r0, r1, r2, r3 );
+	return vec4( SLMATH_ADD_PS( SLMATH_ADD_PS(r0,r1), SLMATH_ADD_PS(r2,r3) ) );
+#else
 	return vec4( dot(v,m[0]), dot(v,m[1]), dot(v,m[2]), dot(v,m[3]) );
+#endif
 }
 
 inline vec4 operator*( const mat4& m, const vec4& v )
 {
 	SLMATH_VEC_ASSERT( check(v) );
 	SLMATH_VEC_ASSERT( check(m) );
+#ifdef SLMATH_SIMD
+	const m128_t* const mp = m.m128();
+	const m128_t vp = v.m128();
+	return vec4( SLMATH_ADD_PS(
+		SLMATH_ADD_PS( SLMATH_MUL_PS(mp[0], SLMATH_SWIZZLE_PS(vp,0,0,0,0)), SLMATH_MUL_PS(mp[1], SLMATH_SWIZZLE_PS(vp,1,1,1,1)) ),
+		SLMATH_ADD_PS( SLMATH_MUL_PS(mp[2], SLMATH_SWIZZLE_PS(vp,2,2,2,2)), SLMATH_MUL_PS(mp[3], SLMATH_SWIZZLE_PS(vp,3,3,3,3)) ) ) );
+#else
 	return m[0]*v.x + m[1]*v.y + m[2]*v.z + m[3]*v.w;
+#endif
 }
 
 inline vec4 mul( const mat4& m, const vec4& v )
@@ -14,6 +14,9 @@ SLMATH_BEGIN()
 /** Returns true if CPU supports SSE2 instruction set. */
 bool isSSE2CPU();
 
+/** Returns true if CPU (and OS) supports AVX instruction set. */
+bool isAVXCPU();
+
 /** Returns true if current compilation options match platform capabilities. */
 bool isValidCPU();
 
@@ -1,3 +1,4 @@
+// This file is part of 'slm' C++ library. Copyright (C) 2009-2018 Jani Kajala (kajala@gmail.com). Licensed under BSD/MIT license
 #ifndef SLMATH_SIMD_H
 #define SLMATH_SIMD_H
 
@@ -11,14 +12,19 @@
 #undef SLMATH_SUB_PS
 #undef SLMATH_LOAD_PS1
 
-#ifdef SLMATH_SSE2_MSVC
-	#define SLMATH_ALIGN16 __declspec(align(16))
+// NOTE: must be placed after the class-key, i.e. class SLMATH_ALIGN16 vec4
+#if defined(SLMATH_SSE2) || defined(SLMATH_NEON)
+	#define SLMATH_ALIGN16 alignas(16)
 #else
 	#define SLMATH_ALIGN16
 #endif
 
-#if defined(SLMATH_SSE2_MSVC)
+#if defined(SLMATH_SSE2)
 	#include <xmmintrin.h>
+	#include <emmintrin.h>
+	#if defined(SLMATH_AVX)
+		#include <immintrin.h>
+	#endif
 
 	SLMATH_BEGIN()
 		typedef __m128 m128_t;
@@ -32,12 +38,41 @@
 	#define SLMATH_LOAD_PS1(A) _mm_load_ps1(A)
 	#define SLMATH_MIN_PS(A,B) _mm_min_ps(A,B)
 	#define SLMATH_MAX_PS(A,B) _mm_max_ps(A,B)
+	#define SLMATH_SET_PS(X,Y,Z,W) _mm_setr_ps(X,Y,Z,W)
+	#define SLMATH_LOADU_PS(P) _mm_loadu_ps(P)
+	#define SLMATH_STOREU_PS(P,A) _mm_storeu_ps(P,A)
+	/** Returns (A[X], A[Y], B[Z], B[W]) */
+	#define SLMATH_SHUFFLE_PS(A,B,X,Y,Z,W) _mm_shuffle_ps(A,B,_MM_SHUFFLE(W,Z,Y,X))
+#elif defined(SLMATH_NEON)
+	#include <arm_neon.h>
+
+	SLMATH_BEGIN()
+		typedef float32x4_t m128_t;
+	SLMATH_END()
+
+	#define SLMATH_MUL_PS(A,B) vmulq_f32(A,B)
+	#define SLMATH_ADD_PS(A,B) vaddq_f32(A,B)
+	#define SLMATH_SUB_PS(A,B) vsubq_f32(A,B)
+	#define SLMATH_DIV_PS(A,B) vdivq_f32(A,B)
+	#define SLMATH_SETZERO_PS() vdupq_n_f32(0.f)
+	#define SLMATH_LOAD_PS1(A) vld1q_dup_f32(A)
+	#define SLMATH_MIN_PS(A,B) vminq_f32(A,B)
+	#define SLMATH_MAX_PS(A,B) vmaxq_f32(A,B)
+	#define SLMATH_SET_PS(X,Y,Z,W) (float32x4_t){X,Y,Z,W}
+	#define SLMATH_LOADU_PS(P) vld1q_f32(P)
+	#define SLMATH_STOREU_PS(P,A) vst1q_f32(P,A)
+	/** Returns (A[X], A[Y], B[Z], B[W]) */
+	#if defined(__clang__) || (__GNUC__ >= 12)
+		#define SLMATH_SHUFFLE_PS(A,B,X,Y,Z,W) __builtin_shufflevector(A,B,X,Y,(Z)+4,(W)+4)
+	#else
+		#define SLMATH_SHUFFLE_PS(A,B,X,Y,Z,W) __builtin_shuffle(A,B,(uint32x4_t){X,Y,(Z)+4,(W)+4})
+	#endif
 #else 
 	// SIMD emulation with standard C++, so you can still use SIMD-macros even without SIMD support if you want
 	#undef SLMATH_SIMD
 
 	SLMATH_BEGIN()
-		SLMATH_ALIGN16 struct m128_emu
+		struct SLMATH_ALIGN16 m128_emu
 		{
 			float m[4]; 
 			
@@ -56,8 +91,27 @@
 	#define SLMATH_LOAD_PS1(A) SLMATH_NS(m128_emu)( *(A) )
 	#define SLMATH_MIN_PS(A,B) SLMATH_NS(m128_emu)( (A).m[0]<(B).m[0]?(A).m[0]:(B).m[0], (A).m[1]<(B).m[1]?(A).m[1]:(B).m[1], (A).m[2]<(B).m[2]?(A).m[2]:(B).m[2], (A).m[3]<(B).m[3]?(A).m[3]:(B).m[3] )
 	#define SLMATH_MAX_PS(A,B) SLMATH_NS(m128_emu)( (A).m[0]<(B).m[0]?(B).m[0]:(A).m[0], (A).m[1]<(B).m[1]?(B).m[1]:(A).m[1], (A).m[2]<(B).m[2]?(B).m[2]:(A).m[2], (A).m[3]<(B).m[3]?(B).m[3]:(A).m[3] )
+	#define SLMATH_SET_PS(X,Y,Z,W) SLMATH_NS(m128_emu)( X, Y, Z, W )
+	#define SLMATH_LOADU_PS(P) SLMATH_NS(m128_emu)( (P)[0], (P)[1], (P)[2], (P)[3] )
+	#define SLMATH_STOREU_PS(P,A) { const SLMATH_NS(m128_emu) a_ = (A); (P)[0]=a_.m[0]; (P)[1]=a_.m[1]; (P)[2]=a_.m[2]; (P)[3]=a_.m[3]; }
+	#define SLMATH_SHUFFLE_PS(A,B,X,Y,Z,W) SLMATH_NS(m128_emu)( (A).m[X], (A).m[Y], (B).m[Z], (B).m[W] )
 #endif
 
+/** Returns (A[X], A[Y], A[Z], A[W]) */
+#define SLMATH_SWIZZLE_PS(A,X,Y,Z,W) SLMATH_SHUFFLE_PS(A,A,X,Y,Z,W)
+
+/** Transposes 4 registers in place */
+#define SLMATH_TRANSPOSE4_PS(R0,R1,R2,R3) \
+	{ \
+		const SLMATH_NS(m128_t) t0_ = SLMATH_SHUFFLE_PS(R0,R1,0,1,0,1); \
+		const SLMATH_NS(m128_t) t2_ = SLMATH_SHUFFLE_PS(R0,R1,2,3,2,3); \
+		const SLMATH_NS(m128_t) t1_ = SLMATH_SHUFFLE_PS(R2,R3,0,1,0,1); \
+		const SLMATH_NS(m128_t) t3_ = SLMATH_SHUFFLE_PS(R2,R3,2,3,2,3); \
+		R0 = SLMATH_SHUFFLE_PS(t0_,t1_,0,2,0,2); \
+		R1 = SLMATH_SHUFFLE_PS(t0_,t1_,1,3,1,3); \
+		R2 = SLMATH_SHUFFLE_PS(t2_,t3_,0,2,0,2); \
+		R3 = SLMATH_SHUFFLE_PS(t2_,t3_,1,3,1,3); \
+	}
+
 #endif
 
-// This file is part of 'slm' C++ library. Copyright (C) 2009-2018 Jani Kajala (kajala@gmail.com). Licensed under BSD/MIT license
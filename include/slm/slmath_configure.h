@@ -1,8 +1,11 @@
 #ifndef SLMATH_CONFIGURE_H
 #define SLMATH_CONFIGURE_H
 
-/** Enable SIMD extensions (if supported by this platform) */
-#if defined(_M_X64) || (_M_IX86_FP == 2)
+/** Enable SIMD extensions (if supported by this platform). Define SLMATH_NO_SIMD to force the scalar paths. */
+#if defined(SLMATH_NO_SIMD)
+#elif defined(_M_X64) || (_M_IX86_FP == 2)
+#define SLMATH_SIMD
+#elif defined(__SSE2__) || (defined(__ARM_NEON) && defined(__aarch64__))
 #define SLMATH_SIMD
 #endif
 
@@ -15,12 +15,16 @@
 #endif
 
 // Use this instead of namespaces directly to enable easier porting for platforms without namespace support
+// SLMATH_NAMESPACE_NAME can be set to build a second copy (e.g. with SLMATH_NO_SIMD) alongside the default one
 #ifdef SLMATH_NAMESPACE
-	#define SLMATH_BEGIN() namespace slm {
+	#ifndef SLMATH_NAMESPACE_NAME
+		#define SLMATH_NAMESPACE_NAME slm
+	#endif
+	#define SLMATH_BEGIN() namespace SLMATH_NAMESPACE_NAME {
 	#define SLMATH_END() }
-	#define SLMATH_USING() using namespace slm;
-	#define SLMATH_NS(A) slm::A
-	namespace slm {}
+	#define SLMATH_USING() using namespace SLMATH_NAMESPACE_NAME;
+	#define SLMATH_NS(A) SLMATH_NAMESPACE_NAME::A
+	namespace SLMATH_NAMESPACE_NAME {}
 #else
 	#define SLMATH_BEGIN()
 	#define SLMATH_END()
@@ -30,14 +34,26 @@
 
 // Verify requested configuration for this build:
 // SSE2 extensions supported for Visual Studio 2005 and newer
+// SSE2 (and optionally AVX) or AArch64 NEON for GCC and Clang
 #if defined(SLMATH_SIMD)
-	#if (_MSC_VER >= 1500)
+	#if defined(_MSC_VER) && (_MSC_VER >= 1500)
 		#define SLMATH_SSE2_MSVC
 		#define SLMATH_MSVC_HAS_INTRIN_H
-	#elif (_MSC_VER >= 1300)
+	#elif defined(_MSC_VER) && (_MSC_VER >= 1300)
 		// Enable SSE2 in Visual Studio 2003
 		// <intrin.h> is not available.
 		#define SLMATH_SSE2_MSVC
+	#elif (defined(__GNUC__) || defined(__clang__)) && defined(__SSE2__)
+		#define SLMATH_SSE2_GCC
+		#if defined(__AVX__)
+			#define SLMATH_AVX
+		#endif
+	#elif (defined(__GNUC__) || defined(__clang__)) && defined(__ARM_NEON) && defined(__aarch64__)
+		#define SLMATH_NEON
+	#endif
+	
+	#if defined(SLMATH_SSE2_MSVC) || defined(SLMATH_SSE2_GCC)
+		#define SLMATH_SSE2
 	#endif
 #endif
 
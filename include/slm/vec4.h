@@ -16,7 +16,7 @@ SLMATH_BEGIN()
 #ifdef SWIG
 class vec4
 #else
-SLMATH_ALIGN16 class vec4
+class SLMATH_ALIGN16 vec4
 #endif
 {
 public:
@@ -162,7 +162,45 @@ mat4 mat4::operator*( const mat4& o ) const
 {
 	mat4 res;
 
-#ifdef SLMATH_SIMD
+#if defined(SLMATH_AVX)
+	// two result columns per 256-bit register: each column of this fills both halves, and the lanes of
+	// two columns of o are broadcast within their own half
+	const __m256 a01 = _mm256_loadu_ps( &get(0).x );
+	const __m256 a23 = _mm256_loadu_ps( &get(2).x );
+	const __m256 a0 = _mm256_permute2f128_ps( a01, a01, 0x00 );
+	const __m256 a1 = _mm256_permute2f128_ps( a01, a01, 0x11 );
+	const __m256 a2 = _mm256_permute2f128_ps( a23, a23, 0x00 );
+	const __m256 a3 = _mm256_permute2f128_ps( a23, a23, 0x11 );
+	const __m256 b01 = _mm256_loadu_ps( &o[0][0] );
+	const __m256 b23 = _mm256_loadu_ps( &o[2][0] );
+	#define COLS(j,b) { \
+		const __m256 r01 = _mm256_add_ps( _mm256_mul_ps(a0, _mm256_permute_ps(b,0x00)), _mm256_mul_ps(a1, _mm256_permute_ps(b,0x55)) ); \
+		const __m256 r23 = _mm256_add_ps( _mm256_mul_ps(a2, _mm256_permute_ps(b,0xAA)), _mm256_mul_ps(a3, _mm256_permute_ps(b,0xFF)) ); \
+		_mm256_storeu_ps( &res[j][0], _mm256_add_ps(r01, r23) ); }
+	COLS(0,b01)
+	COLS(2,b23)
+	#undef COLS
+#elif defined(SLMATH_SSE2) && !defined(SLMATH_SSE2_MSVC)
+	// each column of o is loaded once and its lanes broadcast in registers
+	const __m128 a0 = m_m128[0];
+	const __m128 a1 = m_m128[1];
+	const __m128 a2 = m_m128[2];
+	const __m128 a3 = m_m128[3];
+	const __m128 b0 = o.m128()[0];
+	const __m128 b1 = o.m128()[1];
+	const __m128 b2 = o.m128()[2];
+	const __m128 b3 = o.m128()[3];
+	__m128* const o128 = res.m128();
+	#define COL(j,b) { \
+		const __m128 r01 = _mm_add_ps( _mm_mul_ps(a0, _mm_shuffle_ps(b,b,0x00)), _mm_mul_ps(a1, _mm_shuffle_ps(b,b,0x55)) ); \
+		const __m128 r23 = _mm_add_ps( _mm_mul_ps(a2, _mm_shuffle_ps(b,b,0xAA)), _mm_mul_ps(a3, _mm_shuffle_ps(b,b,0xFF)) ); \
+		o128[j] = _mm_add_ps( r01, r23 ); }
+	COL(0,b0)
+	COL(1,b1)
+	COL(2,b2)
+	COL(3,b3)
+	#undef COL
+#elif defined(SLMATH_SSE2_MSVC)
 	#define VTMP(i,j) SLMATH_MUL_PS( m_m128[i], SLMATH_LOAD_PS1(&o[j][i]) )
 	m128_t* const o128 = res.m128();
 	o128[0] = SLMATH_ADD_PS( SLMATH_ADD_PS(VTMP(0,0),VTMP(1,0)), SLMATH_ADD_PS(VTMP(2,0),VTMP(3,0)) );
@@ -186,18 +224,20 @@ mat4 transpose( const mat4& m )
 {
 	mat4 res;
 
-#ifdef SLMATH_SSE2_MSVC
+#ifdef SLMATH_SIMD
     
+	// transposed in registers, so res is only written once
 	const m128_t* const mp = m.m128();
+	m128_t r0 = mp[0];
+	m128_t r1 = mp[1];
+	m128_t r2 = mp[2];
+	m128_t r3 = mp[3];
+	SLMATH_TRANSPOSE4_PS( r0, r1, r2, r3 );
 	m128_t* const resp = res.m128();
-    m128_t tmp0 = _mm_shuffle_ps(mp[0], mp[1], 0x44);
-    m128_t tmp2 = _mm_shuffle_ps(mp[0], mp[1], 0xEE);
-    m128_t tmp1 = _mm_shuffle_ps(mp[2], mp[3], 0x44);
-    m128_t tmp3 = _mm_shuffle_ps(mp[2], mp[3], 0xEE);
-	resp[0] = _mm_shuffle_ps(tmp0, tmp1, 0x88);
-    resp[1] = _mm_shuffle_ps(tmp0, tmp1, 0xDD);
-    resp[2] = _mm_shuffle_ps(tmp2, tmp3, 0x88);
-    resp[3] = _mm_shuffle_ps(tmp2, tmp3, 0xDD);
+	resp[0] = r0;
+	resp[1] = r1;
+	resp[2] = r2;
+	resp[3] = r3;
 
 #else
 	
@@ -221,10 +261,95 @@ float det( const mat4& m )
 	return res;
 }
 
+#ifdef SLMATH_SIMD
+// 2x2 matrices packed as (m00, m01, m10, m11), used by the SIMD inverse.
+
+/** Returns A*B */
+static inline m128_t mat2Mul( m128_t a, m128_t b )
+{
+	return SLMATH_ADD_PS( SLMATH_MUL_PS(a, SLMATH_SWIZZLE_PS(b,0,3,0,3)),
+		SLMATH_MUL_PS(SLMATH_SWIZZLE_PS(a,1,0,3,2), SLMATH_SWIZZLE_PS(b,2,1,2,1)) );
+}
+
+/** Returns adj(A)*B */
+static inline m128_t mat2AdjMul( m128_t a, m128_t b )
+{
+	return SLMATH_SUB_PS( SLMATH_MUL_PS(SLMATH_SWIZZLE_PS(a,3,3,0,0), b),
+		SLMATH_MUL_PS(SLMATH_SWIZZLE_PS(a,1,1,2,2), SLMATH_SWIZZLE_PS(b,2,3,0,1)) );
+}
+
+/** Returns A*adj(B) */
+static inline m128_t mat2MulAdj( m128_t a, m128_t b )
+{
+	return SLMATH_SUB_PS( SLMATH_MUL_PS(a, SLMATH_SWIZZLE_PS(b,3,0,3,0)),
+		SLMATH_MUL_PS(SLMATH_SWIZZLE_PS(a,1,0,3,2), SLMATH_SWIZZLE_PS(b,2,1,2,1)) );
+}
+
+/**
+ * Inverse via 2x2 blocks:
+ *
+ *   M = | A B |    inv(M) = 1/|M| * | X Y |
+ *       | C D |                     | Z W |
+ *
+ * where |M| = |A||D| + |B||C| - tr(adj(A)B adj(D)C).
+ */
+static mat4 inverseSIMD( const mat4& m0 )
+{
+	const m128_t* const mp = m0.m128();
+
+	const m128_t a = SLMATH_SHUFFLE_PS( mp[0], mp[1], 0,1,0,1 );
+	const m128_t b = SLMATH_SHUFFLE_PS( mp[0], mp[1], 2,3,2,3 );
+	const m128_t c = SLMATH_SHUFFLE_PS( mp[2], mp[3], 0,1,0,1 );
+	const m128_t d = SLMATH_SHUFFLE_PS( mp[2], mp[3], 2,3,2,3 );
+
+	// (|A|, |B|, |C|, |D|)
+	const m128_t detSub = SLMATH_SUB_PS(
+		SLMATH_MUL_PS( SLMATH_SHUFFLE_PS(mp[0], mp[2], 0,2,0,2), SLMATH_SHUFFLE_PS(mp[1], mp[3], 1,3,1,3) ),
+		SLMATH_MUL_PS( SLMATH_SHUFFLE_PS(mp[0], mp[2], 1,3,1,3), SLMATH_SHUFFLE_PS(mp[1], mp[3], 0,2,0,2) ) );
+	const m128_t detA = SLMATH_SWIZZLE_PS( detSub, 0,0,0,0 );
+	const m128_t detB = SLMATH_SWIZZLE_PS( detSub, 1,1,1,1 );
+	const m128_t detC = SLMATH_SWIZZLE_PS( detSub, 2,2,2,2 );
+	const m128_t detD = SLMATH_SWIZZLE_PS( detSub, 3,3,3,3 );
+
+	const m128_t dc = mat2AdjMul( d, c );
+	const m128_t ab = mat2AdjMul( a, b );
+
+	m128_t x = SLMATH_SUB_PS( SLMATH_MUL_PS(detD, a), mat2Mul(b, dc) );
+	m128_t w = SLMATH_SUB_PS( SLMATH_MUL_PS(detA, d), mat2Mul(c, ab) );
+	m128_t y = SLMATH_SUB_PS( SLMATH_MUL_PS(detB, c), mat2MulAdj(d, ab) );
+	m128_t z = SLMATH_SUB_PS( SLMATH_MUL_PS(detC, b), mat2MulAdj(a, dc) );
+
+	m128_t tr = SLMATH_MUL_PS( ab, SLMATH_SWIZZLE_PS(dc,0,2,1,3) );
+	tr = SLMATH_ADD_PS( tr, SLMATH_SWIZZLE_PS(tr,2,3,0,1) );
+	tr = SLMATH_ADD_PS( tr, SLMATH_SWIZZLE_PS(tr,1,0,3,2) );
+
+	const m128_t detM = SLMATH_SUB_PS( SLMATH_ADD_PS(SLMATH_MUL_PS(detA, detD), SLMATH_MUL_PS(detB, detC)), tr );
+	const m128_t rDetM = SLMATH_DIV_PS( SLMATH_SET_PS(1.f, -1.f, -1.f, 1.f), detM );
+
+	x = SLMATH_MUL_PS( x, rDetM );
+	y = SLMATH_MUL_PS( y, rDetM );
+	z = SLMATH_MUL_PS( z, rDetM );
+	w = SLMATH_MUL_PS( w, rDetM );
+
+	// adjugate of each block combined with the store shuffle
+	mat4 res;
+	m128_t* const resp = res.m128();
+	resp[0] = SLMATH_SHUFFLE_PS( x, y, 3,1,3,1 );
+	resp[1] = SLMATH_SHUFFLE_PS( x, y, 2,0,2,0 );
+	resp[2] = SLMATH_SHUFFLE_PS( z, w, 3,1,3,1 );
+	resp[3] = SLMATH_SHUFFLE_PS( z, w, 2,0,2,0 );
+	return res;
+}
+#endif
+
 mat4 inverse( const mat4& m0 )
 {
 	SLMATH_VEC_ASSERT( check(m0) );
 
+#ifdef SLMATH_SIMD
+	return inverseSIMD( m0 );
+#else
+
 	const float* const mp = &m0[0][0];
 	const float a = mp[0];	const float b = mp[1];	const float c = mp[2];	const float d = mp[3];
 	const float e = mp[4];	const float f = mp[5];	const float g = mp[6];	const float h = mp[7];
@@ -256,6 +381,7 @@ mat4 inverse( const mat4& m0 )
 	res[2][3] = -DET3(a,b,d,e,f,h,i,j,l);
 	res[3][3] = DET3(a,b,c,e,f,g,i,j,k);
 	return res * (1.f/det_m);
+#endif
 /*
 	res *= (1.f/det_m);
 	mat4 res2;
@@ -2,7 +2,7 @@
 
 #ifndef SLMATH_NO_PRAGMA_MESSAGES
 	// print some info messages about build settings
-	#ifdef SLMATH_SSE2_MSVC
+	#ifdef SLMATH_SSE2
 		#pragma message( "slm: Using SSE2 SIMD instructions" )
 	#else
 		#pragma message( "slm: Not SSE2 SIMD instructions" )
@@ -54,14 +54,35 @@ bool isSSE2CPU()
 	__cpuid(cpuinfo, 1);
 	bool sse2 = (cpuinfo[3] & (1<<26)) != 0;
 	return sse2;
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
 #else
 	return false;
 #endif
 }
 
-bool isValidCPU()
+bool isAVXCPU()
 {
 #ifdef SLMATH_SSE2_MSVC
+	// AVX and OSXSAVE; the OS state check (xgetbv) is left to the compiler runtime
+	int cpuinfo[4];
+	__cpuid(cpuinfo, 1);
+	return (cpuinfo[2] & (1<<28)) != 0 && (cpuinfo[2] & (1<<27)) != 0;
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+	// also checks the OS saves the AVX registers
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx");
+#else
+	return false;
+#endif
+}
+
+bool isValidCPU()
+{
+#if defined(SLMATH_AVX)
+	return isSSE2CPU() && isAVXCPU();
+#elif defined(SLMATH_SSE2)
 	return isSSE2CPU();
 #else
 	return true;